@@ -2,18 +2,109 @@
 #include <fstream>
 #include <cstring>
 #include <limits> //
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <shared_mutex>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 using namespace std;
 
 // Constante para el tamaño máximo de una ruta o línea de comando
 const int LONGITUD_MAX_RUTA = 1024;
 const int LONGITUD_MAX_CONTENIDO = 4096; // Para el editor de texto y contenido de archivo
+// A partir de este número de hijos un directorio mantiene índices por nombre (hash y ordenado)
+const int UMBRAL_INDICE_HIJOS = 16;
+const int TAM_BLOQUE_ORDENADO = 256; // Entradas por bloque del índice ordenado
+// Asignador agrupado: losas de nodos y trozos de memoria para nombres
+const int NODOS_POR_LOSA = 4096;
+const int TAM_TROZO_NOMBRES = 64 * 1024;
+const int MAX_NOMBRE_ARENA = 256; // Los nombres más largos van directo al heap
+// Caché de rutas resueltas (potencia de 2) y sondeos máximos por búsqueda
+const int CAPACIDAD_CACHE_RUTAS = 4096;
+const int TAM_BUFFER_CARGA = 1 << 20; // Bytes leídos por bloque al cargar el snapshot
+// El diario se compacta en el snapshot al superar cualquiera de estos límites
+const long REGISTROS_POR_CHECKPOINT = 100000;
+const long BYTES_POR_CHECKPOINT = 64L * 1024 * 1024;
+const int SONDEOS_CACHE_RUTAS = 8;
+// Guardado paralelo: unidades de trabajo por hilo y tamaño del buffer de escritura
+const int UNIDADES_POR_HILO = 8;
+const int MAX_HILOS = 64;
+const size_t TAM_BUFFER_ESCRITURA = 1 << 20;
+// find: directorios que se recorren en el hilo de la sesión antes de repartir el resto en el pool
+const long UMBRAL_BUSQUEDA_PARALELA = 4096;
+// Contenido de archivos: piezas antes de compactar y bloque de lectura de 'cat'
+const int MAX_PIEZAS = 1024;
+const size_t TAM_BLOQUE_LECTURA = 64 * 1024;
+// Compresión de contenidos: tabla de coincidencias del compresor y contenidos descomprimidos en caché
+const int BITS_TABLA_LZ = 12;
+const int ENTRADAS_CACHE_DESCOMPRIMIDOS = 16;
+// Modo por lotes: salida acumulada antes de escribirla
+const int TAM_BUFFER_SALIDA_LOTE = 64 * 1024;
+// Servidor (--serve): lectura por llamada, respuestas acumuladas antes de dejar de ejecutar
+// peticiones de una conexión, petición más larga aceptada y eventos por espera
+const size_t TAM_BLOQUE_RECEPCION = 64 * 1024;
+const size_t LIMITE_RESPUESTA_PENDIENTE = 1 << 20;
+const size_t TAM_MAX_PETICION = 64L * 1024 * 1024;
+const int EVENTOS_POR_ESPERA = 256;
+// rm: los subárboles de hasta tantos nodos se liberan en el acto; los mayores, en segundo plano
+// y por lotes, soltando el árbol entre uno y otro
+const long UMBRAL_RECLAMACION_DIFERIDA = 4096;
+const long NODOS_POR_LOTE_RECLAMACION = 4096;
+
+// Salida de la sesión que ejecuta comandos en este hilo: cout, salvo en las sesiones
+// concurrentes (benchmark de estrés, servidor), que escriben cada una en su propio stream
+thread_local ostream* salidaSesion = &cout;
+
+inline ostream& salida() {
+    return *salidaSesion;
+}
+
+// Entrada de la que leen edit/append/write en este hilo: cin, salvo en el servidor, donde cada
+// comando lee el bloque de texto que el cliente envió tras él
+thread_local istream* entradaSesion = &cin;
+
+inline istream& entrada() {
+    return *entradaSesion;
+}
+
+struct Directorio;
+struct IndiceHijos;     // Definidos junto a las funciones de los índices
+struct IndiceOrdenado;
+struct TablaPiezas;     // Definida con las funciones de contenido
 
 // Estructura para Archivos
 struct Archivo {
     char* nombre;       // Nombre del archivo
-    char* contenido;    // Contenido del archivo
+    char* contenido;    // Contenido del archivo (texto original si hay tabla de piezas)
+    TablaPiezas* piezas;      // nullptr mientras el contenido sea una cadena simple
     Archivo* siguiente;       // Puntero al siguiente archivo en la lista del directorio
+    Archivo* anterior;        // El previo en esa lista (desenlazar en O(1))
+    Directorio* padre;        // Directorio que lo contiene
+    uint32_t id;              // En el índice de trigramas; 0 si no está indexado
 };
 
 // Estructura para Directorios
@@ -22,829 +113,8185 @@ struct Directorio {
     Directorio* padre;      // Directorio padre
     Directorio* subdirectorios;     // Lista de subdirectorios (primer hijo)
     Directorio* siguienteDirectorio;        // Siguiente hermano en la lista de subdirectorios del padre
+    Directorio* anteriorDirectorio;         // Hermano previo en esa lista (desenlazar en O(1))
     Archivo* archivos;            // Lista de archivos en este directorio (primer archivo)
+    Directorio* ultimoSubdirectorio;    // Último subdirectorio de la lista (inserción en O(1))
+    Archivo* ultimoArchivo;             // Último archivo de la lista (inserción en O(1))
+    int cantidadHijos;                  // Subdirectorios + archivos
+    IndiceHijos* indice;                // Índice hash por nombre, nullptr mientras haya pocos hijos
+    IndiceOrdenado* ordenado;           // Índice ordenado por nombre, se crea junto con 'indice'
+    long archivosSubarbol;              // Archivos bajo este directorio, a cualquier profundidad
+    long directoriosSubarbol;           // Subdirectorios bajo este directorio, sin contarlo a él
+    uint64_t bytesSubarbol;             // Suma de los contenidos de esos archivos
+    uint64_t cuotaBytes;                // Límite para bytesSubarbol (quota); 0 = sin límite
+    atomic<Directorio*> origen;         // Si es una copia pendiente, el directorio que copia
+    Directorio* copias;                 // Copias pendientes de este directorio
+    Directorio* siguienteCopia;         // Siguiente en la lista 'copias' de su origen
 };
 
-// --- Funciones auxiliares y de gestión de sistema de archivos ---
+// --- Totales por subárbol (du, tree --summary, quota) ---
+// Cada directorio lleva los totales de todo lo que cuelga de él. Enlazar o quitar un archivo
+// o un subárbol, y cambiar un contenido, suma la diferencia en el directorio y en todos sus
+// ancestros, así que mantenerlos cuesta O(profundidad) y consultarlos O(1).
 
-// Función para crear un nuevo archivo
-Archivo* crearArchivo(const char* nombre, const char* contenido = nullptr) {
-    Archivo* nuevoArchivo = new Archivo;
-    nuevoArchivo->nombre = new char[strlen(nombre) + 1];
-    strcpy(nuevoArchivo->nombre, nombre);
+void propagarTotales(Directorio* directorio, long archivos, long directorios, int64_t bytes) {
+    for (Directorio* d = directorio; d; d = d->padre) {
+        d->archivosSubarbol += archivos;
+        d->directoriosSubarbol += directorios;
+        d->bytesSubarbol += (uint64_t)bytes;
+    }
+}
 
-    if (contenido) {
-        nuevoArchivo->contenido = new char[strlen(contenido) + 1];
-        strcpy(nuevoArchivo->contenido, contenido);
-    } else {
-        nuevoArchivo->contenido = nullptr;
+// El directorio más cercano cuya cuota se superaría si el contenido bajo 'directorio' creciera
+// 'bytes', o nullptr si cabe en todas. Lo que no crece siempre cabe, aunque la cuota ya esté
+// superada porque se fijó por debajo de lo que había.
+Directorio* cuotaExcedida(Directorio* directorio, uint64_t bytes) {
+    if (bytes == 0) return nullptr;
+    for (Directorio* d = directorio; d; d = d->padre) {
+        if (d->cuotaBytes && d->bytesSubarbol + bytes > d->cuotaBytes) return d;
     }
-    nuevoArchivo->siguiente = nullptr;
-    return nuevoArchivo;
+    return nullptr;
 }
 
-// Función para crear un nuevo directorio
-Directorio* crearDirectorio(const char* nombre, Directorio* padre = nullptr) {
-    Directorio* nuevoDirectorio = new Directorio;
-    nuevoDirectorio->nombre = new char[strlen(nombre) + 1];
-    strcpy(nuevoDirectorio->nombre, nombre);
+// --- Índice hash de hijos por directorio ---
+// Tabla de direccionamiento abierto (sondeo lineal) que comparte el espacio de nombres
+// de archivos y subdirectorios, igual que mkdir/touch/renombrar.
 
-    nuevoDirectorio->padre = padre;
-    nuevoDirectorio->subdirectorios = nullptr;
-    nuevoDirectorio->siguienteDirectorio = nullptr;
-    nuevoDirectorio->archivos = nullptr;
+// Entrada del índice: exactamente uno de los dos punteros es no nulo si está ocupada
+struct EntradaIndice {
+    unsigned int hash;
+    Directorio* directorio;
+    Archivo* archivo;
+};
 
-    return nuevoDirectorio;
-}
+struct IndiceHijos {
+    EntradaIndice* entradas;
+    unsigned int capacidad; // Siempre potencia de 2
+    unsigned int ocupadas;
+};
 
-// Función para liberar memoria de un archivo
-void eliminarArchivo(Archivo* archivo) {
-    if (archivo) {
-        delete[] archivo->nombre;
-        if (archivo->contenido) delete[] archivo->contenido;
-        delete archivo;
+// Hash FNV-1a del nombre
+unsigned int hashNombre(const char* nombre) {
+    unsigned int hash = 2166136261u;
+    while (*nombre) {
+        hash ^= (unsigned char)*nombre++;
+        hash *= 16777619u;
     }
+    return hash;
 }
 
-// Función para liberar memoria de un directorio y su contenido
-void eliminarDirectorio(Directorio* directorio) {
-    if (directorio) {
-        delete[] directorio->nombre;
-
-        // Eliminar subdirectorios recursivamente
-        Directorio* subDirectorioActual = directorio->subdirectorios;
-        while (subDirectorioActual) {
-            Directorio* siguienteSubDirectorio = subDirectorioActual->siguienteDirectorio;
-            eliminarDirectorio(subDirectorioActual); // Llamada recursiva
-            subDirectorioActual = siguienteSubDirectorio;
-        }
+const char* nombreEntrada(const EntradaIndice& entrada) {
+    return entrada.directorio ? entrada.directorio->nombre : entrada.archivo->nombre;
+}
 
-        // Eliminar archivos
-        Archivo* archivoActual = directorio->archivos;
-        while (archivoActual) {
-            Archivo* siguienteArchivo = archivoActual->siguiente;
-            eliminarArchivo(archivoActual);
-            archivoActual = siguienteArchivo;
-        }
-        delete directorio;
-    }
+bool entradaVacia(const EntradaIndice& entrada) {
+    return entrada.directorio == nullptr && entrada.archivo == nullptr;
 }
 
-// Encontrar archivo en un directorio
-Archivo* buscarArchivo(Directorio* directorio, const char* nombre) {
-    Archivo* actual = directorio->archivos;
-    while (actual) {
-        if (strcmp(actual->nombre, nombre) == 0) {
-            return actual;
-        }
-        actual = actual->siguiente;
+IndiceHijos* crearIndiceHijos(unsigned int capacidad) {
+    IndiceHijos* indice = new IndiceHijos;
+    indice->capacidad = capacidad;
+    indice->ocupadas = 0;
+    indice->entradas = new EntradaIndice[capacidad];
+    for (unsigned int i = 0; i < capacidad; i++) {
+        indice->entradas[i] = {0, nullptr, nullptr};
     }
-    return nullptr;
+    return indice;
 }
 
-// Función para buscar un subdirectorio
-Directorio* buscarDirectorio(Directorio* directorio, const char* nombre) {
-    Directorio* actual = directorio->subdirectorios;
-    while (actual) {
-        if (strcmp(actual->nombre, nombre) == 0) {
-            return actual;
-        }
-        actual = actual->siguienteDirectorio;
+void liberarIndiceHijos(IndiceHijos* indice) {
+    if (indice) {
+        delete[] indice->entradas;
+        delete indice;
     }
-    return nullptr;
 }
 
-// Función para añadir un archivo a un directorio
-void anadirArchivo(Directorio* directorio, Archivo* archivo) {
-    if (directorio->archivos == nullptr) {
-        directorio->archivos = archivo;
-    } else {
-        Archivo* ultimo = directorio->archivos;
-        while (ultimo->siguiente) {
-            ultimo = ultimo->siguiente;
-        }
-        ultimo->siguiente = archivo;
+// Retorna la entrada con ese nombre, o nullptr si no está en el índice
+EntradaIndice* indiceBuscar(IndiceHijos* indice, const char* nombre) {
+    unsigned int hash = hashNombre(nombre);
+    unsigned int mascara = indice->capacidad - 1;
+    for (unsigned int i = hash & mascara; ; i = (i + 1) & mascara) {
+        EntradaIndice& entrada = indice->entradas[i];
+        if (entradaVacia(entrada)) return nullptr;
+        if (entrada.hash == hash && strcmp(nombreEntrada(entrada), nombre) == 0) return &entrada;
     }
-    archivo->siguiente = nullptr; // Asegurar que el nuevo archivo sea el último en su lista
 }
 
-// Función para eliminar un archivo de un directorio
-bool removerArchivo(Directorio* directorio, const char* nombre) {
-    Archivo* actual = directorio->archivos;
-    Archivo* previo = nullptr;
-
-    while (actual) {
-        if (strcmp(actual->nombre, nombre) == 0) {
-            if (previo) {
-                previo->siguiente = actual->siguiente;
-            } else {
-                directorio->archivos = actual->siguiente;
-            }
-            eliminarArchivo(actual);
-            return true;
-        }
-        previo = actual;
-        actual = actual->siguiente;
+void indiceColocar(IndiceHijos* indice, const EntradaIndice& nueva) {
+    unsigned int mascara = indice->capacidad - 1;
+    unsigned int i = nueva.hash & mascara;
+    while (!entradaVacia(indice->entradas[i])) {
+        i = (i + 1) & mascara;
     }
-    return false;
+    indice->entradas[i] = nueva;
+    indice->ocupadas++;
 }
 
-// Función para eliminar un subdirectorio
-bool removerDirectorio(Directorio* padre, const char* nombre) {
-    Directorio* actual = padre->subdirectorios;
-    Directorio* previo = nullptr;
-    
-    while (actual) {
-        if (strcmp(actual->nombre, nombre) == 0) {
-            if (previo) {
-                previo->siguienteDirectorio = actual->siguienteDirectorio;
-            } else {
-                padre->subdirectorios = actual->siguienteDirectorio;
-            }
-            eliminarDirectorio(actual);
-            return true;
+// Inserta un hijo (archivo o directorio) en el índice, duplicando la tabla al 75% de ocupación
+void indiceInsertar(IndiceHijos* indice, Directorio* directorio, Archivo* archivo) {
+    if ((indice->ocupadas + 1) * 4 > indice->capacidad * 3) {
+        EntradaIndice* anteriores = indice->entradas;
+        unsigned int capacidadAnterior = indice->capacidad;
+        indice->capacidad *= 2;
+        indice->ocupadas = 0;
+        indice->entradas = new EntradaIndice[indice->capacidad];
+        for (unsigned int i = 0; i < indice->capacidad; i++) {
+            indice->entradas[i] = {0, nullptr, nullptr};
         }
-        previo = actual;
-        actual = actual->siguienteDirectorio;
+        for (unsigned int i = 0; i < capacidadAnterior; i++) {
+            if (!entradaVacia(anteriores[i])) indiceColocar(indice, anteriores[i]);
+        }
+        delete[] anteriores;
     }
-    return false;
+    const char* nombre = directorio ? directorio->nombre : archivo->nombre;
+    indiceColocar(indice, {hashNombre(nombre), directorio, archivo});
 }
 
-// Valida nombres de archivos/directorios (no pueden ser . o .. ni contener /)
-bool esNombreValido(const char* nombre) {
-    if (!nombre || strlen(nombre) == 0) return false;
-    if (strcmp(nombre, ".") == 0 || strcmp(nombre, "..") == 0) return false;
-    if (strchr(nombre, '/') != nullptr) return false;
-    return true;
-}
+// Quita una entrada por nombre usando borrado con desplazamiento hacia atrás (sin lápidas)
+bool indiceQuitar(IndiceHijos* indice, const char* nombre) {
+    EntradaIndice* entrada = indiceBuscar(indice, nombre);
+    if (!entrada) return false;
 
-// Añade un directorio a la lista de subdirectorios de un padre
-void anadirDirectorioALista(Directorio* padre, Directorio* nuevoDirectorio) {
-    if (padre->subdirectorios == nullptr) {
-        padre->subdirectorios = nuevoDirectorio;
-    } else {
-        Directorio* actual = padre->subdirectorios;
-        while (actual->siguienteDirectorio) {
-            actual = actual->siguienteDirectorio;
+    unsigned int mascara = indice->capacidad - 1;
+    unsigned int hueco = (unsigned int)(entrada - indice->entradas);
+    unsigned int j = hueco;
+    while (true) {
+        j = (j + 1) & mascara;
+        if (entradaVacia(indice->entradas[j])) break;
+        unsigned int ideal = indice->entradas[j].hash & mascara;
+        // La entrada j puede ocupar el hueco si su posición ideal no cae en (hueco, j]
+        bool enRango = (hueco <= j) ? (hueco < ideal && ideal <= j) : (hueco < ideal || ideal <= j);
+        if (!enRango) {
+            indice->entradas[hueco] = indice->entradas[j];
+            hueco = j;
         }
-        actual->siguienteDirectorio = nuevoDirectorio;
     }
-    nuevoDirectorio->padre = padre; // Asegurar el enlace al padre
-    nuevoDirectorio->siguienteDirectorio = nullptr; // Asegurar que sea el último
+    indice->entradas[hueco] = {0, nullptr, nullptr};
+    indice->ocupadas--;
+    return true;
 }
 
-// Función auxiliar para navegar una ruta (absoluta o relativa)
-// Retorna el directorio al final de la ruta, o nullptr si no se encuentra
-Directorio* navegarRuta(Directorio* directorioInicio, const char* ruta, Directorio* raiz) {
-    if (!ruta || strlen(ruta) == 0) return directorioInicio;
+// --- Índice ordenado de hijos por directorio ---
+// Arreglo ordenado partido en bloques de TAM_BLOQUE_ORDENADO entradas (un árbol B de dos
+// niveles): insertar y quitar mueven como mucho un bloque, y la búsqueda es binaria
+// primero sobre los bloques y luego dentro del bloque.
 
-    char copiaRuta[LONGITUD_MAX_RUTA];
-    strncpy(copiaRuta, ruta, LONGITUD_MAX_RUTA - 1);
-    copiaRuta[LONGITUD_MAX_RUTA - 1] = '\0';
+struct BloqueOrdenado {
+    EntradaIndice entradas[TAM_BLOQUE_ORDENADO];
+    int cantidad;
+};
 
-    Directorio* directorioActualNav = directorioInicio;
+struct IndiceOrdenado {
+    BloqueOrdenado** bloques;
+    int cantidadBloques;
+    int capacidadBloques;
+};
 
-    if (ruta[0] == '/') {
-        directorioActualNav = raiz;
-        if (strlen(ruta) == 1) return raiz;
-        strcpy(copiaRuta, ruta + 1);
-    }
-    
-    if (strcmp(copiaRuta, ".") == 0 && ruta[0] != '/') return directorioInicio;
+// Posición dentro del índice ordenado; bloque == cantidadBloques indica el final
+struct PosicionOrdenada {
+    int bloque;
+    int entrada;
+};
 
-    char* token = strtok(copiaRuta, "/");
+IndiceOrdenado* crearIndiceOrdenado() {
+    IndiceOrdenado* ordenado = new IndiceOrdenado;
+    ordenado->capacidadBloques = 4;
+    ordenado->cantidadBloques = 0;
+    ordenado->bloques = new BloqueOrdenado*[ordenado->capacidadBloques];
+    return ordenado;
+}
 
-    while (token != nullptr) {
-        if (strcmp(token, ".") == 0) {
-            // No hacer nada
-        } else if (strcmp(token, "..") == 0) {
-            if (directorioActualNav->padre != nullptr) {
-                directorioActualNav = directorioActualNav->padre;
-            }
-        } else {
-            Directorio* siguienteDir = buscarDirectorio(directorioActualNav, token);
-            if (siguienteDir == nullptr) {
-                return nullptr; // Componente de la ruta no encontrado
-            }
-            directorioActualNav = siguienteDir;
+void liberarIndiceOrdenado(IndiceOrdenado* ordenado) {
+    if (ordenado) {
+        for (int i = 0; i < ordenado->cantidadBloques; i++) {
+            delete ordenado->bloques[i];
         }
-        token = strtok(nullptr, "/");
+        delete[] ordenado->bloques;
+        delete ordenado;
     }
-    return directorioActualNav;
 }
 
-// Obtiene la ruta completa del directorio actual para el prompt
-void obtenerRutaCompleta(Directorio* directorio, char* bufferRuta, int tamanoBuffer) {
-    if (!directorio) {
-        strncpy(bufferRuta, "/", tamanoBuffer);
-        bufferRuta[tamanoBuffer - 1] = '\0';
-        return;
+// Primera posición cuyo nombre es >= nombre
+PosicionOrdenada ordenadoCotaInferior(IndiceOrdenado* ordenado, const char* nombre) {
+    // Último bloque cuyo primer nombre es <= nombre
+    int bajo = 0, alto = ordenado->cantidadBloques - 1, bloque = 0;
+    while (bajo <= alto) {
+        int medio = (bajo + alto) / 2;
+        if (strcmp(nombreEntrada(ordenado->bloques[medio]->entradas[0]), nombre) <= 0) {
+            bloque = medio;
+            bajo = medio + 1;
+        } else {
+            alto = medio - 1;
+        }
     }
+    if (ordenado->cantidadBloques == 0) return {0, 0};
 
-    char componentesRutaTemp[50][100]; // Max 50 componentes de 100 chars cada uno
-    int contadorComponentes = 0;
-
-    Directorio* actual = directorio;
-    while (actual != nullptr) {
-        if (actual->padre == nullptr && strcmp(actual->nombre, "/") == 0) {
-            strncpy(componentesRutaTemp[contadorComponentes++], "/", 100);
+    BloqueOrdenado* b = ordenado->bloques[bloque];
+    bajo = 0;
+    alto = b->cantidad;
+    while (bajo < alto) {
+        int medio = (bajo + alto) / 2;
+        if (strcmp(nombreEntrada(b->entradas[medio]), nombre) < 0) {
+            bajo = medio + 1;
         } else {
-            strncpy(componentesRutaTemp[contadorComponentes++], actual->nombre, 100);
+            alto = medio;
         }
-        actual = actual->padre;
     }
+    if (bajo == b->cantidad) return {bloque + 1, 0};
+    return {bloque, bajo};
+}
 
-    int posBufferActual = 0;
-    if (contadorComponentes > 0 && strcmp(componentesRutaTemp[contadorComponentes - 1], "/") == 0) {
-        if (tamanoBuffer > 0) {
-            bufferRuta[posBufferActual++] = '/';
+// Avanza n entradas saltando bloques completos cuando es posible
+PosicionOrdenada ordenadoAvanzar(IndiceOrdenado* ordenado, PosicionOrdenada posicion, long n) {
+    while (n > 0 && posicion.bloque < ordenado->cantidadBloques) {
+        int restantes = ordenado->bloques[posicion.bloque]->cantidad - posicion.entrada;
+        if (n < restantes) {
+            posicion.entrada += (int)n;
+            return posicion;
         }
-        contadorComponentes--;
+        n -= restantes;
+        posicion.bloque++;
+        posicion.entrada = 0;
     }
+    return posicion;
+}
 
-    for (int i = contadorComponentes - 1; i >= 0; --i) {
-        if (posBufferActual > 0 && bufferRuta[posBufferActual - 1] != '/') {
-            if (posBufferActual < tamanoBuffer - 1) {
-                bufferRuta[posBufferActual++] = '/';
-            }
-        }
-        int len = strlen(componentesRutaTemp[i]);
-        if (posBufferActual + len < tamanoBuffer) {
-            strcpy(bufferRuta + posBufferActual, componentesRutaTemp[i]);
-            posBufferActual += len;
-        } else {
-            break;
-        }
+void ordenadoInsertar(IndiceOrdenado* ordenado, const EntradaIndice& nueva) {
+    const char* nombre = nombreEntrada(nueva);
+    if (ordenado->cantidadBloques == 0) { // Los bloques nunca quedan vacíos: se crea con su primera entrada
+        ordenado->bloques[0] = new BloqueOrdenado;
+        ordenado->bloques[0]->entradas[0] = nueva;
+        ordenado->bloques[0]->cantidad = 1;
+        ordenado->cantidadBloques = 1;
+        return;
     }
-    if (posBufferActual == 0) {
-        if (tamanoBuffer > 0) bufferRuta[posBufferActual++] = '/';
+    PosicionOrdenada posicion = ordenadoCotaInferior(ordenado, nombre);
+    if (posicion.bloque == ordenado->cantidadBloques) { // Va al final del último bloque
+        posicion.bloque--;
+        posicion.entrada = ordenado->bloques[posicion.bloque]->cantidad;
     }
-    bufferRuta[posBufferActual] = '\0';
-}
 
-void imprimirPrompt(Directorio* directorioActual) {
-    char bufferRuta[LONGITUD_MAX_RUTA];
-    obtenerRutaCompleta(directorioActual, bufferRuta, LONGITUD_MAX_RUTA);
-    cout << bufferRuta << " $ ";
+    BloqueOrdenado* b = ordenado->bloques[posicion.bloque];
+    memmove(&b->entradas[posicion.entrada + 1], &b->entradas[posicion.entrada],
+            (b->cantidad - posicion.entrada) * sizeof(EntradaIndice));
+    b->entradas[posicion.entrada] = nueva;
+    b->cantidad++;
+
+    if (b->cantidad == TAM_BLOQUE_ORDENADO) { // Bloque lleno: partirlo por la mitad
+        if (ordenado->cantidadBloques == ordenado->capacidadBloques) {
+            BloqueOrdenado** anteriores = ordenado->bloques;
+            ordenado->capacidadBloques *= 2;
+            ordenado->bloques = new BloqueOrdenado*[ordenado->capacidadBloques];
+            memcpy(ordenado->bloques, anteriores, ordenado->cantidadBloques * sizeof(BloqueOrdenado*));
+            delete[] anteriores;
+        }
+        BloqueOrdenado* mitad = new BloqueOrdenado;
+        mitad->cantidad = b->cantidad / 2;
+        b->cantidad -= mitad->cantidad;
+        memcpy(mitad->entradas, &b->entradas[b->cantidad], mitad->cantidad * sizeof(EntradaIndice));
+        memmove(&ordenado->bloques[posicion.bloque + 2], &ordenado->bloques[posicion.bloque + 1],
+                (ordenado->cantidadBloques - posicion.bloque - 1) * sizeof(BloqueOrdenado*));
+        ordenado->bloques[posicion.bloque + 1] = mitad;
+        ordenado->cantidadBloques++;
+    }
 }
 
-// --- Implementación de Comandos ---
+bool ordenadoQuitar(IndiceOrdenado* ordenado, const char* nombre) {
+    PosicionOrdenada posicion = ordenadoCotaInferior(ordenado, nombre);
+    if (posicion.bloque == ordenado->cantidadBloques) return false;
+    BloqueOrdenado* b = ordenado->bloques[posicion.bloque];
+    if (strcmp(nombreEntrada(b->entradas[posicion.entrada]), nombre) != 0) return false;
 
-void comando_cd(Directorio*& directorioActual, const char* ruta, Directorio* raiz) {
-    Directorio* directorioDestino = navegarRuta(directorioActual, ruta, raiz);
-    if (directorioDestino) {
-        directorioActual = directorioDestino;
-    } else {
-        cout << "cd: " << ruta << ": No existe el archivo o directorio" << endl;
+    b->cantidad--;
+    memmove(&b->entradas[posicion.entrada], &b->entradas[posicion.entrada + 1],
+            (b->cantidad - posicion.entrada) * sizeof(EntradaIndice));
+    if (b->cantidad == 0) {
+        delete b;
+        memmove(&ordenado->bloques[posicion.bloque], &ordenado->bloques[posicion.bloque + 1],
+                (ordenado->cantidadBloques - posicion.bloque - 1) * sizeof(BloqueOrdenado*));
+        ordenado->cantidadBloques--;
     }
+    return true;
 }
 
-void comando_ls(Directorio* directorio) {
-    if (!directorio) return;
+// --- Mantenimiento de los índices de un directorio ---
 
-    // Listar subdirectorios
-    Directorio* subDirectorioActual = directorio->subdirectorios;
-    while (subDirectorioActual) {
-        cout << subDirectorioActual->nombre << "/\t";
-        subDirectorioActual = subDirectorioActual->siguienteDirectorio;
+// Construye ambos índices de un directorio a partir de sus listas de hijos
+void construirIndiceHijos(Directorio* directorio) {
+    unsigned int capacidad = 64;
+    while (capacidad * 3 < (unsigned int)directorio->cantidadHijos * 8) capacidad *= 2;
+    directorio->indice = crearIndiceHijos(capacidad);
+    directorio->ordenado = crearIndiceOrdenado();
+    for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+        indiceInsertar(directorio->indice, d, nullptr);
+        ordenadoInsertar(directorio->ordenado, {0, d, nullptr});
     }
-
-    // Listar archivos
-    Archivo* archivoActual = directorio->archivos;
-    while (archivoActual) {
-        cout << archivoActual->nombre << "\t";
-        archivoActual = archivoActual->siguiente;
+    for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+        indiceInsertar(directorio->indice, nullptr, a);
+        ordenadoInsertar(directorio->ordenado, {0, nullptr, a});
     }
-    cout << endl; // Nueva línea al final
 }
 
-void comando_mkdir(Directorio* directorioActual, const char* nombre) {
-    if (!esNombreValido(nombre)) {
-        cout << "mkdir: '" << nombre << "': Nombre de directorio inválido." << endl;
-        return;
-    }
-    if (buscarDirectorio(directorioActual, nombre) || buscarArchivo(directorioActual, nombre)) {
-        cout << "mkdir: '" << nombre << "': El archivo ya existe" << endl;
-        return;
+// Añade un hijo a los índices del directorio, si los tiene
+void indexarHijo(Directorio* directorio, Directorio* subdirectorio, Archivo* archivo) {
+    if (directorio->indice) {
+        indiceInsertar(directorio->indice, subdirectorio, archivo);
+        ordenadoInsertar(directorio->ordenado, {0, subdirectorio, archivo});
     }
-    Directorio* nuevoDirectorio = crearDirectorio(nombre, directorioActual);
-    if (nuevoDirectorio) {
-        anadirDirectorioALista(directorioActual, nuevoDirectorio);
-    } else {
-        cout << "mkdir: Error al crear el directorio." << endl;
+}
+
+// Quita un hijo de los índices del directorio (su nombre todavía debe ser válido)
+void desindexarHijo(Directorio* directorio, const char* nombre) {
+    if (directorio->indice) {
+        indiceQuitar(directorio->indice, nombre);
+        ordenadoQuitar(directorio->ordenado, nombre);
     }
 }
 
-void comando_rm(Directorio* directorioActual, const char* rutaAEliminar, Directorio* raiz) {
-    if (!rutaAEliminar || strlen(rutaAEliminar) == 0) {
-        cout << "rm: falta un operando" << endl;
-        cout << "Uso: rm <ruta_archivo_o_directorio>" << endl;
-        return;
+// Registra un hijo recién enlazado: actualiza el contador y los índices (creándolos al superar el umbral)
+void registrarHijo(Directorio* directorio, Directorio* subdirectorio, Archivo* archivo) {
+    directorio->cantidadHijos++;
+    if (directorio->indice) {
+        indexarHijo(directorio, subdirectorio, archivo);
+    } else if (directorio->cantidadHijos > UMBRAL_INDICE_HIJOS) {
+        construirIndiceHijos(directorio);
     }
+}
 
-    char copiaRuta[LONGITUD_MAX_RUTA];
-    strncpy(copiaRuta, rutaAEliminar, LONGITUD_MAX_RUTA - 1);
-    copiaRuta[LONGITUD_MAX_RUTA - 1] = '\0';
+// Da de baja un hijo antes de desenlazarlo
+void desregistrarHijo(Directorio* directorio, const char* nombre) {
+    directorio->cantidadHijos--;
+    desindexarHijo(directorio, nombre);
+}
 
-    char* ultimaBarra = strrchr(copiaRuta, '/');
-    char* nombreElemento;
-    char rutaPadre[LONGITUD_MAX_RUTA];
-    rutaPadre[0] = '\0';
+// --- Snapshot binario mapeado en memoria ---
+// Tras cargar un snapshot binario, nombres y contenidos apuntan directo a la región
+// mapeada hasta que se modifican (renombrar/editar hacen una copia propia), así que
+// nunca se liberan desde aquí.
 
-    Directorio* directorioPadreDestino = nullptr;
+const char* inicioMapa = nullptr;
+size_t tamanoMapa = 0;
 
-    if (ultimaBarra == nullptr) { // Es un nombre en el directorio actual
-        nombreElemento = copiaRuta;
-        directorioPadreDestino = directorioActual;
-    } else { // Es una ruta (absoluta o relativa)
-        *ultimaBarra = '\0';
-        nombreElemento = ultimaBarra + 1;
+bool esMemoriaMapeada(const char* puntero) {
+    return inicioMapa && puntero >= inicioMapa && puntero < inicioMapa + tamanoMapa;
+}
 
-        if (strlen(copiaRuta) == 0) {
-            strcpy(rutaPadre, "/");
-        } else {
-            strcpy(rutaPadre, copiaRuta);
-        }
-        
-        directorioPadreDestino = navegarRuta(directorioActual, rutaPadre, raiz);
-    }
+void liberarMapaSnapshot() {
+    if (!inicioMapa) return;
+#ifdef _WIN32
+    delete[] inicioMapa;
+#else
+    munmap((void*)inicioMapa, tamanoMapa);
+#endif
+    inicioMapa = nullptr;
+    tamanoMapa = 0;
+}
 
-    if (!directorioPadreDestino) {
-        cout << "rm: no se puede eliminar '" << rutaAEliminar << "': No existe el archivo o directorio" << endl;
-        return;
-    }
+// --- Buffer de bytes creciente ---
 
-    if (directorioPadreDestino == raiz && strcmp(nombreElemento, "") == 0 && strcmp(rutaAEliminar, "/") == 0) {
-        cout << "rm: no se puede eliminar '/': Es un directorio" << endl;
-        return;
-    }
-    if (strcmp(nombreElemento, ".") == 0 || strcmp(nombreElemento, "..") == 0) {
-        cout << "rm: no se puede eliminar '" << nombreElemento << "': Permiso denegado" << endl;
-        return;
-    }
+struct BufferBytes {
+    char* datos;
+    size_t longitud;
+    size_t capacidad;
+};
 
-    if (removerArchivo(directorioPadreDestino, nombreElemento)) {
-        cout << "rm: '" << nombreElemento << "' eliminado." << endl;
-    }
-    else if (removerDirectorio(directorioPadreDestino, nombreElemento)) {
-        cout << "rm: '" << nombreElemento << "' eliminado (incluyendo su contenido)." << endl;
-    }
-    else {
-        cout << "rm: no se puede eliminar '" << rutaAEliminar << "': No existe el archivo o directorio" << endl;
+void bufferAgregar(BufferBytes& buffer, const void* datos, size_t longitud) {
+    if (longitud == 0) return;
+    if (buffer.longitud + longitud > buffer.capacidad) {
+        size_t capacidad = buffer.capacidad ? buffer.capacidad : 4096;
+        while (capacidad < buffer.longitud + longitud) capacidad *= 2;
+        char* nuevo = new char[capacidad];
+        if (buffer.datos) {
+            memcpy(nuevo, buffer.datos, buffer.longitud);
+            delete[] buffer.datos;
+        }
+        buffer.datos = nuevo;
+        buffer.capacidad = capacidad;
     }
+    memcpy(buffer.datos + buffer.longitud, datos, longitud);
+    buffer.longitud += longitud;
 }
 
-void comando_touch(Directorio* directorioActual, const char* nombre) {
-    if (!esNombreValido(nombre)) {
-        cout << "touch: '" << nombre << "': Nombre de archivo inválido." << endl;
-        return;
-    }
-    if (buscarDirectorio(directorioActual, nombre)) {
-        cout << "touch: '" << nombre << "': Es un directorio" << endl;
-        return;
-    }
-    if (buscarArchivo(directorioActual, nombre)) {
-        cout << "touch: '" << nombre << "': El archivo ya existe. No se realizó ninguna acción." << endl;
-        return;
+void bufferAgregarTexto(BufferBytes& buffer, const char* texto) {
+    bufferAgregar(buffer, texto, strlen(texto));
+}
+
+void bufferLiberar(BufferBytes& buffer) {
+    delete[] buffer.datos;
+    buffer = {nullptr, 0, 0};
+}
+
+// Buffer de trabajo propio de un hilo (thread_local); se libera cuando el hilo termina
+struct BufferHilo {
+    BufferBytes buffer = {nullptr, 0, 0};
+    ~BufferHilo() { bufferLiberar(buffer); }
+};
+
+// Primera línea de los snapshots de texto con contenidos escapados. Los snapshots sin ella
+// (anteriores al escapado) se cargan con los contenidos tal cual.
+const int VERSION_FORMATO_TEXTO = 2;
+const char CABECERA_FORMATO_TEXTO[] = "FORMATO 2\n";
+
+// El formato de texto es de una línea por nodo, así que en los contenidos la barra invertida
+// y el salto de línea se escriben como "\\" y "\n"
+void bufferAgregarEscapado(BufferBytes& buffer, const char* datos, size_t longitud) {
+    size_t inicioTramo = 0;
+    for (size_t i = 0; i < longitud; i++) {
+        if (datos[i] != '\n' && datos[i] != '\\') continue;
+        bufferAgregar(buffer, datos + inicioTramo, i - inicioTramo);
+        bufferAgregar(buffer, datos[i] == '\n' ? "\\n" : "\\\\", 2);
+        inicioTramo = i + 1;
     }
+    bufferAgregar(buffer, datos + inicioTramo, longitud - inicioTramo);
+}
 
-    Archivo* nuevoArchivo = crearArchivo(nombre);
-    if (nuevoArchivo) {
-        anadirArchivo(directorioActual, nuevoArchivo);
-        cout << "touch: '" << nombre << "' creado." << endl;
-    } else {
-        cout << "touch: Error al crear el archivo." << endl;
+// Deshace el escapado en el sitio; cualquier otra barra invertida se deja tal cual. Solo se
+// aplica a snapshots con CABECERA_FORMATO_TEXTO.
+void desescaparContenido(char* texto) {
+    char* destino = texto;
+    for (const char* origen = texto; *origen; origen++) {
+        if (origen[0] == '\\' && (origen[1] == 'n' || origen[1] == '\\')) {
+            *destino++ = origen[1] == 'n' ? '\n' : '\\';
+            origen++;
+        } else {
+            *destino++ = *origen;
+        }
     }
+    *destino = '\0';
 }
 
-void comando_editar(Archivo* archivo) {
-    if (!archivo) {
-        cout << "editar: No hay archivo válido para editar." << endl;
-        return;
+// Longitud que tendrá el texto después de desescaparContenido, sin modificarlo
+size_t longitudDesescapada(const char* texto) {
+    size_t longitud = 0;
+    for (const char* c = texto; *c; c++, longitud++) {
+        if (c[0] == '\\' && (c[1] == 'n' || c[1] == '\\')) c++;
     }
+    return longitud;
+}
 
-    cout << "--- Editando: " << archivo->nombre << " ---" << endl;
-    cout << "Contenido actual:\n" << (archivo->contenido ? archivo->contenido : "(vacío)") << endl;
-    cout << "Ingrese nuevo contenido (presione Enter en una línea vacía para finalizar):\n";
+// Descarta lo que se escribe en un stream (benchmarks y reproducción del diario)
+class BufferNulo : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+};
 
-    char bufferLinea[LONGITUD_MAX_CONTENIDO];
-    char bufferNuevoContenido[LONGITUD_MAX_CONTENIDO * 2];
-    bufferNuevoContenido[0] = '\0';
-    int longitudActual = 0;
+// Salida del modo por lotes: acumula en un buffer grande y sólo lo vuelca cuando se llena o
+// al terminar. sync() no hace nada, así que los 'endl' de los comandos no fuerzan una
+// escritura por línea.
+class BufferSalidaLote : public streambuf {
+public:
+    explicit BufferSalidaLote(FILE* destino) : destino(destino) { setp(datos, datos + sizeof(datos)); }
+    ~BufferSalidaLote() override { volcar(); }
 
-    // Limpiar el buffer de entrada antes de leer líneas
-    cin.clear();
-    // Consumir cualquier caracter de nueva línea pendiente
-    if (cin.peek() == '\n') {
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    void volcar() {
+        vaciarBuffer();
+        fflush(destino);
     }
 
-
-    while (cin.getline(bufferLinea, sizeof(bufferLinea))) {
-        if (strlen(bufferLinea) == 0) {
-            break;
+protected:
+    int overflow(int c) override {
+        vaciarBuffer();
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
         }
-        
-        // Verificar si hay espacio suficiente antes de concatenar
-        if (longitudActual + strlen(bufferLinea) + 1 + 1 > sizeof(bufferNuevoContenido)) {
-            cout << "Advertencia: Contenido demasiado largo, se truncará." << endl;
-            break;
+        return traits_type::not_eof(c);
+    }
+    streamsize xsputn(const char* s, streamsize n) override {
+        if (n >= (streamsize)sizeof(datos)) { // Bloques grandes (cat) van directos
+            vaciarBuffer();
+            return (streamsize)fwrite(s, 1, (size_t)n, destino);
         }
-        strcat(bufferNuevoContenido, bufferLinea);
-        strcat(bufferNuevoContenido, "\n");
-        longitudActual += strlen(bufferLinea) + 1;
+        return streambuf::xsputn(s, n);
     }
+    int sync() override { return 0; }
 
-    if (archivo->contenido) {
-        delete[] archivo->contenido;
-    }
-    if (longitudActual > 0) {
-        // Asegúrate de que el último caracter no sea un salto de línea si el usuario terminó con una línea vacía
-        // Y el bufferNuevoContenido ya tiene un '\n' adicional del strcat, ajustamos
-        if (bufferNuevoContenido[longitudActual-1] == '\n' && longitudActual > 0) {
-            bufferNuevoContenido[longitudActual-1] = '\0'; // Elimina el último salto de línea
-            longitudActual--;
-        }
-        archivo->contenido = new char[longitudActual + 1];
-        strcpy(archivo->contenido, bufferNuevoContenido);
-    } else {
-        archivo->contenido = nullptr;
+private:
+    void vaciarBuffer() {
+        if (pptr() > pbase()) fwrite(pbase(), 1, (size_t)(pptr() - pbase()), destino);
+        setp(datos, datos + sizeof(datos));
     }
 
-    cout << "Contenido de '" << archivo->nombre << "' actualizado." << endl;
-}
+    FILE* destino;
+    char datos[TAM_BUFFER_SALIDA_LOTE];
+};
 
-void comando_renombrar(Directorio* directorioActual, const char* nombreAntiguo, const char* nombreNuevo) {
-    if (!esNombreValido(nombreNuevo)) {
-        cout << "renombrar: '" << nombreNuevo << "': Nuevo nombre inválido." << endl;
-        return;
+// Salida que se acumula en un BufferBytes (respuestas del servidor a cada conexión)
+class BufferSalidaBytes : public streambuf {
+public:
+    BufferBytes* destino = nullptr;
+
+protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            char caracter = (char)c;
+            bufferAgregar(*destino, &caracter, 1);
+        }
+        return traits_type::not_eof(c);
     }
-    if (strcmp(nombreAntiguo, ".") == 0 || strcmp(nombreAntiguo, "..") == 0) {
-        cout << "renombrar: No se pueden renombrar los directorios especiales '.' o '..'." << endl;
-        return;
+    streamsize xsputn(const char* s, streamsize n) override {
+        bufferAgregar(*destino, s, (size_t)n);
+        return n;
     }
+};
 
-    if (buscarArchivo(directorioActual, nombreNuevo) || buscarDirectorio(directorioActual, nombreNuevo)) {
-        cout << "renombrar: '" << nombreNuevo << "': El archivo ya existe" << endl;
-        return;
+// Entrada que lee de un tramo de memoria ya recibido, sin copiarlo
+class BufferEntradaMemoria : public streambuf {
+public:
+    void asignar(const char* datos, size_t longitud) {
+        char* inicio = const_cast<char*>(datos);
+        setg(inicio, inicio, inicio + longitud);
     }
+};
 
-    Archivo* archivoARenombrar = buscarArchivo(directorioActual, nombreAntiguo);
-    if (archivoARenombrar) {
-        delete[] archivoARenombrar->nombre;
-        archivoARenombrar->nombre = new char[strlen(nombreNuevo) + 1];
-        strcpy(archivoARenombrar->nombre, nombreNuevo);
-        cout << "Archivo '" << nombreAntiguo << "' renombrado a '" << nombreNuevo << "'." << endl;
+// --- Almacén de contenidos deduplicados ---
+// Los contenidos se guardan una sola vez por valor: cada BlobContenido lleva delante de sus
+// bytes un hash y un contador de referencias, y Archivo::contenido apunta a los bytes. Un
+// contenido nunca se modifica en el sitio: editar crea (o reutiliza) otro blob y suelta el
+// anterior, y las escrituras parciales usan la tabla de piezas, que no toca el original.
+// Los contenidos que apuntan al snapshot mapeado quedan fuera del almacén.
+// Los blobs de al menos umbralCompresion bytes se guardan comprimidos; en ese caso
+// Archivo::contenido apunta a los bytes comprimidos y hay que leerlo con textoContenido.
+// Los contenidos de menos de UMBRAL_CONTENIDO_PEQUENO bytes no pasan por el almacén: la
+// cabecera y la ranura costarían más de lo que ahorra deduplicarlos. Llevan delante un único
+// byte de marca, cada archivo tiene su propia copia y compartirlos es copiarlos.
+// El byte anterior al contenido (la marca, o el último de la cabecera) dice de qué tipo es.
+
+const size_t UMBRAL_CONTENIDO_PEQUENO = 64;
+const uint8_t MARCA_BLOB = 0xB1;
+const uint8_t MARCA_PEQUENO = 0x5E;
+
+struct BlobContenido {
+    uint64_t hash;              // Del texto sin comprimir
+    size_t longitud;            // Del texto sin comprimir
+    size_t bytesDatos;          // Lo que ocupan los datos detrás de la cabecera
+    uint32_t referencias;
+    bool compartidoEnTexto;     // Se guarda como BLOB + FILEREF en el snapshot de texto
+    bool comprimido;
+    bool perezoso;              // Aún en el snapshot (--lazy); 'longitud' son los bytes en disco
+    uint8_t marca;              // MARCA_BLOB; va justo antes de los datos
+};
+static_assert(offsetof(BlobContenido, marca) == sizeof(BlobContenido) - 1, "la marca debe preceder a los datos");
+
+struct AlmacenContenidos {
+    BlobContenido** ranuras;    // Direccionamiento abierto con sondeo lineal
+    size_t capacidad;           // Potencia de 2
+    size_t ocupadas;
+    long referencias;
+    long long bytesLogicos;     // Lo que ocuparían los contenidos con una copia por archivo
+    long long bytesAlmacenados; // Lo que ocupan de verdad, cabeceras incluidas
+    long pequenos;              // Contenidos pequeños vivos (fuera de la tabla)
+};
+
+AlmacenContenidos almacen = {nullptr, 0, 0, 0, 0, 0, 0};
+// Los comandos que modifican el árbol usan el almacén con el árbol en exclusiva. Este cerrojo
+// cubre lo que pasa con el árbol compartido: cargas perezosas y estadísticas de lectura.
+mutex cerrojoAlmacen;
+
+uint64_t hashContenido(const char* datos, size_t longitud) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ longitud;
+    size_t i = 0;
+    for (; i + 8 <= longitud; i += 8) {
+        uint64_t palabra;
+        memcpy(&palabra, datos + i, 8);
+        hash = (hash ^ palabra) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    uint64_t resto = 0;
+    memcpy(&resto, datos + i, longitud - i);
+    hash = (hash ^ resto) * 0xC4CEB9FE1A85EC53ull;
+    return hash ^ (hash >> 29);
+}
+
+BlobContenido* blobDe(const char* contenido) {
+    return (BlobContenido*)contenido - 1;
+}
+
+char* datosBlob(BlobContenido* blob) {
+    return (char*)(blob + 1);
+}
+
+// Contenido propio de un archivo, sin cabecera (ni mapeado ni en el almacén)
+bool esContenidoPequeno(const char* contenido) {
+    return contenido && !esMemoriaMapeada(contenido) && (uint8_t)contenido[-1] == MARCA_PEQUENO;
+}
+
+// Un blob del almacén (o perezoso) con su cabecera delante
+bool esContenidoBlob(const char* contenido) {
+    return contenido && !esMemoriaMapeada(contenido) && (uint8_t)contenido[-1] == MARCA_BLOB;
+}
+
+char* crearContenidoPequeno(const char* datos, size_t longitud) {
+    char* bloque = new char[longitud + 2];
+    bloque[0] = (char)MARCA_PEQUENO;
+    memcpy(bloque + 1, datos, longitud);
+    bloque[longitud + 1] = '\0';
+    almacen.pequenos++;
+    almacen.referencias++;
+    almacen.bytesLogicos += longitud + 1;
+    almacen.bytesAlmacenados += longitud + 2;
+    return bloque + 1;
+}
+
+// --- Compresión LZ de contenidos ---
+// Formato por secuencias, al estilo de LZ4: un byte de control (4 bits de longitud de
+// literales, 4 bits de longitud de coincidencia - 4; 15 indica que siguen bytes de
+// extensión de 255 en 255), los literales, y si hay coincidencia su distancia en 2 bytes
+// (little endian) y la extensión de su longitud. La última secuencia solo lleva literales y
+// el descompresor se detiene al completar la longitud original, que guarda el blob.
+
+size_t umbralCompresion = 1024; // 0 desactiva la compresión; se ajusta con --compress-threshold N
+
+struct EstadisticasCompresion {
+    long blobsComprimidos;
+    long long bytesOriginales;      // De los blobs comprimidos vivos
+    long long bytesComprimidos;
+    long intentosFallidos;          // Contenidos que no ganaban lo suficiente y quedaron sin comprimir
+    double segundosCompresion;
+    long descompresiones;
+    double segundosDescompresion;
+    double maximoDescompresion;
+};
+
+EstadisticasCompresion estadisticasCompresion = {0, 0, 0, 0, 0, 0, 0, 0};
+mutex cerrojoEstadisticasCompresion; // Para las descompresiones, que ocurren con el árbol compartido
+
+void agregarLongitudLZ(BufferBytes& salida, size_t valor) {
+    for (; valor >= 255; valor -= 255) bufferAgregar(salida, "\xff", 1);
+    unsigned char ultimo = (unsigned char)valor;
+    bufferAgregar(salida, &ultimo, 1);
+}
+
+void emitirSecuenciaLZ(BufferBytes& salida, const unsigned char* literales, size_t cantidadLiterales,
+                       size_t distancia, size_t largoCoincidencia) {
+    size_t extraCoincidencia = largoCoincidencia ? largoCoincidencia - 4 : 0;
+    unsigned char control = (unsigned char)(((cantidadLiterales < 15 ? cantidadLiterales : 15) << 4) |
+                                            (extraCoincidencia < 15 ? extraCoincidencia : 15));
+    bufferAgregar(salida, &control, 1);
+    if (cantidadLiterales >= 15) agregarLongitudLZ(salida, cantidadLiterales - 15);
+    bufferAgregar(salida, literales, cantidadLiterales);
+    if (largoCoincidencia) {
+        unsigned char distanciaBytes[2] = {(unsigned char)(distancia & 0xff), (unsigned char)(distancia >> 8)};
+        bufferAgregar(salida, distanciaBytes, 2);
+        if (extraCoincidencia >= 15) agregarLongitudLZ(salida, extraCoincidencia - 15);
+    }
+}
+
+// Comprime datos[0, longitud) al final de 'salida'
+void comprimirLZ(const char* datos, size_t longitud, BufferBytes& salida) {
+    const unsigned char* entrada = (const unsigned char*)datos;
+    uint32_t* tabla = new uint32_t[1 << BITS_TABLA_LZ](); // Posición + 1 de la última aparición
+    size_t ancla = 0, i = 0;
+    // Los últimos bytes siempre van como literales: así el final nunca es una coincidencia
+    size_t limite = longitud > 12 ? longitud - 12 : 0;
+    while (i < limite) {
+        uint32_t secuencia;
+        memcpy(&secuencia, entrada + i, 4);
+        uint32_t h = (secuencia * 2654435761u) >> (32 - BITS_TABLA_LZ);
+        size_t candidato = tabla[h];
+        tabla[h] = (uint32_t)(i + 1);
+        if (candidato == 0 || i - (candidato - 1) > 0xffff || memcmp(entrada + candidato - 1, entrada + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t origen = candidato - 1;
+        size_t largo = 4;
+        while (i + largo < longitud - 5 && entrada[origen + largo] == entrada[i + largo]) largo++;
+        emitirSecuenciaLZ(salida, entrada + ancla, i - ancla, i - origen, largo);
+        i += largo;
+        ancla = i;
+    }
+    emitirSecuenciaLZ(salida, entrada + ancla, longitud - ancla, 0, 0);
+    delete[] tabla;
+}
+
+bool leerLongitudLZ(const unsigned char*& p, const unsigned char* fin, size_t& valor) {
+    unsigned char byte;
+    do {
+        if (p >= fin) return false;
+        byte = *p++;
+        valor += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Descomprime en 'destino', que tiene espacio para exactamente 'longitud' bytes
+bool descomprimirLZ(const char* datos, size_t bytesDatos, char* destino, size_t longitud) {
+    const unsigned char* p = (const unsigned char*)datos;
+    const unsigned char* fin = p + bytesDatos;
+    size_t escritos = 0;
+    while (escritos < longitud) {
+        if (p >= fin) return false;
+        unsigned char control = *p++;
+        size_t literales = control >> 4;
+        if (literales == 15 && !leerLongitudLZ(p, fin, literales)) return false;
+        if (literales > (size_t)(fin - p) || literales > longitud - escritos) return false;
+        memcpy(destino + escritos, p, literales);
+        p += literales;
+        escritos += literales;
+        if (escritos == longitud) break;
+
+        if (fin - p < 2) return false;
+        size_t distancia = p[0] | (p[1] << 8);
+        p += 2;
+        size_t largo = control & 15;
+        if (largo == 15 && !leerLongitudLZ(p, fin, largo)) return false;
+        largo += 4;
+        if (distancia == 0 || distancia > escritos || largo > longitud - escritos) return false;
+        for (size_t k = 0; k < largo; k++, escritos++) { // Byte a byte: la copia puede solaparse
+            destino[escritos] = destino[escritos - distancia];
+        }
+    }
+    return true;
+}
+
+// Descomprime un blob en un buffer propio terminado en '\0', midiendo la latencia
+char* descomprimirBlob(const BlobContenido* blob) {
+    auto inicio = chrono::steady_clock::now();
+    char* texto = new char[blob->longitud + 1];
+    if (!descomprimirLZ((const char*)(blob + 1), blob->bytesDatos, texto, blob->longitud)) {
+        cerr << "Error: Contenido comprimido dañado." << endl;
+        memset(texto, 0, blob->longitud);
+    }
+    texto[blob->longitud] = '\0';
+    double segundos = chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+    lock_guard<mutex> bloqueo(cerrojoEstadisticasCompresion); // Varias sesiones pueden descomprimir a la vez
+    estadisticasCompresion.descompresiones++;
+    estadisticasCompresion.segundosDescompresion += segundos;
+    if (segundos > estadisticasCompresion.maximoDescompresion) estadisticasCompresion.maximoDescompresion = segundos;
+    return texto;
+}
+
+// Caché LRU pequeña de contenidos descomprimidos, para las lecturas interactivas (cat, edit)
+struct EntradaDescomprimido {
+    const BlobContenido* blob;      // nullptr = libre
+    char* texto;
+    unsigned long ultimoUso;
+};
+
+// Una por hilo: el texto devuelto sigue valiendo mientras el mismo hilo no lea otro comprimido.
+// Liberar un blob comprimido (con el árbol en exclusiva) cambia la generación global, y cada
+// caché se vacía la próxima vez que se usa, antes de que la dirección pueda reutilizarse.
+struct CacheDescomprimidos {
+    EntradaDescomprimido entradas[ENTRADAS_CACHE_DESCOMPRIMIDOS];
+    unsigned long reloj;
+    unsigned long generacion;
+    long aciertos;
+
+    void vaciar() {
+        for (EntradaDescomprimido& entrada : entradas) {
+            delete[] entrada.texto;
+            entrada = {nullptr, nullptr, 0};
+        }
+    }
+    ~CacheDescomprimidos() { vaciar(); }
+};
+
+unsigned long generacionDescomprimidos = 0;
+thread_local CacheDescomprimidos cacheDescomprimidos = {};
+
+const char* textoDescomprimidoEnCache(const BlobContenido* blob) {
+    if (cacheDescomprimidos.generacion != generacionDescomprimidos) {
+        cacheDescomprimidos.vaciar();
+        cacheDescomprimidos.generacion = generacionDescomprimidos;
+    }
+    EntradaDescomprimido* victima = &cacheDescomprimidos.entradas[0];
+    for (EntradaDescomprimido& entrada : cacheDescomprimidos.entradas) {
+        if (entrada.blob == blob) {
+            entrada.ultimoUso = ++cacheDescomprimidos.reloj;
+            cacheDescomprimidos.aciertos++;
+            return entrada.texto;
+        }
+        if (!entrada.blob || (victima->blob && entrada.ultimoUso < victima->ultimoUso)) victima = &entrada;
+    }
+    delete[] victima->texto;
+    victima->blob = blob;
+    victima->texto = descomprimirBlob(blob);
+    victima->ultimoUso = ++cacheDescomprimidos.reloj;
+    return victima->texto;
+}
+
+void quitarDeCacheDescomprimidos(const BlobContenido* blob) {
+    for (EntradaDescomprimido& entrada : cacheDescomprimidos.entradas) {
+        if (entrada.blob == blob) {
+            delete[] entrada.texto;
+            entrada = {nullptr, nullptr, 0};
+        }
+    }
+    generacionDescomprimidos++; // Las cachés de los demás hilos
+}
+
+// --- Carga perezosa de contenidos (--lazy) ---
+// Con --lazy, cargarSistemaArchivos no copia los contenidos de las líneas FILE: cada archivo
+// recibe un blob perezoso que solo recuerda dónde está su contenido (escapado) dentro del
+// snapshot. El primer acceso interactivo lo lee con pread, lo desescapa y lo interna como un
+// contenido normal, que el blob perezoso conserva desde entonces. El descriptor del snapshot
+// queda abierto mientras haya blobs que lo usen; como el guardado reemplaza el archivo con
+// rename, el descriptor sigue viendo la versión de la que se cargó.
+// Solo se difieren los contenidos de al menos UMBRAL_CONTENIDO_PEREZOSO bytes: el blob
+// perezoso ocupa unos 72 bytes, así que con los más cortos no se ahorraría nada.
+
+bool cargaPerezosa = false;
+const size_t UMBRAL_CONTENIDO_PEREZOSO = 256;
+
+struct OrigenPerezoso {
+    int descriptor;
+    long blobs;                 // Blobs perezosos vivos que lo usan
+    bool escapado;              // El snapshot tiene CABECERA_FORMATO_TEXTO
+};
+
+// Datos de un blob perezoso, detrás de su cabecera
+struct ContenidoPerezoso {
+    OrigenPerezoso* origen;
+    uint64_t desplazamiento;
+    uint64_t bytesEnDisco;      // Escapados
+    uint64_t longitud;          // Del texto ya desescapado, para no cargarlo solo por su tamaño
+    atomic<char*> cargado;      // Contenido ya leído (con una referencia propia), o nullptr
+};
+
+struct EstadisticasPerezosas {
+    long creados;
+    long cargados;
+    long long bytesLeidos;
+    double segundosLectura;
+};
+
+EstadisticasPerezosas estadisticasPerezosas = {0, 0, 0, 0};
+
+char* internarContenido(const char* datos, size_t longitud);
+
+ContenidoPerezoso* perezosoDe(const char* contenido) {
+    return (ContenidoPerezoso*)contenido;
+}
+
+// Crea un blob perezoso con una referencia para bytesEnDisco bytes escapados del snapshot,
+// que desescapados son 'longitud'
+char* crearContenidoPerezoso(OrigenPerezoso* origen, uint64_t desplazamiento, uint64_t bytesEnDisco, uint64_t longitud) {
+    BlobContenido* blob = (BlobContenido*)new char[sizeof(BlobContenido) + sizeof(ContenidoPerezoso)];
+    *blob = {0, (size_t)bytesEnDisco, sizeof(ContenidoPerezoso), 1, false, false, true, MARCA_BLOB};
+    new (perezosoDe(datosBlob(blob))) ContenidoPerezoso{origen, desplazamiento, bytesEnDisco, longitud, {nullptr}};
+    origen->blobs++;
+    estadisticasPerezosas.creados++;
+    almacen.referencias++;
+    almacen.bytesLogicos += bytesEnDisco + 1;
+    almacen.bytesAlmacenados += sizeof(BlobContenido) + sizeof(ContenidoPerezoso);
+    return datosBlob(blob);
+}
+
+// Lee y desescapa el contenido en 'destino' (terminado en '\0'); devuelve false si falla
+bool leerContenidoPerezoso(const ContenidoPerezoso* perezoso, BufferBytes& destino) {
+    destino.longitud = 0;
+    if (destino.capacidad < perezoso->bytesEnDisco + 1) {
+        bufferLiberar(destino);
+        destino.datos = new char[perezoso->bytesEnDisco + 1];
+        destino.capacidad = perezoso->bytesEnDisco + 1;
+    }
+    size_t leidos = 0;
+#ifndef _WIN32
+    while (leidos < perezoso->bytesEnDisco) {
+        ssize_t n = pread(perezoso->origen->descriptor, destino.datos + leidos, perezoso->bytesEnDisco - leidos,
+                          (off_t)(perezoso->desplazamiento + leidos));
+        if (n <= 0) break;
+        leidos += (size_t)n;
+    }
+#endif
+    destino.datos[leidos] = '\0';
+    if (leidos < perezoso->bytesEnDisco) {
+        cerr << "Error: No se pudo leer un contenido del snapshot." << endl;
+        return false;
+    }
+    if (perezoso->origen->escapado) desescaparContenido(destino.datos);
+    destino.longitud = strlen(destino.datos);
+    return true;
+}
+
+// Trae el contenido del snapshot y lo interna; desde entonces el blob perezoso lo conserva.
+// Puede llamarse con el árbol compartido: la primera sesión que llega lo carga.
+char* cargarContenidoPerezoso(ContenidoPerezoso* perezoso) {
+    char* cargado = perezoso->cargado.load(memory_order_acquire);
+    if (cargado) return cargado;
+    lock_guard<mutex> bloqueo(cerrojoAlmacen);
+    if (!perezoso->cargado.load(memory_order_relaxed)) {
+        auto inicio = chrono::steady_clock::now();
+        BufferBytes texto = {nullptr, 0, 0};
+        leerContenidoPerezoso(perezoso, texto);
+        perezoso->cargado.store(internarContenido(texto.datos, texto.longitud), memory_order_release);
+        bufferLiberar(texto);
+        estadisticasPerezosas.cargados++;
+        estadisticasPerezosas.bytesLeidos += perezoso->bytesEnDisco;
+        estadisticasPerezosas.segundosLectura += chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+    }
+    return perezoso->cargado;
+}
+
+void soltarOrigenPerezoso(OrigenPerezoso* origen) {
+    if (--origen->blobs > 0) return;
+#ifndef _WIN32
+    close(origen->descriptor);
+#endif
+    delete origen;
+}
+
+bool esContenidoComprimido(const char* contenido) {
+    return esContenidoBlob(contenido) && blobDe(contenido)->comprimido;
+}
+
+// Comprimido o perezoso: los bytes a los que apunta no son el texto
+bool esContenidoIndirecto(const char* contenido) {
+    if (!esContenidoBlob(contenido)) return false;
+    const BlobContenido* blob = blobDe(contenido);
+    return blob->comprimido || blob->perezoso;
+}
+
+// Texto legible de un contenido y su longitud. Con la caché, un contenido comprimido pasa
+// por la LRU de descomprimidos (el puntero vale hasta la próxima lectura de otro comprimido)
+// y uno perezoso se carga para siempre; sin ella (guardado en paralelo, que no debe ensuciar
+// la caché ni compartirla entre hilos) se lee en un buffer propio del hilo.
+const char* textoContenido(const char* contenido, size_t& longitud, bool usarCache = true) {
+    if (!esContenidoIndirecto(contenido)) {
+        longitud = contenido ? strlen(contenido) : 0;
+        return contenido;
+    }
+    const BlobContenido* blob = blobDe(contenido);
+    if (blob->perezoso) {
+        ContenidoPerezoso* perezoso = perezosoDe(contenido);
+        if (usarCache) cargarContenidoPerezoso(perezoso);
+        char* cargado = perezoso->cargado.load(memory_order_acquire);
+        if (cargado) return textoContenido(cargado, longitud, usarCache);
+        thread_local BufferHilo lecturaHilo;
+        leerContenidoPerezoso(perezoso, lecturaHilo.buffer);
+        longitud = lecturaHilo.buffer.longitud;
+        return lecturaHilo.buffer.datos;
+    }
+    longitud = blob->longitud;
+    if (usarCache) return textoDescomprimidoEnCache(blob);
+
+    thread_local BufferHilo hilo;
+    BufferBytes& textoHilo = hilo.buffer;
+    if (textoHilo.capacidad < blob->longitud + 1) {
+        bufferLiberar(textoHilo);
+        textoHilo.datos = new char[blob->longitud + 1];
+        textoHilo.capacidad = blob->longitud + 1;
+    }
+    if (!descomprimirLZ(contenido, blob->bytesDatos, textoHilo.datos, blob->longitud)) {
+        memset(textoHilo.datos, 0, blob->longitud);
+    }
+    textoHilo.datos[blob->longitud] = '\0';
+    return textoHilo.datos;
+}
+
+size_t longitudTexto(const char* contenido) {
+    size_t longitud;
+    if (esContenidoIndirecto(contenido) && blobDe(contenido)->perezoso) longitud = perezosoDe(contenido)->longitud;
+    else if (!contenido) longitud = 0;
+    else longitud = esContenidoComprimido(contenido) ? blobDe(contenido)->longitud : strlen(contenido);
+    return longitud;
+}
+
+void imprimirEstadisticasCompresion() {
+    lock_guard<mutex> bloqueoAlmacen(cerrojoAlmacen);
+    lock_guard<mutex> bloqueoEstadisticas(cerrojoEstadisticasCompresion);
+    const EstadisticasCompresion& e = estadisticasCompresion;
+    salida() << "zstats: umbral " << umbralCompresion << " bytes, " << e.blobsComprimidos << " blobs comprimidos";
+    if (e.bytesComprimidos > 0) {
+        salida() << " (" << e.bytesOriginales << " -> " << e.bytesComprimidos << " bytes, razón "
+                 << ((double)e.bytesOriginales / e.bytesComprimidos) << ")";
+    }
+    salida() << ", " << e.intentosFallidos << " sin ganancia, " << (e.segundosCompresion * 1000) << " ms comprimiendo" << endl;
+    salida() << "  " << e.descompresiones << " descompresiones";
+    if (e.descompresiones > 0) {
+        salida() << " (media " << (e.segundosDescompresion / e.descompresiones * 1e6) << " us, máxima "
+                 << (e.maximoDescompresion * 1e6) << " us)";
+    }
+    salida() << ", " << cacheDescomprimidos.aciertos << " aciertos en la caché de descomprimidos de esta sesión" << endl;
+}
+
+void almacenColocar(BlobContenido* blob) {
+    size_t mascara = almacen.capacidad - 1;
+    size_t i = blob->hash & mascara;
+    while (almacen.ranuras[i]) i = (i + 1) & mascara;
+    almacen.ranuras[i] = blob;
+}
+
+// Devuelve un contenido igual a datos[0, longitud) con una referencia más, creándolo si hace
+// falta (los pequeños siempre se crean)
+char* internarContenido(const char* datos, size_t longitud) {
+    if (longitud < UMBRAL_CONTENIDO_PEQUENO) return crearContenidoPequeno(datos, longitud);
+    uint64_t hash = hashContenido(datos, longitud);
+    size_t largo;
+    if (almacen.capacidad > 0) {
+        size_t mascara = almacen.capacidad - 1;
+        for (size_t i = hash & mascara; almacen.ranuras[i]; i = (i + 1) & mascara) {
+            BlobContenido* blob = almacen.ranuras[i];
+            if (blob->hash == hash && blob->longitud == longitud &&
+                memcmp(textoContenido(datosBlob(blob), largo), datos, longitud) == 0) {
+                blob->referencias++;
+                almacen.referencias++;
+                almacen.bytesLogicos += longitud + 1;
+                return datosBlob(blob);
+            }
+        }
+    }
+
+    if ((almacen.ocupadas + 1) * 4 > almacen.capacidad * 3) {
+        BlobContenido** anteriores = almacen.ranuras;
+        size_t capacidadAnterior = almacen.capacidad;
+        almacen.capacidad = almacen.capacidad ? almacen.capacidad * 2 : 1024;
+        almacen.ranuras = new BlobContenido*[almacen.capacidad]();
+        for (size_t i = 0; i < capacidadAnterior; i++) {
+            if (anteriores[i]) almacenColocar(anteriores[i]);
+        }
+        delete[] anteriores;
+    }
+
+    // Solo se guarda comprimido si se ahorra al menos un octavo
+    BufferBytes comprimido = {nullptr, 0, 0};
+    if (umbralCompresion > 0 && longitud >= umbralCompresion) {
+        auto inicio = chrono::steady_clock::now();
+        comprimirLZ(datos, longitud, comprimido);
+        estadisticasCompresion.segundosCompresion += chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+        if (comprimido.longitud > longitud - longitud / 8) {
+            estadisticasCompresion.intentosFallidos++;
+            bufferLiberar(comprimido);
+        }
+    }
+
+    bool esComprimido = comprimido.datos != nullptr;
+    size_t bytesDatos = esComprimido ? comprimido.longitud : longitud + 1;
+    BlobContenido* blob = (BlobContenido*)new char[sizeof(BlobContenido) + bytesDatos];
+    blob->hash = hash;
+    blob->longitud = longitud;
+    blob->bytesDatos = bytesDatos;
+    blob->referencias = 1;
+    blob->compartidoEnTexto = false;
+    blob->comprimido = esComprimido;
+    blob->perezoso = false;
+    blob->marca = MARCA_BLOB;
+    if (esComprimido) {
+        memcpy(datosBlob(blob), comprimido.datos, comprimido.longitud);
+        bufferLiberar(comprimido);
+        estadisticasCompresion.blobsComprimidos++;
+        estadisticasCompresion.bytesOriginales += longitud;
+        estadisticasCompresion.bytesComprimidos += bytesDatos;
+    } else {
+        memcpy(datosBlob(blob), datos, longitud);
+        datosBlob(blob)[longitud] = '\0';
+    }
+    almacenColocar(blob);
+    almacen.ocupadas++;
+    almacen.referencias++;
+    almacen.bytesLogicos += longitud + 1;
+    almacen.bytesAlmacenados += sizeof(BlobContenido) + bytesDatos;
+    return datosBlob(blob);
+}
+
+// Agrega una referencia a un contenido ya existente; un contenido pequeño se copia
+char* compartirContenido(char* contenido) {
+    if (esContenidoPequeno(contenido)) return crearContenidoPequeno(contenido, strlen(contenido));
+    if (contenido && !esMemoriaMapeada(contenido)) {
+        BlobContenido* blob = blobDe(contenido);
+        blob->referencias++;
+        almacen.referencias++;
+        almacen.bytesLogicos += blob->longitud + 1;
+    }
+    return contenido;
+}
+
+// Suelta una referencia; el último en soltarla saca el blob del almacén
+void liberarContenido(char* contenido) {
+    if (!contenido || esMemoriaMapeada(contenido)) return;
+    if (esContenidoPequeno(contenido)) {
+        size_t longitud = strlen(contenido);
+        almacen.pequenos--;
+        almacen.referencias--;
+        almacen.bytesLogicos -= longitud + 1;
+        almacen.bytesAlmacenados -= longitud + 2;
+        delete[] (contenido - 1);
+        return;
+    }
+    BlobContenido* blob = blobDe(contenido);
+    almacen.referencias--;
+    almacen.bytesLogicos -= blob->longitud + 1;
+    if (--blob->referencias > 0) return;
+    if (blob->perezoso) { // Los perezosos no están en la tabla: no se conoce su hash
+        ContenidoPerezoso* perezoso = perezosoDe(contenido);
+        liberarContenido(perezoso->cargado);
+        soltarOrigenPerezoso(perezoso->origen);
+        almacen.bytesAlmacenados -= sizeof(BlobContenido) + blob->bytesDatos;
+        delete[] (char*)blob;
         return;
     }
 
-    Directorio* directorioARenombrar = buscarDirectorio(directorioActual, nombreAntiguo);
-    if (directorioARenombrar) {
-        delete[] directorioARenombrar->nombre;
-        directorioARenombrar->nombre = new char[strlen(nombreNuevo) + 1];
-        strcpy(directorioARenombrar->nombre, nombreNuevo);
-        cout << "Directorio '" << nombreAntiguo << "' renombrado a '" << nombreNuevo << "'." << endl;
-        return;
+    // Borrado con desplazamiento hacia atrás para no dejar huecos en las secuencias de sondeo
+    size_t mascara = almacen.capacidad - 1;
+    size_t i = blob->hash & mascara;
+    while (almacen.ranuras[i] != blob) i = (i + 1) & mascara;
+    size_t hueco = i;
+    for (size_t j = (i + 1) & mascara; almacen.ranuras[j]; j = (j + 1) & mascara) {
+        size_t ideal = almacen.ranuras[j]->hash & mascara;
+        if (((j - ideal) & mascara) >= ((j - hueco) & mascara)) {
+            almacen.ranuras[hueco] = almacen.ranuras[j];
+            hueco = j;
+        }
+    }
+    almacen.ranuras[hueco] = nullptr;
+    almacen.ocupadas--;
+    almacen.bytesAlmacenados -= sizeof(BlobContenido) + blob->bytesDatos;
+    if (blob->comprimido) {
+        quitarDeCacheDescomprimidos(blob);
+        estadisticasCompresion.blobsComprimidos--;
+        estadisticasCompresion.bytesOriginales -= blob->longitud;
+        estadisticasCompresion.bytesComprimidos -= blob->bytesDatos;
+    }
+    delete[] (char*)blob;
+}
+
+// Marca los blobs que el snapshot de texto guardará una sola vez: los que tienen más de una
+// referencia y un hash que no comparten con otro blob (el hash hace de identificador)
+void marcarBlobsCompartidos() {
+    size_t mascara = almacen.capacidad - 1;
+    for (size_t i = 0; i < almacen.capacidad; i++) {
+        BlobContenido* blob = almacen.ranuras[i];
+        if (!blob) continue;
+        blob->compartidoEnTexto = blob->referencias > 1;
+        for (size_t j = blob->hash & mascara; blob->compartidoEnTexto && almacen.ranuras[j]; j = (j + 1) & mascara) {
+            if (almacen.ranuras[j] != blob && almacen.ranuras[j]->hash == blob->hash) blob->compartidoEnTexto = false;
+        }
+    }
+}
+
+// El ahorro se mide contra una copia por archivo en un new char[] (bytes lógicos), y lo
+// almacenado incluye las cabeceras, las marcas de los pequeños y las ranuras de la tabla
+void imprimirEstadisticasContenidos() {
+    lock_guard<mutex> bloqueo(cerrojoAlmacen);
+    long long almacenados = almacen.bytesAlmacenados + (long long)(almacen.capacidad * sizeof(BlobContenido*));
+    salida() << "  contenidos: " << almacen.referencias << " referencias a " << almacen.ocupadas << " blobs únicos y "
+             << almacen.pequenos << " pequeños sin deduplicar, " << almacen.bytesLogicos
+             << " bytes con una copia por archivo, " << almacenados << " bytes almacenados";
+    if (almacen.bytesLogicos > 0) {
+        salida() << " (ahorro " << (100.0 * (almacen.bytesLogicos - almacenados) / almacen.bytesLogicos) << "%)";
+    }
+    salida() << endl;
+    if (inicioMapa) salida() << "  snapshot mapeado: " << tamanoMapa << " bytes" << endl;
+    if (estadisticasPerezosas.creados > 0) {
+        salida() << "  contenidos perezosos: " << estadisticasPerezosas.creados << " creados, "
+                 << estadisticasPerezosas.cargados << " cargados (" << estadisticasPerezosas.bytesLeidos
+                 << " bytes leídos del snapshot en " << (estadisticasPerezosas.segundosLectura * 1000) << " ms)" << endl;
+    }
+}
+
+// --- Contenido de archivos: tabla de piezas ---
+// Mientras un archivo solo se lee o se reemplaza entero, su contenido es una cadena simple
+// (propia o dentro del snapshot mapeado). La primera escritura parcial crea una tabla de
+// piezas: el texto original queda intacto, lo nuevo se agrega al final de un buffer de solo
+// agregar y el contenido es la secuencia de piezas que apuntan a uno u otro. Escribir al
+// final extiende la última pieza, así que agregar en streaming no copia lo ya escrito.
+
+struct Pieza {
+    bool agregada;      // true: en TablaPiezas::agregado; false: en Archivo::contenido
+    size_t inicio;
+    size_t longitud;
+};
+
+struct TablaPiezas {
+    BufferBytes agregado;
+    Pieza* piezas;
+    int cantidad;
+    int capacidad;
+    size_t longitudTotal;
+};
+
+const char* datosPieza(const Archivo* archivo, const Pieza& pieza) {
+    return (pieza.agregada ? archivo->piezas->agregado.datos : archivo->contenido) + pieza.inicio;
+}
+
+size_t longitudContenido(const Archivo* archivo) {
+    if (archivo->piezas) return archivo->piezas->longitudTotal;
+    return longitudTexto(archivo->contenido);
+}
+
+bool contenidoVacio(const Archivo* archivo) {
+    if (archivo->piezas) return archivo->piezas->longitudTotal == 0;
+    return !archivo->contenido || (!esContenidoIndirecto(archivo->contenido) && !archivo->contenido[0]);
+}
+
+// Recorre el contenido por fragmentos contiguos: se llama con indice = 0, 1, ... hasta que
+// devuelva false. 'usarCache' indica si un contenido comprimido pasa por la caché de
+// descomprimidos (ver textoContenido).
+bool fragmentoContenido(const Archivo* archivo, int indice, const char*& datos, size_t& longitud, bool usarCache = true) {
+    if (!archivo->piezas) {
+        if (indice > 0 || !archivo->contenido) return false;
+        datos = textoContenido(archivo->contenido, longitud, usarCache);
+        return true;
+    }
+    if (indice >= archivo->piezas->cantidad) return false;
+    datos = datosPieza(archivo, archivo->piezas->piezas[indice]);
+    longitud = archivo->piezas->piezas[indice].longitud;
+    return true;
+}
+
+// Agrega a 'destino' hasta 'longitud' bytes del contenido a partir de 'desde'; devuelve cuántos
+size_t contenidoLeer(const Archivo* archivo, size_t desde, size_t longitud, BufferBytes& destino) {
+    size_t copiados = 0, posicion = 0;
+    const char* datos;
+    size_t largo;
+    for (int i = 0; copiados < longitud && fragmentoContenido(archivo, i, datos, largo); i++) {
+        if (posicion + largo > desde) {
+            size_t saltar = desde > posicion ? desde - posicion : 0;
+            size_t tomar = largo - saltar;
+            if (tomar > longitud - copiados) tomar = longitud - copiados;
+            bufferAgregar(destino, datos + saltar, tomar);
+            copiados += tomar;
+        }
+        posicion += largo;
+    }
+    return copiados;
+}
+
+void liberarTablaPiezas(TablaPiezas* tabla) {
+    if (!tabla) return;
+    bufferLiberar(tabla->agregado);
+    delete[] tabla->piezas;
+    delete tabla;
+}
+
+// Libera el contenido de un archivo, sea cadena simple o tabla de piezas
+void liberarContenidoArchivo(Archivo* archivo) {
+    liberarContenido(archivo->contenido);
+    liberarTablaPiezas(archivo->piezas);
+    archivo->contenido = nullptr;
+    archivo->piezas = nullptr;
+}
+
+void tablaInsertarPieza(TablaPiezas* tabla, int posicion, const Pieza& pieza) {
+    if (tabla->cantidad == tabla->capacidad) {
+        tabla->capacidad = tabla->capacidad ? tabla->capacidad * 2 : 8;
+        Pieza* piezas = new Pieza[tabla->capacidad];
+        if (tabla->cantidad > 0) memcpy(piezas, tabla->piezas, tabla->cantidad * sizeof(Pieza));
+        delete[] tabla->piezas;
+        tabla->piezas = piezas;
+    }
+    memmove(tabla->piezas + posicion + 1, tabla->piezas + posicion, (tabla->cantidad - posicion) * sizeof(Pieza));
+    tabla->piezas[posicion] = pieza;
+    tabla->cantidad++;
+}
+
+TablaPiezas* asegurarTablaPiezas(Archivo* archivo) {
+    if (!archivo->piezas) {
+        TablaPiezas* tabla = new TablaPiezas{{nullptr, 0, 0}, nullptr, 0, 0, 0};
+        size_t longitud = longitudTexto(archivo->contenido);
+        if (esContenidoIndirecto(archivo->contenido)) {
+            // Las piezas apuntan al original tal cual, así que el texto se pasa al buffer agregado
+            const char* texto = textoContenido(archivo->contenido, longitud);
+            bufferAgregar(tabla->agregado, texto, longitud);
+            liberarContenido(archivo->contenido);
+            archivo->contenido = nullptr;
+            tablaInsertarPieza(tabla, 0, {true, 0, longitud});
+        } else if (longitud > 0) {
+            tablaInsertarPieza(tabla, 0, {false, 0, longitud});
+        }
+        tabla->longitudTotal = longitud;
+        archivo->piezas = tabla;
+    }
+    return archivo->piezas;
+}
+
+// Devuelve el índice de la pieza que empieza exactamente en 'desplazamiento' (cantidad si es
+// el final), partiendo en dos la pieza que lo contenga
+int tablaDividir(TablaPiezas* tabla, size_t desplazamiento) {
+    size_t posicion = 0;
+    for (int i = 0; i < tabla->cantidad; i++) {
+        Pieza& pieza = tabla->piezas[i];
+        if (posicion == desplazamiento) return i;
+        if (desplazamiento < posicion + pieza.longitud) {
+            size_t corte = desplazamiento - posicion;
+            Pieza resto = {pieza.agregada, pieza.inicio + corte, pieza.longitud - corte};
+            pieza.longitud = corte;
+            tablaInsertarPieza(tabla, i + 1, resto);
+            return i + 1;
+        }
+        posicion += pieza.longitud;
+    }
+    return tabla->cantidad;
+}
+
+// Reúne todas las piezas en una sola; el texto original deja de hacer falta
+void compactarContenido(Archivo* archivo) {
+    TablaPiezas* tabla = archivo->piezas;
+    BufferBytes compacto = {nullptr, 0, 0};
+    contenidoLeer(archivo, 0, tabla->longitudTotal, compacto);
+    liberarContenido(archivo->contenido);
+    archivo->contenido = nullptr;
+    bufferLiberar(tabla->agregado);
+    tabla->agregado = compacto;
+    tabla->cantidad = 0;
+    if (compacto.longitud > 0) tablaInsertarPieza(tabla, 0, {true, 0, compacto.longitud});
+}
+
+// Quita 'longitud' bytes a partir de 'desde' (que no debe superar el tamaño del contenido)
+void contenidoBorrar(Archivo* archivo, size_t desde, size_t longitud) {
+    TablaPiezas* tabla = asegurarTablaPiezas(archivo);
+    if (desde + longitud > tabla->longitudTotal) longitud = tabla->longitudTotal - desde;
+    if (longitud == 0) return;
+    int primera = tablaDividir(tabla, desde);
+    int fin = tablaDividir(tabla, desde + longitud);
+    memmove(tabla->piezas + primera, tabla->piezas + fin, (tabla->cantidad - fin) * sizeof(Pieza));
+    tabla->cantidad -= fin - primera;
+    tabla->longitudTotal -= longitud;
+}
+
+// Inserta 'longitud' bytes en la posición 'desde' (como mucho el tamaño actual del contenido)
+void contenidoInsertar(Archivo* archivo, size_t desde, const char* datos, size_t longitud) {
+    if (longitud == 0) return;
+    TablaPiezas* tabla = asegurarTablaPiezas(archivo);
+    int posicion = tablaDividir(tabla, desde);
+    size_t inicio = tabla->agregado.longitud;
+    bufferAgregar(tabla->agregado, datos, longitud);
+    tabla->longitudTotal += longitud;
+
+    // Si la pieza anterior termina justo donde empieza lo agregado, basta con extenderla
+    Pieza* anterior = posicion > 0 ? &tabla->piezas[posicion - 1] : nullptr;
+    if (anterior && anterior->agregada && anterior->inicio + anterior->longitud == inicio) {
+        anterior->longitud += longitud;
+    } else {
+        tablaInsertarPieza(tabla, posicion, {true, inicio, longitud});
+    }
+    if (tabla->cantidad > MAX_PIEZAS) compactarContenido(archivo);
+}
+
+void reindexarTrigramas(Archivo* archivo); // Índice de trigramas, más abajo
+void prepararModificacion(Directorio* directorio); // Copias con estructura compartida, más abajo
+
+// Sobrescribe a partir de 'desde' y extiende el archivo si hace falta, como pwrite
+void contenidoEscribir(Archivo* archivo, size_t desde, const char* datos, size_t longitud) {
+    prepararModificacion(archivo->padre);
+    size_t anterior = longitudContenido(archivo);
+    contenidoBorrar(archivo, desde, longitud);
+    contenidoInsertar(archivo, desde, datos, longitud);
+    propagarTotales(archivo->padre, 0, 0, (int64_t)longitudContenido(archivo) - (int64_t)anterior);
+    reindexarTrigramas(archivo);
+}
+
+// --- Asignador de nodos y nombres ---
+// Los nodos Archivo/Directorio salen de losas de NODOS_POR_LOSA elementos con una lista de
+// libres, y los nombres de una arena por trozos con listas de libres por tamaño (múltiplos
+// de 8 bytes). Así crear y borrar millones de nodos no llama a malloc/free por cada uno, y
+// al salir se devuelven losas y trozos completos de una vez.
+
+struct PoolNodos {
+    size_t tamNodo;
+    char** losas;
+    int cantidadLosas;
+    int capacidadLosas;
+    int usadosUltimaLosa;   // Nodos entregados de la última losa
+    void* libres;           // Nodos devueltos (el enlace va en su primera palabra)
+    long vivos;
+};
+
+struct ArenaNombres {
+    char** trozos;
+    int cantidadTrozos;
+    int capacidadTrozos;
+    char* cursor;           // Siguiente byte libre del trozo actual
+    size_t restante;
+    char* libres[MAX_NOMBRE_ARENA / 8 + 1]; // Bloques devueltos por clase de tamaño
+    long bytesEntregados;
+    long bloquesReciclados;
+    long nombresEnHeap;
+};
+
+// Con false se usa new/delete por nodo como antes (solo para comparar en el benchmark;
+// no debe cambiarse mientras haya nodos vivos)
+bool asignadorAgrupado = true;
+PoolNodos poolArchivos = {sizeof(Archivo), nullptr, 0, 0, 0, nullptr, 0};
+PoolNodos poolDirectorios = {sizeof(Directorio), nullptr, 0, 0, 0, nullptr, 0};
+ArenaNombres arenaNombres = {};
+
+// Agrega un puntero a un arreglo dinámico, duplicando su capacidad cuando se llena
+void agregarPuntero(char**& arreglo, int& cantidad, int& capacidad, char* puntero) {
+    if (cantidad == capacidad) {
+        capacidad = capacidad ? capacidad * 2 : 16;
+        char** nuevo = new char*[capacidad];
+        if (arreglo) {
+            memcpy(nuevo, arreglo, cantidad * sizeof(char*));
+            delete[] arreglo;
+        }
+        arreglo = nuevo;
+    }
+    arreglo[cantidad++] = puntero;
+}
+
+struct PilaDirectorios {
+    Directorio** directorios;
+    size_t cantidad;
+    size_t capacidad;
+};
+
+void pilaApilar(PilaDirectorios& pila, Directorio* directorio) {
+    if (pila.cantidad == pila.capacidad) {
+        size_t capacidad = pila.capacidad ? pila.capacidad * 2 : 64;
+        Directorio** mayor = new Directorio*[capacidad];
+        if (pila.directorios) memcpy(mayor, pila.directorios, pila.cantidad * sizeof(Directorio*));
+        delete[] pila.directorios;
+        pila.directorios = mayor;
+        pila.capacidad = capacidad;
+    }
+    pila.directorios[pila.cantidad++] = directorio;
+}
+
+// Recorrido en preorden de un subárbol con pila explícita. Los hijos de un directorio se apilan
+// en la llamada siguiente a la que lo devolvió, así que quien lo recibe puede materializarlo
+// antes de descender a ellos. Al terminar libera la pila; si se abandona antes, recorridoLiberar.
+struct RecorridoSubarbol {
+    PilaDirectorios pila;
+    Directorio* actual;
+};
+
+void recorridoIniciar(RecorridoSubarbol& recorrido, Directorio* inicio) {
+    recorrido = {{nullptr, 0, 0}, nullptr};
+    if (inicio) pilaApilar(recorrido.pila, inicio);
+}
+
+void recorridoLiberar(RecorridoSubarbol& recorrido) {
+    delete[] recorrido.pila.directorios;
+    recorrido = {{nullptr, 0, 0}, nullptr};
+}
+
+Directorio* recorridoSiguiente(RecorridoSubarbol& recorrido) {
+    if (recorrido.actual) {
+        for (Directorio* d = recorrido.actual->subdirectorios; d; d = d->siguienteDirectorio) pilaApilar(recorrido.pila, d);
+    }
+    if (recorrido.pila.cantidad == 0) {
+        recorridoLiberar(recorrido);
+        return nullptr;
+    }
+    recorrido.actual = recorrido.pila.directorios[--recorrido.pila.cantidad];
+    return recorrido.actual;
+}
+
+void* poolReservar(PoolNodos& pool) {
+    pool.vivos++;
+    if (pool.libres) {
+        void* nodo = pool.libres;
+        pool.libres = *(void**)nodo;
+        return nodo;
+    }
+    if (pool.cantidadLosas == 0 || pool.usadosUltimaLosa == NODOS_POR_LOSA) {
+        agregarPuntero(pool.losas, pool.cantidadLosas, pool.capacidadLosas, new char[pool.tamNodo * NODOS_POR_LOSA]);
+        pool.usadosUltimaLosa = 0;
+    }
+    return pool.losas[pool.cantidadLosas - 1] + pool.tamNodo * pool.usadosUltimaLosa++;
+}
+
+void poolLiberar(PoolNodos& pool, void* nodo) {
+    *(void**)nodo = pool.libres;
+    pool.libres = nodo;
+    pool.vivos--;
+}
+
+// Devuelve todas las losas de una vez; los nodos que quedaran vivos dejan de ser válidos
+void poolReiniciar(PoolNodos& pool) {
+    for (int i = 0; i < pool.cantidadLosas; i++) {
+        delete[] pool.losas[i];
+    }
+    delete[] pool.losas;
+    pool.losas = nullptr;
+    pool.cantidadLosas = pool.capacidadLosas = pool.usadosUltimaLosa = 0;
+    pool.libres = nullptr;
+    pool.vivos = 0;
+}
+
+// Copia un nombre a la arena (o al heap si es muy largo o el asignador no está agrupado)
+char* copiarNombre(const char* nombre) {
+    size_t longitud = strlen(nombre) + 1;
+    size_t tamano = (longitud + 7) & ~(size_t)7;
+    char* copia;
+    if (!asignadorAgrupado || tamano > (size_t)MAX_NOMBRE_ARENA) {
+        copia = new char[longitud];
+        arenaNombres.nombresEnHeap++;
+    } else if (arenaNombres.libres[tamano / 8]) {
+        copia = arenaNombres.libres[tamano / 8];
+        arenaNombres.libres[tamano / 8] = *(char**)copia;
+        arenaNombres.bloquesReciclados++;
+    } else {
+        if (arenaNombres.restante < tamano) {
+            arenaNombres.cursor = new char[TAM_TROZO_NOMBRES];
+            arenaNombres.restante = TAM_TROZO_NOMBRES;
+            agregarPuntero(arenaNombres.trozos, arenaNombres.cantidadTrozos, arenaNombres.capacidadTrozos, arenaNombres.cursor);
+        }
+        copia = arenaNombres.cursor;
+        arenaNombres.cursor += tamano;
+        arenaNombres.restante -= tamano;
+        arenaNombres.bytesEntregados += tamano;
+    }
+    memcpy(copia, nombre, longitud);
+    return copia;
+}
+
+void liberarNombre(char* nombre) {
+    if (esMemoriaMapeada(nombre)) return;
+    size_t tamano = (strlen(nombre) + 1 + 7) & ~(size_t)7;
+    if (!asignadorAgrupado || tamano > (size_t)MAX_NOMBRE_ARENA) {
+        delete[] nombre;
+        arenaNombres.nombresEnHeap--;
+    } else {
+        *(char**)nombre = arenaNombres.libres[tamano / 8];
+        arenaNombres.libres[tamano / 8] = nombre;
+    }
+}
+
+void arenaReiniciar() {
+    for (int i = 0; i < arenaNombres.cantidadTrozos; i++) {
+        delete[] arenaNombres.trozos[i];
+    }
+    delete[] arenaNombres.trozos;
+    long nombresEnHeap = arenaNombres.nombresEnHeap;
+    arenaNombres = {};
+    arenaNombres.nombresEnHeap = nombresEnHeap;
+}
+
+Archivo* reservarArchivo() {
+    return asignadorAgrupado ? new (poolReservar(poolArchivos)) Archivo : new Archivo;
+}
+
+Directorio* reservarDirectorio() {
+    return asignadorAgrupado ? new (poolReservar(poolDirectorios)) Directorio : new Directorio;
+}
+
+void liberarNodoArchivo(Archivo* archivo) {
+    if (asignadorAgrupado) poolLiberar(poolArchivos, archivo);
+    else delete archivo;
+}
+
+void liberarNodoDirectorio(Directorio* directorio) {
+    if (asignadorAgrupado) poolLiberar(poolDirectorios, directorio);
+    else delete directorio;
+}
+
+void imprimirEstadisticasAsignador() {
+    salida() << "  nodos Archivo vivos: " << poolArchivos.vivos << " (" << poolArchivos.cantidadLosas << " losas)" << endl;
+    salida() << "  nodos Directorio vivos: " << poolDirectorios.vivos << " (" << poolDirectorios.cantidadLosas << " losas)" << endl;
+    salida() << "  bytes en losas: "
+             << (long)(poolArchivos.cantidadLosas * poolArchivos.tamNodo + poolDirectorios.cantidadLosas * poolDirectorios.tamNodo) * NODOS_POR_LOSA << endl;
+    salida() << "  arena de nombres: " << arenaNombres.cantidadTrozos << " trozos, "
+             << arenaNombres.bytesEntregados << " bytes entregados, "
+             << arenaNombres.bloquesReciclados << " bloques reciclados, "
+             << arenaNombres.nombresEnHeap << " nombres en heap" << endl;
+}
+
+// Para materializar copias pendientes con el árbol compartido (ver "Copias con estructura compartida")
+mutex cerrojoCopias;
+atomic<long> copiasPendientes(0);
+
+// --- Índice de trigramas de contenidos (grep) ---
+// Índice invertido: por cada trigrama (3 bytes seguidos) que aparece en algún contenido, la
+// lista de los archivos que lo contienen. Se construye con el primer grep y desde entonces se
+// mantiene al crear, modificar y borrar archivos, con el árbol en exclusiva.
+// Las listas solo crecen por el final: cada vez que se indexa un archivo (también al cambiar
+// su contenido) recibe un identificador nuevo y mayor que todos los anteriores, así que las
+// listas quedan ordenadas sin mover nada, y el identificador anterior queda muerto en
+// archivosPorId. Cuando hay más identificadores muertos que vivos se renumeran los vivos y se
+// filtran las listas (sin volver a leer contenidos); una actualización cuesta O(tamaño del
+// contenido) amortizado.
+
+const uint32_t TRIGRAMA_VACIO = 0xFFFFFFFFu; // Los trigramas ocupan 24 bits
+const uint32_t MINIMO_IDS_COMPACTACION = 4096;
+
+struct ListaTrigrama {
+    uint32_t trigrama;      // TRIGRAMA_VACIO si la entrada de la tabla está libre
+    uint32_t cantidad;
+    uint32_t capacidad;
+    uint32_t* archivos;     // Identificadores en orden creciente
+};
+
+struct IndiceTrigramas {
+    bool activo;
+    ListaTrigrama* listas;      // Tabla hash por trigrama, direccionamiento abierto
+    uint32_t capacidadListas;   // Potencia de 2
+    uint32_t cantidadListas;
+    Archivo** archivosPorId;    // El 0 no se usa; nullptr es un identificador muerto
+    uint32_t siguienteId;
+    uint32_t capacidadIds;
+    uint32_t vivos;
+    uint64_t entradas;          // Total de identificadores en las listas, muertos incluidos
+    uint64_t* vistos;           // Un bit por trigrama posible, para no repetirlos por archivo
+    long compactaciones;
+};
+
+IndiceTrigramas trigramas = {false, nullptr, 0, 0, nullptr, 1, 0, 0, 0, nullptr, 0};
+// Para construirlo y para lo que cambia con el árbol compartido (materializar copias); los
+// comandos que modifican el árbol lo actualizan en exclusiva sin tomarlo
+mutex cerrojoTrigramas;
+
+inline uint32_t hashTrigrama(uint32_t trigrama) {
+    return trigrama * 2654435761u;
+}
+
+ListaTrigrama* buscarListaTrigrama(uint32_t trigrama) {
+    if (trigramas.capacidadListas == 0) return nullptr;
+    uint32_t mascara = trigramas.capacidadListas - 1;
+    for (uint32_t i = hashTrigrama(trigrama) & mascara;; i = (i + 1) & mascara) {
+        ListaTrigrama& lista = trigramas.listas[i];
+        if (lista.trigrama == trigrama) return &lista;
+        if (lista.trigrama == TRIGRAMA_VACIO) return nullptr;
+    }
+}
+
+void colocarListaTrigrama(ListaTrigrama* tabla, uint32_t capacidad, const ListaTrigrama& lista) {
+    uint32_t mascara = capacidad - 1;
+    uint32_t i = hashTrigrama(lista.trigrama) & mascara;
+    while (tabla[i].trigrama != TRIGRAMA_VACIO) i = (i + 1) & mascara;
+    tabla[i] = lista;
+}
+
+// Rehace la tabla con 'capacidad' entradas; las listas vacías se descartan
+void redimensionarTablaTrigramas(uint32_t capacidad) {
+    ListaTrigrama* tabla = new ListaTrigrama[capacidad];
+    for (uint32_t i = 0; i < capacidad; i++) tabla[i] = {TRIGRAMA_VACIO, 0, 0, nullptr};
+    uint32_t cantidad = 0;
+    for (uint32_t i = 0; i < trigramas.capacidadListas; i++) {
+        ListaTrigrama& lista = trigramas.listas[i];
+        if (lista.trigrama == TRIGRAMA_VACIO) continue;
+        if (lista.cantidad == 0) {
+            delete[] lista.archivos;
+            continue;
+        }
+        colocarListaTrigrama(tabla, capacidad, lista);
+        cantidad++;
+    }
+    delete[] trigramas.listas;
+    trigramas.listas = tabla;
+    trigramas.capacidadListas = capacidad;
+    trigramas.cantidadListas = cantidad;
+}
+
+ListaTrigrama* obtenerListaTrigrama(uint32_t trigrama) {
+    ListaTrigrama* lista = buscarListaTrigrama(trigrama);
+    if (lista) return lista;
+    if ((trigramas.cantidadListas + 1) * 10 > trigramas.capacidadListas * 7) {
+        redimensionarTablaTrigramas(trigramas.capacidadListas ? trigramas.capacidadListas * 2 : 1024);
+    }
+    colocarListaTrigrama(trigramas.listas, trigramas.capacidadListas, {trigrama, 0, 0, nullptr});
+    trigramas.cantidadListas++;
+    return buscarListaTrigrama(trigrama);
+}
+
+void listaAgregarArchivo(ListaTrigrama* lista, uint32_t id) {
+    if (lista->cantidad == lista->capacidad) {
+        uint32_t capacidad = lista->capacidad ? lista->capacidad * 2 : 4;
+        uint32_t* archivos = new uint32_t[capacidad];
+        if (lista->cantidad > 0) memcpy(archivos, lista->archivos, lista->cantidad * sizeof(uint32_t));
+        delete[] lista->archivos;
+        lista->archivos = archivos;
+        lista->capacidad = capacidad;
+    }
+    lista->archivos[lista->cantidad++] = id;
+    trigramas.entradas++;
+}
+
+// Agrega a 'destino' los trigramas distintos del contenido del archivo, como uint32_t
+void trigramasDeArchivo(const Archivo* archivo, BufferBytes& destino) {
+    uint32_t trigrama = 0;
+    size_t leidos = 0;
+    const char* datos;
+    size_t longitud;
+    for (int i = 0; fragmentoContenido(archivo, i, datos, longitud, false); i++) {
+        for (size_t j = 0; j < longitud; j++, leidos++) {
+            trigrama = ((trigrama << 8) | (unsigned char)datos[j]) & 0xFFFFFF;
+            if (leidos < 2) continue;
+            uint64_t& palabra = trigramas.vistos[trigrama >> 6];
+            uint64_t bit = (uint64_t)1 << (trigrama & 63);
+            if (palabra & bit) continue;
+            palabra |= bit;
+            bufferAgregar(destino, &trigrama, sizeof(trigrama));
+        }
+    }
+    // El mapa de bits vuelve a quedar en cero para el próximo archivo
+    const uint32_t* lista = (const uint32_t*)destino.datos;
+    for (size_t i = 0; i < destino.longitud / sizeof(uint32_t); i++) {
+        trigramas.vistos[lista[i] >> 6] &= ~((uint64_t)1 << (lista[i] & 63));
+    }
+}
+
+void indexarTrigramas(Archivo* archivo) {
+    if (trigramas.siguienteId >= trigramas.capacidadIds) {
+        uint32_t capacidad = trigramas.capacidadIds ? trigramas.capacidadIds * 2 : 1024;
+        Archivo** archivos = new Archivo*[capacidad];
+        if (trigramas.archivosPorId) memcpy(archivos, trigramas.archivosPorId, trigramas.siguienteId * sizeof(Archivo*));
+        else archivos[0] = nullptr; // El identificador 0 no se usa
+        delete[] trigramas.archivosPorId;
+        trigramas.archivosPorId = archivos;
+        trigramas.capacidadIds = capacidad;
+    }
+    uint32_t id = trigramas.siguienteId++;
+    trigramas.archivosPorId[id] = archivo;
+    trigramas.vivos++;
+    archivo->id = id;
+
+    thread_local BufferHilo propios;
+    BufferBytes& lista = propios.buffer;
+    lista.longitud = 0;
+    trigramasDeArchivo(archivo, lista);
+    const uint32_t* valores = (const uint32_t*)lista.datos;
+    for (size_t i = 0; i < lista.longitud / sizeof(uint32_t); i++) {
+        listaAgregarArchivo(obtenerListaTrigrama(valores[i]), id);
+    }
+}
+
+// Renumera los identificadores vivos (conservando su orden, así las listas siguen ordenadas)
+// y quita de las listas los muertos
+void compactarTrigramas() {
+    uint32_t* nuevos = new uint32_t[trigramas.siguienteId];
+    uint32_t siguiente = 1;
+    nuevos[0] = 0;
+    for (uint32_t id = 1; id < trigramas.siguienteId; id++) {
+        Archivo* archivo = trigramas.archivosPorId[id];
+        nuevos[id] = archivo ? siguiente : 0;
+        if (archivo) {
+            archivo->id = siguiente;
+            trigramas.archivosPorId[siguiente++] = archivo;
+        }
+    }
+    trigramas.siguienteId = siguiente;
+    trigramas.entradas = 0;
+    for (uint32_t i = 0; i < trigramas.capacidadListas; i++) {
+        ListaTrigrama& lista = trigramas.listas[i];
+        if (lista.trigrama == TRIGRAMA_VACIO) continue;
+        uint32_t quedan = 0;
+        for (uint32_t j = 0; j < lista.cantidad; j++) {
+            if (nuevos[lista.archivos[j]]) lista.archivos[quedan++] = nuevos[lista.archivos[j]];
+        }
+        lista.cantidad = quedan;
+        trigramas.entradas += quedan;
+    }
+    delete[] nuevos;
+    uint32_t capacidad = trigramas.capacidadListas;
+    while (capacidad > 1024 && trigramas.cantidadListas * 10 < capacidad * 2) capacidad /= 2;
+    redimensionarTablaTrigramas(capacidad); // Descarta las listas que quedaron vacías
+    trigramas.compactaciones++;
+}
+
+// Con el árbol en exclusiva, antes de liberar el archivo
+void olvidarTrigramas(Archivo* archivo) {
+    if (!archivo->id) return;
+    trigramas.archivosPorId[archivo->id] = nullptr;
+    trigramas.vivos--;
+    archivo->id = 0;
+    uint32_t muertos = trigramas.siguienteId - 1 - trigramas.vivos;
+    if (muertos > trigramas.vivos && muertos > MINIMO_IDS_COMPACTACION) compactarTrigramas();
+}
+
+// Con el árbol en exclusiva, después de cambiar el contenido
+void reindexarTrigramas(Archivo* archivo) {
+    if (!trigramas.activo) return;
+    olvidarTrigramas(archivo);
+    indexarTrigramas(archivo);
+}
+
+// Indexa el árbol completo la primera vez; devuelve los segundos que tardó (0 si ya estaba).
+// Las copias pendientes no tienen hijos propios: sus archivos se indexan al materializarlas.
+double asegurarIndiceTrigramas(Directorio* raiz) {
+    lock_guard<mutex> bloqueoCopias(cerrojoCopias); // Ninguna copia pendiente se materializa a medias
+    lock_guard<mutex> bloqueo(cerrojoTrigramas);
+    if (trigramas.activo) return 0;
+    auto inicio = chrono::steady_clock::now();
+    trigramas.vistos = new uint64_t[(1 << 24) / 64]();
+    RecorridoSubarbol recorrido;
+    recorridoIniciar(recorrido, raiz);
+    while (Directorio* directorio = recorridoSiguiente(recorrido)) {
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) indexarTrigramas(a);
+    }
+    trigramas.activo = true;
+    return chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+}
+
+void liberarIndiceTrigramas() {
+    for (uint32_t i = 0; i < trigramas.capacidadListas; i++) delete[] trigramas.listas[i].archivos;
+    delete[] trigramas.listas;
+    delete[] trigramas.archivosPorId;
+    delete[] trigramas.vistos;
+    trigramas = {false, nullptr, 0, 0, nullptr, 1, 0, 0, 0, nullptr, 0};
+}
+
+size_t memoriaIndiceTrigramas() {
+    size_t bytes = (size_t)trigramas.capacidadListas * sizeof(ListaTrigrama) + (size_t)trigramas.capacidadIds * sizeof(Archivo*);
+    if (trigramas.vistos) bytes += (1 << 24) / 8;
+    for (uint32_t i = 0; i < trigramas.capacidadListas; i++) bytes += (size_t)trigramas.listas[i].capacidad * sizeof(uint32_t);
+    return bytes;
+}
+
+void imprimirEstadisticasTrigramas() {
+    if (!trigramas.activo) {
+        salida() << "  índice de trigramas: sin construir (se construye con el primer grep)" << endl;
+        return;
+    }
+    salida() << "  índice de trigramas: " << trigramas.vivos << " archivos, " << trigramas.cantidadListas
+             << " trigramas, " << trigramas.entradas << " entradas (" << trigramas.siguienteId - 1 - trigramas.vivos
+             << " identificadores muertos, " << trigramas.compactaciones << " compactaciones), "
+             << memoriaIndiceTrigramas() << " bytes" << endl;
+}
+
+// --- Caché de rutas (dentry cache) ---
+// Asocia rutas absolutas normalizadas con su Directorio*, o con nullptr si la ruta no existe.
+// En lugar de borrar entradas se usan épocas: eliminar o renombrar un directorio invalida
+// todas las entradas positivas, y crear uno (o renombrarlo) invalida las negativas.
+// Cada hilo tiene su propia tabla, así las sesiones concurrentes consultan y guardan rutas
+// sin cerrojos; las épocas son globales y solo las cambian los comandos que modifican el
+// árbol, que lo tienen en exclusiva.
+
+struct EntradaCacheRutas {
+    char* ruta;                 // Copia propia de la ruta normalizada, nullptr si el hueco está libre
+    unsigned int hash;
+    unsigned int longitud;
+    Directorio* directorio;     // nullptr = la ruta no existe
+    unsigned long epoca;
+};
+
+struct CacheRutas {
+    EntradaCacheRutas entradas[CAPACIDAD_CACHE_RUTAS];
+    long aciertos;
+    long fallos;
+
+    ~CacheRutas() {
+        for (EntradaCacheRutas& entrada : entradas) delete[] entrada.ruta;
+    }
+};
+
+bool cacheRutasActiva = true;
+unsigned long epocaRutasPositiva = 0;
+unsigned long epocaRutasNegativa = 0;
+thread_local CacheRutas cacheRutas = {};
+
+// Un directorio dejó de existir o cambió de ruta
+void invalidarRutasPositivas() {
+    epocaRutasPositiva++;
+}
+
+// Apareció un directorio donde antes podía no haber nada
+void invalidarRutasNegativas() {
+    epocaRutasNegativa++;
+}
+
+bool entradaCacheVigente(const EntradaCacheRutas& entrada) {
+    return entrada.ruta && entrada.epoca == (entrada.directorio ? epocaRutasPositiva : epocaRutasNegativa);
+}
+
+EntradaCacheRutas* cacheRutasBuscar(const char* ruta, unsigned int longitud, unsigned int hash) {
+    for (int i = 0; i < SONDEOS_CACHE_RUTAS; i++) {
+        EntradaCacheRutas& entrada = cacheRutas.entradas[(hash + i) & (CAPACIDAD_CACHE_RUTAS - 1)];
+        if (!entrada.ruta) return nullptr;
+        if (entrada.hash == hash && entrada.longitud == longitud && memcmp(entrada.ruta, ruta, longitud) == 0) {
+            return entradaCacheVigente(entrada) ? &entrada : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+// Guarda una ruta reutilizando su entrada anterior, un hueco libre o vencido, o desalojando la primera
+void cacheRutasGuardar(const char* ruta, unsigned int longitud, unsigned int hash, Directorio* directorio) {
+    EntradaCacheRutas* destino = nullptr;
+    for (int i = 0; i < SONDEOS_CACHE_RUTAS; i++) {
+        EntradaCacheRutas& entrada = cacheRutas.entradas[(hash + i) & (CAPACIDAD_CACHE_RUTAS - 1)];
+        if (!entrada.ruta || (entrada.hash == hash && entrada.longitud == longitud && memcmp(entrada.ruta, ruta, longitud) == 0)) {
+            destino = &entrada;
+            break;
+        }
+        if (!destino && !entradaCacheVigente(entrada)) destino = &entrada;
+    }
+    if (!destino) destino = &cacheRutas.entradas[hash & (CAPACIDAD_CACHE_RUTAS - 1)];
+
+    if (!destino->ruta || destino->longitud != longitud || memcmp(destino->ruta, ruta, longitud) != 0) {
+        delete[] destino->ruta;
+        destino->ruta = new char[longitud];
+        memcpy(destino->ruta, ruta, longitud);
+    }
+    destino->hash = hash;
+    destino->longitud = longitud;
+    destino->directorio = directorio;
+    destino->epoca = directorio ? epocaRutasPositiva : epocaRutasNegativa;
+}
+
+void imprimirEstadisticasCacheRutas() {
+    int vigentes = 0;
+    for (int i = 0; i < CAPACIDAD_CACHE_RUTAS; i++) {
+        if (entradaCacheVigente(cacheRutas.entradas[i])) vigentes++;
+    }
+    long consultas = cacheRutas.aciertos + cacheRutas.fallos;
+    salida() << "dcache: " << cacheRutas.aciertos << " aciertos, " << cacheRutas.fallos << " fallos";
+    if (consultas > 0) salida() << " (" << (100.0 * cacheRutas.aciertos / consultas) << "% aciertos)";
+    salida() << ", " << vigentes << "/" << CAPACIDAD_CACHE_RUTAS << " entradas vigentes" << endl;
+}
+
+// --- Sesiones concurrentes ---
+// Varias sesiones (una por hilo) pueden trabajar sobre el mismo árbol. Los comandos que solo
+// leen (cd, ls, cat, estadísticas) toman cerrojoArbol compartido y los que lo modifican, en
+// exclusiva; edit/append/write leen su entrada sin cerrojo y lo toman solo para aplicarla.
+// Cada sesión tiene su directorio actual: si rm elimina el subárbol en el que está una sesión
+// registrada, la sesión pasa al padre del directorio eliminado.
+
+shared_mutex cerrojoArbol;
+
+struct Sesion {
+    Directorio* directorioActual;
+    Sesion* siguiente;
+};
+
+Sesion* sesiones = nullptr; // Se recorre y modifica con cerrojoArbol en exclusiva
+
+void registrarSesion(Sesion* sesion) {
+    unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+    sesion->siguiente = sesiones;
+    sesiones = sesion;
+}
+
+void quitarSesion(Sesion* sesion) {
+    unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+    for (Sesion** s = &sesiones; *s; s = &(*s)->siguiente) {
+        if (*s == sesion) {
+            *s = sesion->siguiente;
+            break;
+        }
+    }
+}
+
+// Con el árbol en exclusiva, antes de liberar 'eliminado'
+void reubicarSesiones(Directorio* eliminado) {
+    for (Sesion* s = sesiones; s; s = s->siguiente) {
+        for (Directorio* d = s->directorioActual; d; d = d->padre) {
+            if (d == eliminado) {
+                s->directorioActual = eliminado->padre;
+                break;
+            }
+        }
+    }
+}
+
+// --- Funciones auxiliares y de gestión de sistema de archivos ---
+
+// Inicializa un nodo Archivo ya reservado; nombre y contenido pasan a ser suyos
+// (o apuntan al snapshot mapeado)
+Archivo* inicializarArchivo(Archivo* archivo, char* nombre, char* contenido) {
+    archivo->nombre = nombre;
+    archivo->contenido = contenido;
+    archivo->piezas = nullptr;
+    archivo->siguiente = nullptr;
+    archivo->anterior = nullptr;
+    archivo->padre = nullptr;
+    archivo->id = 0;
+    return archivo;
+}
+
+// Función para crear un nuevo archivo
+Archivo* crearArchivo(const char* nombre, const char* contenido = nullptr) {
+    char* contenidoCompartido = contenido ? internarContenido(contenido, strlen(contenido)) : nullptr;
+    return inicializarArchivo(reservarArchivo(), copiarNombre(nombre), contenidoCompartido);
+}
+
+// Inicializa un nodo Directorio ya reservado; el nombre pasa a ser suyo
+Directorio* inicializarDirectorio(Directorio* directorio, char* nombre, Directorio* padre) {
+    directorio->nombre = nombre;
+    directorio->padre = padre;
+    directorio->subdirectorios = nullptr;
+    directorio->siguienteDirectorio = nullptr;
+    directorio->anteriorDirectorio = nullptr;
+    directorio->archivos = nullptr;
+    directorio->ultimoSubdirectorio = nullptr;
+    directorio->ultimoArchivo = nullptr;
+    directorio->cantidadHijos = 0;
+    directorio->indice = nullptr;
+    directorio->ordenado = nullptr;
+    directorio->archivosSubarbol = 0;
+    directorio->directoriosSubarbol = 0;
+    directorio->bytesSubarbol = 0;
+    directorio->cuotaBytes = 0;
+    directorio->origen.store(nullptr, memory_order_relaxed);
+    directorio->copias = nullptr;
+    directorio->siguienteCopia = nullptr;
+    return directorio;
+}
+
+// Función para crear un nuevo directorio
+Directorio* crearDirectorio(const char* nombre, Directorio* padre = nullptr) {
+    return inicializarDirectorio(reservarDirectorio(), copiarNombre(nombre), padre);
+}
+
+// --- Copias con estructura compartida (cp -r, snapshot) ---
+// Copiar un directorio no copia su subárbol: la copia nace pendiente, sin hijos propios, con
+// 'origen' apuntando al directorio copiado y anotada en la lista 'copias' de ese origen. Se
+// mantiene que el subárbol del origen no cambió desde la copia, así que ella puede verlo:
+// - Antes de modificar un directorio (hijos o contenido de sus archivos) se separan las copias
+//   pendientes de él y de sus ancestros, de la raíz hacia abajo. Separar una copia es
+//   materializarla un nivel: recibe sus propios archivos, que comparten el contenido por
+//   referencia, y sus subdirectorios como nuevas copias pendientes de los del origen.
+// - Quien necesita los hijos de un directorio concreto (buscar un nombre, ls, find, du)
+//   materializa antes ese nivel. Puede pasar con el árbol compartido, así que se hace bajo
+//   cerrojoCopias y 'origen' se pone en nullptr recién cuando los hijos están enlazados.
+// - Guardar y tree solo necesitan nombres y contenidos: leen a través de vistaDirectorio sin
+//   materializar nada.
+// Copiar cuesta O(1) y la memoria crece solo con lo que diverge cada lado. El origen de una
+// copia nunca es otra copia pendiente: copiar una copia apunta directamente a su origen.
+
+// El directorio cuyos hijos representan a 'directorio': su origen si es una copia pendiente
+inline Directorio* vistaDirectorio(Directorio* directorio) {
+    Directorio* origen = directorio->origen.load(memory_order_acquire);
+    return origen ? origen : directorio;
+}
+
+// Engancha un archivo al final de la lista del directorio, sin tocar totales ni índices
+void enlazarArchivo(Directorio* directorio, Archivo* archivo) {
+    if (directorio->archivos == nullptr) {
+        directorio->archivos = archivo;
+    } else {
+        directorio->ultimoArchivo->siguiente = archivo;
+    }
+    archivo->anterior = directorio->ultimoArchivo;
+    directorio->ultimoArchivo = archivo;
+    archivo->siguiente = nullptr; // Asegurar que el nuevo archivo sea el último en su lista
+    archivo->padre = directorio;
+    registrarHijo(directorio, nullptr, archivo);
+}
+
+void enlazarDirectorio(Directorio* padre, Directorio* nuevoDirectorio) {
+    if (padre->subdirectorios == nullptr) {
+        padre->subdirectorios = nuevoDirectorio;
+    } else {
+        padre->ultimoSubdirectorio->siguienteDirectorio = nuevoDirectorio;
+    }
+    nuevoDirectorio->anteriorDirectorio = padre->ultimoSubdirectorio;
+    padre->ultimoSubdirectorio = nuevoDirectorio;
+    nuevoDirectorio->padre = padre; // Asegurar el enlace al padre
+    nuevoDirectorio->siguienteDirectorio = nullptr; // Asegurar que sea el último
+    registrarHijo(padre, nuevoDirectorio, nullptr);
+}
+
+// Lo inverso de enlazarArchivo, en O(1): lo suelta de la lista y de los índices de su padre
+void desenlazarArchivo(Directorio* directorio, Archivo* archivo) {
+    desregistrarHijo(directorio, archivo->nombre);
+    if (archivo->anterior) {
+        archivo->anterior->siguiente = archivo->siguiente;
+    } else {
+        directorio->archivos = archivo->siguiente;
+    }
+    if (archivo->siguiente) {
+        archivo->siguiente->anterior = archivo->anterior;
+    } else {
+        directorio->ultimoArchivo = archivo->anterior;
+    }
+    archivo->siguiente = nullptr;
+    archivo->anterior = nullptr;
+}
+
+void desenlazarDirectorio(Directorio* padre, Directorio* directorio) {
+    desregistrarHijo(padre, directorio->nombre);
+    if (directorio->anteriorDirectorio) {
+        directorio->anteriorDirectorio->siguienteDirectorio = directorio->siguienteDirectorio;
+    } else {
+        padre->subdirectorios = directorio->siguienteDirectorio;
+    }
+    if (directorio->siguienteDirectorio) {
+        directorio->siguienteDirectorio->anteriorDirectorio = directorio->anteriorDirectorio;
+    } else {
+        padre->ultimoSubdirectorio = directorio->anteriorDirectorio;
+    }
+    directorio->siguienteDirectorio = nullptr;
+    directorio->anteriorDirectorio = nullptr;
+}
+
+// Un directorio 'nombre', sin enlazar, que es copia pendiente de 'fuente' (o uno vacío si
+// 'fuente' no tiene hijos). Con el árbol en exclusiva o bajo cerrojoCopias.
+Directorio* crearCopiaPendiente(Directorio* fuente, const char* nombre) {
+    Directorio* origen = vistaDirectorio(fuente);
+    Directorio* copia = crearDirectorio(nombre);
+    if (origen->cantidadHijos == 0) return copia;
+    copia->archivosSubarbol = origen->archivosSubarbol;
+    copia->directoriosSubarbol = origen->directoriosSubarbol;
+    copia->bytesSubarbol = origen->bytesSubarbol;
+    copia->siguienteCopia = origen->copias;
+    origen->copias = copia;
+    copia->origen.store(origen, memory_order_relaxed);
+    copiasPendientes++;
+    return copia;
+}
+
+// Un archivo 'nombre', sin enlazar, con el mismo contenido que 'fuente': compartido si es un
+// blob, aplanado en uno nuevo si 'fuente' tiene tabla de piezas
+Archivo* copiarArchivo(Archivo* fuente, const char* nombre) {
+    char* contenido;
+    if (fuente->piezas) {
+        BufferBytes texto = {nullptr, 0, 0};
+        contenidoLeer(fuente, 0, longitudContenido(fuente), texto);
+        lock_guard<mutex> bloqueo(cerrojoAlmacen);
+        contenido = texto.longitud > 0 ? internarContenido(texto.datos, texto.longitud) : nullptr;
+        bufferLiberar(texto);
+    } else {
+        lock_guard<mutex> bloqueo(cerrojoAlmacen);
+        contenido = compartirContenido(fuente->contenido);
+    }
+    return inicializarArchivo(reservarArchivo(), copiarNombre(nombre), contenido);
+}
+
+void quitarDeCopias(Directorio* copia, Directorio* origen) {
+    for (Directorio** enlace = &origen->copias; *enlace; enlace = &(*enlace)->siguienteCopia) {
+        if (*enlace == copia) {
+            *enlace = copia->siguienteCopia;
+            break;
+        }
+    }
+    copia->siguienteCopia = nullptr;
+}
+
+// Le da a la copia pendiente sus propios hijos (un nivel). Con el árbol al menos compartido.
+void materializarCopia(Directorio* copia) {
+    lock_guard<mutex> bloqueo(cerrojoCopias);
+    Directorio* origen = copia->origen.load(memory_order_relaxed);
+    if (!origen) return; // Otra sesión se adelantó
+    quitarDeCopias(copia, origen);
+    for (Directorio* d = origen->subdirectorios; d; d = d->siguienteDirectorio) {
+        enlazarDirectorio(copia, crearCopiaPendiente(d, d->nombre));
+    }
+    for (Archivo* a = origen->archivos; a; a = a->siguiente) enlazarArchivo(copia, copiarArchivo(a, a->nombre));
+    if (trigramas.activo) { // Las sesiones que consultan el índice con el árbol compartido usan su cerrojo
+        lock_guard<mutex> bloqueoIndice(cerrojoTrigramas);
+        for (Archivo* a = copia->archivos; a; a = a->siguiente) indexarTrigramas(a);
+    }
+    copiasPendientes--;
+    copia->origen.store(nullptr, memory_order_release);
+}
+
+inline void materializarSiPendiente(Directorio* directorio) {
+    if (directorio->origen.load(memory_order_acquire)) materializarCopia(directorio);
+}
+
+// Antes de modificar los hijos de 'directorio' o el contenido de uno de sus archivos, con el
+// árbol en exclusiva: lo materializa si es una copia pendiente y separa las copias pendientes
+// de él y de sus ancestros, que dejarían de ver el estado en que se hicieron
+void prepararModificacion(Directorio* directorio) {
+    if (copiasPendientes.load(memory_order_relaxed) == 0 || !directorio) return;
+    materializarSiPendiente(directorio);
+    Directorio* superior = nullptr; // El ancestro más alto con copias
+    for (Directorio* d = directorio; d; d = d->padre) {
+        if (d->copias) superior = d;
+    }
+    if (!superior) return;
+    // Separar las copias de un ancestro crea copias pendientes de sus hijos, entre ellos el
+    // siguiente del camino, así que se recorre de arriba hacia abajo
+    char** camino = nullptr;
+    int cantidad = 0, capacidad = 0;
+    for (Directorio* d = directorio; d != superior->padre; d = d->padre) agregarPuntero(camino, cantidad, capacidad, (char*)d);
+    while (cantidad > 0) {
+        Directorio* d = (Directorio*)camino[--cantidad];
+        while (d->copias) materializarCopia(d->copias);
+    }
+    delete[] camino;
+}
+
+// Antes de liberar un directorio: sus copias pendientes se separan y, si él mismo es una copia
+// pendiente, sale de la lista de su origen
+void soltarCopias(Directorio* directorio) {
+    while (directorio->copias) materializarCopia(directorio->copias);
+    Directorio* origen = directorio->origen.load(memory_order_relaxed);
+    if (origen) {
+        quitarDeCopias(directorio, origen);
+        directorio->origen.store(nullptr, memory_order_relaxed);
+        copiasPendientes--;
+    }
+}
+
+// Materializa todas las copias pendientes bajo 'directorio' (grep, que busca en el índice)
+void materializarSubarbol(Directorio* directorio) {
+    RecorridoSubarbol recorrido;
+    recorridoIniciar(recorrido, directorio);
+    while (Directorio* actual = recorridoSiguiente(recorrido)) materializarSiPendiente(actual);
+}
+
+// Función para liberar memoria de un archivo
+void eliminarArchivo(Archivo* archivo) {
+    if (archivo) {
+        if (trigramas.activo) olvidarTrigramas(archivo);
+        liberarNombre(archivo->nombre);
+        liberarContenidoArchivo(archivo);
+        liberarNodoArchivo(archivo);
+    }
+}
+
+// Libera desde la pila de directorios pendientes hasta 'limite' nodos (directorios y archivos)
+// y devuelve cuántos liberó; lo que falte queda en la pila. Es iterativa y va de arriba hacia
+// abajo: al visitar un directorio se separan sus copias pendientes, que todavía ven sus hijos,
+// y los hijos pasan a la pila sin padre (el suyo puede liberarse antes que ellos).
+long liberarPendientes(char**& pila, int& cantidad, int& capacidad, long limite, bool separarCopias) {
+    long liberados = 0;
+    while (cantidad > 0 && liberados < limite) {
+        Directorio* directorio = (Directorio*)pila[cantidad - 1];
+        if (separarCopias && copiasPendientes.load(memory_order_relaxed) > 0) soltarCopias(directorio);
+        if (directorio->subdirectorios) {
+            for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+                d->padre = nullptr;
+                agregarPuntero(pila, cantidad, capacidad, (char*)d);
+            }
+            directorio->subdirectorios = nullptr;
+            directorio->ultimoSubdirectorio = nullptr;
+            continue;
+        }
+        while (directorio->archivos && liberados < limite) {
+            Archivo* archivo = directorio->archivos;
+            directorio->archivos = archivo->siguiente;
+            eliminarArchivo(archivo);
+            liberados++;
+        }
+        if (directorio->archivos) break;
+        cantidad--;
+        liberarNombre(directorio->nombre);
+        liberarIndiceHijos(directorio->indice);
+        liberarIndiceOrdenado(directorio->ordenado);
+        liberarNodoDirectorio(directorio);
+        liberados++;
+    }
+    return liberados;
+}
+
+// Función para liberar memoria de un directorio y su contenido. Sin 'separarCopias' (todo el
+// árbol se libera junto) no se materializan las copias pendientes que dependen de él.
+void eliminarDirectorio(Directorio* directorio, bool separarCopias = true) {
+    if (directorio) {
+        invalidarRutasPositivas();
+        char** pila = nullptr;
+        int cantidad = 0, capacidad = 0;
+        agregarPuntero(pila, cantidad, capacidad, (char*)directorio);
+        liberarPendientes(pila, cantidad, capacidad, numeric_limits<long>::max(), separarCopias);
+        delete[] pila;
+    }
+}
+
+// --- Reclamación en segundo plano (rm de subárboles grandes) ---
+// rm desenlaza el subárbol en el acto (totales, sesiones, caché de rutas) y, si supera
+// UMBRAL_RECLAMACION_DIFERIDA nodos, lo deja en la pila del reclamador en vez de liberarlo. El
+// reclamador es un hilo que libera NODOS_POR_LOTE_RECLAMACION nodos por vez con cerrojoArbol en
+// exclusiva, así las sesiones se intercalan entre lote y lote. Lo pendiente no es alcanzable
+// desde la raíz; solo lo ven las copias pendientes que lo tienen de origen, que se separan antes
+// de liberar su origen. 'sync' y la salida lo liberan todo en el hilo que llama.
+// Orden de cerrojos: cerrojoArbol -> reclamador.cerrojo -> cerrojoCopias.
+
+struct Reclamador {
+    mutex cerrojo;              // Protege la pila y los contadores
+    condition_variable trabajo;
+    thread hilo;
+    bool activo;                // El hilo está en marcha
+    bool terminar;
+    char** pila;                // Directorios por liberar (ver liberarPendientes)
+    int cantidad;
+    int capacidad;
+    long subarboles;            // Entregados desde el arranque
+    long nodosLiberados;
+    long lotes;
+};
+
+Reclamador reclamador = {{}, {}, {}, false, false, nullptr, 0, 0, 0, 0, 0};
+
+void bucleReclamador() {
+    unique_lock<mutex> bloqueo(reclamador.cerrojo);
+    while (true) {
+        reclamador.trabajo.wait(bloqueo, [] { return reclamador.cantidad > 0 || reclamador.terminar; });
+        if (reclamador.terminar) return;
+        bloqueo.unlock();
+        {
+            unique_lock<shared_mutex> bloqueoArbol(cerrojoArbol);
+            lock_guard<mutex> bloqueoPila(reclamador.cerrojo);
+            reclamador.nodosLiberados += liberarPendientes(reclamador.pila, reclamador.cantidad, reclamador.capacidad,
+                                                           NODOS_POR_LOTE_RECLAMACION, true);
+            reclamador.lotes++;
+        }
+        this_thread::yield(); // Deja pasar a las sesiones que esperan el árbol
+        bloqueo.lock();
+    }
+}
+
+// Con el árbol en exclusiva: libera 'directorio', ya desenlazado, en el acto si es chico o
+// en segundo plano si no
+void reclamarDirectorio(Directorio* directorio) {
+    if (directorio->archivosSubarbol + directorio->directoriosSubarbol < UMBRAL_RECLAMACION_DIFERIDA) {
+        eliminarDirectorio(directorio);
+        return;
+    }
+    directorio->padre = nullptr;
+    lock_guard<mutex> bloqueo(reclamador.cerrojo);
+    agregarPuntero(reclamador.pila, reclamador.cantidad, reclamador.capacidad, (char*)directorio);
+    reclamador.subarboles++;
+    if (!reclamador.activo) {
+        reclamador.terminar = false;
+        reclamador.hilo = thread(bucleReclamador);
+        reclamador.activo = true;
+    }
+    reclamador.trabajo.notify_one();
+}
+
+// Con el árbol en exclusiva: libera ya todo lo pendiente y devuelve cuántos nodos eran
+long reclamarPendientes() {
+    lock_guard<mutex> bloqueo(reclamador.cerrojo);
+    long liberados = liberarPendientes(reclamador.pila, reclamador.cantidad, reclamador.capacidad, numeric_limits<long>::max(), true);
+    reclamador.nodosLiberados += liberados;
+    return liberados;
+}
+
+// Sin cerrojos tomados y sin otras sesiones: detiene el hilo y libera lo que quedaba
+void detenerReclamador() {
+    if (reclamador.activo) {
+        {
+            lock_guard<mutex> bloqueo(reclamador.cerrojo);
+            reclamador.terminar = true;
+        }
+        reclamador.trabajo.notify_one();
+        reclamador.hilo.join();
+        reclamador.activo = false;
+    }
+    reclamarPendientes();
+    delete[] reclamador.pila;
+    reclamador.pila = nullptr;
+    reclamador.capacidad = 0;
+}
+
+void imprimirEstadisticasReclamador() {
+    lock_guard<mutex> bloqueo(reclamador.cerrojo);
+    salida() << "  reclamación en segundo plano: " << reclamador.cantidad << " directorios pendientes, "
+             << reclamador.subarboles << " subárboles recibidos, " << reclamador.nodosLiberados << " nodos liberados en "
+             << reclamador.lotes << " lotes" << endl;
+}
+
+// Libera el árbol completo al salir. Con el asignador agrupado solo se recorre el árbol para
+// liberar lo que vive en el heap (contenidos e índices); nodos y nombres se devuelven en
+// bloque con sus losas y trozos. Solo es válido si raiz es el único árbol vivo.
+void liberarSistemaArchivos(Directorio* raiz) {
+    detenerReclamador();
+    liberarIndiceTrigramas();
+    copiasPendientes = 0;
+    if (!asignadorAgrupado) {
+        eliminarDirectorio(raiz, false);
+        liberarMapaSnapshot();
+        return;
+    }
+    char** pendientes = nullptr;
+    int cantidad = 0, capacidad = 0;
+    if (raiz) agregarPuntero(pendientes, cantidad, capacidad, (char*)raiz);
+    while (cantidad > 0) {
+        Directorio* directorio = (Directorio*)pendientes[--cantidad];
+        for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+            agregarPuntero(pendientes, cantidad, capacidad, (char*)d);
+        }
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+            liberarContenidoArchivo(a);
+        }
+        liberarIndiceHijos(directorio->indice);
+        liberarIndiceOrdenado(directorio->ordenado);
+    }
+    delete[] pendientes;
+    invalidarRutasPositivas();
+    poolReiniciar(poolArchivos);
+    poolReiniciar(poolDirectorios);
+    arenaReiniciar();
+    liberarMapaSnapshot();
+}
+
+// Encontrar archivo en un directorio
+Archivo* buscarArchivo(Directorio* directorio, const char* nombre) {
+    materializarSiPendiente(directorio);
+    if (directorio->indice) {
+        EntradaIndice* entrada = indiceBuscar(directorio->indice, nombre);
+        return entrada ? entrada->archivo : nullptr;
+    }
+    Archivo* actual = directorio->archivos;
+    while (actual) {
+        if (strcmp(actual->nombre, nombre) == 0) {
+            return actual;
+        }
+        actual = actual->siguiente;
+    }
+    return nullptr;
+}
+
+// Función para buscar un subdirectorio
+Directorio* buscarDirectorio(Directorio* directorio, const char* nombre) {
+    materializarSiPendiente(directorio);
+    if (directorio->indice) {
+        EntradaIndice* entrada = indiceBuscar(directorio->indice, nombre);
+        return entrada ? entrada->directorio : nullptr;
+    }
+    Directorio* actual = directorio->subdirectorios;
+    while (actual) {
+        if (strcmp(actual->nombre, nombre) == 0) {
+            return actual;
+        }
+        actual = actual->siguienteDirectorio;
+    }
+    return nullptr;
+}
+
+const size_t LONGITUD_DESCONOCIDA = ~(size_t)0;
+
+// Función para añadir un archivo a un directorio. 'bytes' es la longitud de su contenido si quien
+// llama ya la conoce (el snapshot binario la pasa para no tocar las páginas mapeadas).
+void anadirArchivo(Directorio* directorio, Archivo* archivo, size_t bytes = LONGITUD_DESCONOCIDA) {
+    prepararModificacion(directorio);
+    enlazarArchivo(directorio, archivo);
+    propagarTotales(directorio, 1, 0, (int64_t)(bytes == LONGITUD_DESCONOCIDA ? longitudContenido(archivo) : bytes));
+    if (trigramas.activo) indexarTrigramas(archivo);
+}
+
+// Función para eliminar un archivo de un directorio
+bool removerArchivo(Directorio* directorio, const char* nombre) {
+    prepararModificacion(directorio);
+    Archivo* archivo = buscarArchivo(directorio, nombre);
+    if (!archivo) return false;
+    desenlazarArchivo(directorio, archivo);
+    propagarTotales(directorio, -1, 0, -(int64_t)longitudContenido(archivo));
+    eliminarArchivo(archivo);
+    return true;
+}
+
+// Función para eliminar un subdirectorio
+bool removerDirectorio(Directorio* padre, const char* nombre) {
+    prepararModificacion(padre);
+    Directorio* directorio = buscarDirectorio(padre, nombre);
+    if (!directorio) return false;
+    desenlazarDirectorio(padre, directorio);
+    propagarTotales(padre, -directorio->archivosSubarbol, -directorio->directoriosSubarbol - 1,
+                    -(int64_t)directorio->bytesSubarbol);
+    reubicarSesiones(directorio);
+    invalidarRutasPositivas();
+    reclamarDirectorio(directorio);
+    return true;
+}
+
+// Valida nombres de archivos/directorios (no pueden ser . o .. ni contener /)
+bool esNombreValido(const char* nombre) {
+    if (!nombre || strlen(nombre) == 0) return false;
+    if (strcmp(nombre, ".") == 0 || strcmp(nombre, "..") == 0) return false;
+    if (strchr(nombre, '/') != nullptr) return false;
+    return true;
+}
+
+// Añade un directorio a la lista de subdirectorios de un padre
+void anadirDirectorioALista(Directorio* padre, Directorio* nuevoDirectorio) {
+    prepararModificacion(padre);
+    enlazarDirectorio(padre, nuevoDirectorio);
+    propagarTotales(padre, nuevoDirectorio->archivosSubarbol, nuevoDirectorio->directoriosSubarbol + 1,
+                    (int64_t)nuevoDirectorio->bytesSubarbol);
+    invalidarRutasNegativas();
+}
+
+// Resuelve una ruta absoluta a través de la caché. La ruta se normaliza ('.', '..' y barras
+// repetidas) calculando a la vez el hash FNV-1a de cada prefijo; si la ruta completa no está
+// en caché se parte del prefijo cacheado más largo y se memoriza cada prefijo recorrido.
+// Retorna false si la ruta no cabe en el buffer y hay que resolverla sin caché.
+bool navegarRutaConCache(const char* ruta, Directorio* raiz, Directorio*& resultado) {
+    char normalizada[LONGITUD_MAX_RUTA];
+    unsigned int finComponente[LONGITUD_MAX_RUTA / 2];  // Longitud de la ruta tras cada componente
+    unsigned int hashComponente[LONGITUD_MAX_RUTA / 2]; // Hash de ese prefijo
+    int componentes = 0;
+    unsigned int longitud = 0;
+    unsigned int hash = 2166136261u;
+
+    const char* p = ruta;
+    while (*p) {
+        while (*p == '/') p++;
+        const char* inicio = p;
+        while (*p && *p != '/') p++;
+        size_t largo = p - inicio;
+        if (largo == 0 || (largo == 1 && inicio[0] == '.')) continue;
+        if (largo == 2 && inicio[0] == '.' && inicio[1] == '.') {
+            if (componentes > 0) componentes--;
+            longitud = componentes > 0 ? finComponente[componentes - 1] : 0;
+            hash = componentes > 0 ? hashComponente[componentes - 1] : 2166136261u;
+            continue;
+        }
+        if (longitud + 1 + largo >= (size_t)LONGITUD_MAX_RUTA) return false;
+        normalizada[longitud++] = '/';
+        hash = (hash ^ '/') * 16777619u;
+        for (size_t i = 0; i < largo; i++) {
+            normalizada[longitud++] = inicio[i];
+            hash = (hash ^ (unsigned char)inicio[i]) * 16777619u;
+        }
+        finComponente[componentes] = longitud;
+        hashComponente[componentes] = hash;
+        componentes++;
+    }
+
+    if (componentes == 0) {
+        resultado = raiz;
+        return true;
+    }
+
+    EntradaCacheRutas* entrada = cacheRutasBuscar(normalizada, longitud, hash);
+    if (entrada) {
+        cacheRutas.aciertos++;
+        resultado = entrada->directorio;
+        return true;
+    }
+    cacheRutas.fallos++;
+
+    // Prefijo cacheado más largo
+    Directorio* actual = raiz;
+    int resueltos = 0;
+    for (int k = componentes - 1; k > 0; k--) {
+        EntradaCacheRutas* prefijo = cacheRutasBuscar(normalizada, finComponente[k - 1], hashComponente[k - 1]);
+        if (prefijo) {
+            if (!prefijo->directorio) {
+                resultado = nullptr;
+                return true;
+            }
+            actual = prefijo->directorio;
+            resueltos = k;
+            break;
+        }
+    }
+
+    for (int k = resueltos; k < componentes; k++) {
+        unsigned int inicio = (k == 0 ? 0 : finComponente[k - 1]) + 1;
+        char nombre[LONGITUD_MAX_RUTA];
+        memcpy(nombre, normalizada + inicio, finComponente[k] - inicio);
+        nombre[finComponente[k] - inicio] = '\0';
+        actual = buscarDirectorio(actual, nombre);
+        cacheRutasGuardar(normalizada, finComponente[k], hashComponente[k], actual);
+        if (!actual) break;
+    }
+    resultado = actual;
+    return true;
+}
+
+// Tokenizador reentrante (a diferencia de strtok no guarda estado global): salta los
+// separadores iniciales, termina el token con '\0' y deja 'cursor' después de él.
+// Devuelve nullptr cuando no quedan tokens.
+char* siguienteToken(char*& cursor, char separador) {
+    if (!cursor) return nullptr;
+    while (*cursor == separador) cursor++;
+    if (*cursor == '\0') {
+        cursor = nullptr;
+        return nullptr;
+    }
+    char* token = cursor;
+    while (*cursor && *cursor != separador) cursor++;
+    if (*cursor) *cursor++ = '\0';
+    else cursor = nullptr;
+    return token;
+}
+
+// Función auxiliar para navegar una ruta (absoluta o relativa)
+// Retorna el directorio al final de la ruta, o nullptr si no se encuentra
+Directorio* navegarRuta(Directorio* directorioInicio, const char* ruta, Directorio* raiz) {
+    if (!ruta || strlen(ruta) == 0) return directorioInicio;
+
+    // Las rutas absolutas (o relativas a la raíz) pasan por la caché de rutas
+    Directorio* resultadoCache;
+    if (cacheRutasActiva && (ruta[0] == '/' || directorioInicio == raiz) &&
+        navegarRutaConCache(ruta, raiz, resultadoCache)) {
+        return resultadoCache;
+    }
+
+    char copiaRuta[LONGITUD_MAX_RUTA];
+    strncpy(copiaRuta, ruta, LONGITUD_MAX_RUTA - 1);
+    copiaRuta[LONGITUD_MAX_RUTA - 1] = '\0';
+
+    Directorio* directorioActualNav = directorioInicio;
+
+    if (ruta[0] == '/') {
+        directorioActualNav = raiz;
+        if (strlen(ruta) == 1) return raiz;
+        memmove(copiaRuta, copiaRuta + 1, strlen(copiaRuta)); // Sin la '/' inicial
+    }
+    
+    if (strcmp(copiaRuta, ".") == 0 && ruta[0] != '/') return directorioInicio;
+
+    char* cursor = copiaRuta;
+    char* token = siguienteToken(cursor, '/');
+
+    while (token != nullptr) {
+        if (strcmp(token, ".") == 0) {
+            // No hacer nada
+        } else if (strcmp(token, "..") == 0) {
+            if (directorioActualNav->padre != nullptr) {
+                directorioActualNav = directorioActualNav->padre;
+            }
+        } else {
+            Directorio* siguienteDir = buscarDirectorio(directorioActualNav, token);
+            if (siguienteDir == nullptr) {
+                return nullptr; // Componente de la ruta no encontrado
+            }
+            directorioActualNav = siguienteDir;
+        }
+        token = siguienteToken(cursor, '/');
+    }
+    return directorioActualNav;
+}
+
+// Agrega la ruta absoluta del directorio, sin límite de componentes ni de longitud
+void agregarRutaDirectorio(BufferBytes& buffer, Directorio* directorio) {
+    if (!directorio->padre) {
+        bufferAgregar(buffer, "/", 1);
+        return;
+    }
+    PilaDirectorios ancestros = {nullptr, 0, 0};
+    for (Directorio* d = directorio; d->padre; d = d->padre) pilaApilar(ancestros, d);
+    while (ancestros.cantidad > 0) {
+        bufferAgregar(buffer, "/", 1);
+        bufferAgregarTexto(buffer, ancestros.directorios[--ancestros.cantidad]->nombre);
+    }
+    delete[] ancestros.directorios;
+}
+
+// Deja en 'salida' la ruta absoluta del directorio (o "/" si no hay), terminada en '\0'
+void obtenerRutaCompleta(Directorio* directorio, BufferBytes& salida) {
+    salida.longitud = 0;
+    if (directorio) agregarRutaDirectorio(salida, directorio);
+    else bufferAgregar(salida, "/", 1);
+    bufferAgregar(salida, "", 1);
+    salida.longitud--; // El '\0' queda en el buffer pero no cuenta
+}
+
+// Escribe en 'salida' la ruta absoluta de directorio/nombre (o solo del directorio si nombre
+// es nullptr), sin límite de componentes ni de longitud
+void construirRuta(Directorio* directorio, const char* nombre, BufferBytes& salida) {
+    if (!nombre) {
+        obtenerRutaCompleta(directorio, salida);
+        return;
+    }
+    salida.longitud = 0;
+    if (directorio && directorio->padre) agregarRutaDirectorio(salida, directorio);
+    bufferAgregar(salida, "/", 1);
+    bufferAgregarTexto(salida, nombre);
+    bufferAgregar(salida, "", 1);
+    salida.longitud--;
+}
+
+// --- Diario de operaciones (write-ahead journal) ---
+// Cada mkdir, touch, rm, rename, edit, cp y mv se agrega a <snapshot>.journal en cuanto ocurre,
+// con rutas absolutas. 'save' solo fuerza el diario a disco; el snapshot completo se
+// reescribe en los checkpoints, que luego vacían el diario. Al arrancar se reproduce el
+// diario sobre el snapshot. Los registros son idempotentes (mkdir/touch de algo existente
+// o rm de algo inexistente no hacen nada), así que reproducirlos de más tras una caída
+// entre el checkpoint y el vaciado del diario no altera el resultado.
+//
+//   MKDIR <ruta>\n      TOUCH <ruta>\n      RM <ruta>\n      RENAME <ruta> <nombre>\n
+//   EDIT <ruta> <bytes>\n<contenido>\n      (bytes = -1 si el archivo queda vacío)
+//   WRITE <ruta> <desde> <bytes>\n<datos>\n
+//   COPY <ruta> <ruta destino>\n   (cp y snapshot)      MOVE <ruta> <ruta destino>\n   (mv)
+//   (COPY y MOVE se omiten si el destino ya existe; MOVE, también si el origen ya no está)
+// append se registra como WRITE en el tamaño que tenía el archivo: sobrescribir los mismos
+// bytes en la misma posición es idempotente, agregar al final no lo sería.
+
+struct Diario {
+    FILE* archivo;
+    char ruta[LONGITUD_MAX_RUTA];
+    long registros;     // Desde el último checkpoint
+    long bytes;
+    bool activo;        // false mientras se reproduce
+};
+
+Diario diario = {nullptr, "", 0, 0, false};
+
+void escribirRegistro(const char* tipo, const char* ruta, const char* argumento, const char* datos, long longitudDatos) {
+    if (!diario.activo || !diario.archivo) return;
+    int escritos;
+    if (datos || longitudDatos < 0) {
+        if (argumento) {
+            escritos = fprintf(diario.archivo, "%s %s %s %ld\n", tipo, ruta, argumento, longitudDatos);
+        } else {
+            escritos = fprintf(diario.archivo, "%s %s %ld\n", tipo, ruta, longitudDatos);
+        }
+        if (longitudDatos > 0) escritos += (int)fwrite(datos, 1, longitudDatos, diario.archivo);
+        escritos += fprintf(diario.archivo, "\n");
+    } else if (argumento) {
+        escritos = fprintf(diario.archivo, "%s %s %s\n", tipo, ruta, argumento);
+    } else {
+        escritos = fprintf(diario.archivo, "%s %s\n", tipo, ruta);
+    }
+    fflush(diario.archivo); // Una caída del proceso pierde como mucho este registro
+    diario.registros++;
+    diario.bytes += escritos;
+}
+
+// Registra una operación sobre directorio/nombre
+void registrarOperacion(const char* tipo, Directorio* directorio, const char* nombre, const char* argumento = nullptr) {
+    if (!diario.activo) return;
+    BufferBytes ruta = {nullptr, 0, 0};
+    construirRuta(directorio, nombre, ruta);
+    escribirRegistro(tipo, ruta.datos, argumento, nullptr, 0);
+    bufferLiberar(ruta);
+}
+
+void registrarEdicion(Directorio* directorio, Archivo* archivo) {
+    if (!diario.activo) return;
+    BufferBytes ruta = {nullptr, 0, 0};
+    construirRuta(directorio, archivo->nombre, ruta);
+    if (!contenidoVacio(archivo)) {
+        BufferBytes contenido = {nullptr, 0, 0};
+        contenidoLeer(archivo, 0, longitudContenido(archivo), contenido);
+        escribirRegistro("EDIT", ruta.datos, nullptr, contenido.datos, (long)contenido.longitud);
+        bufferLiberar(contenido);
+    } else {
+        escribirRegistro("EDIT", ruta.datos, nullptr, nullptr, -1);
+    }
+    bufferLiberar(ruta);
+}
+
+// Registra los 'longitud' bytes que quedaron en el archivo a partir de 'desde'
+void registrarEscritura(Directorio* directorio, Archivo* archivo, size_t desde, size_t longitud) {
+    if (!diario.activo) return;
+    BufferBytes ruta = {nullptr, 0, 0};
+    BufferBytes datos = {nullptr, 0, 0};
+    construirRuta(directorio, archivo->nombre, ruta);
+    contenidoLeer(archivo, desde, longitud, datos);
+    char posicion[32];
+    snprintf(posicion, sizeof(posicion), "%zu", desde);
+    escribirRegistro("WRITE", ruta.datos, posicion, datos.datos, (long)datos.longitud);
+    bufferLiberar(datos);
+    bufferLiberar(ruta);
+}
+
+void imprimirPrompt(Directorio*& directorioActual) {
+    thread_local BufferHilo ruta;
+    {
+        shared_lock<shared_mutex> bloqueo(cerrojoArbol);
+        obtenerRutaCompleta(directorioActual, ruta.buffer);
+    }
+    salida().write(ruta.buffer.datos, (streamsize)ruta.buffer.longitud) << " $ ";
+}
+
+// --- Implementación de Comandos ---
+
+void comando_cd(Directorio*& directorioActual, const char* ruta, Directorio* raiz) {
+    Directorio* directorioDestino = navegarRuta(directorioActual, ruta, raiz);
+    if (directorioDestino) {
+        directorioActual = directorioDestino;
+    } else {
+        salida() << "cd: " << ruta << ": No existe el archivo o directorio" << endl;
+    }
+}
+
+void imprimirEntradaLs(const EntradaIndice& entrada) {
+    if (entrada.directorio) {
+        salida() << entrada.directorio->nombre << "/\t";
+    } else {
+        salida() << entrada.archivo->nombre << "\t";
+    }
+}
+
+bool empiezaCon(const char* nombre, const char* prefijo) {
+    return strncmp(nombre, prefijo, strlen(prefijo)) == 0;
+}
+
+// Lista los hijos en orden alfabético. Con prefijo solo muestra los nombres que empiezan por él;
+// 'desde' y 'limite' (-1 = sin límite) paginan el resultado.
+void comando_ls(Directorio* directorio, const char* prefijo = "", long desde = 0, long limite = -1) {
+    if (!directorio) return;
+    materializarSiPendiente(directorio);
+
+    if (directorio->ordenado) {
+        // Directorio grande: búsqueda binaria del prefijo y recorrido de los k resultados
+        IndiceOrdenado* ordenado = directorio->ordenado;
+        PosicionOrdenada posicion = ordenadoCotaInferior(ordenado, prefijo);
+        posicion = ordenadoAvanzar(ordenado, posicion, desde);
+        while (limite != 0 && posicion.bloque < ordenado->cantidadBloques) {
+            const EntradaIndice& entrada = ordenado->bloques[posicion.bloque]->entradas[posicion.entrada];
+            if (!empiezaCon(nombreEntrada(entrada), prefijo)) break;
+            imprimirEntradaLs(entrada);
+            if (limite > 0) limite--;
+            posicion = ordenadoAvanzar(ordenado, posicion, 1);
+        }
+        salida() << endl;
+        return;
+    }
+
+    // Directorio pequeño (sin índice): se ordenan sus pocos hijos al vuelo
+    EntradaIndice* hijos = new EntradaIndice[directorio->cantidadHijos + 1];
+    int cantidad = 0;
+    for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+        if (empiezaCon(d->nombre, prefijo)) hijos[cantidad++] = {0, d, nullptr};
+    }
+    for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+        if (empiezaCon(a->nombre, prefijo)) hijos[cantidad++] = {0, nullptr, a};
+    }
+    for (int i = 1; i < cantidad; i++) { // Ordenamiento por inserción
+        EntradaIndice actual = hijos[i];
+        int j = i - 1;
+        while (j >= 0 && strcmp(nombreEntrada(hijos[j]), nombreEntrada(actual)) > 0) {
+            hijos[j + 1] = hijos[j];
+            j--;
+        }
+        hijos[j + 1] = actual;
+    }
+    for (long i = desde; i < cantidad && limite != 0; i++) {
+        imprimirEntradaLs(hijos[i]);
+        if (limite > 0) limite--;
+    }
+    delete[] hijos;
+    salida() << endl; // Nueva línea al final
+}
+
+void comando_mkdir(Directorio* directorioActual, const char* nombre) {
+    if (!esNombreValido(nombre)) {
+        salida() << "mkdir: '" << nombre << "': Nombre de directorio inválido." << endl;
+        return;
+    }
+    if (buscarDirectorio(directorioActual, nombre) || buscarArchivo(directorioActual, nombre)) {
+        salida() << "mkdir: '" << nombre << "': El archivo ya existe" << endl;
+        return;
+    }
+    Directorio* nuevoDirectorio = crearDirectorio(nombre, directorioActual);
+    if (nuevoDirectorio) {
+        anadirDirectorioALista(directorioActual, nuevoDirectorio);
+        registrarOperacion("MKDIR", directorioActual, nombre);
+    } else {
+        salida() << "mkdir: Error al crear el directorio." << endl;
+    }
+}
+
+void comando_rm(Directorio* directorioActual, const char* rutaAEliminar, Directorio* raiz) {
+    if (!rutaAEliminar || strlen(rutaAEliminar) == 0) {
+        salida() << "rm: falta un operando" << endl;
+        salida() << "Uso: rm <ruta_archivo_o_directorio>" << endl;
+        return;
+    }
+
+    char copiaRuta[LONGITUD_MAX_RUTA];
+    strncpy(copiaRuta, rutaAEliminar, LONGITUD_MAX_RUTA - 1);
+    copiaRuta[LONGITUD_MAX_RUTA - 1] = '\0';
+
+    char* ultimaBarra = strrchr(copiaRuta, '/');
+    char* nombreElemento;
+    char rutaPadre[LONGITUD_MAX_RUTA];
+    rutaPadre[0] = '\0';
+
+    Directorio* directorioPadreDestino = nullptr;
+
+    if (ultimaBarra == nullptr) { // Es un nombre en el directorio actual
+        nombreElemento = copiaRuta;
+        directorioPadreDestino = directorioActual;
+    } else { // Es una ruta (absoluta o relativa)
+        *ultimaBarra = '\0';
+        nombreElemento = ultimaBarra + 1;
+
+        if (strlen(copiaRuta) == 0) {
+            strcpy(rutaPadre, "/");
+        } else {
+            strcpy(rutaPadre, copiaRuta);
+        }
+        
+        directorioPadreDestino = navegarRuta(directorioActual, rutaPadre, raiz);
+    }
+
+    if (!directorioPadreDestino) {
+        salida() << "rm: no se puede eliminar '" << rutaAEliminar << "': No existe el archivo o directorio" << endl;
+        return;
+    }
+
+    if (directorioPadreDestino == raiz && strcmp(nombreElemento, "") == 0 && strcmp(rutaAEliminar, "/") == 0) {
+        salida() << "rm: no se puede eliminar '/': Es un directorio" << endl;
+        return;
+    }
+    if (strcmp(nombreElemento, ".") == 0 || strcmp(nombreElemento, "..") == 0) {
+        salida() << "rm: no se puede eliminar '" << nombreElemento << "': Permiso denegado" << endl;
+        return;
+    }
+
+    if (removerArchivo(directorioPadreDestino, nombreElemento)) {
+        registrarOperacion("RM", directorioPadreDestino, nombreElemento);
+        salida() << "rm: '" << nombreElemento << "' eliminado." << endl;
+    }
+    else if (removerDirectorio(directorioPadreDestino, nombreElemento)) {
+        registrarOperacion("RM", directorioPadreDestino, nombreElemento);
+        salida() << "rm: '" << nombreElemento << "' eliminado (incluyendo su contenido)." << endl;
+    }
+    else {
+        salida() << "rm: no se puede eliminar '" << rutaAEliminar << "': No existe el archivo o directorio" << endl;
+    }
+}
+
+void comando_touch(Directorio* directorioActual, const char* nombre) {
+    if (!esNombreValido(nombre)) {
+        salida() << "touch: '" << nombre << "': Nombre de archivo inválido." << endl;
+        return;
+    }
+    if (buscarDirectorio(directorioActual, nombre)) {
+        salida() << "touch: '" << nombre << "': Es un directorio" << endl;
+        return;
+    }
+    if (buscarArchivo(directorioActual, nombre)) {
+        salida() << "touch: '" << nombre << "': El archivo ya existe. No se realizó ninguna acción." << endl;
+        return;
+    }
+
+    Archivo* nuevoArchivo = crearArchivo(nombre);
+    if (nuevoArchivo) {
+        anadirArchivo(directorioActual, nuevoArchivo);
+        registrarOperacion("TOUCH", directorioActual, nombre);
+        salida() << "touch: '" << nombre << "' creado." << endl;
+    } else {
+        salida() << "touch: Error al crear el archivo." << endl;
+    }
+}
+
+// Reemplaza el contenido de un archivo por los primeros 'longitud' bytes de 'contenido'
+// (nullptr deja el archivo vacío). Si otro archivo ya tiene ese contenido se comparte.
+void reemplazarContenido(Archivo* archivo, const char* contenido, size_t longitud) {
+    prepararModificacion(archivo->padre);
+    char* nuevo = contenido ? internarContenido(contenido, longitud) : nullptr;
+    propagarTotales(archivo->padre, 0, 0, (int64_t)longitud - (int64_t)longitudContenido(archivo));
+    liberarContenidoArchivo(archivo);
+    archivo->contenido = nuevo;
+    reindexarTrigramas(archivo);
+}
+
+// Lee una línea completa de la entrada de la sesión, de cualquier longitud y sin el '\n' final.
+// Devuelve false si la entrada terminó sin leer nada.
+bool leerLineaEntrada(BufferBytes& linea) {
+    char bloque[LONGITUD_MAX_CONTENIDO];
+    linea.longitud = 0;
+    istream& flujo = entrada();
+    while (true) {
+        flujo.getline(bloque, sizeof(bloque));
+        bufferAgregar(linea, bloque, strlen(bloque));
+        if (!flujo.fail()) return true;
+        if (flujo.eof()) return linea.longitud > 0;
+        flujo.clear(); // Se llenó el bloque: la línea sigue
+    }
+}
+
+void imprimirContenido(const Archivo* archivo) {
+    const char* datos;
+    size_t longitud;
+    for (int i = 0; fragmentoContenido(archivo, i, datos, longitud); i++) {
+        salida().write(datos, longitud);
+    }
+}
+
+// edit y append/write leen su entrada sin tener el árbol tomado, para no bloquear a las demás
+// sesiones mientras se escribe; al aplicar el cambio vuelven a buscar el archivo, que otra
+// sesión pudo haber eliminado entretanto.
+void comando_editar(Directorio*& directorioActual, const char* nombreArchivo) {
+    {
+        shared_lock<shared_mutex> bloqueo(cerrojoArbol);
+        Archivo* archivo = buscarArchivo(directorioActual, nombreArchivo);
+        if (!archivo) {
+            salida() << "editar: '" << nombreArchivo << "': No existe tal archivo" << endl;
+            return;
+        }
+        salida() << "--- Editando: " << archivo->nombre << " ---" << endl;
+        salida() << "Contenido actual:\n";
+        if (contenidoVacio(archivo)) salida() << "(vacío)";
+        else imprimirContenido(archivo);
+        salida() << endl;
+    }
+    salida() << "Ingrese nuevo contenido (presione Enter en una línea vacía para finalizar):\n";
+
+    BufferBytes linea = {nullptr, 0, 0};
+    BufferBytes nuevoContenido = {nullptr, 0, 0};
+
+    // Limpiar el buffer de entrada antes de leer líneas
+    entrada().clear();
+    // Consumir cualquier caracter de nueva línea pendiente
+    if (entrada().peek() == '\n') {
+        entrada().ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+
+    while (leerLineaEntrada(linea) && linea.longitud > 0) {
+        if (nuevoContenido.longitud > 0) bufferAgregar(nuevoContenido, "\n", 1);
+        bufferAgregar(nuevoContenido, linea.datos, linea.longitud);
+    }
+    bufferLiberar(linea);
+
+    unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+    Archivo* archivo = buscarArchivo(directorioActual, nombreArchivo);
+    if (!archivo) {
+        salida() << "editar: '" << nombreArchivo << "': El archivo se eliminó durante la edición" << endl;
+    } else if (Directorio* excedida = cuotaExcedida(directorioActual, nuevoContenido.longitud > longitudContenido(archivo)
+                                                    ? nuevoContenido.longitud - longitudContenido(archivo) : 0)) {
+        salida() << "editar: '" << nombreArchivo << "': se superaría la cuota de '" << excedida->nombre << "' ("
+                 << excedida->cuotaBytes << " bytes)" << endl;
+    } else {
+        reemplazarContenido(archivo, nuevoContenido.datos, nuevoContenido.longitud);
+        registrarEdicion(directorioActual, archivo);
+        salida() << "Contenido de '" << archivo->nombre << "' actualizado." << endl;
+    }
+    bufferLiberar(nuevoContenido);
+}
+
+// Cuánto crecería el archivo al escribir 'longitud' bytes en 'desde' (o al final)
+size_t crecimientoEscritura(const Archivo* archivo, bool esAppend, size_t desde, size_t longitud) {
+    size_t actual = longitudContenido(archivo);
+    size_t fin = (esAppend ? actual : desde) + longitud;
+    return fin > actual ? fin - actual : 0;
+}
+
+// append/write: lee líneas de la entrada hasta una línea con solo "." y las escribe en el
+// archivo a partir de 'desde' (al final si esAppend), sin límite de tamaño
+void comando_escribir(const char* nombreComando, Directorio*& directorioActual, const char* nombreArchivo,
+                      bool esAppend, size_t desde) {
+    {
+        shared_lock<shared_mutex> bloqueo(cerrojoArbol);
+        Archivo* archivo = buscarArchivo(directorioActual, nombreArchivo);
+        if (!archivo) {
+            salida() << nombreComando << ": '" << nombreArchivo << "': No existe tal archivo" << endl;
+            return;
+        }
+        if (!esAppend && desde > longitudContenido(archivo)) {
+            salida() << nombreComando << ": el desplazamiento " << desde << " supera el tamaño de '" << nombreArchivo
+                     << "' (" << longitudContenido(archivo) << " bytes)" << endl;
+            return;
+        }
+    }
+    salida() << "Escriba el texto (una línea con solo '.' para terminar):" << endl;
+    BufferBytes linea = {nullptr, 0, 0};
+    BufferBytes texto = {nullptr, 0, 0};
+    while (leerLineaEntrada(linea)) {
+        if (linea.longitud == 1 && linea.datos[0] == '.') break;
+        bufferAgregar(texto, linea.datos, linea.longitud);
+        bufferAgregar(texto, "\n", 1);
+    }
+    bufferLiberar(linea);
+
+    unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+    Archivo* archivo = buscarArchivo(directorioActual, nombreArchivo);
+    if (!archivo) {
+        salida() << nombreComando << ": '" << nombreArchivo << "': El archivo se eliminó mientras se escribía" << endl;
+    } else if (!esAppend && desde > longitudContenido(archivo)) {
+        salida() << nombreComando << ": el desplazamiento " << desde << " supera el tamaño de '" << nombreArchivo
+                 << "' (" << longitudContenido(archivo) << " bytes)" << endl;
+    } else if (Directorio* excedida = cuotaExcedida(directorioActual, crecimientoEscritura(archivo, esAppend, desde, texto.longitud))) {
+        salida() << nombreComando << ": '" << nombreArchivo << "': se superaría la cuota de '" << excedida->nombre << "' ("
+                 << excedida->cuotaBytes << " bytes)" << endl;
+    } else {
+        if (esAppend) desde = longitudContenido(archivo);
+        if (texto.longitud > 0) {
+            contenidoEscribir(archivo, desde, texto.datos, texto.longitud);
+            registrarEscritura(directorioActual, archivo, desde, texto.longitud);
+        }
+        salida() << nombreComando << ": " << texto.longitud << " bytes escritos en '" << archivo->nombre
+                 << "' (tamaño: " << longitudContenido(archivo) << " bytes)." << endl;
+    }
+    bufferLiberar(texto);
+}
+
+// Muestra 'longitud' bytes del archivo a partir de 'desde', por bloques
+void comando_cat(Archivo* archivo, size_t desde, size_t longitud) {
+    BufferBytes bloque = {nullptr, 0, 0};
+    size_t total = longitudContenido(archivo);
+    size_t fin = (longitud > total || desde + longitud > total) ? total : desde + longitud;
+    for (size_t posicion = desde; posicion < fin; posicion += bloque.longitud) {
+        bloque.longitud = 0;
+        size_t tomar = fin - posicion < TAM_BLOQUE_LECTURA ? fin - posicion : TAM_BLOQUE_LECTURA;
+        if (contenidoLeer(archivo, posicion, tomar, bloque) == 0) break;
+        salida().write(bloque.datos, bloque.longitud);
+    }
+    if (bloque.longitud > 0 && bloque.datos[bloque.longitud - 1] != '\n') salida() << endl;
+    bufferLiberar(bloque);
+}
+
+void comando_renombrar(Directorio* directorioActual, const char* nombreAntiguo, const char* nombreNuevo) {
+    if (!esNombreValido(nombreNuevo)) {
+        salida() << "renombrar: '" << nombreNuevo << "': Nuevo nombre inválido." << endl;
+        return;
+    }
+    if (strcmp(nombreAntiguo, ".") == 0 || strcmp(nombreAntiguo, "..") == 0) {
+        salida() << "renombrar: No se pueden renombrar los directorios especiales '.' o '..'." << endl;
+        return;
+    }
+
+    if (buscarArchivo(directorioActual, nombreNuevo) || buscarDirectorio(directorioActual, nombreNuevo)) {
+        salida() << "renombrar: '" << nombreNuevo << "': El archivo ya existe" << endl;
+        return;
+    }
+
+    prepararModificacion(directorioActual);
+    Archivo* archivoARenombrar = buscarArchivo(directorioActual, nombreAntiguo);
+    if (archivoARenombrar) {
+        desindexarHijo(directorioActual, archivoARenombrar->nombre);
+        liberarNombre(archivoARenombrar->nombre);
+        archivoARenombrar->nombre = copiarNombre(nombreNuevo);
+        indexarHijo(directorioActual, nullptr, archivoARenombrar);
+        registrarOperacion("RENAME", directorioActual, nombreAntiguo, nombreNuevo);
+        salida() << "Archivo '" << nombreAntiguo << "' renombrado a '" << nombreNuevo << "'." << endl;
+        return;
+    }
+
+    Directorio* directorioARenombrar = buscarDirectorio(directorioActual, nombreAntiguo);
+    if (directorioARenombrar) {
+        desindexarHijo(directorioActual, directorioARenombrar->nombre);
+        invalidarRutasPositivas();
+        invalidarRutasNegativas();
+        liberarNombre(directorioARenombrar->nombre);
+        directorioARenombrar->nombre = copiarNombre(nombreNuevo);
+        indexarHijo(directorioActual, directorioARenombrar, nullptr);
+        registrarOperacion("RENAME", directorioActual, nombreAntiguo, nombreNuevo);
+        salida() << "Directorio '" << nombreAntiguo << "' renombrado a '" << nombreNuevo << "'." << endl;
+        return;
+    }
+
+    salida() << "renombrar: '" << nombreAntiguo << "': No existe el archivo o directorio" << endl;
+}
+
+// --- Copias y traslados: cp, snapshot, mv ---
+
+// Deja en 'nombre' el último componente de 'ruta' y devuelve su directorio padre ya resuelto
+// (nullptr si no existe). 'copia' (LONGITUD_MAX_RUTA bytes) guarda la ruta troceada.
+Directorio* resolverPadreRelativo(Directorio* directorioActual, const char* ruta, Directorio* raiz,
+                                  char* copia, char*& nombre) {
+    strncpy(copia, ruta, LONGITUD_MAX_RUTA - 1);
+    copia[LONGITUD_MAX_RUTA - 1] = '\0';
+    char* ultimaBarra = strrchr(copia, '/');
+    if (!ultimaBarra) {
+        nombre = copia;
+        return directorioActual;
+    }
+    *ultimaBarra = '\0';
+    nombre = ultimaBarra + 1;
+    return navegarRuta(directorioActual, copia[0] ? copia : "/", raiz);
+}
+
+// Copia el directorio 'fuenteDirectorio' o el archivo 'fuenteArchivo' dentro de 'destino' con
+// el nombre 'nombre', que no debe existir, y lo anota en el diario como COPY
+void copiarEnDirectorio(Directorio* destino, const char* nombre, Directorio* fuenteDirectorio, Archivo* fuenteArchivo) {
+    if (diario.activo) {
+        BufferBytes rutaDestino = {nullptr, 0, 0};
+        construirRuta(destino, nombre, rutaDestino);
+        if (fuenteDirectorio) {
+            registrarOperacion("COPY", fuenteDirectorio->padre, fuenteDirectorio->nombre, rutaDestino.datos);
+        } else {
+            registrarOperacion("COPY", fuenteArchivo->padre, fuenteArchivo->nombre, rutaDestino.datos);
+        }
+        bufferLiberar(rutaDestino);
+    }
+    if (fuenteDirectorio) {
+        anadirDirectorioALista(destino, crearCopiaPendiente(fuenteDirectorio, nombre));
+    } else {
+        anadirArchivo(destino, copiarArchivo(fuenteArchivo, nombre), longitudContenido(fuenteArchivo));
+    }
+}
+
+// Origen y destino ya resueltos de cp o mv
+struct OperandosTraslado {
+    Directorio* fuenteDirectorio;       // Exactamente uno de los dos no es nulo
+    Archivo* fuenteArchivo;
+    Directorio* destino;                // Directorio donde queda el resultado
+    char* nombre;                       // Nombre que tendrá allí
+    char copiaOrigen[LONGITUD_MAX_RUTA];
+    char copiaDestino[LONGITUD_MAX_RUTA];
+};
+
+// Resuelve los operandos de cp y mv: si 'rutaDestino' es un directorio existente el resultado
+// queda dentro con el nombre del origen; si no, se llama como el último componente de
+// 'rutaDestino', que no debe existir. Un directorio no puede ir a parar dentro de sí mismo.
+// Si algo falla lo informa con el nombre del comando y devuelve false.
+bool resolverTraslado(const char* comando, Directorio* directorioActual, Directorio* raiz,
+                      const char* rutaOrigen, const char* rutaDestino, OperandosTraslado& operandos) {
+    operandos.fuenteDirectorio = navegarRuta(directorioActual, rutaOrigen, raiz);
+    operandos.fuenteArchivo = nullptr;
+    if (!operandos.fuenteDirectorio) {
+        Directorio* padre = resolverPadreRelativo(directorioActual, rutaOrigen, raiz, operandos.copiaOrigen, operandos.nombre);
+        if (padre) operandos.fuenteArchivo = buscarArchivo(padre, operandos.nombre);
+        if (!operandos.fuenteArchivo) {
+            salida() << comando << ": '" << rutaOrigen << "': No existe el archivo o directorio" << endl;
+            return false;
+        }
+    }
+
+    operandos.destino = navegarRuta(directorioActual, rutaDestino, raiz);
+    if (operandos.destino) {
+        operandos.nombre = operandos.fuenteDirectorio ? operandos.fuenteDirectorio->nombre : operandos.fuenteArchivo->nombre;
+    } else {
+        operandos.destino = resolverPadreRelativo(directorioActual, rutaDestino, raiz, operandos.copiaDestino, operandos.nombre);
+        if (!operandos.destino) {
+            salida() << comando << ": no se puede crear '" << rutaDestino << "': No existe el directorio" << endl;
+            return false;
+        }
+    }
+    if (!esNombreValido(operandos.nombre)) {
+        salida() << comando << ": '" << operandos.nombre << "': Nombre de destino inválido." << endl;
+        return false;
+    }
+    if (operandos.fuenteDirectorio) {
+        for (Directorio* d = operandos.destino; d; d = d->padre) {
+            if (d == operandos.fuenteDirectorio) {
+                salida() << comando << ": no se puede poner el directorio '" << rutaOrigen << "' dentro de sí mismo" << endl;
+                return false;
+            }
+        }
+    }
+    if (buscarArchivo(operandos.destino, operandos.nombre) || buscarDirectorio(operandos.destino, operandos.nombre)) {
+        salida() << comando << ": '" << operandos.nombre << "': El archivo ya existe" << endl;
+        return false;
+    }
+    return true;
+}
+
+// cp [-r] <origen> <destino>: copiar un directorio cuesta O(1), la copia comparte el subárbol
+// hasta que uno de los dos cambia
+void comando_cp(Directorio* directorioActual, Directorio* raiz, const char* rutaOrigen, const char* rutaDestino, bool recursivo) {
+    OperandosTraslado operandos;
+    if (!resolverTraslado("cp", directorioActual, raiz, rutaOrigen, rutaDestino, operandos)) return;
+    Directorio* fuenteDirectorio = operandos.fuenteDirectorio;
+    Archivo* fuenteArchivo = operandos.fuenteArchivo;
+    Directorio* destino = operandos.destino;
+    const char* nombre = operandos.nombre;
+    if (fuenteDirectorio && !recursivo) {
+        salida() << "cp: -r no especificado; se omite el directorio '" << rutaOrigen << "'" << endl;
+        return;
+    }
+    uint64_t bytes = fuenteDirectorio ? fuenteDirectorio->bytesSubarbol : longitudContenido(fuenteArchivo);
+    if (Directorio* excedida = cuotaExcedida(destino, bytes)) {
+        salida() << "cp: '" << rutaOrigen << "': se superaría la cuota de '" << excedida->nombre << "' ("
+                 << excedida->cuotaBytes << " bytes)" << endl;
+        return;
+    }
+
+    copiarEnDirectorio(destino, nombre, fuenteDirectorio, fuenteArchivo);
+    BufferBytes ruta = {nullptr, 0, 0};
+    construirRuta(destino, nombre, ruta);
+    salida() << "cp: '" << rutaOrigen << "' copiado en '" << ruta.datos << "'." << endl;
+    bufferLiberar(ruta);
+}
+
+// snapshot <nombre> [ruta]: copia O(1) del directorio (por defecto el actual) como su hermano
+// '<directorio>@<nombre>'. La raíz no tiene dónde guardarlo; para ella está cp -r.
+void comando_snapshot(Directorio* directorioActual, Directorio* raiz, const char* nombre, const char* ruta) {
+    Directorio* directorio = ruta ? navegarRuta(directorioActual, ruta, raiz) : directorioActual;
+    if (!directorio) {
+        salida() << "snapshot: '" << ruta << "': No existe el directorio" << endl;
+        return;
+    }
+    if (!directorio->padre) {
+        salida() << "snapshot: no se puede tomar un snapshot de '/': no tiene directorio padre" << endl;
+        return;
+    }
+    char nombreCopia[LONGITUD_MAX_RUTA];
+    if (!esNombreValido(nombre) ||
+        snprintf(nombreCopia, sizeof(nombreCopia), "%s@%s", directorio->nombre, nombre) >= (int)sizeof(nombreCopia)) {
+        salida() << "snapshot: '" << nombre << "': Nombre inválido." << endl;
+        return;
+    }
+    Directorio* padre = directorio->padre;
+    if (buscarArchivo(padre, nombreCopia) || buscarDirectorio(padre, nombreCopia)) {
+        salida() << "snapshot: '" << nombreCopia << "': El archivo ya existe" << endl;
+        return;
+    }
+    if (Directorio* excedida = cuotaExcedida(padre, directorio->bytesSubarbol)) {
+        salida() << "snapshot: '" << nombreCopia << "': se superaría la cuota de '" << excedida->nombre << "' ("
+                 << excedida->cuotaBytes << " bytes)" << endl;
+        return;
+    }
+
+    copiarEnDirectorio(padre, nombreCopia, directorio, nullptr);
+    BufferBytes rutaCopia = {nullptr, 0, 0};
+    construirRuta(padre, nombreCopia, rutaCopia);
+    salida() << "snapshot: '" << rutaCopia.datos << "' creado (" << directorio->archivosSubarbol << " archivos, "
+             << directorio->directoriosSubarbol << " directorios, " << directorio->bytesSubarbol << " bytes)." << endl;
+    bufferLiberar(rutaCopia);
+}
+
+// Mueve el directorio o archivo a 'destino' con el nombre 'nombre', que no debe existir, y lo
+// anota en el diario como MOVE. Solo se reenlaza el nodo y se corrigen los totales de los dos
+// caminos: el subárbol no se recorre, así que cuesta O(profundidad).
+void moverEntrada(Directorio* destino, const char* nombre, Directorio* fuenteDirectorio, Archivo* fuenteArchivo) {
+    Directorio* padre = fuenteDirectorio ? fuenteDirectorio->padre : fuenteArchivo->padre;
+    if (diario.activo) {
+        BufferBytes rutaDestino = {nullptr, 0, 0};
+        construirRuta(destino, nombre, rutaDestino);
+        registrarOperacion("MOVE", padre, fuenteDirectorio ? fuenteDirectorio->nombre : fuenteArchivo->nombre,
+                           rutaDestino.datos);
+        bufferLiberar(rutaDestino);
+    }
+    // Los dos lados cambian: las copias pendientes de sus ancestros dejarían de ver lo copiado
+    prepararModificacion(padre);
+    prepararModificacion(destino);
+    if (fuenteDirectorio) {
+        desenlazarDirectorio(padre, fuenteDirectorio);
+        propagarTotales(padre, -fuenteDirectorio->archivosSubarbol, -fuenteDirectorio->directoriosSubarbol - 1,
+                        -(int64_t)fuenteDirectorio->bytesSubarbol);
+        if (strcmp(fuenteDirectorio->nombre, nombre) != 0) {
+            liberarNombre(fuenteDirectorio->nombre);
+            fuenteDirectorio->nombre = copiarNombre(nombre);
+        }
+        enlazarDirectorio(destino, fuenteDirectorio);
+        propagarTotales(destino, fuenteDirectorio->archivosSubarbol, fuenteDirectorio->directoriosSubarbol + 1,
+                        (int64_t)fuenteDirectorio->bytesSubarbol);
+        invalidarRutasPositivas();
+        invalidarRutasNegativas();
+    } else {
+        int64_t bytes = (int64_t)longitudContenido(fuenteArchivo);
+        desenlazarArchivo(padre, fuenteArchivo);
+        propagarTotales(padre, -1, 0, -bytes);
+        if (strcmp(fuenteArchivo->nombre, nombre) != 0) {
+            liberarNombre(fuenteArchivo->nombre);
+            fuenteArchivo->nombre = copiarNombre(nombre);
+        }
+        enlazarArchivo(destino, fuenteArchivo);
+        propagarTotales(destino, 1, 0, bytes);
+    }
+}
+
+// mv <origen> <destino>: mueve entre directorios cualesquiera sin copiar nada. La cuota solo
+// se comprueba en los ancestros del destino que no contienen ya al origen.
+void comando_mv(Directorio* directorioActual, Directorio* raiz, const char* rutaOrigen, const char* rutaDestino) {
+    OperandosTraslado operandos;
+    if (!resolverTraslado("mv", directorioActual, raiz, rutaOrigen, rutaDestino, operandos)) return;
+    Directorio* padre = operandos.fuenteDirectorio ? operandos.fuenteDirectorio->padre : operandos.fuenteArchivo->padre;
+    uint64_t bytes = operandos.fuenteDirectorio ? operandos.fuenteDirectorio->bytesSubarbol
+                                                : longitudContenido(operandos.fuenteArchivo);
+    for (Directorio* d = operandos.destino; d && bytes > 0; d = d->padre) {
+        bool contieneOrigen = false;
+        for (Directorio* a = padre; a && !contieneOrigen; a = a->padre) contieneOrigen = a == d;
+        if (contieneOrigen) break;
+        if (d->cuotaBytes && d->bytesSubarbol + bytes > d->cuotaBytes) {
+            salida() << "mv: '" << rutaOrigen << "': se superaría la cuota de '" << d->nombre << "' ("
+                     << d->cuotaBytes << " bytes)" << endl;
+            return;
+        }
+    }
+
+    moverEntrada(operandos.destino, operandos.nombre, operandos.fuenteDirectorio, operandos.fuenteArchivo);
+    BufferBytes ruta = {nullptr, 0, 0};
+    construirRuta(operandos.destino, operandos.nombre, ruta);
+    salida() << "mv: '" << rutaOrigen << "' movido a '" << ruta.datos << "'." << endl;
+    bufferLiberar(ruta);
+}
+
+// --- Carga Inicial del Sistema de Archivos ---
+// El snapshot se lee en bloques de TAM_BUFFER_CARGA bytes y cada línea se procesa en el
+// mismo buffer, sin copiarla. guardarSistemaArchivos escribe en profundidad, así que las
+// líneas consecutivas casi siempre comparten padre: se guarda un cursor con el último
+// padre resuelto y solo se recurre a navegarRuta cuando la línea sale de su subárbol.
+
+// Último directorio padre resuelto durante la carga y su ruta ("" para la raíz)
+// Contenido compartido leído de una línea BLOB; la carga tiene una referencia hasta el final
+struct BlobCarga {
+    uint64_t id;
+    char* contenido;    // nullptr = hueco libre
+};
+
+struct CursorCarga {
+    char* ruta;
+    size_t longitud;
+    size_t capacidad;
+    Directorio* directorio;
+    BlobCarga* blobs;       // Direccionamiento abierto por id
+    size_t capacidadBlobs;
+    size_t cantidadBlobs;
+    OrigenPerezoso* origen; // Solo con --lazy
+    uint64_t desplazamientoLinea;   // Posición en el archivo de la línea en proceso
+    bool escapado;          // Se leyó CABECERA_FORMATO_TEXTO: hay que desescapar los contenidos
+};
+
+void cargaRegistrarBlob(CursorCarga& cursor, uint64_t id, char* contenido) {
+    if ((cursor.cantidadBlobs + 1) * 2 > cursor.capacidadBlobs) {
+        BlobCarga* anteriores = cursor.blobs;
+        size_t capacidadAnterior = cursor.capacidadBlobs;
+        cursor.capacidadBlobs = capacidadAnterior ? capacidadAnterior * 2 : 256;
+        cursor.blobs = new BlobCarga[cursor.capacidadBlobs]();
+        cursor.cantidadBlobs = 0;
+        for (size_t i = 0; i < capacidadAnterior; i++) {
+            if (anteriores[i].contenido) cargaRegistrarBlob(cursor, anteriores[i].id, anteriores[i].contenido);
+        }
+        delete[] anteriores;
+    }
+    size_t mascara = cursor.capacidadBlobs - 1;
+    size_t i = (size_t)(id * 0x9E3779B97F4A7C15ull) & mascara;
+    while (cursor.blobs[i].contenido) i = (i + 1) & mascara;
+    cursor.blobs[i] = {id, contenido};
+    cursor.cantidadBlobs++;
+}
+
+char* cargaBuscarBlob(const CursorCarga& cursor, uint64_t id) {
+    if (cursor.capacidadBlobs == 0) return nullptr;
+    size_t mascara = cursor.capacidadBlobs - 1;
+    for (size_t i = (size_t)(id * 0x9E3779B97F4A7C15ull) & mascara; cursor.blobs[i].contenido; i = (i + 1) & mascara) {
+        if (cursor.blobs[i].id == id) return cursor.blobs[i].contenido;
+    }
+    return nullptr;
+}
+
+// Recorre los componentes de ruta[0, longitud) desde 'inicio' sin límite de longitud
+Directorio* recorrerComponentes(Directorio* inicio, char* ruta, size_t longitud) {
+    Directorio* actual = inicio;
+    size_t i = 0;
+    while (actual && i < longitud) {
+        while (i < longitud && ruta[i] == '/') i++;
+        size_t inicioNombre = i;
+        while (i < longitud && ruta[i] != '/') i++;
+        if (i == inicioNombre) break;
+
+        char guardado = ruta[i];
+        ruta[i] = '\0';
+        if (strcmp(ruta + inicioNombre, "..") == 0) {
+            if (actual->padre) actual = actual->padre;
+        } else if (strcmp(ruta + inicioNombre, ".") != 0) {
+            actual = buscarDirectorio(actual, ruta + inicioNombre);
+        }
+        ruta[i] = guardado;
+    }
+    return actual;
+}
+
+// Resuelve el directorio padre de una línea, aprovechando el cursor cuando es posible
+Directorio* resolverPadreCarga(Directorio* raiz, CursorCarga& cursor, char* rutaPadre, size_t longitud) {
+    if (cursor.directorio && longitud == cursor.longitud && memcmp(rutaPadre, cursor.ruta, longitud) == 0) {
+        return cursor.directorio;
+    }
+
+    Directorio* padre;
+    if (cursor.directorio && longitud > cursor.longitud && rutaPadre[cursor.longitud] == '/' &&
+        memcmp(rutaPadre, cursor.ruta, cursor.longitud) == 0) {
+        // Descendiente del cursor: solo se recorren los componentes que faltan
+        padre = recorrerComponentes(cursor.directorio, rutaPadre + cursor.longitud, longitud - cursor.longitud);
+    } else if (longitud < (size_t)LONGITUD_MAX_RUTA) {
+        char guardado = rutaPadre[longitud];
+        rutaPadre[longitud] = '\0';
+        padre = navegarRuta(raiz, longitud == 0 ? "/" : rutaPadre, raiz);
+        rutaPadre[longitud] = guardado;
+    } else {
+        padre = recorrerComponentes(raiz, rutaPadre, longitud);
+    }
+
+    if (padre) {
+        if (longitud + 1 > cursor.capacidad) {
+            delete[] cursor.ruta;
+            cursor.capacidad = (longitud + 1) * 2;
+            cursor.ruta = new char[cursor.capacidad];
+        }
+        memcpy(cursor.ruta, rutaPadre, longitud);
+        cursor.longitud = longitud;
+        cursor.directorio = padre;
+    }
+    return padre;
+}
+
+// Procesa una línea "FORMATO <versión>", "DIR <ruta>", "FILE <ruta> [contenido escapado]",
+// "BLOB <id> <contenido escapado>" o "FILEREF <ruta> <id>" ya terminada en '\0'
+void procesarLineaCarga(char* linea, size_t longitud, Directorio* raiz, CursorCarga& cursor) {
+    if (longitud > 0 && linea[longitud - 1] == '\r') linea[--longitud] = '\0';
+    if (longitud == 0) return;
+
+    char* comando = linea;
+    char* ruta = comando;
+    while (*ruta && *ruta != ' ' && *ruta != '\t') ruta++;
+    if (*ruta) *ruta++ = '\0';
+    while (*ruta == ' ' || *ruta == '\t') ruta++;
+    char* finRuta = ruta;
+    while (*finRuta && *finRuta != ' ' && *finRuta != '\t') finRuta++;
+    if (finRuta == ruta) {
+        cerr << "Advertencia: Línea mal formada en el archivo de configuración: " << comando << endl;
+        return;
+    }
+    char* contenido = finRuta;
+    if (*contenido) *contenido++ = '\0';
+    while (*contenido == ' ') contenido++; // Ignora espacios en blanco
+
+    if (strcmp(comando, "FORMATO") == 0) {
+        int version = atoi(ruta);
+        if (version > VERSION_FORMATO_TEXTO) {
+            cerr << "Advertencia: Formato de snapshot " << version << " más nuevo que el soportado ("
+                 << VERSION_FORMATO_TEXTO << ")" << endl;
+        }
+        cursor.escapado = version >= 2;
+        if (cursor.origen) cursor.origen->escapado = cursor.escapado;
+        return;
+    }
+
+    if (strcmp(comando, "BLOB") == 0) {
+        char* finId;
+        uint64_t id = strtoull(ruta, &finId, 16);
+        if (*finId) {
+            cerr << "Advertencia: Identificador de BLOB inválido: " << ruta << endl;
+            return;
+        }
+        if (cursor.escapado && strchr(contenido, '\\')) desescaparContenido(contenido);
+        cargaRegistrarBlob(cursor, id, internarContenido(contenido, strlen(contenido)));
+        return;
+    }
+
+    bool esDirectorio = strcmp(comando, "DIR") == 0;
+    bool esReferencia = strcmp(comando, "FILEREF") == 0;
+    if (!esDirectorio && !esReferencia && strcmp(comando, "FILE") != 0) {
+        cerr << "Advertencia: Comando desconocido en el archivo de configuración: " << comando << endl;
+        return;
+    }
+
+    char* ultimaBarra = strrchr(ruta, '/');
+    if (ultimaBarra == nullptr) {
+        cerr << "Advertencia: Formato de ruta " << comando << " inválido: " << ruta << endl;
+        return;
+    }
+    char* nombre = ultimaBarra + 1;
+    if (*nombre == '\0') {
+        if (ultimaBarra != ruta) {
+            cerr << "Advertencia: Formato de ruta " << comando << " inválido: " << ruta << endl;
+        }
+        return; // "DIR /" describe la raíz, que ya existe
+    }
+
+    Directorio* padre = resolverPadreCarga(raiz, cursor, ruta, ultimaBarra - ruta);
+    if (!padre) {
+        *ultimaBarra = '\0';
+        cerr << "Error: No se encontró el directorio padre para " << comando << ": " << (*ruta ? ruta : "/") << endl;
+        return;
+    }
+
+    if (buscarDirectorio(padre, nombre) || buscarArchivo(padre, nombre)) {
+        return; // Ya existe, se omite
+    }
+    size_t bytesEnDisco = cursor.origen ? strlen(contenido) : 0;
+    if (esDirectorio) {
+        anadirDirectorioALista(padre, crearDirectorio(nombre));
+    } else if (esReferencia) {
+        char* compartido = cargaBuscarBlob(cursor, strtoull(contenido, nullptr, 16));
+        if (!compartido) {
+            cerr << "Advertencia: Contenido compartido desconocido para " << ruta << ": " << contenido << endl;
+        }
+        anadirArchivo(padre, inicializarArchivo(reservarArchivo(), copiarNombre(nombre), compartirContenido(compartido)));
+    } else if (bytesEnDisco >= UMBRAL_CONTENIDO_PEREZOSO) {
+        uint64_t desplazamiento = cursor.desplazamientoLinea + (contenido - linea);
+        char* perezoso = crearContenidoPerezoso(cursor.origen, desplazamiento, bytesEnDisco,
+                                                cursor.escapado && memchr(contenido, '\\', bytesEnDisco) ?
+                                                    longitudDesescapada(contenido) : bytesEnDisco);
+        anadirArchivo(padre, inicializarArchivo(reservarArchivo(), copiarNombre(nombre), perezoso));
+    } else {
+        if (cursor.escapado && strchr(contenido, '\\')) desescaparContenido(contenido);
+        anadirArchivo(padre, crearArchivo(nombre, *contenido ? contenido : nullptr));
+    }
+}
+
+Directorio* cargarSistemaArchivos(const char* nombreArchivo, Directorio*& raiz) {
+    ifstream archivo(nombreArchivo, ios::binary);
+    if (!archivo.is_open()) {
+        cerr << "Error: No se pudo abrir el archivo de configuración del sistema de archivos: " << nombreArchivo << endl;
+        return nullptr;
+    }
+
+    if (!raiz) {
+        raiz = crearDirectorio("/");
+        if (!raiz) {
+            cerr << "Error: No se pudo crear el directorio raíz." << endl;
+            return nullptr;
+        }
+    }
+
+    CursorCarga cursor = {nullptr, 0, 0, nullptr, nullptr, 0, 0, nullptr, 0, false};
+#ifndef _WIN32
+    if (cargaPerezosa) {
+        int descriptor = open(nombreArchivo, O_RDONLY);
+        if (descriptor >= 0) cursor.origen = new OrigenPerezoso{descriptor, 1, false}; // La carga también lo usa
+    }
+#endif
+    size_t capacidad = TAM_BUFFER_CARGA;
+    char* buffer = new char[capacidad + 1];
+    size_t inicio = 0, fin = 0;
+    uint64_t desplazamientoBuffer = 0; // Posición en el archivo de buffer[0]
+    bool finArchivo = false;
+
+    while (true) {
+        char* salto = (char*)memchr(buffer + inicio, '\n', fin - inicio);
+        if (salto) {
+            *salto = '\0';
+            cursor.desplazamientoLinea = desplazamientoBuffer + inicio;
+            procesarLineaCarga(buffer + inicio, salto - (buffer + inicio), raiz, cursor);
+            inicio = salto + 1 - buffer;
+            continue;
+        }
+        if (finArchivo) {
+            if (inicio < fin) { // Última línea sin salto final
+                buffer[fin] = '\0';
+                cursor.desplazamientoLinea = desplazamientoBuffer + inicio;
+                procesarLineaCarga(buffer + inicio, fin - inicio, raiz, cursor);
+            }
+            break;
+        }
+
+        // Mover la línea incompleta al principio y rellenar el buffer
+        size_t pendiente = fin - inicio;
+        if (pendiente == capacidad) { // Línea más larga que el buffer: se agranda
+            char* mayor = new char[capacidad * 2 + 1];
+            memcpy(mayor, buffer + inicio, pendiente);
+            delete[] buffer;
+            buffer = mayor;
+            capacidad *= 2;
+        } else {
+            memmove(buffer, buffer + inicio, pendiente);
+        }
+        desplazamientoBuffer += inicio;
+        inicio = 0;
+        fin = pendiente;
+        archivo.read(buffer + fin, capacidad - fin);
+        size_t leidos = (size_t)archivo.gcount();
+        fin += leidos;
+        if (leidos == 0) finArchivo = true;
+    }
+
+    delete[] buffer;
+    delete[] cursor.ruta;
+    for (size_t i = 0; i < cursor.capacidadBlobs; i++) {
+        liberarContenido(cursor.blobs[i].contenido);
+    }
+    delete[] cursor.blobs;
+    if (cursor.origen) soltarOrigenPerezoso(cursor.origen);
+    archivo.close();
+    salida() << "Sistema de archivos inicial cargado desde '" << nombreArchivo << "'." << endl;
+    return raiz;
+}
+
+// --- Pool de trabajo con robo de tareas (work stealing) ---
+// Cada hilo tiene su propia cola doble: toma tareas del frente de la suya y, cuando se
+// queda sin trabajo, roba del final de la de otro hilo. Una tarea puede agregar más
+// tareas; el pool termina cuando no queda ninguna pendiente ni en ejecución.
+
+struct TareaPool {
+    void (*ejecutar)(void* datos, int hilo);
+    void* datos;
+};
+
+// Cola doble circular protegida por su propio cerrojo
+struct ColaTrabajo {
+    mutex cerrojo;
+    TareaPool* tareas = nullptr;
+    size_t capacidad = 0;   // Potencia de 2
+    size_t cabeza = 0;
+    size_t cantidad = 0;
+};
+
+struct PoolTrabajo {
+    int cantidadHilos;
+    ColaTrabajo* colas;
+    atomic<long> pendientes;    // Encoladas o en ejecución
+};
+
+void colaAgregarAlFinal(ColaTrabajo& cola, const TareaPool& tarea) {
+    lock_guard<mutex> bloqueo(cola.cerrojo);
+    if (cola.cantidad == cola.capacidad) {
+        size_t capacidad = cola.capacidad ? cola.capacidad * 2 : 64;
+        TareaPool* tareas = new TareaPool[capacidad];
+        for (size_t i = 0; i < cola.cantidad; i++) {
+            tareas[i] = cola.tareas[(cola.cabeza + i) & (cola.capacidad - 1)];
+        }
+        delete[] cola.tareas;
+        cola.tareas = tareas;
+        cola.capacidad = capacidad;
+        cola.cabeza = 0;
+    }
+    cola.tareas[(cola.cabeza + cola.cantidad) & (cola.capacidad - 1)] = tarea;
+    cola.cantidad++;
+}
+
+bool colaTomar(ColaTrabajo& cola, TareaPool& tarea, bool delFrente) {
+    lock_guard<mutex> bloqueo(cola.cerrojo);
+    if (cola.cantidad == 0) return false;
+    if (delFrente) {
+        tarea = cola.tareas[cola.cabeza];
+        cola.cabeza = (cola.cabeza + 1) & (cola.capacidad - 1);
+    } else {
+        tarea = cola.tareas[(cola.cabeza + cola.cantidad - 1) & (cola.capacidad - 1)];
+    }
+    cola.cantidad--;
+    return true;
+}
+
+void poolIniciar(PoolTrabajo& pool, int hilos) {
+    pool.cantidadHilos = hilos;
+    pool.colas = new ColaTrabajo[hilos];
+    pool.pendientes = 0;
+}
+
+void poolLiberar(PoolTrabajo& pool) {
+    for (int i = 0; i < pool.cantidadHilos; i++) {
+        delete[] pool.colas[i].tareas;
+    }
+    delete[] pool.colas;
+    pool.colas = nullptr;
+}
+
+void poolAgregarTarea(PoolTrabajo& pool, int hilo, void (*ejecutar)(void*, int), void* datos) {
+    pool.pendientes++;
+    colaAgregarAlFinal(pool.colas[hilo % pool.cantidadHilos], {ejecutar, datos});
+}
+
+void trabajadorPool(PoolTrabajo* pool, int hilo) {
+    while (pool->pendientes > 0) {
+        TareaPool tarea;
+        bool tomada = colaTomar(pool->colas[hilo], tarea, true);
+        for (int k = 1; !tomada && k < pool->cantidadHilos; k++) {
+            tomada = colaTomar(pool->colas[(hilo + k) % pool->cantidadHilos], tarea, false);
+        }
+        if (tomada) {
+            tarea.ejecutar(tarea.datos, hilo);
+            pool->pendientes--;
+        } else {
+            this_thread::yield();
+        }
+    }
+}
+
+// Ejecuta las tareas encoladas con cantidadHilos hilos y espera a que terminen todas
+void poolEjecutar(PoolTrabajo& pool) {
+    thread* hilos = new thread[pool.cantidadHilos];
+    for (int i = 0; i < pool.cantidadHilos; i++) {
+        hilos[i] = thread(trabajadorPool, &pool, i);
+    }
+    for (int i = 0; i < pool.cantidadHilos; i++) {
+        hilos[i].join();
+    }
+    delete[] hilos;
+}
+
+// --- Escritor atómico de snapshots ---
+// Toda escritura de un snapshot pasa por aquí: los datos se acumulan en un buffer grande en
+// memoria (los bloques mayores que el buffer van directo al archivo), se escriben a
+// '<nombre>.tmp', se fuerzan a disco con fsync y solo entonces el temporal reemplaza al
+// original con rename. Una caída a mitad de guardado deja intacto el snapshot anterior.
+
+const size_t TAM_BUFFER_ESCRITOR = 4 << 20;
+
+struct EscritorAtomico {
+    FILE* archivo;
+    char rutaFinal[LONGITUD_MAX_RUTA];
+    char rutaTemporal[LONGITUD_MAX_RUTA];
+    char* buffer;
+    size_t usado;
+    bool error;
+};
+
+struct EstadisticasEscritor {
+    long guardados;
+    long vaciados;          // Llamadas a fwrite sobre el archivo
+    long long bytes;
+    double segundosEscritura;
+    double segundosFsync;
+};
+
+EstadisticasEscritor estadisticasEscritor = {0, 0, 0, 0, 0};
+
+bool escritorAbrir(EscritorAtomico& escritor, const char* nombreArchivo) {
+    snprintf(escritor.rutaFinal, sizeof(escritor.rutaFinal), "%s", nombreArchivo);
+    snprintf(escritor.rutaTemporal, sizeof(escritor.rutaTemporal), "%s.tmp", nombreArchivo);
+    escritor.archivo = fopen(escritor.rutaTemporal, "wb");
+    escritor.buffer = nullptr;
+    escritor.usado = 0;
+    escritor.error = escritor.archivo == nullptr;
+    if (escritor.archivo) {
+        setvbuf(escritor.archivo, nullptr, _IONBF, 0); // El buffer es el nuestro
+        escritor.buffer = new char[TAM_BUFFER_ESCRITOR];
+    }
+    return !escritor.error;
+}
+
+void escritorEscribirDirecto(EscritorAtomico& escritor, const char* datos, size_t longitud) {
+    if (escritor.error || longitud == 0) return;
+    auto inicio = chrono::steady_clock::now();
+    if (fwrite(datos, 1, longitud, escritor.archivo) != longitud) escritor.error = true;
+    estadisticasEscritor.segundosEscritura += chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+    estadisticasEscritor.vaciados++;
+    estadisticasEscritor.bytes += longitud;
+}
+
+void escritorVaciar(EscritorAtomico& escritor) {
+    escritorEscribirDirecto(escritor, escritor.buffer, escritor.usado);
+    escritor.usado = 0;
+}
+
+void escritorEscribir(EscritorAtomico& escritor, const char* datos, size_t longitud) {
+    if (longitud == 0) return;
+    if (escritor.usado + longitud > TAM_BUFFER_ESCRITOR) {
+        escritorVaciar(escritor);
+    }
+    if (longitud >= TAM_BUFFER_ESCRITOR) {
+        escritorEscribirDirecto(escritor, datos, longitud);
+    } else {
+        memcpy(escritor.buffer + escritor.usado, datos, longitud);
+        escritor.usado += longitud;
+    }
+}
+
+// Fuerza el temporal a disco y lo renombra sobre el original. Si algo falló el temporal se
+// descarta y el original queda como estaba.
+bool escritorConfirmar(EscritorAtomico& escritor) {
+    if (escritor.archivo) {
+        escritorVaciar(escritor);
+        auto inicio = chrono::steady_clock::now();
+        if (fflush(escritor.archivo) != 0) escritor.error = true;
+#ifndef _WIN32
+        if (!escritor.error && fsync(fileno(escritor.archivo)) != 0) escritor.error = true;
+#endif
+        estadisticasEscritor.segundosFsync += chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+        if (fclose(escritor.archivo) != 0) escritor.error = true;
+        escritor.archivo = nullptr;
+    }
+    delete[] escritor.buffer;
+    escritor.buffer = nullptr;
+    if (escritor.error) {
+        remove(escritor.rutaTemporal);
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(escritor.rutaFinal);
+#endif
+    if (rename(escritor.rutaTemporal, escritor.rutaFinal) != 0) {
+        remove(escritor.rutaTemporal);
+        return false;
+    }
+#ifndef _WIN32
+    // El rename solo es durable cuando el directorio que lo contiene llega a disco
+    char directorio[LONGITUD_MAX_RUTA];
+    snprintf(directorio, sizeof(directorio), "%s", escritor.rutaFinal);
+    char* ultimaBarra = strrchr(directorio, '/');
+    if (ultimaBarra == directorio) ultimaBarra[1] = '\0';
+    else if (ultimaBarra) *ultimaBarra = '\0';
+    else strcpy(directorio, ".");
+    int descriptor = open(directorio, O_RDONLY);
+    if (descriptor >= 0) {
+        fsync(descriptor);
+        close(descriptor);
+    }
+#endif
+    estadisticasEscritor.guardados++;
+    return true;
+}
+
+void imprimirEstadisticasEscritor() {
+    const EstadisticasEscritor& e = estadisticasEscritor;
+    salida() << "wstats: " << e.guardados << " guardados, " << e.bytes << " bytes en " << e.vaciados << " escrituras";
+    if (e.vaciados > 0) salida() << " (" << (e.bytes / e.vaciados) << " bytes/escritura)";
+    salida() << ", " << (e.segundosEscritura * 1000) << " ms escribiendo, " << (e.segundosFsync * 1000) << " ms en fsync" << endl;
+}
+
+// --- Guardado del snapshot de texto ---
+// El orden de salida es el de siempre: para cada directorio, primero las líneas DIR de sus
+// subdirectorios y las FILE de sus archivos, y después cada subdirectorio (del último al
+// primero) con todo su subárbol. El árbol se parte en unidades consecutivas de ese orden;
+// cada hilo formatea unidades en su propio buffer y el hilo principal las escribe en orden,
+// así la salida es idéntica byte a byte con cualquier cantidad de hilos.
+// La primera línea es CABECERA_FORMATO_TEXTO. Los contenidos compartidos por varios archivos
+// van a continuación en líneas BLOB, y esos archivos se escriben como "FILEREF <ruta> <id>".
+
+int hilosGuardado = 1; // Se ajusta con --threads N
+
+// Agrega las líneas DIR/FILE de los hijos directos de un directorio cuya ruta es ruta[0, longitud)
+void emitirBloque(Directorio* directorio, const char* ruta, size_t longitud, BufferBytes& salida) {
+    directorio = vistaDirectorio(directorio); // Una copia pendiente se guarda como su origen
+    for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+        bufferAgregar(salida, "DIR ", 4);
+        bufferAgregar(salida, ruta, longitud);
+        bufferAgregar(salida, "/", 1);
+        bufferAgregarTexto(salida, d->nombre);
+        bufferAgregar(salida, "\n", 1);
+    }
+    for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+        bool referencia = !a->piezas && esContenidoBlob(a->contenido) && blobDe(a->contenido)->compartidoEnTexto;
+        bufferAgregar(salida, referencia ? "FILEREF " : "FILE ", referencia ? 8 : 5);
+        bufferAgregar(salida, ruta, longitud);
+        bufferAgregar(salida, "/", 1);
+        bufferAgregarTexto(salida, a->nombre);
+        if (referencia) {
+            char identificador[24];
+            int largo = snprintf(identificador, sizeof(identificador), " %016llx", (unsigned long long)blobDe(a->contenido)->hash);
+            bufferAgregar(salida, identificador, largo);
+        } else if (!contenidoVacio(a)) {
+            bufferAgregar(salida, " ", 1);
+            const char* datos;
+            size_t longitud;
+            for (int i = 0; fragmentoContenido(a, i, datos, longitud, false); i++) {
+                bufferAgregarEscapado(salida, datos, longitud);
+            }
+        }
+        bufferAgregar(salida, "\n", 1);
+    }
+}
+
+// Recorrido iterativo (pila creciente, sin límite de profundidad ni de anchura) del
+// subárbol de un directorio. Si se pasa un archivo de salida, el buffer se vuelca cada
+// TAM_BUFFER_ESCRITURA bytes.
+void emitirSubarbol(Directorio* raizSubarbol, const char* rutaRaiz, size_t longitudRaiz, BufferBytes& salida, EscritorAtomico* escritor) {
+    struct Pendiente {
+        Directorio* directorio;
+        size_t longitudPadre;   // La ruta del padre es el prefijo vigente de 'ruta'
+    };
+    Pendiente* pila = new Pendiente[64];
+    size_t cantidad = 0, capacidad = 64;
+    BufferBytes ruta = {nullptr, 0, 0};
+    bufferAgregar(ruta, rutaRaiz, longitudRaiz);
+
+    emitirBloque(raizSubarbol, ruta.datos, ruta.longitud, salida);
+    for (Directorio* d = raizSubarbol->subdirectorios; d; d = d->siguienteDirectorio) {
+        if (cantidad == capacidad) {
+            Pendiente* mayor = new Pendiente[capacidad * 2];
+            memcpy(mayor, pila, cantidad * sizeof(Pendiente));
+            delete[] pila;
+            pila = mayor;
+            capacidad *= 2;
+        }
+        pila[cantidad++] = {d, longitudRaiz};
+    }
+
+    while (cantidad > 0) {
+        Pendiente actual = pila[--cantidad];
+        ruta.longitud = actual.longitudPadre;
+        bufferAgregar(ruta, "/", 1);
+        bufferAgregarTexto(ruta, actual.directorio->nombre);
+        size_t longitudActual = ruta.longitud;
+
+        emitirBloque(actual.directorio, ruta.datos, ruta.longitud, salida);
+        for (Directorio* d = vistaDirectorio(actual.directorio)->subdirectorios; d; d = d->siguienteDirectorio) {
+            if (cantidad == capacidad) {
+                Pendiente* mayor = new Pendiente[capacidad * 2];
+                memcpy(mayor, pila, cantidad * sizeof(Pendiente));
+                delete[] pila;
+                pila = mayor;
+                capacidad *= 2;
+            }
+            pila[cantidad++] = {d, longitudActual};
+        }
+
+        if (escritor && salida.longitud >= TAM_BUFFER_ESCRITURA) {
+            escritorEscribir(*escritor, salida.datos, salida.longitud);
+            salida.longitud = 0;
+        }
+    }
+    delete[] pila;
+    bufferLiberar(ruta);
+}
+
+// Una porción consecutiva de la salida: solo el bloque de un directorio o su subárbol completo
+struct UnidadGuardado {
+    Directorio* directorio;
+    char* ruta;
+    size_t longitudRuta;
+    bool soloBloque;
+    BufferBytes salida;
+    bool terminada;
+};
+
+struct TrabajoGuardado {
+    UnidadGuardado* unidades;
+    mutex cerrojo;
+    condition_variable unidadTerminada;
+};
+
+struct TareaUnidad {
+    TrabajoGuardado* trabajo;
+    size_t indice;
+};
+
+void formatearUnidad(void* datos, int) {
+    TareaUnidad* tarea = (TareaUnidad*)datos;
+    UnidadGuardado& unidad = tarea->trabajo->unidades[tarea->indice];
+    if (unidad.soloBloque) {
+        emitirBloque(unidad.directorio, unidad.ruta, unidad.longitudRuta, unidad.salida);
+    } else {
+        emitirSubarbol(unidad.directorio, unidad.ruta, unidad.longitudRuta, unidad.salida, nullptr);
+    }
+    lock_guard<mutex> bloqueo(tarea->trabajo->cerrojo);
+    unidad.terminada = true;
+    tarea->trabajo->unidadTerminada.notify_all();
+}
+
+UnidadGuardado nuevaUnidad(Directorio* directorio, const char* rutaPadre, size_t longitudPadre, bool soloBloque) {
+    UnidadGuardado unidad = {directorio, nullptr, 0, soloBloque, {nullptr, 0, 0}, false};
+    size_t longitudNombre = directorio->padre ? strlen(directorio->nombre) + 1 : 0;
+    unidad.longitudRuta = longitudPadre + longitudNombre;
+    unidad.ruta = new char[unidad.longitudRuta + 1];
+    memcpy(unidad.ruta, rutaPadre, longitudPadre);
+    if (longitudNombre) {
+        unidad.ruta[longitudPadre] = '/';
+        memcpy(unidad.ruta + longitudPadre + 1, directorio->nombre, longitudNombre - 1);
+    }
+    unidad.ruta[unidad.longitudRuta] = '\0';
+    return unidad;
+}
+
+// Parte el árbol en al menos 'objetivo' unidades (si hay suficientes directorios) expandiendo
+// por niveles: un subárbol se reemplaza por su bloque seguido de los subárboles de sus hijos
+UnidadGuardado* planificarUnidades(Directorio* raiz, size_t objetivo, size_t& cantidad) {
+    UnidadGuardado* unidades = new UnidadGuardado[1];
+    unidades[0] = nuevaUnidad(raiz, "", 0, false);
+    cantidad = 1;
+
+    bool expandida = true;
+    while (cantidad < objetivo && expandida) {
+        expandida = false;
+        size_t nuevaCantidad = 0;
+        for (size_t i = 0; i < cantidad; i++) {
+            nuevaCantidad++;
+            if (!unidades[i].soloBloque) nuevaCantidad += vistaDirectorio(unidades[i].directorio)->cantidadHijos;
+        }
+        UnidadGuardado* nuevas = new UnidadGuardado[nuevaCantidad];
+        size_t n = 0;
+        for (size_t i = 0; i < cantidad; i++) {
+            UnidadGuardado& unidad = unidades[i];
+            Directorio* vista = vistaDirectorio(unidad.directorio);
+            if (unidad.soloBloque || !vista->subdirectorios) {
+                nuevas[n++] = unidad;
+                continue;
+            }
+            expandida = true;
+            unidad.soloBloque = true;
+            nuevas[n++] = unidad;
+            size_t primero = n;
+            for (Directorio* d = vista->subdirectorios; d; d = d->siguienteDirectorio) {
+                nuevas[n++] = nuevaUnidad(d, unidad.ruta, unidad.longitudRuta, false);
+            }
+            for (size_t a = primero, b = n - 1; a < b; a++, b--) { // Los hijos van del último al primero
+                UnidadGuardado temporal = nuevas[a];
+                nuevas[a] = nuevas[b];
+                nuevas[b] = temporal;
+            }
+        }
+        delete[] unidades;
+        unidades = nuevas;
+        cantidad = n;
+    }
+    return unidades;
+}
+
+// Formatea el árbol en paralelo y escribe las unidades en orden a medida que se completan
+void guardarEnParalelo(Directorio* raiz, EscritorAtomico& escritor, int hilos) {
+    size_t cantidad;
+    TrabajoGuardado trabajo;
+    trabajo.unidades = planificarUnidades(raiz, (size_t)hilos * UNIDADES_POR_HILO, cantidad);
+
+    TareaUnidad* tareas = new TareaUnidad[cantidad];
+    PoolTrabajo pool;
+    poolIniciar(pool, hilos);
+    for (size_t i = 0; i < cantidad; i++) {
+        tareas[i] = {&trabajo, i};
+        poolAgregarTarea(pool, (int)(i % hilos), formatearUnidad, &tareas[i]);
+    }
+    thread coordinador(poolEjecutar, ref(pool));
+
+    for (size_t i = 0; i < cantidad; i++) {
+        UnidadGuardado& unidad = trabajo.unidades[i];
+        {
+            unique_lock<mutex> bloqueo(trabajo.cerrojo);
+            trabajo.unidadTerminada.wait(bloqueo, [&unidad] { return unidad.terminada; });
+        }
+        escritorEscribir(escritor, unidad.salida.datos, unidad.salida.longitud);
+        bufferLiberar(unidad.salida);
+        delete[] unidad.ruta;
+    }
+    coordinador.join();
+    poolLiberar(pool);
+    delete[] tareas;
+    delete[] trabajo.unidades;
+}
+
+// Función para guardar el sistema de archivos a un archivo de texto. Devuelve false si el
+// snapshot no llegó a reemplazar al anterior.
+bool guardarSistemaArchivos(const char* nombreArchivo, Directorio* raiz, int hilos = hilosGuardado) {
+    // Nunca se trunca el original en el sitio: además de no dejar un snapshot a medias,
+    // un snapshot binario mapeado invalidaría los nombres y contenidos que apuntan a él
+    EscritorAtomico escritor;
+    if (!escritorAbrir(escritor, nombreArchivo)) {
+        cerr << "Error: No se pudo abrir el archivo para guardar el sistema de archivos: " << nombreArchivo << endl;
+        return false;
+    }
+
+    // Primero los contenidos compartidos, una vez cada uno: "BLOB <id> <contenido escapado>"
+    marcarBlobsCompartidos();
+    BufferBytes blobs = {nullptr, 0, 0};
+    bufferAgregarTexto(blobs, CABECERA_FORMATO_TEXTO);
+    for (size_t i = 0; i < almacen.capacidad; i++) {
+        BlobContenido* blob = almacen.ranuras[i];
+        if (!blob || !blob->compartidoEnTexto) continue;
+        char cabecera[32];
+        int largo = snprintf(cabecera, sizeof(cabecera), "BLOB %016llx ", (unsigned long long)blob->hash);
+        bufferAgregar(blobs, cabecera, largo);
+        size_t largoTexto;
+        const char* texto = textoContenido(datosBlob(blob), largoTexto, false);
+        bufferAgregarEscapado(blobs, texto, largoTexto);
+        bufferAgregar(blobs, "\n", 1);
+        if (blobs.longitud >= TAM_BUFFER_ESCRITURA) {
+            escritorEscribir(escritor, blobs.datos, blobs.longitud);
+            blobs.longitud = 0;
+        }
+    }
+    escritorEscribir(escritor, blobs.datos, blobs.longitud);
+    bufferLiberar(blobs);
+
+    if (hilos > 1) {
+        guardarEnParalelo(raiz, escritor, hilos);
+    } else {
+        BufferBytes salida = {nullptr, 0, 0};
+        emitirSubarbol(raiz, "", 0, salida, &escritor);
+        escritorEscribir(escritor, salida.datos, salida.longitud);
+        bufferLiberar(salida);
+    }
+
+    if (!escritorConfirmar(escritor)) {
+        cerr << "Error: No se pudo guardar el sistema de archivos en: " << nombreArchivo << endl;
+        return false;
+    }
+    salida() << "Sistema de archivos guardado en '" << nombreArchivo << "'." << endl;
+    return true;
+}
+
+
+// --- Snapshot binario ---
+// Formato (versión 1, enteros en el orden de bytes de la máquina):
+//   CabeceraSnapshot
+//   tabla de nodos: cantidadNodos x NodoSnapshot, en anchura; el nodo 0 es la raíz y cada
+//                   nodo aparece después de su padre, en el orden de las listas de hijos
+//   tabla de cadenas: nombres terminados en '\0'
+//   contenidos: contenidos terminados en '\0'; los compartidos por varios archivos, una vez
+// El archivo se mapea con mmap y los nodos apuntan directamente a sus cadenas.
+
+const char MAGIA_SNAPSHOT[8] = {'B', 'A', 'L', 'A', 'T', 'R', 'O', 'B'};
+const uint32_t VERSION_SNAPSHOT = 1;
+const uint64_t SIN_CONTENIDO = ~(uint64_t)0;
+
+struct CabeceraSnapshot {
+    char magia[8];
+    uint32_t version;
+    uint32_t reservado;
+    uint64_t cantidadNodos;
+    uint64_t desplazamientoCadenas;     // Desde el inicio del archivo
+    uint64_t bytesCadenas;
+    uint64_t desplazamientoContenidos;
+    uint64_t bytesContenidos;
+};
+
+struct NodoSnapshot {
+    uint32_t padre;         // Índice del padre (la raíz se apunta a sí misma)
+    uint32_t esArchivo;
+    uint64_t nombre;        // Desplazamiento en la tabla de cadenas
+    uint64_t contenido;     // Desplazamiento en los contenidos, o SIN_CONTENIDO
+};
+
+// Formato con el que se guardan 'save' y 'exit'; cambia al cargar un binario o con save --binary/--text
+bool guardarEnBinario = false;
+
+// Escribe un archivo completo de forma segura: primero a <nombre>.tmp y luego se renombra,
+// así un snapshot binario mapeado sigue siendo válido mientras se reemplaza
+bool reemplazarArchivo(const char* nombreArchivo, const BufferBytes* partes, int cantidadPartes) {
+    EscritorAtomico escritor;
+    if (!escritorAbrir(escritor, nombreArchivo)) return false;
+    for (int i = 0; i < cantidadPartes; i++) {
+        escritorEscribir(escritor, partes[i].datos, partes[i].longitud);
+    }
+    return escritorConfirmar(escritor);
+}
+
+// Contenidos ya escritos en el snapshot binario, por dirección: los archivos que comparten un
+// blob del almacén (o un contenido del snapshot mapeado) comparten también desplazamiento
+struct ContenidoEscrito {
+    const char* contenido;      // nullptr = hueco libre
+    uint64_t desplazamiento;
+};
+
+struct TablaContenidosEscritos {
+    ContenidoEscrito* entradas;
+    size_t capacidad;           // Potencia de 2
+    size_t cantidad;
+};
+
+void colocarContenidoEscrito(TablaContenidosEscritos& tabla, const ContenidoEscrito& entrada) {
+    size_t mascara = tabla.capacidad - 1;
+    size_t i = (size_t)(((uintptr_t)entrada.contenido >> 3) * 0x9E3779B97F4A7C15ull) & mascara;
+    while (tabla.entradas[i].contenido) i = (i + 1) & mascara;
+    tabla.entradas[i] = entrada;
+}
+
+// Devuelve dónde quedó 'contenido' en la sección de contenidos, agregándolo la primera vez
+uint64_t desplazamientoContenido(TablaContenidosEscritos& tabla, const char* contenido, BufferBytes& contenidos) {
+    if (tabla.capacidad > 0) {
+        size_t mascara = tabla.capacidad - 1;
+        size_t i = (size_t)(((uintptr_t)contenido >> 3) * 0x9E3779B97F4A7C15ull) & mascara;
+        for (; tabla.entradas[i].contenido; i = (i + 1) & mascara) {
+            if (tabla.entradas[i].contenido == contenido) return tabla.entradas[i].desplazamiento;
+        }
+    }
+    if ((tabla.cantidad + 1) * 2 > tabla.capacidad) {
+        ContenidoEscrito* anteriores = tabla.entradas;
+        size_t capacidadAnterior = tabla.capacidad;
+        tabla.capacidad = capacidadAnterior ? capacidadAnterior * 2 : 1024;
+        tabla.entradas = new ContenidoEscrito[tabla.capacidad]();
+        for (size_t i = 0; i < capacidadAnterior; i++) {
+            if (anteriores[i].contenido) colocarContenidoEscrito(tabla, anteriores[i]);
+        }
+        delete[] anteriores;
+    }
+    ContenidoEscrito entrada = {contenido, contenidos.longitud};
+    colocarContenidoEscrito(tabla, entrada);
+    tabla.cantidad++;
+    size_t longitud;
+    const char* texto = textoContenido(contenido, longitud, false);
+    bufferAgregar(contenidos, texto, longitud);
+    bufferAgregar(contenidos, "", 1);
+    return entrada.desplazamiento;
+}
+
+bool guardarSnapshotBinario(const char* nombreArchivo, Directorio* raiz) {
+    // La propia tabla de nodos hace de cola del recorrido en anchura
+    struct NodoPendiente {
+        Directorio* directorio;
+        Archivo* archivo;
+    };
+    NodoPendiente* pendientes = new NodoPendiente[1024];
+    size_t cantidad = 0, capacidad = 1024;
+
+    BufferBytes nodos = {nullptr, 0, 0}, cadenas = {nullptr, 0, 0}, contenidos = {nullptr, 0, 0};
+    TablaContenidosEscritos escritos = {nullptr, 0, 0};
+    pendientes[cantidad++] = {raiz, nullptr};
+    NodoSnapshot nodoRaiz = {0, 0, 0, SIN_CONTENIDO};
+    bufferAgregar(nodos, &nodoRaiz, sizeof(nodoRaiz));
+    bufferAgregar(cadenas, "/", 2);
+
+    for (size_t i = 0; i < cantidad; i++) {
+        Directorio* directorio = pendientes[i].directorio;
+        if (!directorio) continue;
+        directorio = vistaDirectorio(directorio); // Una copia pendiente se guarda como su origen
+        size_t hijos = directorio->cantidadHijos;
+        if (cantidad + hijos > capacidad) {
+            while (cantidad + hijos > capacidad) capacidad *= 2;
+            NodoPendiente* mayor = new NodoPendiente[capacidad];
+            memcpy(mayor, pendientes, cantidad * sizeof(NodoPendiente));
+            delete[] pendientes;
+            pendientes = mayor;
+        }
+
+        for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+            NodoSnapshot nodo = {(uint32_t)i, 0, cadenas.longitud, SIN_CONTENIDO};
+            bufferAgregar(cadenas, d->nombre, strlen(d->nombre) + 1);
+            bufferAgregar(nodos, &nodo, sizeof(nodo));
+            pendientes[cantidad++] = {d, nullptr};
+        }
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+            NodoSnapshot nodo = {(uint32_t)i, 1, cadenas.longitud, SIN_CONTENIDO};
+            bufferAgregar(cadenas, a->nombre, strlen(a->nombre) + 1);
+            if (!contenidoVacio(a) && !a->piezas) {
+                nodo.contenido = desplazamientoContenido(escritos, a->contenido, contenidos);
+            } else if (!contenidoVacio(a)) {
+                nodo.contenido = contenidos.longitud;
+                const char* datos;
+                size_t longitud;
+                for (int k = 0; fragmentoContenido(a, k, datos, longitud, false); k++) {
+                    bufferAgregar(contenidos, datos, longitud);
+                }
+                bufferAgregar(contenidos, "", 1);
+            }
+            bufferAgregar(nodos, &nodo, sizeof(nodo));
+            pendientes[cantidad++] = {nullptr, a};
+        }
+    }
+    delete[] pendientes;
+    delete[] escritos.entradas;
+
+    CabeceraSnapshot cabecera;
+    memcpy(cabecera.magia, MAGIA_SNAPSHOT, sizeof(cabecera.magia));
+    cabecera.version = VERSION_SNAPSHOT;
+    cabecera.reservado = 0;
+    cabecera.cantidadNodos = cantidad;
+    cabecera.desplazamientoCadenas = sizeof(cabecera) + nodos.longitud;
+    cabecera.bytesCadenas = cadenas.longitud;
+    cabecera.desplazamientoContenidos = cabecera.desplazamientoCadenas + cadenas.longitud;
+    cabecera.bytesContenidos = contenidos.longitud;
+
+    BufferBytes partes[4] = {{(char*)&cabecera, sizeof(cabecera), sizeof(cabecera)}, nodos, cadenas, contenidos};
+    bool correcto = reemplazarArchivo(nombreArchivo, partes, 4);
+    bufferLiberar(nodos);
+    bufferLiberar(cadenas);
+    bufferLiberar(contenidos);
+
+    if (!correcto) {
+        cerr << "Error: No se pudo abrir el archivo para guardar el sistema de archivos: " << nombreArchivo << endl;
+        return false;
+    }
+    salida() << "Sistema de archivos guardado en '" << nombreArchivo << "' (binario)." << endl;
+    return true;
+}
+
+// Mapea el archivo completo en memoria (en Windows se lee a un buffer propio)
+bool mapearArchivo(const char* nombreArchivo, const char*& datos, size_t& tamano) {
+#ifdef _WIN32
+    ifstream entrada(nombreArchivo, ios::binary | ios::ate);
+    if (!entrada.is_open()) return false;
+    tamano = (size_t)entrada.tellg();
+    char* buffer = new char[tamano ? tamano : 1];
+    entrada.seekg(0);
+    entrada.read(buffer, tamano);
+    datos = buffer;
+    return true;
+#else
+    int descriptor = open(nombreArchivo, O_RDONLY);
+    if (descriptor < 0) return false;
+    struct stat informacion;
+    if (fstat(descriptor, &informacion) != 0 || informacion.st_size == 0) {
+        close(descriptor);
+        return false;
+    }
+    tamano = (size_t)informacion.st_size;
+    void* mapa = mmap(nullptr, tamano, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (mapa == MAP_FAILED) return false;
+    datos = (const char*)mapa;
+    return true;
+#endif
+}
+
+Directorio* cargarSnapshotBinario(const char* nombreArchivo, Directorio*& raiz) {
+    if (inicioMapa) {
+        cerr << "Error: Ya hay un snapshot binario cargado." << endl;
+        return nullptr;
+    }
+    const char* datos;
+    size_t tamano;
+    if (!mapearArchivo(nombreArchivo, datos, tamano)) {
+        cerr << "Error: No se pudo abrir el archivo de configuración del sistema de archivos: " << nombreArchivo << endl;
+        return nullptr;
+    }
+    inicioMapa = datos;
+    tamanoMapa = tamano;
+
+    // Validación de la cabecera y de que todas las tablas caen dentro del archivo
+    const CabeceraSnapshot* cabecera = (const CabeceraSnapshot*)datos;
+    bool valido = tamano >= sizeof(CabeceraSnapshot) && cabecera->version == VERSION_SNAPSHOT &&
+                  cabecera->cantidadNodos > 0 &&
+                  cabecera->cantidadNodos <= (tamano - sizeof(CabeceraSnapshot)) / sizeof(NodoSnapshot) &&
+                  cabecera->desplazamientoCadenas == sizeof(CabeceraSnapshot) + cabecera->cantidadNodos * sizeof(NodoSnapshot) &&
+                  cabecera->bytesCadenas > 0 && cabecera->desplazamientoCadenas + cabecera->bytesCadenas <= tamano &&
+                  cabecera->desplazamientoContenidos == cabecera->desplazamientoCadenas + cabecera->bytesCadenas &&
+                  cabecera->desplazamientoContenidos + cabecera->bytesContenidos <= tamano;
+    const char* cadenas = datos + (valido ? cabecera->desplazamientoCadenas : 0);
+    const char* contenidos = datos + (valido ? cabecera->desplazamientoContenidos : 0);
+    valido = valido && cadenas[cabecera->bytesCadenas - 1] == '\0' &&
+             (cabecera->bytesContenidos == 0 || contenidos[cabecera->bytesContenidos - 1] == '\0');
+    if (!valido) {
+        cerr << "Error: Snapshot binario inválido o de otra versión: " << nombreArchivo << endl;
+        liberarMapaSnapshot();
+        return nullptr;
+    }
+
+    const NodoSnapshot* nodos = (const NodoSnapshot*)(datos + sizeof(CabeceraSnapshot));
+    uint64_t cantidad = cabecera->cantidadNodos;
+    Directorio** directorios = new Directorio*[cantidad]; // nullptr para los archivos
+
+    // Longitudes de los contenidos sin leerlos: el guardado escribe cada contenido distinto la
+    // primera vez que un nodo lo usa, así que esas primeras apariciones tienen desplazamientos
+    // crecientes y cada contenido termina justo antes del siguiente
+    uint64_t* inicios = new uint64_t[cantidad + 1];
+    uint64_t cantidadInicios = 0;
+    for (uint64_t i = 1; i < cantidad; i++) {
+        uint64_t desplazamiento = nodos[i].contenido;
+        if (desplazamiento == SIN_CONTENIDO || desplazamiento >= cabecera->bytesContenidos) continue;
+        if (cantidadInicios == 0 || desplazamiento > inicios[cantidadInicios - 1]) inicios[cantidadInicios++] = desplazamiento;
+    }
+    inicios[cantidadInicios] = cabecera->bytesContenidos;
+    uint64_t siguienteInicio = 0;
+
+    if (!raiz) raiz = crearDirectorio("/");
+    directorios[0] = raiz;
+    for (uint64_t i = 1; i < cantidad; i++) {
+        const NodoSnapshot& nodo = nodos[i];
+        directorios[i] = nullptr;
+        if (nodo.padre >= i || !directorios[nodo.padre] || nodo.nombre >= cabecera->bytesCadenas ||
+            (nodo.contenido != SIN_CONTENIDO && nodo.contenido >= cabecera->bytesContenidos)) {
+            cerr << "Advertencia: Nodo " << i << " inválido en el snapshot binario, se omite." << endl;
+            continue;
+        }
+        Directorio* padre = directorios[nodo.padre];
+
+        // Los nodos se enlazan sin copiar nombre ni contenido
+        if (nodo.esArchivo) {
+            char* contenido = nodo.contenido == SIN_CONTENIDO ? nullptr : (char*)(contenidos + nodo.contenido);
+            size_t bytes = 0;
+            if (contenido && siguienteInicio < cantidadInicios && inicios[siguienteInicio] == nodo.contenido) {
+                bytes = (size_t)(inicios[siguienteInicio + 1] - nodo.contenido - 1); // Primera aparición
+                siguienteInicio++;
+            } else if (contenido) {
+                uint64_t desde = 0, hasta = cantidadInicios; // Primer inicio > nodo.contenido
+                while (desde < hasta) {
+                    uint64_t medio = desde + (hasta - desde) / 2;
+                    if (inicios[medio] <= nodo.contenido) desde = medio + 1;
+                    else hasta = medio;
+                }
+                bool esInicio = desde > 0 && inicios[desde - 1] == nodo.contenido;
+                bytes = esInicio ? (size_t)(inicios[desde] - nodo.contenido - 1) : strlen(contenido); // Si no lo escribió el guardado
+            }
+            anadirArchivo(padre, inicializarArchivo(reservarArchivo(), (char*)(cadenas + nodo.nombre), contenido), bytes);
+        } else {
+            Directorio* directorio = inicializarDirectorio(reservarDirectorio(), (char*)(cadenas + nodo.nombre), padre);
+            anadirDirectorioALista(padre, directorio);
+            directorios[i] = directorio;
+        }
+    }
+    delete[] directorios;
+    delete[] inicios;
+
+    guardarEnBinario = true;
+    salida() << "Sistema de archivos inicial cargado desde '" << nombreArchivo << "' (binario)." << endl;
+    return raiz;
+}
+
+// Detecta el formato por los primeros bytes y carga con el lector correspondiente
+Directorio* cargarSnapshot(const char* nombreArchivo, Directorio*& raiz) {
+    char magia[sizeof(MAGIA_SNAPSHOT)] = {};
+    {
+        ifstream entrada(nombreArchivo, ios::binary);
+        entrada.read(magia, sizeof(magia));
+    }
+    if (memcmp(magia, MAGIA_SNAPSHOT, sizeof(magia)) == 0) {
+        return cargarSnapshotBinario(nombreArchivo, raiz);
+    }
+    guardarEnBinario = false;
+    return cargarSistemaArchivos(nombreArchivo, raiz);
+}
+
+// Guarda en el formato vigente; devuelve false si el guardado falló
+bool guardarSnapshot(const char* nombreArchivo, Directorio* raiz) {
+    if (guardarEnBinario) {
+        return guardarSnapshotBinario(nombreArchivo, raiz);
+    }
+    return guardarSistemaArchivos(nombreArchivo, raiz);
+}
+
+// --- Reproducción y compactación del diario ---
+
+void rutaDiario(const char* nombreSnapshot, char* ruta, size_t tamano) {
+    snprintf(ruta, tamano, "%s.journal", nombreSnapshot);
+}
+
+// Separa "/a/b/nombre" en el directorio padre (resuelto desde la raíz) y el nombre
+Directorio* resolverPadreDeRuta(char* ruta, Directorio* raiz, char*& nombre) {
+    char* ultimaBarra = strrchr(ruta, '/');
+    if (!ultimaBarra) return nullptr;
+    nombre = ultimaBarra + 1;
+    if (ultimaBarra == ruta) return raiz;
+    *ultimaBarra = '\0';
+    Directorio* padre = navegarRuta(raiz, ruta, raiz);
+    *ultimaBarra = '/';
+    return padre;
+}
+
+// Aplica los registros del diario; devuelve los bytes del prefijo válido
+long reproducirDiario(const char* datos, long longitud, Directorio* raiz, long& aplicados) {
+    long posicion = 0;
+    aplicados = 0;
+    while (posicion < longitud) {
+        const char* finLinea = (const char*)memchr(datos + posicion, '\n', longitud - posicion);
+        if (!finLinea) break; // Registro cortado por una caída: se descarta
+        size_t largo = finLinea - (datos + posicion);
+        char* linea = new char[largo + 1];
+        memcpy(linea, datos + posicion, largo);
+        linea[largo] = '\0';
+        long siguiente = (finLinea - datos) + 1;
+
+        char* tipo = linea;
+        char* ruta = strchr(tipo, ' ');
+        char* argumento = nullptr;
+        bool valido = ruta != nullptr;
+        if (valido) {
+            *ruta++ = '\0';
+            argumento = strchr(ruta, ' ');
+            if (argumento) *argumento++ = '\0';
+        }
+
+        // EDIT y WRITE llevan datos detrás de la línea; WRITE además la posición
+        const char* contenido = nullptr;
+        long longitudDatos = -1;
+        long desdeEscritura = 0;
+        bool esEscritura = valido && strcmp(tipo, "WRITE") == 0;
+        if (valido && (esEscritura || strcmp(tipo, "EDIT") == 0)) {
+            char* campo = argumento;
+            if (campo && esEscritura) {
+                desdeEscritura = strtol(campo, &campo, 10);
+                if (desdeEscritura < 0 || *campo != ' ') campo = nullptr;
+            }
+            longitudDatos = campo ? atol(campo) : -2;
+            if (longitudDatos < -1 || (esEscritura && longitudDatos < 0) ||
+                siguiente + (longitudDatos > 0 ? longitudDatos : 0) + 1 > longitud) {
+                delete[] linea;
+                break;
+            }
+            if (longitudDatos >= 0) contenido = datos + siguiente;
+            siguiente += (longitudDatos > 0 ? longitudDatos : 0) + 1;
+        }
+
+        char* nombre = nullptr;
+        Directorio* padre = valido ? resolverPadreDeRuta(ruta, raiz, nombre) : nullptr;
+        if (!valido) {
+            cerr << "Advertencia: Registro mal formado en el diario: " << linea << endl;
+        } else if (!padre) {
+            // La ruta ya no existe (por ejemplo, rm del padre más adelante): no hay nada que aplicar
+        } else if (strcmp(tipo, "MKDIR") == 0) {
+            comando_mkdir(padre, nombre);
+        } else if (strcmp(tipo, "TOUCH") == 0) {
+            comando_touch(padre, nombre);
+        } else if (strcmp(tipo, "RM") == 0) {
+            comando_rm(padre, nombre, raiz);
+        } else if (strcmp(tipo, "RENAME") == 0 && argumento) {
+            comando_renombrar(padre, nombre, argumento);
+        } else if (strcmp(tipo, "COPY") == 0 && argumento) {
+            char* nombreDestino = nullptr;
+            Directorio* destino = resolverPadreDeRuta(argumento, raiz, nombreDestino);
+            Directorio* fuenteDirectorio = buscarDirectorio(padre, nombre);
+            Archivo* fuenteArchivo = fuenteDirectorio ? nullptr : buscarArchivo(padre, nombre);
+            if (destino && (fuenteDirectorio || fuenteArchivo) && esNombreValido(nombreDestino) &&
+                !buscarArchivo(destino, nombreDestino) && !buscarDirectorio(destino, nombreDestino)) {
+                copiarEnDirectorio(destino, nombreDestino, fuenteDirectorio, fuenteArchivo);
+            }
+        } else if (strcmp(tipo, "MOVE") == 0 && argumento) {
+            char* nombreDestino = nullptr;
+            Directorio* destino = resolverPadreDeRuta(argumento, raiz, nombreDestino);
+            Directorio* fuenteDirectorio = buscarDirectorio(padre, nombre);
+            Archivo* fuenteArchivo = fuenteDirectorio ? nullptr : buscarArchivo(padre, nombre);
+            bool dentroDeSiMismo = false;
+            for (Directorio* d = destino; d && fuenteDirectorio && !dentroDeSiMismo; d = d->padre) {
+                dentroDeSiMismo = d == fuenteDirectorio;
+            }
+            if (destino && (fuenteDirectorio || fuenteArchivo) && !dentroDeSiMismo && esNombreValido(nombreDestino) &&
+                !buscarArchivo(destino, nombreDestino) && !buscarDirectorio(destino, nombreDestino)) {
+                moverEntrada(destino, nombreDestino, fuenteDirectorio, fuenteArchivo);
+            }
+        } else if (strcmp(tipo, "EDIT") == 0) {
+            Archivo* archivo = buscarArchivo(padre, nombre);
+            if (archivo) reemplazarContenido(archivo, contenido, contenido ? longitudDatos : 0);
+        } else if (esEscritura) {
+            Archivo* archivo = buscarArchivo(padre, nombre);
+            if (archivo && (size_t)desdeEscritura <= longitudContenido(archivo)) {
+                contenidoEscribir(archivo, desdeEscritura, contenido, longitudDatos);
+            }
+        } else {
+            cerr << "Advertencia: Registro desconocido en el diario: " << tipo << endl;
+        }
+        delete[] linea;
+        aplicados++;
+        posicion = siguiente;
+    }
+    return posicion;
+}
+
+// Reproduce el diario existente sobre el árbol recién cargado y lo deja abierto para agregar
+void abrirDiario(const char* nombreSnapshot, Directorio* raiz) {
+    rutaDiario(nombreSnapshot, diario.ruta, sizeof(diario.ruta));
+    diario.registros = 0;
+    diario.bytes = 0;
+
+    ifstream entrada(diario.ruta, ios::binary | ios::ate);
+    if (entrada.is_open()) {
+        long longitud = (long)entrada.tellg();
+        char* datos = new char[longitud > 0 ? longitud : 1];
+        entrada.seekg(0);
+        entrada.read(datos, longitud);
+        entrada.close();
+
+        BufferNulo bufferNulo;
+        streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+        long aplicados;
+        long valido;
+        { // Un rm reproducido puede poner en marcha al reclamador, que libera con el árbol tomado
+            unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+            valido = reproducirDiario(datos, longitud, raiz, aplicados);
+        }
+        cout.rdbuf(salidaOriginal);
+        delete[] datos;
+
+        if (valido < longitud) {
+            cerr << "Advertencia: Se descartan " << (longitud - valido) << " bytes incompletos al final del diario." << endl;
+#ifndef _WIN32
+            if (truncate(diario.ruta, valido) != 0) {
+                cerr << "Error: No se pudo recortar el diario: " << diario.ruta << endl;
+            }
+#endif
+        }
+        if (aplicados > 0) {
+            salida() << "Diario: " << aplicados << " operaciones reproducidas desde '" << diario.ruta << "'." << endl;
+        }
+        diario.registros = aplicados;
+        diario.bytes = valido;
+    }
+
+    diario.archivo = fopen(diario.ruta, "ab");
+    if (!diario.archivo) {
+        cerr << "Advertencia: No se pudo abrir el diario; los cambios solo se guardarán con checkpoints: " << diario.ruta << endl;
+    }
+    diario.activo = true;
+}
+
+// Fuerza el diario a disco: es lo que hace 'save' entre checkpoints
+void sincronizarDiario() {
+    if (!diario.archivo) return;
+    fflush(diario.archivo);
+#ifndef _WIN32
+    fsync(fileno(diario.archivo));
+#endif
+}
+
+// Compacta el diario en el snapshot: se reescribe el snapshot y se vacía el diario.
+// Si el snapshot no se pudo guardar el diario queda intacto y se sigue agregando a él,
+// porque es lo único que tiene los cambios desde el último checkpoint.
+// Devuelve si el snapshot se guardó.
+bool checkpoint(const char* nombreSnapshot, Directorio* raiz) {
+    if (!guardarSnapshot(nombreSnapshot, raiz)) {
+        if (diario.archivo) {
+            cerr << "Error: Checkpoint fallido; se conserva el diario '" << diario.ruta << "' con "
+                 << diario.registros << " operaciones." << endl;
+        }
+        return false;
+    }
+    if (diario.archivo) {
+        fclose(diario.archivo);
+        diario.archivo = fopen(diario.ruta, "wb");
+    }
+    diario.registros = 0;
+    diario.bytes = 0;
+    return true;
+}
+
+bool diarioNecesitaCheckpoint() {
+    return diario.registros >= REGISTROS_POR_CHECKPOINT || diario.bytes >= BYTES_POR_CHECKPOINT;
+}
+
+void cerrarDiario() {
+    if (diario.archivo) {
+        sincronizarDiario();
+        fclose(diario.archivo);
+        diario.archivo = nullptr;
+    }
+    diario.activo = false;
+}
+
+// --- Búsqueda por nombre (find) ---
+// find [ruta] [-name patrón] recorre el subárbol con una pila explícita (sin límite de
+// profundidad). Los primeros UMBRAL_BUSQUEDA_PARALELA directorios se recorren en el hilo de la
+// sesión; si el subárbol es más grande, lo que queda en la pila se reparte en el pool con robo
+// de tareas (hilosGuardado hilos) y una tarea cede la mitad de su pila cada vez que hay hilos
+// sin trabajo. Las coincidencias se acumulan por tarea y se escriben por bloques a medida que
+// aparecen; en paralelo su orden no es determinista.
+// El patrón se compila una vez: '*', '?', clases "[a-z]" / "[!0-9]" y '\' para escapar. Se
+// compara byte a byte, así que '?' equivale a un byte y no a un carácter UTF-8.
+
+enum TipoElementoGlob {
+    GLOB_LITERAL,
+    GLOB_CUALQUIERA,    // '?'
+    GLOB_ESTRELLA,      // '*'
+    GLOB_CLASE          // '[...]'
+};
+
+struct ElementoGlob {
+    TipoElementoGlob tipo;
+    unsigned char caracter;     // GLOB_LITERAL
+    uint32_t clase[8];          // GLOB_CLASE: un bit por byte aceptado
+};
+
+// Formas frecuentes que se resuelven sin el comparador general
+enum FormaGlob {
+    GLOB_GENERAL,
+    GLOB_TODO,          // "*"
+    GLOB_EXACTO,        // "texto"
+    GLOB_PREFIJO,       // "texto*"
+    GLOB_SUFIJO,        // "*texto"
+    GLOB_CONTIENE       // "*texto*"
+};
+
+struct PatronGlob {
+    ElementoGlob* elementos;
+    int cantidad;
+    FormaGlob forma;
+    char* literal;              // Texto de las formas con atajo
+    size_t longitudLiteral;
+    // Filtros previos al comparador general, que descartan la mayoría de los nombres sin
+    // recorrerlos: largo mínimo, elementos fijos al principio y al final, y el tramo literal
+    // más largo entre estrellas, que debe aparecer en el nombre
+    size_t minimo;
+    int cabeza;
+    int cola;
+    bool conEstrellas;
+    char* fragmento;
+};
+
+void compilarGlob(const char* texto, PatronGlob& patron) {
+    size_t longitud = strlen(texto);
+    patron.elementos = new ElementoGlob[longitud + 1];
+    patron.cantidad = 0;
+    for (size_t i = 0; i < longitud; i++) {
+        ElementoGlob& elemento = patron.elementos[patron.cantidad];
+        memset(&elemento, 0, sizeof(elemento));
+        char c = texto[i];
+        if (c == '*') {
+            if (patron.cantidad > 0 && patron.elementos[patron.cantidad - 1].tipo == GLOB_ESTRELLA) continue;
+            elemento.tipo = GLOB_ESTRELLA;
+        } else if (c == '?') {
+            elemento.tipo = GLOB_CUALQUIERA;
+        } else if (c == '[') {
+            // Una clase sin ']' de cierre es un '[' literal
+            size_t j = i + 1;
+            bool negada = j < longitud && (texto[j] == '!' || texto[j] == '^');
+            if (negada) j++;
+            size_t inicioClase = j;
+            if (j < longitud && texto[j] == ']') j++;
+            while (j < longitud && texto[j] != ']') j += texto[j] == '\\' && j + 1 < longitud ? 2 : 1;
+            if (j >= longitud) {
+                elemento.tipo = GLOB_LITERAL;
+                elemento.caracter = '[';
+            } else {
+                elemento.tipo = GLOB_CLASE;
+                for (size_t k = inicioClase; k < j; k++) {
+                    if (texto[k] == '\\' && k + 1 < j) k++;
+                    unsigned char desde = (unsigned char)texto[k], hasta = desde;
+                    if (k + 2 < j && texto[k + 1] == '-') {
+                        k += 2;
+                        if (texto[k] == '\\' && k + 1 < j) k++;
+                        hasta = (unsigned char)texto[k];
+                    }
+                    for (unsigned int b = desde; b <= hasta; b++) elemento.clase[b >> 5] |= 1u << (b & 31);
+                }
+                if (negada) {
+                    for (uint32_t& palabra : elemento.clase) palabra = ~palabra;
+                }
+                i = j;
+            }
+        } else {
+            if (c == '\\' && i + 1 < longitud) c = texto[++i];
+            elemento.tipo = GLOB_LITERAL;
+            elemento.caracter = (unsigned char)c;
+        }
+        patron.cantidad++;
+    }
+
+    // Atajos: solo literales, con a lo sumo una estrella al principio y otra al final
+    int primero = 0, ultimo = patron.cantidad;
+    bool estrellaInicial = ultimo > 0 && patron.elementos[0].tipo == GLOB_ESTRELLA;
+    if (estrellaInicial) primero++;
+    bool estrellaFinal = ultimo > primero && patron.elementos[ultimo - 1].tipo == GLOB_ESTRELLA;
+    if (estrellaFinal) ultimo--;
+    bool soloLiterales = true;
+    for (int i = primero; i < ultimo; i++) {
+        if (patron.elementos[i].tipo != GLOB_LITERAL) soloLiterales = false;
+    }
+    patron.literal = nullptr;
+    patron.longitudLiteral = 0;
+    patron.fragmento = nullptr;
+    if (!soloLiterales) {
+        patron.forma = GLOB_GENERAL;
+        patron.minimo = 0;
+        patron.conEstrellas = false;
+        for (int i = 0; i < patron.cantidad; i++) {
+            if (patron.elementos[i].tipo == GLOB_ESTRELLA) patron.conEstrellas = true;
+            else patron.minimo++;
+        }
+        patron.cabeza = 0;
+        while (patron.cabeza < patron.cantidad && patron.elementos[patron.cabeza].tipo != GLOB_ESTRELLA) patron.cabeza++;
+        patron.cola = 0;
+        while (patron.conEstrellas && patron.elementos[patron.cantidad - 1 - patron.cola].tipo != GLOB_ESTRELLA) patron.cola++;
+        int mejorInicio = 0, mejorLargo = 0;
+        for (int i = patron.cabeza; i < patron.cantidad - patron.cola;) {
+            int j = i;
+            while (j < patron.cantidad - patron.cola && patron.elementos[j].tipo == GLOB_LITERAL) j++;
+            if (j - i > mejorLargo) {
+                mejorInicio = i;
+                mejorLargo = j - i;
+            }
+            i = j + 1;
+        }
+        if (mejorLargo > 0) {
+            patron.fragmento = new char[mejorLargo + 1];
+            for (int i = 0; i < mejorLargo; i++) patron.fragmento[i] = (char)patron.elementos[mejorInicio + i].caracter;
+            patron.fragmento[mejorLargo] = '\0';
+        }
+        return;
+    }
+    patron.longitudLiteral = (size_t)(ultimo - primero);
+    patron.literal = new char[patron.longitudLiteral + 1];
+    for (int i = primero; i < ultimo; i++) patron.literal[i - primero] = (char)patron.elementos[i].caracter;
+    patron.literal[patron.longitudLiteral] = '\0';
+    if (estrellaInicial && patron.longitudLiteral == 0) patron.forma = GLOB_TODO;
+    else if (estrellaInicial && estrellaFinal) patron.forma = GLOB_CONTIENE;
+    else if (estrellaInicial) patron.forma = GLOB_SUFIJO;
+    else if (estrellaFinal) patron.forma = GLOB_PREFIJO;
+    else patron.forma = GLOB_EXACTO;
+}
+
+void liberarGlob(PatronGlob& patron) {
+    delete[] patron.elementos;
+    delete[] patron.literal;
+    delete[] patron.fragmento;
+    patron.elementos = nullptr;
+    patron.literal = nullptr;
+    patron.fragmento = nullptr;
+}
+
+inline bool aceptaElementoGlob(const ElementoGlob& elemento, unsigned char c) {
+    switch (elemento.tipo) {
+    case GLOB_LITERAL: return elemento.caracter == c;
+    case GLOB_CUALQUIERA: return true;
+    case GLOB_CLASE: return (elemento.clase[c >> 5] >> (c & 31)) & 1;
+    default: return false;
+    }
+}
+
+// Comparador general: avanza sin retroceso salvo hasta la última estrella vista, lo que basta
+// porque una estrella posterior puede absorber todo lo que una anterior habría consumido
+bool coincideGlob(const PatronGlob& patron, const char* nombre) {
+    switch (patron.forma) {
+    case GLOB_TODO:
+        return true;
+    case GLOB_EXACTO:
+        return strcmp(nombre, patron.literal) == 0;
+    case GLOB_PREFIJO:
+        return strncmp(nombre, patron.literal, patron.longitudLiteral) == 0;
+    case GLOB_SUFIJO: {
+        size_t longitud = strlen(nombre);
+        return longitud >= patron.longitudLiteral &&
+               memcmp(nombre + longitud - patron.longitudLiteral, patron.literal, patron.longitudLiteral) == 0;
+    }
+    case GLOB_CONTIENE:
+        return strstr(nombre, patron.literal) != nullptr;
+    default:
+        break;
+    }
+    size_t longitud = strlen(nombre);
+    if (longitud < patron.minimo || (!patron.conEstrellas && longitud != patron.minimo)) return false;
+    for (int i = 1; i <= patron.cola; i++) {
+        if (!aceptaElementoGlob(patron.elementos[patron.cantidad - i], (unsigned char)nombre[longitud - i])) return false;
+    }
+    for (int i = 0; i < patron.cabeza; i++) {
+        if (!aceptaElementoGlob(patron.elementos[i], (unsigned char)nombre[i])) return false;
+    }
+    if (!patron.conEstrellas) return true;
+    if (patron.fragmento && !strstr(nombre + patron.cabeza, patron.fragmento)) return false;
+
+    int elemento = 0, trasEstrella = -1;
+    const char* reintento = nullptr;
+    const char* c = nombre;
+    while (*c) {
+        if (elemento < patron.cantidad && patron.elementos[elemento].tipo == GLOB_ESTRELLA) {
+            trasEstrella = ++elemento;
+            reintento = c;
+        } else if (elemento < patron.cantidad && aceptaElementoGlob(patron.elementos[elemento], (unsigned char)*c)) {
+            elemento++;
+            c++;
+        } else if (trasEstrella >= 0) {
+            elemento = trasEstrella; // La estrella absorbe un byte más
+            c = ++reintento;
+        } else {
+            return false;
+        }
+    }
+    while (elemento < patron.cantidad && patron.elementos[elemento].tipo == GLOB_ESTRELLA) elemento++;
+    return elemento == patron.cantidad;
+}
+
+struct TrabajoBusqueda {
+    PatronGlob patron;
+    ostream* destino;           // Salida de la sesión que ejecutó find
+    mutex cerrojoSalida;
+    atomic<long> coincidencias;
+    PoolTrabajo* pool;          // nullptr mientras se recorre en el hilo de la sesión
+};
+
+struct TareaBusqueda {
+    TrabajoBusqueda* trabajo;
+    PilaDirectorios pila;
+};
+
+void volcarResultadosBusqueda(TrabajoBusqueda& trabajo, BufferBytes& resultados) {
+    if (resultados.longitud == 0) return;
+    lock_guard<mutex> bloqueo(trabajo.cerrojoSalida);
+    trabajo.destino->write(resultados.datos, (streamsize)resultados.longitud);
+    resultados.longitud = 0;
+}
+
+void tareaBusqueda(void* datos, int hilo);
+
+void anotarCoincidencia(BufferBytes& resultados, BufferBytes& ruta, Directorio* directorio, const char* nombre) {
+    if (ruta.longitud == 0) {
+        agregarRutaDirectorio(ruta, directorio);
+        if (directorio->padre) bufferAgregar(ruta, "/", 1);
+    }
+    bufferAgregar(resultados, ruta.datos, ruta.longitud);
+    bufferAgregarTexto(resultados, nombre);
+    bufferAgregar(resultados, "\n", 1);
+}
+
+// Saca directorios de la pila (hasta 'limite' si es positivo) y anota en 'resultados' los
+// hijos que coinciden con el patrón. Dentro del pool, cede la mitad inferior de la pila (los
+// subárboles más cercanos a la raíz, en general los más grandes) cuando hay hilos sin trabajo.
+void recorrerBusqueda(TrabajoBusqueda& trabajo, PilaDirectorios& pila, BufferBytes& resultados, int hilo, long limite) {
+    BufferBytes ruta = {nullptr, 0, 0}; // Del directorio actual, se arma con su primera coincidencia
+    long recorridos = 0, coincidencias = 0;
+    while (pila.cantidad > 0 && (limite <= 0 || recorridos < limite)) {
+        Directorio* directorio = pila.directorios[--pila.cantidad];
+        materializarSiPendiente(directorio); // Las rutas de las coincidencias salen de 'padre'
+        recorridos++;
+        ruta.longitud = 0;
+        for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+            pilaApilar(pila, d);
+            if (coincideGlob(trabajo.patron, d->nombre)) {
+                anotarCoincidencia(resultados, ruta, directorio, d->nombre);
+                coincidencias++;
+            }
+        }
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+            if (coincideGlob(trabajo.patron, a->nombre)) {
+                anotarCoincidencia(resultados, ruta, directorio, a->nombre);
+                coincidencias++;
+            }
+        }
+        if (resultados.longitud >= TAM_BLOQUE_LECTURA) volcarResultadosBusqueda(trabajo, resultados);
+
+        if (trabajo.pool && pila.cantidad >= 2 && trabajo.pool->pendientes.load(memory_order_relaxed) < trabajo.pool->cantidadHilos) {
+            TareaBusqueda* cedida = new TareaBusqueda{&trabajo, {nullptr, 0, 0}};
+            size_t mitad = pila.cantidad / 2;
+            for (size_t i = 0; i < mitad; i++) pilaApilar(cedida->pila, pila.directorios[i]);
+            memmove(pila.directorios, pila.directorios + mitad, (pila.cantidad - mitad) * sizeof(Directorio*));
+            pila.cantidad -= mitad;
+            poolAgregarTarea(*trabajo.pool, hilo, tareaBusqueda, cedida);
+        }
+    }
+    bufferLiberar(ruta);
+    trabajo.coincidencias += coincidencias;
+}
+
+void tareaBusqueda(void* datos, int hilo) {
+    TareaBusqueda* tarea = (TareaBusqueda*)datos;
+    BufferBytes resultados = {nullptr, 0, 0};
+    recorrerBusqueda(*tarea->trabajo, tarea->pila, resultados, hilo, 0);
+    volcarResultadosBusqueda(*tarea->trabajo, resultados);
+    bufferLiberar(resultados);
+    delete[] tarea->pila.directorios;
+    delete tarea;
+}
+
+// Escribe en 'destino' las rutas de los nodos bajo 'inicio' (incluido) cuyo nombre coincide
+// con 'patron' y devuelve cuántos son. El árbol debe estar tomado al menos en modo compartido.
+long buscarPorNombre(Directorio* inicio, const char* patron, ostream& destino, int hilos) {
+    TrabajoBusqueda trabajo;
+    compilarGlob(patron, trabajo.patron);
+    trabajo.destino = &destino;
+    trabajo.coincidencias = 0;
+    trabajo.pool = nullptr;
+
+    BufferBytes resultados = {nullptr, 0, 0};
+    if (inicio->padre && coincideGlob(trabajo.patron, inicio->nombre)) {
+        agregarRutaDirectorio(resultados, inicio);
+        bufferAgregar(resultados, "\n", 1);
+        trabajo.coincidencias++;
+    }
+    PilaDirectorios pila = {nullptr, 0, 0};
+    pilaApilar(pila, inicio);
+    recorrerBusqueda(trabajo, pila, resultados, 0, hilos > 1 ? UMBRAL_BUSQUEDA_PARALELA : 0);
+    volcarResultadosBusqueda(trabajo, resultados);
+
+    if (pila.cantidad > 0) { // Subárbol grande: el resto se reparte entre los hilos
+        PoolTrabajo pool;
+        poolIniciar(pool, hilos);
+        trabajo.pool = &pool;
+        for (int h = 0; h < hilos && (size_t)h < pila.cantidad; h++) {
+            TareaBusqueda* tarea = new TareaBusqueda{&trabajo, {nullptr, 0, 0}};
+            for (size_t i = h; i < pila.cantidad; i += hilos) pilaApilar(tarea->pila, pila.directorios[i]);
+            poolAgregarTarea(pool, h, tareaBusqueda, tarea);
+        }
+        poolEjecutar(pool);
+        poolLiberar(pool);
+    }
+    delete[] pila.directorios;
+    bufferLiberar(resultados);
+    liberarGlob(trabajo.patron);
+    return trabajo.coincidencias;
+}
+
+// --- Búsqueda en contenidos (grep) ---
+// grep <texto> [ruta] muestra como "ruta:línea:texto" las líneas que contienen el texto
+// (literal, sin expresiones regulares) en los archivos bajo 'ruta' o el directorio actual.
+// Los candidatos salen de intersecar las listas del índice de trigramas de los trigramas del
+// texto; con menos de 3 bytes se revisan todos los archivos. Cada candidato se verifica con
+// buscarSubcadena.
+
+// Primera aparición de 'aguja' en 'texto' o nullptr. Con SSE2 compara de a 16 posiciones el
+// primer y el último byte de la aguja y solo llama a memcmp donde coinciden los dos.
+const char* buscarSubcadena(const char* texto, size_t longitud, const char* aguja, size_t largoAguja) {
+    if (largoAguja == 0) return texto;
+    if (largoAguja > longitud) return nullptr;
+    size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i primero = _mm_set1_epi8(aguja[0]);
+    const __m128i ultimo = _mm_set1_epi8(aguja[largoAguja - 1]);
+    for (; i + largoAguja - 1 + 16 <= longitud; i += 16) {
+        __m128i inicios = _mm_loadu_si128((const __m128i*)(texto + i));
+        __m128i finales = _mm_loadu_si128((const __m128i*)(texto + i + largoAguja - 1));
+        unsigned int mascara = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(inicios, primero), _mm_cmpeq_epi8(finales, ultimo)));
+        while (mascara) {
+            int desplazamiento = __builtin_ctz(mascara);
+            if (memcmp(texto + i + desplazamiento, aguja, largoAguja) == 0) return texto + i + desplazamiento;
+            mascara &= mascara - 1;
+        }
+    }
+#endif
+    for (; i + largoAguja <= longitud; i++) {
+        if (texto[i] == aguja[0] && memcmp(texto + i, aguja, largoAguja) == 0) return texto + i;
+    }
+    return nullptr;
+}
+
+// Deja al principio de 'resultado' los identificadores que también están en 'lista' (ambas
+// ordenadas) y devuelve cuántos quedan. Cada búsqueda en 'lista' avanza con saltos que se
+// duplican y luego bisección, así que una lista corta contra una larga cuesta poco.
+size_t intersecarListas(uint32_t* resultado, size_t cantidad, const uint32_t* lista, size_t largoLista) {
+    size_t quedan = 0, posicion = 0;
+    for (size_t i = 0; i < cantidad && posicion < largoLista; i++) {
+        uint32_t buscado = resultado[i];
+        size_t salto = 1, hasta = posicion;
+        while (hasta < largoLista && lista[hasta] < buscado) {
+            posicion = hasta + 1;
+            hasta += salto;
+            salto *= 2;
+        }
+        if (hasta > largoLista) hasta = largoLista;
+        while (posicion < hasta) { // Primer elemento >= buscado en [posicion, hasta]
+            size_t medio = posicion + (hasta - posicion) / 2;
+            if (lista[medio] < buscado) posicion = medio + 1;
+            else hasta = medio;
+        }
+        if (posicion < largoLista && lista[posicion] == buscado) resultado[quedan++] = buscado;
+    }
+    return quedan;
+}
+
+// Los subárboles que esperan al reclamador siguen en el índice pero no llegan a la raíz
+bool archivoDentroDe(const Archivo* archivo, const Directorio* directorio) {
+    for (const Directorio* d = archivo->padre; d; d = d->padre) {
+        if (d == directorio) return true;
+    }
+    return false;
+}
+
+// Escribe las líneas del archivo que contienen el texto y devuelve cuántas fueron
+long grepArchivo(Archivo* archivo, const char* texto, size_t largo) {
+    thread_local BufferHilo compacto;
+    const char* datos;
+    size_t longitud;
+    if (archivo->piezas) {
+        compacto.buffer.longitud = 0;
+        contenidoLeer(archivo, 0, longitudContenido(archivo), compacto.buffer);
+        datos = compacto.buffer.datos;
+        longitud = compacto.buffer.longitud;
+    } else if (archivo->contenido) {
+        datos = textoContenido(archivo->contenido, longitud);
+    } else {
+        return 0;
+    }
+
+    long lineas = 0, numeroLinea = 1;
+    const char* inicioLinea = datos;
+    const char* fin = datos + longitud;
+    BufferBytes ruta = {nullptr, 0, 0};
+    const char* encontrado;
+    while (inicioLinea < fin && (encontrado = buscarSubcadena(inicioLinea, fin - inicioLinea, texto, largo)) != nullptr) {
+        for (const char* salto; (salto = (const char*)memchr(inicioLinea, '\n', encontrado - inicioLinea)) != nullptr;) {
+            numeroLinea++;
+            inicioLinea = salto + 1;
+        }
+        const char* finLinea = (const char*)memchr(encontrado, '\n', fin - encontrado);
+        if (!finLinea) finLinea = fin;
+        if (ruta.longitud == 0) {
+            agregarRutaDirectorio(ruta, archivo->padre);
+            if (archivo->padre->padre) bufferAgregar(ruta, "/", 1);
+            bufferAgregarTexto(ruta, archivo->nombre);
+        }
+        salida().write(ruta.datos, (streamsize)ruta.longitud);
+        salida() << ':' << numeroLinea << ':';
+        salida().write(inicioLinea, finLinea - inicioLinea);
+        salida() << '\n';
+        lineas++;
+        inicioLinea = finLinea + 1;
+        numeroLinea++;
+    }
+    bufferLiberar(ruta);
+    return lineas;
+}
+
+// Con el árbol tomado al menos en modo compartido
+long comando_grep(Directorio* directorio, Directorio* raiz, const char* texto) {
+    if (copiasPendientes.load(memory_order_relaxed) > 0) materializarSubarbol(directorio); // Para que estén indexadas
+    asegurarIndiceTrigramas(raiz);
+    size_t largo = strlen(texto);
+    uint32_t* candidatos = nullptr;
+    size_t cantidad = 0;
+    unique_lock<mutex> bloqueoIndice(cerrojoTrigramas); // Otras sesiones pueden estar materializando copias
+    if (largo >= 3) {
+        // Las listas de los trigramas del texto, de la más corta a la más larga
+        size_t cantidadListas = 0;
+        ListaTrigrama** listas = new ListaTrigrama*[largo - 2];
+        for (size_t i = 0; i + 2 < largo; i++) {
+            uint32_t trigrama = ((unsigned char)texto[i] << 16) | ((unsigned char)texto[i + 1] << 8) | (unsigned char)texto[i + 2];
+            ListaTrigrama* lista = buscarListaTrigrama(trigrama);
+            if (!lista || lista->cantidad == 0) { // Ningún archivo lo contiene
+                cantidadListas = 0;
+                break;
+            }
+            size_t j = cantidadListas++;
+            for (; j > 0 && listas[j - 1]->cantidad > lista->cantidad; j--) listas[j] = listas[j - 1];
+            listas[j] = lista;
+        }
+        if (cantidadListas > 0) {
+            candidatos = new uint32_t[listas[0]->cantidad];
+            cantidad = listas[0]->cantidad;
+            memcpy(candidatos, listas[0]->archivos, cantidad * sizeof(uint32_t));
+            for (size_t i = 1; i < cantidadListas && cantidad > 0; i++) {
+                if (listas[i] == listas[i - 1]) continue; // Trigrama repetido en el texto
+                cantidad = intersecarListas(candidatos, cantidad, listas[i]->archivos, listas[i]->cantidad);
+            }
+        }
+        delete[] listas;
+    } else {
+        cantidad = trigramas.siguienteId - 1;
+        candidatos = new uint32_t[cantidad + 1];
+        for (size_t i = 0; i < cantidad; i++) candidatos[i] = (uint32_t)(i + 1);
+    }
+
+    Archivo** archivos = new Archivo*[cantidad + 1];
+    size_t cantidadArchivos = 0;
+    for (size_t i = 0; i < cantidad; i++) {
+        Archivo* archivo = trigramas.archivosPorId[candidatos[i]];
+        if (archivo && archivoDentroDe(archivo, directorio)) archivos[cantidadArchivos++] = archivo;
+    }
+    bloqueoIndice.unlock();
+    delete[] candidatos;
+
+    long lineas = 0;
+    for (size_t i = 0; i < cantidadArchivos; i++) lineas += grepArchivo(archivos[i], texto, largo);
+    delete[] archivos;
+    return lineas;
+}
+
+// --- Tamaños de subárboles (du, tree, quota) ---
+// du y tree --summary leen los totales que cada directorio mantiene (ver propagarTotales), así
+// que no recorren el subárbol; tree sin --summary sí lo recorre para dibujarlo.
+
+void imprimirTotalesDirectorio(Directorio* directorio) {
+    BufferBytes ruta = {nullptr, 0, 0};
+    agregarRutaDirectorio(ruta, directorio);
+    bufferAgregar(ruta, "", 1);
+    char linea[96];
+    snprintf(linea, sizeof(linea), "%14llu bytes %10ld archivos %10ld directorios  ",
+             (unsigned long long)directorio->bytesSubarbol, directorio->archivosSubarbol, directorio->directoriosSubarbol);
+    salida() << linea << ruta.datos << endl;
+    bufferLiberar(ruta);
+}
+
+// du [-s] [ruta]: los totales de cada subdirectorio inmediato y al final los del directorio;
+// con -s solo los del directorio
+void comando_du(Directorio* directorio, bool soloTotal) {
+    if (!soloTotal) {
+        materializarSiPendiente(directorio); // Las rutas de los hijos salen de 'padre'
+        for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) imprimirTotalesDirectorio(d);
+    }
+    imprimirTotalesDirectorio(directorio);
+}
+
+void imprimirResumenArbol(const Directorio* directorio) {
+    salida() << directorio->directoriosSubarbol << " directorios, " << directorio->archivosSubarbol << " archivos, "
+             << directorio->bytesSubarbol << " bytes" << endl;
+}
+
+// Nivel de tree en curso: el directorio y los hijos que faltan por dibujar
+struct NivelArbol {
+    Directorio* subdirectorio;
+    Archivo* archivo;
+};
+
+// tree [ruta]: dibuja el subárbol (subdirectorios y luego archivos, en el orden de sus listas)
+// sin recursión, para soportar árboles profundos
+void comando_tree(Directorio* directorio) {
+    BufferBytes ruta = {nullptr, 0, 0};
+    agregarRutaDirectorio(ruta, directorio);
+    salida().write(ruta.datos, (streamsize)ruta.longitud);
+    salida() << '\n';
+    bufferLiberar(ruta);
+
+    NivelArbol* niveles = nullptr;
+    int profundidad = 0, capacidad = 0;
+    BufferBytes prefijo = {nullptr, 0, 0}; // 4 bytes por nivel
+    auto entrar = [&](Directorio* d) {
+        if (profundidad == capacidad) {
+            capacidad = capacidad ? capacidad * 2 : 16;
+            NivelArbol* nuevos = new NivelArbol[capacidad];
+            if (profundidad > 0) memcpy(nuevos, niveles, profundidad * sizeof(NivelArbol));
+            delete[] niveles;
+            niveles = nuevos;
+        }
+        Directorio* vista = vistaDirectorio(d); // Sin materializar las copias pendientes
+        niveles[profundidad++] = {vista->subdirectorios, vista->archivos};
+    };
+    entrar(directorio);
+    while (profundidad > 0) {
+        NivelArbol& nivel = niveles[profundidad - 1];
+        if (!nivel.subdirectorio && !nivel.archivo) {
+            profundidad--;
+            if (prefijo.longitud >= 4) prefijo.longitud -= 4;
+            continue;
+        }
+        const char* nombre;
+        Directorio* subdirectorio = nivel.subdirectorio;
+        if (subdirectorio) {
+            nombre = subdirectorio->nombre;
+            nivel.subdirectorio = subdirectorio->siguienteDirectorio;
+        } else {
+            nombre = nivel.archivo->nombre;
+            nivel.archivo = nivel.archivo->siguiente;
+        }
+        bool ultimo = !nivel.subdirectorio && !nivel.archivo;
+        salida().write(prefijo.datos, (streamsize)prefijo.longitud);
+        salida() << (ultimo ? "`-- " : "|-- ") << nombre << (subdirectorio ? "/\n" : "\n");
+        if (subdirectorio) {
+            bufferAgregar(prefijo, ultimo ? "    " : "|   ", 4);
+            entrar(subdirectorio);
+        }
+    }
+    delete[] niveles;
+    bufferLiberar(prefijo);
+    salida() << '\n';
+    imprimirResumenArbol(directorio);
+}
+
+// quota [ruta [bytes|none]]: muestra, fija o quita el límite de bytes del subárbol. La cuota
+// vive en memoria: no se guarda en el snapshot ni en el diario.
+void comando_quota(Directorio* directorio, const char* limite) {
+    BufferBytes ruta = {nullptr, 0, 0};
+    agregarRutaDirectorio(ruta, directorio);
+    bufferAgregar(ruta, "", 1);
+    if (limite) {
+        char* fin = nullptr;
+        unsigned long long bytes = strtoull(limite, &fin, 10);
+        if (strcmp(limite, "none") == 0) {
+            directorio->cuotaBytes = 0;
+        } else if (!isdigit((unsigned char)limite[0]) || *fin != '\0' || bytes == 0) {
+            salida() << "quota: '" << limite << "': límite inválido (bytes mayor que 0, o none)" << endl;
+            bufferLiberar(ruta);
+            return;
+        } else {
+            directorio->cuotaBytes = bytes;
+        }
+    }
+    if (directorio->cuotaBytes == 0) {
+        salida() << "quota: '" << ruta.datos << "': sin cuota, " << directorio->bytesSubarbol << " bytes en uso" << endl;
+    } else {
+        salida() << "quota: '" << ruta.datos << "': " << directorio->bytesSubarbol << " de " << directorio->cuotaBytes
+                 << " bytes en uso" << (directorio->bytesSubarbol > directorio->cuotaBytes ? " (excedida)" : "") << endl;
+    }
+    bufferLiberar(ruta);
+}
+
+// --- Estadísticas de comandos ---
+// Por cada comando: veces, tiempo total, máximo y un histograma de latencias al estilo HDR
+// (16 cubetas lineales por cada potencia de 2, error relativo menor al 6,25%). Compilando con
+// -DSIN_ESTADISTICAS_COMANDOS la medición desaparece por completo.
+// Las latencias se acumulan en marcas del contador de ciclos (rdtsc, más barato que
+// steady_clock) y se pasan a tiempo al imprimirlas, calibrando contra el reloj desde el arranque.
+// Con --stats-muestreo N sólo se cronometra una de cada N ejecuciones de cada comando (las
+// veces se cuentan todas), 16 por omisión en todos los modos: cada rdtsc cuesta unos 50 ns en
+// una máquina virtual y cronometrar todos los cd o cat de un lote lo hacía un 40% más lento.
+// Los comandos cuya media ya supera MARCAS_CRONOMETRAR_SIEMPRE se cronometran todas las veces.
+#ifndef SIN_ESTADISTICAS_COMANDOS
+#define ESTADISTICAS_COMANDOS 1
+#else
+#define ESTADISTICAS_COMANDOS 0
+#endif
+
+const int BITS_SUBCUBETAS = 4;
+const int SUBCUBETAS = 1 << BITS_SUBCUBETAS;
+const int CUBETAS_LATENCIA = 45 * SUBCUBETAS; // Hasta 2^48 marcas
+
+const char* const NOMBRES_COMANDOS[] = {
+    "cd", "ls", "mkdir", "rm", "touch", "edit", "append", "write", "cat", "find", "grep", "du", "tree", "quota", "rename", "cp",
+    "mv", "snapshot", "sync", "dcache", "wstats", "zstats", "mem", "stats", "save", "checkpoint", "exit", "load", "otros"
+};
+
+// En el orden de NOMBRES_COMANDOS; procesarComando lo resuelve una vez por línea y con él elige
+// el cerrojo, ejecuta el comando y acumula su estadística
+enum Comando {
+    COMANDO_CD, COMANDO_LS, COMANDO_MKDIR, COMANDO_RM, COMANDO_TOUCH, COMANDO_EDIT, COMANDO_APPEND, COMANDO_WRITE,
+    COMANDO_CAT, COMANDO_FIND, COMANDO_GREP, COMANDO_DU, COMANDO_TREE, COMANDO_QUOTA, COMANDO_RENAME, COMANDO_CP,
+    COMANDO_MV, COMANDO_SNAPSHOT, COMANDO_SYNC, COMANDO_DCACHE, COMANDO_WSTATS, COMANDO_ZSTATS, COMANDO_MEM,
+    COMANDO_STATS, COMANDO_SAVE, COMANDO_CHECKPOINT, COMANDO_EXIT,
+    COMANDO_CARGA,          // La carga inicial del snapshot
+    COMANDO_OTROS,          // Vacíos y desconocidos
+    CANTIDAD_COMANDOS
+};
+static_assert(sizeof(NOMBRES_COMANDOS) / sizeof(NOMBRES_COMANDOS[0]) == CANTIDAD_COMANDOS,
+              "NOMBRES_COMANDOS y Comando deben coincidir");
+
+// Cada hilo acumula en su propio bloque (sin operaciones atómicas de lectura-modificación ni
+// líneas de caché compartidas) y 'stats' suma los bloques de todos los hilos. Los contadores
+// son atómicos solo para que esa lectura desde otro hilo no sea una carrera.
+struct EstadisticaComando {
+    atomic<uint64_t> veces;
+    uint64_t saltos;                    // Ejecuciones sin cronometrar hasta la próxima muestra
+    atomic<uint64_t> muestras;          // Ejecuciones cronometradas
+    atomic<uint64_t> marcasTotales;     // De las muestras
+    atomic<uint64_t> maximo;
+    atomic<uint64_t> cubetas[CUBETAS_LATENCIA]; // Al final: lo que no se muestrea no sale de la primera línea de caché
+};
+
+struct EstadisticasHilo {
+    EstadisticaComando comandos[CANTIDAD_COMANDOS];
+    EstadisticasHilo* siguiente;
+};
+
+// Suma de los bloques de todos los hilos para un comando
+struct ResumenComando {
+    uint64_t veces;
+    uint64_t muestras;
+    uint64_t marcasTotales;
+    uint64_t maximo;
+    uint64_t cubetas[CUBETAS_LATENCIA];
+};
+
+mutex cerrojoEstadisticasHilos;
+EstadisticasHilo* estadisticasHilos = nullptr; // Los bloques viven hasta el final del proceso
+
+inline EstadisticasHilo* estadisticasDelHilo() {
+    thread_local EstadisticasHilo* propias = nullptr;
+    if (!propias) {
+        propias = new EstadisticasHilo();
+        lock_guard<mutex> bloqueo(cerrojoEstadisticasHilos);
+        propias->siguiente = estadisticasHilos;
+        estadisticasHilos = propias;
+    }
+    return propias;
+}
+
+void liberarEstadisticasHilos() {
+    lock_guard<mutex> bloqueo(cerrojoEstadisticasHilos);
+    while (estadisticasHilos) {
+        EstadisticasHilo* siguiente = estadisticasHilos->siguiente;
+        delete estadisticasHilos;
+        estadisticasHilos = siguiente;
+    }
+}
+
+// Solo el hilo dueño escribe en su bloque: basta con leer y escribir, sin 'lock add'
+inline void sumarContador(atomic<uint64_t>& contador, uint64_t cantidad) {
+    contador.store(contador.load(memory_order_relaxed) + cantidad, memory_order_relaxed);
+}
+
+bool volcarEstadisticasAlSalir = false; // --stats
+long periodoMuestreo = 16;              // --stats-muestreo
+
+// Unos 20 us a 3 GHz: a partir de ahí los dos rdtsc no llegan al 0,5% del comando
+const uint64_t MARCAS_CRONOMETRAR_SIEMPRE = 1 << 16;
+
+inline uint64_t marcaTiempo() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const uint64_t marcaArranque = marcaTiempo();
+const chrono::steady_clock::time_point relojArranque = chrono::steady_clock::now();
+
+double nanosegundosPorMarca() {
+    double nanosegundos = chrono::duration<double, nano>(chrono::steady_clock::now() - relojArranque).count();
+    uint64_t marcas = marcaTiempo() - marcaArranque;
+    return marcas > 0 ? nanosegundos / marcas : 1.0;
+}
+
+Comando indiceComando(const char* nombre) {
+    if (!nombre) return COMANDO_OTROS;
+    for (int i = 0; i < COMANDO_CARGA; i++) {
+        if (NOMBRES_COMANDOS[i][0] == nombre[0] && strcmp(NOMBRES_COMANDOS[i], nombre) == 0) return (Comando)i;
+    }
+    return COMANDO_OTROS;
+}
+
+int cubetaLatencia(uint64_t marcas) {
+    if (marcas < (uint64_t)SUBCUBETAS) return (int)marcas;
+#if defined(__GNUC__)
+    int bitAlto = 63 - __builtin_clzll(marcas);
+#else
+    int bitAlto = 0;
+    while (marcas >> (bitAlto + 1)) bitAlto++;
+#endif
+    int desplazamiento = bitAlto - BITS_SUBCUBETAS;
+    int cubeta = (desplazamiento + 1) * SUBCUBETAS + (int)((marcas >> desplazamiento) & (SUBCUBETAS - 1));
+    return cubeta < CUBETAS_LATENCIA ? cubeta : CUBETAS_LATENCIA - 1;
+}
+
+// Mayor latencia que cae en la cubeta
+uint64_t techoCubeta(int cubeta) {
+    if (cubeta < SUBCUBETAS) return (uint64_t)cubeta;
+    int desplazamiento = cubeta / SUBCUBETAS - 1;
+    uint64_t base = (uint64_t)(SUBCUBETAS + cubeta % SUBCUBETAS) << desplazamiento;
+    return base + ((uint64_t)1 << desplazamiento) - 1;
+}
+
+void registrarLatencia(EstadisticaComando& e, uint64_t marcas) {
+    sumarContador(e.muestras, 1);
+    sumarContador(e.marcasTotales, marcas);
+    if (marcas > e.maximo.load(memory_order_relaxed)) e.maximo.store(marcas, memory_order_relaxed);
+    sumarContador(e.cubetas[cubetaLatencia(marcas)], 1);
+}
+
+void resumirComando(int comando, ResumenComando& resumen) {
+    memset(&resumen, 0, sizeof(resumen));
+    lock_guard<mutex> bloqueo(cerrojoEstadisticasHilos);
+    for (EstadisticasHilo* h = estadisticasHilos; h; h = h->siguiente) {
+        const EstadisticaComando& e = h->comandos[comando];
+        resumen.veces += e.veces.load(memory_order_relaxed);
+        resumen.muestras += e.muestras.load(memory_order_relaxed);
+        resumen.marcasTotales += e.marcasTotales.load(memory_order_relaxed);
+        uint64_t maximo = e.maximo.load(memory_order_relaxed);
+        if (maximo > resumen.maximo) resumen.maximo = maximo;
+        for (int i = 0; i < CUBETAS_LATENCIA; i++) resumen.cubetas[i] += e.cubetas[i].load(memory_order_relaxed);
+    }
+}
+
+void reiniciarEstadisticasComandos() {
+    lock_guard<mutex> bloqueo(cerrojoEstadisticasHilos);
+    for (EstadisticasHilo* h = estadisticasHilos; h; h = h->siguiente) {
+        for (EstadisticaComando& e : h->comandos) {
+            e.veces.store(0, memory_order_relaxed);
+            e.muestras.store(0, memory_order_relaxed);
+            e.marcasTotales.store(0, memory_order_relaxed);
+            e.maximo.store(0, memory_order_relaxed);
+            for (atomic<uint64_t>& cubeta : e.cubetas) cubeta.store(0, memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t percentilLatencia(const ResumenComando& e, double percentil) {
+    uint64_t objetivo = (uint64_t)(e.muestras * percentil);
+    if (objetivo >= e.muestras) objetivo = e.muestras - 1;
+    uint64_t acumulado = 0;
+    for (int i = 0; i < CUBETAS_LATENCIA; i++) {
+        acumulado += e.cubetas[i];
+        if (acumulado > objetivo) return techoCubeta(i) < e.maximo ? techoCubeta(i) : e.maximo;
+    }
+    return e.maximo;
+}
+
+// Mide desde su construcción hasta que sale de ámbito (cualquier return de procesarComando).
+// La primera ejecución de cada comando siempre se cronometra.
+struct MedicionComando {
+    EstadisticaComando& estadistica;
+    uint64_t inicio;
+    explicit MedicionComando(int comando) : estadistica(estadisticasDelHilo()->comandos[comando]), inicio(0) {
+        sumarContador(estadistica.veces, 1);
+        if (estadistica.saltos > 0) {
+            estadistica.saltos--;
+        } else {
+            uint64_t muestras = estadistica.muestras.load(memory_order_relaxed);
+            bool largo = muestras > 0 &&
+                         estadistica.marcasTotales.load(memory_order_relaxed) / muestras >= MARCAS_CRONOMETRAR_SIEMPRE;
+            estadistica.saltos = largo ? 0 : (uint64_t)periodoMuestreo - 1;
+            inicio = marcaTiempo();
+        }
+    }
+    ~MedicionComando() {
+        if (inicio) registrarLatencia(estadistica, marcaTiempo() - inicio);
+    }
+};
+
+void imprimirEstadisticasComandos() {
+#if ESTADISTICAS_COMANDOS
+    ResumenComando* resumenes = new ResumenComando[CANTIDAD_COMANDOS];
+    uint64_t total = 0;
+    for (int i = 0; i < CANTIDAD_COMANDOS; i++) {
+        resumirComando(i, resumenes[i]);
+        total += resumenes[i].veces;
+    }
+    double microsegundos = nanosegundosPorMarca() / 1e3; // Por marca
+    salida() << "stats: " << total << " comandos (latencias en us";
+    if (periodoMuestreo > 1) salida() << ", cronometrado 1 de cada " << periodoMuestreo;
+    salida() << "; edit/append/write incluyen la espera de la entrada)" << endl;
+    char linea[160];
+    snprintf(linea, sizeof(linea), "  %-10s %10s %12s %10s %10s %10s %10s %10s",
+             "comando", "veces", "total ms", "media", "p50", "p90", "p99", "max");
+    salida() << linea << endl;
+    for (int i = 0; i < CANTIDAD_COMANDOS; i++) {
+        const ResumenComando& e = resumenes[i];
+        if (e.muestras == 0) continue;
+        snprintf(linea, sizeof(linea), "  %-10s %10llu %12.3f %10.2f %10.2f %10.2f %10.2f %10.2f",
+                 NOMBRES_COMANDOS[i], (unsigned long long)e.veces,
+                 e.marcasTotales * microsegundos / 1e3 * e.veces / e.muestras, // Estimado si hay muestreo
+                 e.marcasTotales * microsegundos / e.muestras, percentilLatencia(e, 0.5) * microsegundos,
+                 percentilLatencia(e, 0.9) * microsegundos, percentilLatencia(e, 0.99) * microsegundos,
+                 e.maximo * microsegundos);
+        salida() << linea << endl;
+    }
+    delete[] resumenes;
+#else
+    salida() << "stats: medición de comandos desactivada al compilar (SIN_ESTADISTICAS_COMANDOS)" << endl;
+#endif
+    imprimirEstadisticasContenidos();
+    imprimirEstadisticasTrigramas();
+    salida() << "  copias pendientes (cp -r, snapshot): " << copiasPendientes.load() << " directorios" << endl;
+    imprimirEstadisticasReclamador();
+    if (asignadorAgrupado) imprimirEstadisticasAsignador();
+}
+
+// --- Bucle Principal de la Terminal ---
+
+enum ModoCerrojo {
+    CERROJO_NINGUNO,        // No toca el árbol
+    CERROJO_COMPARTIDO,     // Solo lo lee
+    CERROJO_EXCLUSIVO,      // Lo modifica
+    CERROJO_PROPIO          // Lee su entrada sin cerrojo y lo toma por su cuenta (edit, append, write)
+};
+
+ModoCerrojo modoCerrojoComando(Comando comando) {
+    switch (comando) {
+    case COMANDO_CD: case COMANDO_LS: case COMANDO_CAT: case COMANDO_FIND: case COMANDO_GREP: case COMANDO_DU:
+    case COMANDO_TREE: case COMANDO_DCACHE: case COMANDO_WSTATS: case COMANDO_ZSTATS: case COMANDO_MEM: case COMANDO_STATS:
+        return CERROJO_COMPARTIDO;
+    case COMANDO_MKDIR: case COMANDO_RM: case COMANDO_TOUCH: case COMANDO_QUOTA: case COMANDO_RENAME: case COMANDO_CP:
+    case COMANDO_MV: case COMANDO_SNAPSHOT: case COMANDO_SYNC: case COMANDO_SAVE: case COMANDO_CHECKPOINT:
+        return CERROJO_EXCLUSIVO;
+    case COMANDO_EDIT: case COMANDO_APPEND: case COMANDO_WRITE:
+        return CERROJO_PROPIO;
+    default:
+        return CERROJO_NINGUNO;
+    }
+}
+
+bool ejecutarComando(Comando comando, char* lineaComando, char* token, char*& cursor, Directorio*& directorioActual,
+                     Directorio* raiz, const char* nombreArchivoGuardado);
+
+// Ejecuta una línea de comando con el árbol tomado según lo que haga el comando. Es reentrante:
+// varias sesiones pueden llamarla a la vez, cada una con su propio directorio actual.
+// Devuelve false cuando el comando es 'exit'.
+bool procesarComando(char* lineaComando, Directorio*& directorioActual, Directorio* raiz, const char* nombreArchivoGuardado) {
+    char* cursor = lineaComando;
+    char* token = siguienteToken(cursor, ' ');
+    Comando comando = indiceComando(token);
+
+#if ESTADISTICAS_COMANDOS
+    MedicionComando medicion(comando);
+#endif
+    if (token == nullptr) return true;
+
+    switch (modoCerrojoComando(comando)) {
+    case CERROJO_COMPARTIDO: {
+        shared_lock<shared_mutex> bloqueo(cerrojoArbol);
+        return ejecutarComando(comando, lineaComando, token, cursor, directorioActual, raiz, nombreArchivoGuardado);
+    }
+    case CERROJO_EXCLUSIVO: {
+        unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+        bool seguir = ejecutarComando(comando, lineaComando, token, cursor, directorioActual, raiz, nombreArchivoGuardado);
+        if (diarioNecesitaCheckpoint()) checkpoint(nombreArchivoGuardado, raiz);
+        return seguir;
+    }
+    case CERROJO_PROPIO: {
+        bool seguir = ejecutarComando(comando, lineaComando, token, cursor, directorioActual, raiz, nombreArchivoGuardado);
+        unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+        if (diarioNecesitaCheckpoint()) checkpoint(nombreArchivoGuardado, raiz);
+        return seguir;
+    }
+    default:
+        return ejecutarComando(comando, lineaComando, token, cursor, directorioActual, raiz, nombreArchivoGuardado);
+    }
+}
+
+bool ejecutarComando(Comando comando, char* lineaComando, char* token, char*& cursor, Directorio*& directorioActual,
+                     Directorio* raiz, const char* nombreArchivoGuardado) {
+    if (comando == COMANDO_CD) {
+        char* ruta = siguienteToken(cursor, ' ');
+        if (ruta) {
+            comando_cd(directorioActual, ruta, raiz);
+        } else {
+            salida() << "cd: falta un operando" << endl;
+            salida() << "Uso: cd <ruta_directorio>" << endl;
+        }
+    }
+    else if (comando == COMANDO_LS) {
+        // ls [ruta][/prefijo*] [--offset N] [--limit M]
+        char* ruta = nullptr;
+        long desde = 0, limite = -1;
+        bool usoValido = true;
+        char* argumento;
+        while ((argumento = siguienteToken(cursor, ' ')) != nullptr) {
+            if (strcmp(argumento, "--offset") == 0 || strcmp(argumento, "--limit") == 0) {
+                char* valor = siguienteToken(cursor, ' ');
+                if (!valor || atol(valor) < 0) {
+                    usoValido = false;
+                    break;
+                }
+                if (strcmp(argumento, "--offset") == 0) desde = atol(valor);
+                else limite = atol(valor);
+            } else if (!ruta) {
+                ruta = argumento;
+            } else {
+                usoValido = false;
+                break;
+            }
+        }
+
+        if (!usoValido) {
+            salida() << "ls: argumentos inválidos" << endl;
+            salida() << "Uso: ls [ruta|ruta/prefijo*] [--offset N] [--limit M]" << endl;
+        } else if (ruta == nullptr) {
+            comando_ls(directorioActual, "", desde, limite);
+        } else {
+            // Un '*' final en el último componente se interpreta como búsqueda por prefijo
+            char rutaDirectorio[LONGITUD_MAX_RUTA];
+            char prefijo[LONGITUD_MAX_RUTA] = "";
+            strncpy(rutaDirectorio, ruta, LONGITUD_MAX_RUTA - 1);
+            rutaDirectorio[LONGITUD_MAX_RUTA - 1] = '\0';
+            size_t longitud = strlen(rutaDirectorio);
+            if (longitud > 0 && rutaDirectorio[longitud - 1] == '*') {
+                rutaDirectorio[longitud - 1] = '\0';
+                char* ultimaBarra = strrchr(rutaDirectorio, '/');
+                if (ultimaBarra) {
+                    strcpy(prefijo, ultimaBarra + 1);
+                    ultimaBarra[1] = '\0'; // Se conserva la barra: "/Music/" o "/"
+                } else {
+                    strcpy(prefijo, rutaDirectorio);
+                    strcpy(rutaDirectorio, ".");
+                }
+            }
+
+            Directorio* directorioDestino = navegarRuta(directorioActual, rutaDirectorio, raiz);
+            if (directorioDestino) {
+                comando_ls(directorioDestino, prefijo, desde, limite);
+            } else {
+                salida() << "ls: no se puede acceder a '" << ruta << "': No existe el archivo o directorio" << endl;
+            }
+        }
+    }
+    else if (comando == COMANDO_MKDIR) {
+        char* nombre = siguienteToken(cursor, ' ');
+        if (nombre) {
+            comando_mkdir(directorioActual, nombre);
+        } else {
+            salida() << "mkdir: falta un operando" << endl;
+            salida() << "Uso: mkdir <nombre_carpeta>" << endl;
+        }
+    }
+    else if (comando == COMANDO_RM) {
+        char* rutaAEliminar = siguienteToken(cursor, ' ');
+        if (rutaAEliminar) {
+            comando_rm(directorioActual, rutaAEliminar, raiz);
+        } else {
+            salida() << "rm: falta un operando" << endl;
+            salida() << "Uso: rm <ruta_archivo_o_directorio>" << endl;
+        }
+    }
+    else if (comando == COMANDO_TOUCH) {
+        char* nombre = siguienteToken(cursor, ' ');
+        if (nombre) {
+            comando_touch(directorioActual, nombre);
+        } else {
+            salida() << "touch: falta un operando" << endl;
+            salida() << "Uso: touch <nombre_archivo>" << endl;
+        }
+    }
+    else if (comando == COMANDO_EDIT) {
+        char* nombreArchivo = siguienteToken(cursor, ' ');
+        if (nombreArchivo) {
+            comando_editar(directorioActual, nombreArchivo);
+        } else {
+            salida() << "editar: falta un operando" << endl;
+            salida() << "Uso: editar <nombre_archivo>" << endl;
+        }
+    }
+    else if (comando == COMANDO_APPEND || comando == COMANDO_WRITE) {
+        bool esAppend = comando == COMANDO_APPEND;
+        char* nombreArchivo = siguienteToken(cursor, ' ');
+        char* desde = esAppend ? nullptr : siguienteToken(cursor, ' ');
+        char* fin = nullptr;
+        long long posicion = desde ? strtoll(desde, &fin, 10) : 0;
+        if (!nombreArchivo || (!esAppend && !desde)) {
+            salida() << token << ": falta un operando" << endl;
+            salida() << (esAppend ? "Uso: append <nombre_archivo>" : "Uso: write <nombre_archivo> <desplazamiento>") << endl;
+        } else if (desde && (*fin || posicion < 0)) {
+            salida() << token << ": desplazamiento inválido '" << desde << "'" << endl;
+        } else {
+            comando_escribir(token, directorioActual, nombreArchivo, esAppend, (size_t)posicion);
+        }
+    }
+    else if (comando == COMANDO_CAT) {
+        char* nombreArchivo = siguienteToken(cursor, ' ');
+        char* desde = siguienteToken(cursor, ' ');
+        char* longitud = siguienteToken(cursor, ' ');
+        Archivo* archivo = nombreArchivo ? buscarArchivo(directorioActual, nombreArchivo) : nullptr;
+        if (!nombreArchivo) {
+            salida() << "cat: falta un operando" << endl;
+            salida() << "Uso: cat <nombre_archivo> [desde] [longitud]" << endl;
+        } else if (!archivo) {
+            salida() << "cat: '" << nombreArchivo << "': No existe tal archivo" << endl;
+        } else if ((desde && atol(desde) < 0) || (longitud && atol(longitud) < 0)) {
+            salida() << "cat: argumentos inválidos" << endl;
+            salida() << "Uso: cat <nombre_archivo> [desde] [longitud]" << endl;
+        } else {
+            comando_cat(archivo, desde ? atol(desde) : 0, longitud ? (size_t)atol(longitud) : (size_t)-1);
+        }
+    }
+    else if (comando == COMANDO_FIND) {
+        // find [ruta] [-name patrón]
+        char* ruta = nullptr;
+        const char* patron = "*";
+        bool usoValido = true;
+        char* argumento;
+        while ((argumento = siguienteToken(cursor, ' ')) != nullptr) {
+            if (strcmp(argumento, "-name") == 0) {
+                patron = siguienteToken(cursor, ' ');
+                if (!patron) {
+                    usoValido = false;
+                    break;
+                }
+            } else if (!ruta) {
+                ruta = argumento;
+            } else {
+                usoValido = false;
+                break;
+            }
+        }
+        Directorio* inicio = usoValido && ruta ? navegarRuta(directorioActual, ruta, raiz) : directorioActual;
+        if (!usoValido) {
+            salida() << "find: argumentos inválidos" << endl;
+            salida() << "Uso: find [ruta] [-name patrón]" << endl;
+        } else if (!inicio) {
+            salida() << "find: '" << ruta << "': No existe el archivo o directorio" << endl;
+        } else {
+            buscarPorNombre(inicio, patron, salida(), hilosGuardado);
+        }
+    }
+    else if (comando == COMANDO_GREP) {
+        char* texto = siguienteToken(cursor, ' ');
+        char* ruta = siguienteToken(cursor, ' ');
+        Directorio* inicio = ruta ? navegarRuta(directorioActual, ruta, raiz) : directorioActual;
+        if (!texto || siguienteToken(cursor, ' ')) {
+            salida() << "grep: argumentos inválidos" << endl;
+            salida() << "Uso: grep <texto> [ruta]" << endl;
+        } else if (!inicio) {
+            salida() << "grep: '" << ruta << "': No existe el archivo o directorio" << endl;
+        } else {
+            comando_grep(inicio, raiz, texto);
+        }
+    }
+    else if (comando == COMANDO_DU || comando == COMANDO_TREE) {
+        // du [-s] [ruta] / tree [ruta] [--summary]
+        bool esDu = comando == COMANDO_DU;
+        const char* opcionResumen = esDu ? "-s" : "--summary";
+        char* ruta = nullptr;
+        bool resumen = false, usoValido = true;
+        char* argumento;
+        while ((argumento = siguienteToken(cursor, ' ')) != nullptr) {
+            if (strcmp(argumento, opcionResumen) == 0) resumen = true;
+            else if (!ruta) ruta = argumento;
+            else usoValido = false;
+        }
+        Directorio* inicio = usoValido && ruta ? navegarRuta(directorioActual, ruta, raiz) : directorioActual;
+        if (!usoValido) {
+            salida() << token << ": argumentos inválidos" << endl;
+            salida() << (esDu ? "Uso: du [-s] [ruta]" : "Uso: tree [ruta] [--summary]") << endl;
+        } else if (!inicio) {
+            salida() << token << ": '" << ruta << "': No existe el directorio" << endl;
+        } else if (esDu) {
+            comando_du(inicio, resumen);
+        } else if (resumen) {
+            imprimirResumenArbol(inicio);
+        } else {
+            comando_tree(inicio);
+        }
+    }
+    else if (comando == COMANDO_QUOTA) {
+        char* ruta = siguienteToken(cursor, ' ');
+        char* limite = siguienteToken(cursor, ' ');
+        Directorio* inicio = ruta ? navegarRuta(directorioActual, ruta, raiz) : directorioActual;
+        if (siguienteToken(cursor, ' ')) {
+            salida() << "quota: argumentos inválidos" << endl;
+            salida() << "Uso: quota [ruta [bytes|none]]" << endl;
+        } else if (!inicio) {
+            salida() << "quota: '" << ruta << "': No existe el directorio" << endl;
+        } else {
+            comando_quota(inicio, limite);
+        }
+    }
+    else if (comando == COMANDO_RENAME) {
+        char* nombreAntiguo = siguienteToken(cursor, ' ');
+        char* nombreNuevo = siguienteToken(cursor, ' ');
+        if (nombreAntiguo && nombreNuevo) {
+            comando_renombrar(directorioActual, nombreAntiguo, nombreNuevo);
+        } else {
+            salida() << "renombrar: falta un operando" << endl;
+            salida() << "Uso: renombrar <nombre_antiguo> <nombre_nuevo>" << endl;
+        }
+    }
+    else if (comando == COMANDO_CP) {
+        char* operandos[2] = {nullptr, nullptr};
+        int cantidadOperandos = 0;
+        bool recursivo = false, usoValido = true;
+        char* argumento;
+        while ((argumento = siguienteToken(cursor, ' ')) != nullptr) {
+            if (strcmp(argumento, "-r") == 0) recursivo = true;
+            else if (cantidadOperandos < 2) operandos[cantidadOperandos++] = argumento;
+            else usoValido = false;
+        }
+        if (!usoValido || cantidadOperandos < 2) {
+            salida() << "cp: " << (usoValido ? "falta un operando" : "argumentos inválidos") << endl;
+            salida() << "Uso: cp [-r] <origen> <destino>" << endl;
+        } else {
+            comando_cp(directorioActual, raiz, operandos[0], operandos[1], recursivo);
+        }
+    }
+    else if (comando == COMANDO_MV) {
+        char* rutaOrigen = siguienteToken(cursor, ' ');
+        char* rutaDestino = siguienteToken(cursor, ' ');
+        if (!rutaOrigen || !rutaDestino || siguienteToken(cursor, ' ')) {
+            salida() << "mv: " << (rutaDestino ? "argumentos inválidos" : "falta un operando") << endl;
+            salida() << "Uso: mv <origen> <destino>" << endl;
+        } else {
+            comando_mv(directorioActual, raiz, rutaOrigen, rutaDestino);
+        }
+    }
+    else if (comando == COMANDO_SNAPSHOT) {
+        char* nombre = siguienteToken(cursor, ' ');
+        char* ruta = siguienteToken(cursor, ' ');
+        if (!nombre || siguienteToken(cursor, ' ')) {
+            salida() << "snapshot: argumentos inválidos" << endl;
+            salida() << "Uso: snapshot <nombre> [ruta]" << endl;
+        } else {
+            comando_snapshot(directorioActual, raiz, nombre, ruta);
+        }
+    }
+    else if (comando == COMANDO_DCACHE) {
+        imprimirEstadisticasCacheRutas();
+    }
+    else if (comando == COMANDO_WSTATS) {
+        imprimirEstadisticasEscritor();
+    }
+    else if (comando == COMANDO_ZSTATS) {
+        imprimirEstadisticasCompresion();
+    }
+    else if (comando == COMANDO_MEM) {
+        salida() << "mem:" << endl;
+        imprimirEstadisticasContenidos();
+        imprimirEstadisticasTrigramas();
+        salida() << "  copias pendientes (cp -r, snapshot): " << copiasPendientes.load() << " directorios" << endl;
+        imprimirEstadisticasReclamador();
+        if (asignadorAgrupado) imprimirEstadisticasAsignador();
+    }
+    else if (comando == COMANDO_STATS) {
+        char* opcion = siguienteToken(cursor, ' ');
+        if (opcion && strcmp(opcion, "reset") == 0) {
+            reiniciarEstadisticasComandos();
+            salida() << "stats: estadísticas reiniciadas." << endl;
+        } else if (opcion) {
+            salida() << "Uso: stats [reset]" << endl;
+        } else {
+            imprimirEstadisticasComandos();
+        }
+    }
+    else if (comando == COMANDO_SAVE) {
+        char* formato = siguienteToken(cursor, ' ');
+        bool formatoAnterior = guardarEnBinario;
+        if (formato && strcmp(formato, "--binary") == 0) {
+            guardarEnBinario = true;
+        } else if (formato && strcmp(formato, "--text") == 0) {
+            guardarEnBinario = false;
+        } else if (formato) {
+            salida() << "save: opción desconocida '" << formato << "'" << endl;
+            salida() << "Uso: save [--binary|--text]" << endl;
+            return true;
+        }
+        if (formato || !diario.archivo) {
+            // Cambio de formato: se reescribe el snapshot
+            if (!checkpoint(nombreArchivoGuardado, raiz)) {
+                guardarEnBinario = formatoAnterior;
+                salida() << "save: '" << nombreArchivoGuardado << "': no se pudo guardar el snapshot" << endl;
+            }
+        } else {
+            sincronizarDiario();
+            salida() << "Cambios guardados en el diario '" << diario.ruta << "' (" << diario.registros << " operaciones desde el último checkpoint)." << endl;
+        }
+    }
+    else if (comando == COMANDO_CHECKPOINT) {
+        if (!checkpoint(nombreArchivoGuardado, raiz)) {
+            salida() << "checkpoint: '" << nombreArchivoGuardado << "': no se pudo guardar el snapshot" << endl;
+        }
+    }
+    else if (comando == COMANDO_SYNC) {
+        long liberados = reclamarPendientes();
+        salida() << "sync: " << liberados << " nodos pendientes de rm liberados." << endl;
+    }
+    else if (comando == COMANDO_EXIT) {
+        salida() << "Saliendo de la terminal." << endl;
+        return false;
+    }
+    else {
+        salida() << lineaComando << ": comando no encontrado" << endl;
+    }
+    return true;
+}
+
+// --- Benchmarks ---
+// Se ejecutan con: ./terminal --bench <nombre> [parametros]
+
+double segundosDesde(chrono::steady_clock::time_point inicio) {
+    return chrono::duration<double>(chrono::steady_clock::now() - inicio).count();
+}
+
+// Inserta N entradas en un único directorio (mitad mkdir, mitad touch) y reporta
+// el costo por inserción en tramos: con el índice hash debe mantenerse plano.
+void benchmarkIndiceHijos(int totalEntradas) {
+    Directorio* raiz = crearDirectorio("/");
+    BufferNulo bufferNulo;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+
+    const int tramos = 10;
+    int porTramo = totalEntradas / tramos;
+    double tiempos[tramos];
+    char nombre[64];
+    int creadas = 0;
+    for (int t = 0; t < tramos; t++) {
+        auto inicio = chrono::steady_clock::now();
+        for (int i = 0; i < porTramo; i++, creadas++) {
+            snprintf(nombre, sizeof(nombre), "entrada_%d", creadas);
+            if (creadas % 2 == 0) {
+                comando_mkdir(raiz, nombre);
+            } else {
+                comando_touch(raiz, nombre);
+            }
+        }
+        tiempos[t] = segundosDesde(inicio);
+    }
+
+    cout.rdbuf(salidaOriginal);
+    cout << "indice_hijos: " << creadas << " entradas en un directorio" << endl;
+    for (int t = 0; t < tramos; t++) {
+        cout << "  hasta " << (t + 1) * porTramo << " entradas: "
+             << (tiempos[t] * 1e9 / porTramo) << " ns/insercion" << endl;
+    }
+    eliminarDirectorio(raiz);
+}
+
+// Escribe un snapshot sintético: directorios /dN con archivosPorDirectorio archivos cada uno,
+// con contenidos de unos bytesContenido bytes (o un texto corto si es 0)
+void escribirSnapshotSintetico(const char* ruta, int directorios, int archivosPorDirectorio, int bytesContenido = 0) {
+    ofstream salida(ruta);
+    char* relleno = new char[bytesContenido + 1];
+    memset(relleno, 'x', bytesContenido);
+    relleno[bytesContenido] = '\0';
+    for (int d = 0; d < directorios; d++) {
+        salida << "DIR /dir_" << d << "\n";
+        for (int a = 0; a < archivosPorDirectorio; a++) {
+            salida << "FILE /dir_" << d << "/archivo_" << a << ".txt contenido " << d << "_" << a << relleno << "\n";
+        }
+    }
+    delete[] relleno;
+}
+
+// Genera un árbol sintético en el formato del snapshot de texto, con unos 'nodos' nodos:
+//   ancho:    pocos directorios con miles de archivos cada uno
+//   profundo: cadenas de PROFUNDIDAD_SINTETICA directorios anidados con un archivo por nivel
+//   mixto:    cada nodo cuelga de un directorio al azar (15% directorios, hasta 30 niveles)
+//   grupos:   /gN/sM/archivo_K en el orden de guardarSistemaArchivos, 10 subdirectorios de
+//             100 archivos por grupo
+// Devuelve false si la forma no existe.
+const int PROFUNDIDAD_SINTETICA = 120;
+
+bool generarArbolSintetico(const char* ruta, const char* forma, long nodos) {
+    if (strcmp(forma, "ancho") != 0 && strcmp(forma, "profundo") != 0 && strcmp(forma, "mixto") != 0 &&
+        strcmp(forma, "grupos") != 0) {
+        return false;
+    }
+    ofstream salida(ruta);
+    salida << "DIR /\n";
+    if (strcmp(forma, "ancho") == 0) {
+        const long ARCHIVOS_POR_DIR = 10000;
+        for (long d = 0, creados = 0; creados < nodos; d++) {
+            salida << "DIR /ancho_" << d << "\n";
+            creados++;
+            for (long a = 0; a < ARCHIVOS_POR_DIR && creados < nodos; a++, creados++) {
+                salida << "FILE /ancho_" << d << "/archivo_" << a << " contenido " << d << "_" << a << "\n";
+            }
+        }
+    } else if (strcmp(forma, "profundo") == 0) {
+        char rutaNivel[LONGITUD_MAX_RUTA];
+        for (long c = 0, creados = 0; creados < nodos; c++) {
+            int largo = snprintf(rutaNivel, sizeof(rutaNivel), "/cadena_%ld", c);
+            for (int nivel = 0; nivel < PROFUNDIDAD_SINTETICA && creados < nodos; nivel++) {
+                if (nivel > 0) largo += snprintf(rutaNivel + largo, sizeof(rutaNivel) - largo, "/n%d", nivel);
+                salida << "DIR " << rutaNivel << "\n";
+                creados++;
+                if (creados < nodos) {
+                    salida << "FILE " << rutaNivel << "/hoja contenido " << c << "_" << nivel << "\n";
+                    creados++;
+                }
+            }
+        }
+    } else if (strcmp(forma, "grupos") == 0) {
+        long creados = 0;
+        for (int g = 0; creados < nodos; g++) {
+            salida << "DIR /g" << g << "\n";
+            creados++;
+            for (int sub = 0; sub < 10 && creados < nodos; sub++) {
+                salida << "DIR /g" << g << "/s" << sub << "\n";
+                creados++;
+                for (int a = 0; a < 100 && creados < nodos; a++, creados++) {
+                    salida << "FILE /g" << g << "/s" << sub << "/archivo_" << a << " contenido del archivo " << a << "\n";
+                }
+            }
+        }
+    } else {
+        const int PROFUNDIDAD_MAXIMA = 30;
+        long capacidad = nodos / 4 + 2;
+        char** rutas = new char*[capacidad];
+        int* profundidades = new int[capacidad];
+        long directorios = 1;
+        rutas[0] = new char[1];
+        rutas[0][0] = '\0';
+        profundidades[0] = 0;
+        unsigned int semilla = 2024;
+        char nombre[LONGITUD_MAX_RUTA];
+        for (long i = 0; i < nodos; i++) {
+            semilla = semilla * 1103515245 + 12345;
+            long padre = (long)((semilla >> 8) % directorios);
+            semilla = semilla * 1103515245 + 12345;
+            bool esDirectorio = (semilla >> 16) % 100 < 15 && profundidades[padre] < PROFUNDIDAD_MAXIMA &&
+                                directorios < capacidad;
+            int largo = snprintf(nombre, sizeof(nombre), "%s/%s_%ld", rutas[padre], esDirectorio ? "dir" : "archivo", i);
+            if (esDirectorio) {
+                salida << "DIR " << nombre << "\n";
+                rutas[directorios] = new char[largo + 1];
+                memcpy(rutas[directorios], nombre, largo + 1);
+                profundidades[directorios] = profundidades[padre] + 1;
+                directorios++;
+            } else {
+                salida << "FILE " << nombre << " contenido " << i << "\n";
+            }
+        }
+        for (long d = 0; d < directorios; d++) delete[] rutas[d];
+        delete[] rutas;
+        delete[] profundidades;
+    }
+    return true;
+}
+
+// Genera un árbol sintético de la forma dada y lo carga sin mostrar los mensajes de la carga.
+// Devuelve nullptr si la forma no existe o la carga falla.
+Directorio* cargarArbolSintetico(const char* forma, long nodos) {
+    const char* rutaEntrada = "balatro_bench_sintetico.txt";
+    if (!generarArbolSintetico(rutaEntrada, forma, nodos)) return nullptr;
+    BufferNulo bufferNulo;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    Directorio* raiz = nullptr;
+    cargarSistemaArchivos(rutaEntrada, raiz);
+    cout.rdbuf(salidaOriginal);
+    remove(rutaEntrada);
+    return raiz;
+}
+
+// Compara carga y liberación del árbol con el asignador agrupado y con new/delete por nodo
+void benchmarkAsignador(int totalArchivos) {
+    const char* rutaSnapshot = "balatro_bench_asignador.tmp";
+    int directorios = totalArchivos / 1000 > 0 ? totalArchivos / 1000 : 1;
+    escribirSnapshotSintetico(rutaSnapshot, directorios, totalArchivos / directorios);
+
+    BufferNulo bufferNulo;
+    for (int modo = 0; modo < 2; modo++) {
+        asignadorAgrupado = (modo == 0);
+        Directorio* raiz = nullptr;
+
+        streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+        auto inicio = chrono::steady_clock::now();
+        cargarSistemaArchivos(rutaSnapshot, raiz);
+        double tiempoCarga = segundosDesde(inicio);
+        cout.rdbuf(salidaOriginal);
+
+        cout << "asignador " << (asignadorAgrupado ? "agrupado" : "new/delete") << ": " << totalArchivos << " archivos" << endl;
+        if (asignadorAgrupado) imprimirEstadisticasAsignador();
+
+        inicio = chrono::steady_clock::now();
+        liberarSistemaArchivos(raiz);
+        double tiempoLiberacion = segundosDesde(inicio);
+        cout << "  carga: " << tiempoCarga << " s, liberacion: " << tiempoLiberacion << " s" << endl;
+    }
+    asignadorAgrupado = true;
+    remove(rutaSnapshot);
+}
+
+// Resuelve repetidamente una ruta profunda (/n0/n1/.../nK) en directorios anchos,
+// con y sin la caché de rutas
+void benchmarkCacheRutas(int consultas) {
+    const int profundidad = 12, anchura = 200;
+    Directorio* raiz = crearDirectorio("/");
+    Directorio* actual = raiz;
+    char nombre[64];
+    char rutaProfunda[LONGITUD_MAX_RUTA] = "";
+    for (int nivel = 0; nivel < profundidad; nivel++) {
+        for (int i = 0; i < anchura; i++) { // Hermanos que alargan la búsqueda lineal sin índice
+            snprintf(nombre, sizeof(nombre), "hermano_%d", i);
+            comando_mkdir(actual, nombre);
+        }
+        snprintf(nombre, sizeof(nombre), "n%d", nivel);
+        comando_mkdir(actual, nombre);
+        actual = buscarDirectorio(actual, nombre);
+        strcat(rutaProfunda, "/");
+        strcat(rutaProfunda, nombre);
+    }
+
+    cout << "cache_rutas: " << consultas << " consultas de " << rutaProfunda << endl;
+    for (int modo = 0; modo < 2; modo++) {
+        cacheRutasActiva = (modo == 0);
+        auto inicio = chrono::steady_clock::now();
+        for (int i = 0; i < consultas; i++) {
+            if (navegarRuta(raiz, rutaProfunda, raiz) != actual) {
+                cout << "  resultado incorrecto" << endl;
+                break;
+            }
+        }
+        double tiempo = segundosDesde(inicio);
+        cout << "  " << (cacheRutasActiva ? "con cache" : "sin cache") << ": "
+             << (tiempo * 1e9 / consultas) << " ns/consulta" << endl;
+    }
+    cacheRutasActiva = true;
+    imprimirEstadisticasCacheRutas();
+    eliminarDirectorio(raiz);
+}
+
+// Escribe un snapshot de 'lineas' nodos en el orden de guardarSistemaArchivos
+// (/gN/sM/archivo_K) y mide la carga
+void benchmarkCarga(long lineas) {
+    const char* rutaSnapshot = "balatro_bench_carga.tmp";
+    generarArbolSintetico(rutaSnapshot, "grupos", lineas);
+
+    BufferNulo bufferNulo;
+    Directorio* raiz = nullptr;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    auto inicio = chrono::steady_clock::now();
+    cargarSistemaArchivos(rutaSnapshot, raiz);
+    double tiempo = segundosDesde(inicio);
+    cout.rdbuf(salidaOriginal);
+
+    cout << "carga: " << lineas << " lineas en " << tiempo << " s ("
+         << (long)(lineas / tiempo) << " lineas/s)" << endl;
+    liberarSistemaArchivos(raiz);
+    remove(rutaSnapshot);
+}
+
+// KB residentes del proceso (VmRSS), o -1 si no se puede leer
+long memoriaResidenteKB() {
+    ifstream estado("/proc/self/status");
+    char linea[256];
+    while (estado.getline(linea, sizeof(linea))) {
+        if (strncmp(linea, "VmRSS:", 6) == 0) return atol(linea + 6);
+    }
+    return -1;
+}
+
+// Ejecuta una medición en un proceso hijo (en POSIX) para que la memoria de una no
+// afecte a la siguiente
+void ejecutarAislado(void (*medicion)(const char*, const char*), const char* etiqueta, const char* ruta) {
+#ifndef _WIN32
+    cout.flush();
+    pid_t hijo = fork();
+    if (hijo == 0) {
+        medicion(etiqueta, ruta);
+        cout.flush();
+        _exit(0);
+    }
+    int estado;
+    waitpid(hijo, &estado, 0);
+#else
+    medicion(etiqueta, ruta);
+#endif
+}
+
+void convertirABinario(const char* rutaTexto, const char* rutaBinario) {
+    BufferNulo bufferNulo;
+    Directorio* raiz = nullptr;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    cargarSistemaArchivos(rutaTexto, raiz);
+    guardarSnapshotBinario(rutaBinario, raiz);
+    cout.rdbuf(salidaOriginal);
+    liberarSistemaArchivos(raiz);
+}
+
+// Carga un snapshot y reporta tiempo y memoria residente añadida
+void medirArranque(const char* etiqueta, const char* rutaSnapshot) {
+    BufferNulo bufferNulo;
+    Directorio* raiz = nullptr;
+    long memoriaInicial = memoriaResidenteKB();
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    auto inicio = chrono::steady_clock::now();
+    cargarSnapshot(rutaSnapshot, raiz);
+    double tiempo = segundosDesde(inicio);
+    cout.rdbuf(salidaOriginal);
+    cout << "  " << etiqueta << ": " << tiempo << " s, RSS +" << (memoriaResidenteKB() - memoriaInicial) << " KB" << endl;
+    liberarSistemaArchivos(raiz);
+}
+
+void medirArranquePerezoso(const char* etiqueta, const char* rutaSnapshot) {
+    cargaPerezosa = true;
+    medirArranque(etiqueta, rutaSnapshot);
+}
+
+// Compara el arranque desde el snapshot de texto (completo y perezoso) y desde el binario del
+// mismo árbol
+void benchmarkArranque(int totalArchivos) {
+    const char* rutaTexto = "balatro_bench_arranque.txt";
+    const char* rutaBinario = "balatro_bench_arranque.bin";
+    int directorios = totalArchivos / 1000 > 0 ? totalArchivos / 1000 : 1;
+    escribirSnapshotSintetico(rutaTexto, directorios, totalArchivos / directorios, 256);
+    ejecutarAislado(convertirABinario, rutaTexto, rutaBinario);
+
+    cout << "arranque: " << totalArchivos << " archivos de ~256 bytes" << endl;
+    ejecutarAislado(medirArranque, "texto", rutaTexto);
+    ejecutarAislado(medirArranquePerezoso, "texto --lazy", rutaTexto);
+    ejecutarAislado(medirArranque, "binario (mmap)", rutaBinario);
+    remove(rutaTexto);
+    remove(rutaBinario);
+}
+
+// Compara el costo de 'save' con diario (sincronizar los cambios) frente a reescribir el
+// snapshot completo, tras unos pocos cambios sobre un árbol grande
+void benchmarkDiario(int totalArchivos) {
+    const char* rutaSnapshot = "balatro_bench_diario.txt";
+    int directorios = totalArchivos / 1000 > 0 ? totalArchivos / 1000 : 1;
+    escribirSnapshotSintetico(rutaSnapshot, directorios, totalArchivos / directorios);
+
+    BufferNulo bufferNulo;
+    Directorio* raiz = nullptr;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    cargarSistemaArchivos(rutaSnapshot, raiz);
+    abrirDiario(rutaSnapshot, raiz);
+
+    const int cambios = 100;
+    char nombre[32];
+    for (int i = 0; i < cambios; i++) {
+        snprintf(nombre, sizeof(nombre), "cambio_%d", i);
+        comando_mkdir(raiz, nombre);
+    }
+    auto inicio = chrono::steady_clock::now();
+    sincronizarDiario();
+    double tiempoDiario = segundosDesde(inicio);
+
+    inicio = chrono::steady_clock::now();
+    checkpoint(rutaSnapshot, raiz);
+    double tiempoCompleto = segundosDesde(inicio);
+    cout.rdbuf(salidaOriginal);
+
+    cout << "diario: " << cambios << " cambios sobre " << totalArchivos << " archivos" << endl;
+    cout << "  save con diario: " << tiempoDiario * 1e3 << " ms" << endl;
+    cout << "  snapshot completo: " << tiempoCompleto * 1e3 << " ms" << endl;
+
+    cerrarDiario();
+    liberarSistemaArchivos(raiz);
+    remove(rutaSnapshot);
+    remove(diario.ruta);
+}
+
+// Suma simple para comparar salidas byte a byte
+unsigned long long huellaArchivo(const char* ruta) {
+    ifstream entrada(ruta, ios::binary);
+    unsigned long long huella = 1469598103934665603ull;
+    char bloque[65536];
+    while (entrada.read(bloque, sizeof(bloque)) || entrada.gcount() > 0) {
+        for (streamsize i = 0; i < entrada.gcount(); i++) {
+            huella = (huella ^ (unsigned char)bloque[i]) * 1099511628211ull;
+        }
+    }
+    return huella;
+}
+
+// Guarda el mismo árbol con 1, 2, 4, 8 y 16 hilos y verifica que la salida sea idéntica
+void benchmarkGuardado(long lineas) {
+    const char* rutaEntrada = "balatro_bench_guardado.txt";
+    const char* rutaSalida = "balatro_bench_guardado.out";
+    generarArbolSintetico(rutaEntrada, "grupos", lineas);
+
+    BufferNulo bufferNulo;
+    Directorio* raiz = nullptr;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    cargarSistemaArchivos(rutaEntrada, raiz);
+    cout.rdbuf(salidaOriginal);
+
+    cout << "guardado: " << lineas << " lineas, " << thread::hardware_concurrency() << " nucleos" << endl;
+    unsigned long long huellaReferencia = 0;
+    double tiempoReferencia = 0;
+    for (int hilos = 1; hilos <= 16; hilos *= 2) {
+        cout.rdbuf(&bufferNulo);
+        auto inicio = chrono::steady_clock::now();
+        guardarSistemaArchivos(rutaSalida, raiz, hilos);
+        double tiempo = segundosDesde(inicio);
+        cout.rdbuf(salidaOriginal);
+
+        unsigned long long huella = huellaArchivo(rutaSalida);
+        if (hilos == 1) {
+            huellaReferencia = huella;
+            tiempoReferencia = tiempo;
+        }
+        cout << "  " << hilos << " hilos: " << tiempo << " s (x" << (tiempoReferencia / tiempo) << ")"
+             << (huella == huellaReferencia ? "" : " SALIDA DISTINTA") << endl;
+    }
+    liberarSistemaArchivos(raiz);
+    remove(rutaEntrada);
+    remove(rutaSalida);
+}
+
+long long tamanoEnDisco(const char* ruta) {
+    ifstream entrada(ruta, ios::binary | ios::ate);
+    return entrada.is_open() ? (long long)entrada.tellg() : -1;
+}
+
+// Muchos archivos que comparten unas pocas plantillas de ~1 KB: memoria de los contenidos
+// y tamaño de los snapshots de texto y binario con deduplicación
+void benchmarkContenidos(long archivos) {
+    const int PLANTILLAS = 16;
+    const int ARCHIVOS_POR_DIR = 1000;
+    const char* rutaEntrada = "balatro_bench_contenidos.txt";
+    const char* rutaTexto = "balatro_bench_contenidos.out";
+    const char* rutaBinario = "balatro_bench_contenidos.bin";
+    {
+        ofstream salida(rutaEntrada);
+        for (long d = 0; d * ARCHIVOS_POR_DIR < archivos; d++) {
+            salida << "DIR /dir_" << d << "\n";
+            for (long a = d * ARCHIVOS_POR_DIR; a < archivos && a < (d + 1) * ARCHIVOS_POR_DIR; a++) {
+                salida << "FILE /dir_" << d << "/archivo_" << a << ".txt plantilla " << (a % PLANTILLAS) << " "
+                       << string(1000, (char)('a' + a % PLANTILLAS)) << "\n";
+            }
+        }
+    }
+
+    BufferNulo bufferNulo;
+    Directorio* raiz = nullptr;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    auto inicio = chrono::steady_clock::now();
+    cargarSistemaArchivos(rutaEntrada, raiz);
+    double tiempoCarga = segundosDesde(inicio);
+    guardarSistemaArchivos(rutaTexto, raiz);
+    guardarSnapshotBinario(rutaBinario, raiz);
+    cout.rdbuf(salidaOriginal);
+
+    cout << "contenidos: " << archivos << " archivos, " << PLANTILLAS << " plantillas de ~1 KB, carga en "
+         << tiempoCarga << " s" << endl;
+    imprimirEstadisticasContenidos();
+    cout << "  snapshot de texto: " << tamanoEnDisco(rutaEntrada) << " bytes sin deduplicar, "
+         << tamanoEnDisco(rutaTexto) << " bytes guardados" << endl;
+    cout << "  snapshot binario: " << tamanoEnDisco(rutaBinario) << " bytes" << endl;
+
+    liberarSistemaArchivos(raiz);
+    remove(rutaEntrada);
+    remove(rutaTexto);
+    remove(rutaBinario);
+}
+
+// Contenidos únicos con texto repetitivo (tipo registro) de 200 B a ~8 KB, internados con
+// distintos umbrales de compresión: memoria, razón de compresión y latencia de lectura
+void benchmarkCompresion(long cantidad) {
+    char** contenidos = new char*[cantidad];
+    size_t* longitudes = new size_t[cantidad];
+    unsigned int semilla = 12345;
+    for (long i = 0; i < cantidad; i++) {
+        BufferBytes texto = {nullptr, 0, 0};
+        semilla = semilla * 1103515245 + 12345;
+        long lineas = 3 + (semilla >> 16) % 120;
+        for (long l = 0; l < lineas; l++) {
+            char linea[96];
+            int largo = snprintf(linea, sizeof(linea), "%06ld INFO proceso %ld: operación %ld completada en %ld ms\n",
+                                 i, (i * 7 + l) % 97, l, (i * 31 + l * 17) % 1000);
+            bufferAgregar(texto, linea, largo);
+        }
+        contenidos[i] = texto.datos;
+        longitudes[i] = texto.longitud;
+    }
+
+    size_t umbrales[] = {0, 256, 1024, 4096};
+    size_t umbralOriginal = umbralCompresion;
+    cout << "compresion: " << cantidad << " contenidos únicos" << endl;
+    for (size_t umbral : umbrales) {
+        umbralCompresion = umbral;
+        estadisticasCompresion = {};
+        char** internados = new char*[cantidad];
+        auto inicio = chrono::steady_clock::now();
+        for (long i = 0; i < cantidad; i++) internados[i] = internarContenido(contenidos[i], longitudes[i]);
+        double tiempoInternado = segundosDesde(inicio);
+
+        // Lecturas con un conjunto caliente de 8 archivos y el resto al azar
+        const long LECTURAS = 100000;
+        size_t suma = 0;
+        inicio = chrono::steady_clock::now();
+        for (long r = 0; r < LECTURAS; r++) {
+            semilla = semilla * 1103515245 + 12345;
+            long i = (r % 4 != 0) ? (long)((semilla >> 16) % 8) : (long)((semilla >> 8) % cantidad);
+            size_t largo;
+            const char* texto = textoContenido(internados[i], largo);
+            suma += (unsigned char)texto[largo / 2];
+        }
+        double tiempoLectura = segundosDesde(inicio);
+
+        cout << "  umbral " << umbral << ": " << almacen.bytesAlmacenados << " bytes almacenados de "
+             << almacen.bytesLogicos << ", internado " << tiempoInternado << " s, lectura "
+             << (tiempoLectura / LECTURAS * 1e9) << " ns (control " << suma % 10 << ")" << endl;
+        imprimirEstadisticasCompresion();
+        for (long i = 0; i < cantidad; i++) liberarContenido(internados[i]);
+        delete[] internados;
+    }
+    umbralCompresion = umbralOriginal;
+    for (long i = 0; i < cantidad; i++) delete[] contenidos[i];
+    delete[] contenidos;
+    delete[] longitudes;
+}
+
+// Muestra de nodos del árbol para las mediciones de búsqueda: hasta MUESTRAS_SUITE directorios
+// y archivos tomados al azar (muestreo de reservorio) y el total de cada tipo
+const int MUESTRAS_SUITE = 4096;
+
+struct MuestraArbol {
+    Directorio* directorios[MUESTRAS_SUITE];
+    Directorio* padresArchivos[MUESTRAS_SUITE];
+    Archivo* archivos[MUESTRAS_SUITE];
+    long totalDirectorios;
+    long totalArchivos;
+    int profundidadMaxima;
+};
+
+void muestrearArbol(Directorio* raiz, MuestraArbol& muestra) {
+    muestra.totalDirectorios = 0;
+    muestra.totalArchivos = 0;
+    muestra.profundidadMaxima = 0;
+    unsigned int semilla = 77;
+    long capacidad = 1024, cantidad = 0;
+    Directorio** pila = new Directorio*[capacidad];
+    int* profundidades = new int[capacidad];
+    pila[cantidad] = raiz;
+    profundidades[cantidad++] = 0;
+    while (cantidad > 0) {
+        cantidad--;
+        Directorio* directorio = pila[cantidad];
+        int profundidad = profundidades[cantidad];
+        if (profundidad > muestra.profundidadMaxima) muestra.profundidadMaxima = profundidad;
+        semilla = semilla * 1103515245 + 12345;
+        long posicion = muestra.totalDirectorios < MUESTRAS_SUITE ? muestra.totalDirectorios
+                        : (long)((semilla >> 4) % (muestra.totalDirectorios + 1));
+        if (posicion < MUESTRAS_SUITE) muestra.directorios[posicion] = directorio;
+        muestra.totalDirectorios++;
+
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+            semilla = semilla * 1103515245 + 12345;
+            posicion = muestra.totalArchivos < MUESTRAS_SUITE ? muestra.totalArchivos
+                       : (long)((semilla >> 4) % (muestra.totalArchivos + 1));
+            if (posicion < MUESTRAS_SUITE) {
+                muestra.padresArchivos[posicion] = directorio;
+                muestra.archivos[posicion] = a;
+            }
+            muestra.totalArchivos++;
+        }
+        for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+            if (cantidad == capacidad) {
+                Directorio** nuevaPila = new Directorio*[capacidad * 2];
+                int* nuevasProfundidades = new int[capacidad * 2];
+                memcpy(nuevaPila, pila, capacidad * sizeof(Directorio*));
+                memcpy(nuevasProfundidades, profundidades, capacidad * sizeof(int));
+                delete[] pila;
+                delete[] profundidades;
+                pila = nuevaPila;
+                profundidades = nuevasProfundidades;
+                capacidad *= 2;
+            }
+            pila[cantidad] = d;
+            profundidades[cantidad++] = profundidad + 1;
+        }
+    }
+    delete[] pila;
+    delete[] profundidades;
+}
+
+void imprimirMedicionJSON(const char* nombre, long operaciones, double segundos, bool ultima = false) {
+    cout << "        \"" << nombre << "\": {\"operaciones\": " << operaciones << ", \"segundos\": " << segundos
+         << ", \"ns_por_operacion\": " << (operaciones > 0 ? segundos * 1e9 / operaciones : 0) << "}"
+         << (ultima ? "\n" : ",\n");
+}
+
+// Mide las operaciones principales sobre un árbol sintético de la forma dada e imprime un
+// objeto JSON con los resultados (el resto de la salida de los comandos se descarta)
+void medirFormaSuite(const char* forma, long nodos, bool ultima) {
+    const char* rutaEntrada = "balatro_bench_suite.txt";
+    const char* rutaSalida = "balatro_bench_suite.out";
+    const long CONSULTAS = 1000000;
+    generarArbolSintetico(rutaEntrada, forma, nodos);
+
+    BufferNulo bufferNulo;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    Directorio* raiz = nullptr;
+    auto inicio = chrono::steady_clock::now();
+    cargarSistemaArchivos(rutaEntrada, raiz);
+    double tiempoCarga = segundosDesde(inicio);
+
+    MuestraArbol* muestra = new MuestraArbol;
+    muestrearArbol(raiz, *muestra);
+    long nodosCargados = muestra->totalDirectorios + muestra->totalArchivos;
+    int directoriosMuestra = muestra->totalDirectorios < MUESTRAS_SUITE ? (int)muestra->totalDirectorios : MUESTRAS_SUITE;
+    int archivosMuestra = muestra->totalArchivos < MUESTRAS_SUITE ? (int)muestra->totalArchivos : MUESTRAS_SUITE;
+
+    inicio = chrono::steady_clock::now();
+    guardarSistemaArchivos(rutaSalida, raiz);
+    double tiempoGuardado = segundosDesde(inicio);
+
+    // Rutas absolutas de los directorios de la muestra, que también mide obtenerRutaCompleta
+    BufferBytes* rutas = new BufferBytes[directoriosMuestra]();
+    inicio = chrono::steady_clock::now();
+    for (long i = 0; i < CONSULTAS; i++) {
+        obtenerRutaCompleta(muestra->directorios[i % directoriosMuestra], rutas[i % directoriosMuestra]);
+    }
+    double tiempoRutaCompleta = segundosDesde(inicio);
+
+    long fallos = 0;
+    inicio = chrono::steady_clock::now();
+    for (long i = 0; i < CONSULTAS; i++) {
+        int j = (int)((i * 2654435761UL) % directoriosMuestra);
+        if (navegarRuta(raiz, rutas[j].datos, raiz) != muestra->directorios[j]) fallos++;
+    }
+    double tiempoNavegar = segundosDesde(inicio);
+
+    double tiempoBuscar = 0;
+    if (archivosMuestra > 0) {
+        inicio = chrono::steady_clock::now();
+        for (long i = 0; i < CONSULTAS; i++) {
+            int j = (int)((i * 2654435761UL) % archivosMuestra);
+            if (buscarArchivo(muestra->padresArchivos[j], muestra->archivos[j]->nombre) != muestra->archivos[j]) fallos++;
+        }
+        tiempoBuscar = segundosDesde(inicio);
+    }
+
+    // Inserciones en bloque en un directorio nuevo, mitad mkdir y mitad touch
+    long inserciones = nodos < 200000 ? nodos : 200000;
+    comando_mkdir(raiz, "insercion_suite");
+    Directorio* destino = buscarDirectorio(raiz, "insercion_suite");
+    char nombre[64];
+    inicio = chrono::steady_clock::now();
+    for (long i = 0; i < inserciones; i++) {
+        snprintf(nombre, sizeof(nombre), "nuevo_%ld", i);
+        if (i % 2 == 0) comando_mkdir(destino, nombre);
+        else comando_touch(destino, nombre);
+    }
+    double tiempoInsercion = segundosDesde(inicio);
+
+    // rm de cada subárbol de la raíz, que en conjunto son todos los nodos
+    long subarboles = 0;
+    for (Directorio* d = raiz->subdirectorios; d; d = d->siguienteDirectorio) subarboles++;
+    char (*nombresRaiz)[LONGITUD_MAX_RUTA] = new char[subarboles > 0 ? subarboles : 1][LONGITUD_MAX_RUTA];
+    long k = 0;
+    for (Directorio* d = raiz->subdirectorios; d; d = d->siguienteDirectorio, k++) {
+        snprintf(nombresRaiz[k], LONGITUD_MAX_RUTA, "/%s", d->nombre);
+    }
+    inicio = chrono::steady_clock::now();
+    { // Incluye la liberación de lo que rm deja al reclamador
+        unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+        for (k = 0; k < subarboles; k++) comando_rm(raiz, nombresRaiz[k], raiz);
+        reclamarPendientes();
+    }
+    double tiempoRm = segundosDesde(inicio);
+    cout.rdbuf(salidaOriginal);
+
+    cout << "    {\n";
+    cout << "      \"forma\": \"" << forma << "\",\n";
+    cout << "      \"nodos\": " << nodosCargados << ",\n";
+    cout << "      \"directorios\": " << muestra->totalDirectorios << ",\n";
+    cout << "      \"archivos\": " << muestra->totalArchivos << ",\n";
+    cout << "      \"profundidad_maxima\": " << muestra->profundidadMaxima << ",\n";
+    cout << "      \"snapshot_bytes\": " << tamanoEnDisco(rutaEntrada) << ",\n";
+    cout << "      \"fallos\": " << fallos << ",\n";
+    cout << "      \"mediciones\": {\n";
+    imprimirMedicionJSON("cargarSistemaArchivos", nodosCargados, tiempoCarga);
+    imprimirMedicionJSON("guardarSistemaArchivos", nodosCargados, tiempoGuardado);
+    imprimirMedicionJSON("navegarRuta", CONSULTAS, tiempoNavegar);
+    imprimirMedicionJSON("buscarArchivo", archivosMuestra > 0 ? CONSULTAS : 0, tiempoBuscar);
+    imprimirMedicionJSON("obtenerRutaCompleta", CONSULTAS, tiempoRutaCompleta);
+    imprimirMedicionJSON("insercion_mkdir_touch", inserciones, tiempoInsercion);
+    imprimirMedicionJSON("rm_subarboles", nodosCargados + inserciones, tiempoRm, true);
+    cout << "      }\n";
+    cout << "    }" << (ultima ? "\n" : ",\n");
+
+    for (int i = 0; i < directoriosMuestra; i++) bufferLiberar(rutas[i]);
+    delete[] rutas;
+    delete[] nombresRaiz;
+    delete muestra;
+    liberarSistemaArchivos(raiz);
+    remove(rutaEntrada);
+    remove(rutaSalida);
+}
+
+// Suite completa: una o todas las formas de árbol, con la salida en JSON para comparar versiones
+bool benchmarkSuite(long nodos, const char* forma) {
+    const char* formas[] = {"ancho", "profundo", "mixto"};
+    int cantidadFormas = 3;
+    if (forma) {
+        bool valida = false;
+        for (int i = 0; i < cantidadFormas; i++) valida = valida || strcmp(formas[i], forma) == 0;
+        if (!valida) {
+            cerr << "Error: Forma de árbol desconocida '" << forma << "' (ancho, profundo o mixto)." << endl;
+            return false;
+        }
+        formas[0] = forma;
+        cantidadFormas = 1;
+    }
+    cout << "{\n";
+    cout << "  \"benchmark\": \"suite\",\n";
+    cout << "  \"nodos_pedidos\": " << nodos << ",\n";
+    cout << "  \"hilos_guardado\": " << hilosGuardado << ",\n";
+    cout << "  \"formas\": [\n";
+    for (int i = 0; i < cantidadFormas; i++) medirFormaSuite(formas[i], nodos, i == cantidadFormas - 1);
+    cout << "  ]\n";
+    cout << "}" << endl;
+    return true;
+}
+
+// Sesiones concurrentes sobre el mismo árbol: cada hilo tiene una sesión lectora que se mueve
+// por /base_N haciendo cd, ls y cat (y a veces entra en directorios que otro hilo está creando
+// y borrando) y una sesión escritora fija en /estres_H que hace mkdir y rm.
+const int DIRECTORIOS_ESTRES = 100;
+const int ARCHIVOS_ESTRES = 100;
+
+struct TrabajoEstres {
+    Directorio* raiz;
+    int hilo;
+    int hilos;
+    long operaciones;
+};
+
+void sesionEstres(TrabajoEstres* trabajo) {
+    BufferNulo bufferNulo;
+    ostream salidaNula(&bufferNulo);
+    salidaSesion = &salidaNula;
+
+    char linea[LONGITUD_MAX_RUTA];
+    snprintf(linea, sizeof(linea), "/estres_%d", trabajo->hilo);
+    Sesion lectora = {trabajo->raiz, nullptr};
+    Sesion escritora = {nullptr, nullptr};
+    {
+        shared_lock<shared_mutex> bloqueo(cerrojoArbol);
+        escritora.directorioActual = navegarRuta(trabajo->raiz, linea, trabajo->raiz);
+    }
+    registrarSesion(&lectora);
+    registrarSesion(&escritora);
+
+    unsigned int semilla = 1234 + trabajo->hilo * 7919;
+    long creados = 0, borrados = 0;
+    for (long i = 0; i < trabajo->operaciones; i++) {
+        semilla = semilla * 1103515245 + 12345;
+        int tipo = (int)((semilla >> 16) % 100);
+        semilla = semilla * 1103515245 + 12345;
+        unsigned int azar = semilla >> 8;
+        Sesion* sesion = &lectora;
+        if (tipo < 35) {
+            snprintf(linea, sizeof(linea), "cd /base_%u", azar % DIRECTORIOS_ESTRES);
+        } else if (tipo < 40) {
+            snprintf(linea, sizeof(linea), "cd /estres_%u/d_%u", azar % trabajo->hilos, (azar >> 8) % 64);
+        } else if (tipo < 65) {
+            snprintf(linea, sizeof(linea), "ls --limit 20");
+        } else if (tipo < 90) {
+            snprintf(linea, sizeof(linea), "cat archivo_%u", azar % ARCHIVOS_ESTRES);
+        } else if (tipo < 95 || borrados == creados) {
+            sesion = &escritora;
+            snprintf(linea, sizeof(linea), "mkdir d_%ld", creados++);
+        } else {
+            sesion = &escritora;
+            snprintf(linea, sizeof(linea), "rm d_%ld", borrados++);
+        }
+        procesarComando(linea, sesion->directorioActual, trabajo->raiz, "balatro_bench_estres.tmp");
+    }
+    while (borrados < creados) {
+        snprintf(linea, sizeof(linea), "rm d_%ld", borrados++);
+        procesarComando(linea, escritora.directorioActual, trabajo->raiz, "balatro_bench_estres.tmp");
+    }
+
+    quitarSesion(&lectora);
+    quitarSesion(&escritora);
+    salidaSesion = &cout;
+}
+
+void benchmarkEstres(int maxHilos, long operacionesPorHilo) {
+    if (maxHilos < 1) maxHilos = 1;
+    if (maxHilos > MAX_HILOS) maxHilos = MAX_HILOS;
+    Directorio* raiz = crearDirectorio("/");
+    BufferNulo bufferNulo;
+    streambuf* salidaOriginal = cout.rdbuf(&bufferNulo);
+    char nombre[64];
+    for (int d = 0; d < DIRECTORIOS_ESTRES; d++) {
+        snprintf(nombre, sizeof(nombre), "base_%d", d);
+        comando_mkdir(raiz, nombre);
+        Directorio* directorio = buscarDirectorio(raiz, nombre);
+        for (int a = 0; a < ARCHIVOS_ESTRES; a++) {
+            snprintf(nombre, sizeof(nombre), "archivo_%d", a);
+            comando_touch(directorio, nombre);
+            // Uno de cada diez supera el umbral de compresión: esos cat pasan por la caché de descomprimidos
+            BufferBytes contenido = {nullptr, 0, 0};
+            for (int r = 0; r < (a % 10 == 0 ? 200 : 1); r++) {
+                bufferAgregarTexto(contenido, nombre);
+                bufferAgregar(contenido, "\n", 1);
+            }
+            buscarArchivo(directorio, nombre)->contenido = internarContenido(contenido.datos, contenido.longitud);
+            bufferLiberar(contenido);
+        }
+    }
+    for (int h = 0; h < maxHilos; h++) {
+        snprintf(nombre, sizeof(nombre), "estres_%d", h);
+        comando_mkdir(raiz, nombre);
+    }
+    cout.rdbuf(salidaOriginal);
+
+    MuestraArbol* muestra = new MuestraArbol;
+    muestrearArbol(raiz, *muestra);
+    long nodosIniciales = muestra->totalDirectorios + muestra->totalArchivos;
+
+    cout << "estres: " << operacionesPorHilo << " operaciones por hilo (60% cd/ls, 25% cat, 10% mkdir/rm, 5% cd a directorios que otros borran)" << endl;
+    double base = 0;
+    // Potencias de dos hasta maxHilos, que siempre se mide aunque no lo sea
+    for (int hilos = 1; hilos <= maxHilos; hilos = (hilos < maxHilos && hilos * 2 > maxHilos) ? maxHilos : hilos * 2) {
+        TrabajoEstres trabajos[MAX_HILOS];
+        thread* ejecutores = new thread[hilos];
+        auto inicio = chrono::steady_clock::now();
+        for (int h = 0; h < hilos; h++) {
+            trabajos[h] = {raiz, h, hilos, operacionesPorHilo};
+            ejecutores[h] = thread(sesionEstres, &trabajos[h]);
+        }
+        for (int h = 0; h < hilos; h++) ejecutores[h].join();
+        double tiempo = segundosDesde(inicio);
+        delete[] ejecutores;
+
+        muestrearArbol(raiz, *muestra);
+        long nodos = muestra->totalDirectorios + muestra->totalArchivos;
+        double porSegundo = hilos * operacionesPorHilo / tiempo;
+        if (hilos == 1) base = porSegundo;
+        cout << "  " << hilos << " hilos: " << (long)porSegundo << " operaciones/s (x" << porSegundo / base << ")"
+             << (nodos == nodosIniciales ? "" : ", ERROR: el árbol no volvió a su estado inicial") << endl;
+    }
+    delete muestra;
+    eliminarDirectorio(raiz);
+}
+
+// find sobre un árbol sintético mixto con 1, 2, 4... hasta maxHilos hilos. Todas las
+// ejecuciones deben encontrar las mismas coincidencias.
+void benchmarkBuscar(long nodos, const char* patron, int maxHilos) {
+    if (maxHilos < 1) maxHilos = 1;
+    if (maxHilos > MAX_HILOS) maxHilos = MAX_HILOS;
+    Directorio* raiz = cargarArbolSintetico("mixto", nodos);
+    if (!raiz) return;
+
+    BufferNulo bufferNulo;
+    ostream salidaNula(&bufferNulo);
+    cout << "buscar: find / -name " << patron << " sobre " << nodos << " nodos" << endl;
+    double base = 0;
+    long esperadas = -1;
+    for (int hilos = 1; hilos <= maxHilos; hilos = (hilos < maxHilos && hilos * 2 > maxHilos) ? maxHilos : hilos * 2) {
+        auto inicio = chrono::steady_clock::now();
+        long coincidencias = buscarPorNombre(raiz, patron, salidaNula, hilos);
+        double tiempo = segundosDesde(inicio);
+        if (hilos == 1) base = tiempo;
+        if (esperadas < 0) esperadas = coincidencias;
+        cout << "  " << hilos << " hilos: " << tiempo * 1000 << " ms, " << (long)(nodos / tiempo) << " nodos/s, "
+             << coincidencias << " coincidencias (x" << base / tiempo << ")"
+             << (coincidencias == esperadas ? "" : ", ERROR: distinto número de coincidencias") << endl;
+    }
+    eliminarDirectorio(raiz);
+}
+
+// grep sobre un árbol sintético mixto: construcción y memoria del índice de trigramas, latencia
+// de consultas comparada con revisar todos los archivos y costo de mantenerlo al editar.
+// Ambos caminos deben encontrar las mismas líneas.
+long grepSinIndice(Directorio* raiz, const char* texto) {
+    size_t largo = strlen(texto);
+    long lineas = 0;
+    RecorridoSubarbol recorrido;
+    recorridoIniciar(recorrido, raiz);
+    while (Directorio* directorio = recorridoSiguiente(recorrido)) {
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) lineas += grepArchivo(a, texto, largo);
+    }
+    return lineas;
+}
+
+void benchmarkGrep(long nodos, long ediciones) {
+    Directorio* raiz = cargarArbolSintetico("mixto", nodos);
+    if (!raiz) return;
+
+    BufferNulo bufferNulo;
+    ostream salidaNula(&bufferNulo);
+    salidaSesion = &salidaNula;
+    double construccion = asegurarIndiceTrigramas(raiz);
+    cout << "grep: " << nodos << " nodos, " << trigramas.vivos << " archivos" << endl;
+    cout << "  índice: " << construccion * 1000 << " ms en construirse, " << trigramas.cantidadListas << " trigramas, "
+         << trigramas.entradas << " entradas, " << memoriaIndiceTrigramas() / 1024 << " KB" << endl;
+
+    const char* consultas[] = {"contenido 12345", "77777", "999", "sin coincidencias", "tenido"};
+    for (const char* texto : consultas) {
+        const int repeticiones = 20;
+        long conIndice = 0;
+        auto inicio = chrono::steady_clock::now();
+        for (int r = 0; r < repeticiones; r++) conIndice = comando_grep(raiz, raiz, texto);
+        double tiempoIndice = segundosDesde(inicio) / repeticiones;
+        inicio = chrono::steady_clock::now();
+        long sinIndice = grepSinIndice(raiz, texto);
+        double tiempoRecorrido = segundosDesde(inicio);
+        cout << "  \"" << texto << "\": " << conIndice << " líneas, " << tiempoIndice * 1e6 << " us con índice, "
+             << tiempoRecorrido * 1e6 << " us revisando todo (x" << tiempoRecorrido / tiempoIndice << ")"
+             << (conIndice == sinIndice ? "" : ", ERROR: distinto número de líneas") << endl;
+    }
+
+    // Ediciones: cada append reindexa el archivo y deja un identificador muerto
+    Archivo** archivos = new Archivo*[trigramas.vivos];
+    uint32_t cantidad = 0;
+    for (uint32_t id = 1; id < trigramas.siguienteId; id++) {
+        if (trigramas.archivosPorId[id]) archivos[cantidad++] = trigramas.archivosPorId[id];
+    }
+    if (cantidad > 0) {
+        uint32_t compactacionesIniciales = trigramas.compactaciones;
+        auto inicio = chrono::steady_clock::now();
+        for (long i = 0; i < ediciones; i++) {
+            Archivo* archivo = archivos[(uint32_t)((i * 2654435761u) % cantidad)];
+            contenidoEscribir(archivo, longitudContenido(archivo), " editado", 8);
+        }
+        double tiempo = segundosDesde(inicio);
+        long lineas = comando_grep(raiz, raiz, "editado");
+        cout << "  " << ediciones << " appends: " << tiempo / ediciones * 1e6 << " us cada uno con reindexado, "
+             << trigramas.compactaciones - compactacionesIniciales << " compactaciones; \"editado\": " << lineas
+             << " líneas" << (lineas == grepSinIndice(raiz, "editado") ? "" : ", ERROR: índice desactualizado") << endl;
+    }
+    delete[] archivos;
+    salidaSesion = &cout;
+    liberarIndiceTrigramas();
+    eliminarDirectorio(raiz);
+}
+
+// cp -r con estructura compartida sobre un árbol sintético mixto: costo y memoria de la copia,
+// de modificar 'modificados' archivos del original (cada uno separa la copia a lo largo de su
+// camino) y de materializarla entera, que es lo que costaría una copia profunda.
+void benchmarkCopias(long nodos, long modificados) {
+    Directorio* datos = cargarArbolSintetico("mixto", nodos);
+    if (!datos) return;
+
+    // El árbol cargado pasa a ser /datos para que la copia tenga dónde quedar
+    Directorio* raiz = crearDirectorio("/");
+    liberarNombre(datos->nombre);
+    datos->nombre = copiarNombre("datos");
+    anadirDirectorioALista(raiz, datos);
+
+    Archivo** archivos = new Archivo*[datos->archivosSubarbol > 0 ? datos->archivosSubarbol : 1];
+    long cantidad = 0;
+    RecorridoSubarbol recorrido;
+    recorridoIniciar(recorrido, datos);
+    while (Directorio* directorio = recorridoSiguiente(recorrido)) {
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) archivos[cantidad++] = a;
+    }
+
+    cout << "copias: " << nodos << " nodos, " << datos->archivosSubarbol << " archivos, "
+         << datos->directoriosSubarbol << " directorios, " << datos->bytesSubarbol << " bytes" << endl;
+    uint64_t bytesOriginales = datos->bytesSubarbol;
+    long memoriaInicial = memoriaResidenteKB();
+    auto inicio = chrono::steady_clock::now();
+    Directorio* copia = crearCopiaPendiente(datos, "datos@copia");
+    anadirDirectorioALista(raiz, copia);
+    double tiempo = segundosDesde(inicio);
+    cout << "  cp -r: " << tiempo * 1e6 << " us, RSS +" << (memoriaResidenteKB() - memoriaInicial) << " KB" << endl;
+
+    if (cantidad > 0 && modificados > 0) {
+        long memoriaAntes = memoriaResidenteKB();
+        inicio = chrono::steady_clock::now();
+        for (long i = 0; i < modificados; i++) {
+            Archivo* archivo = archivos[(long)(((uint64_t)i * 2654435761u) % cantidad)];
+            contenidoEscribir(archivo, longitudContenido(archivo), " editado", 8);
+        }
+        tiempo = segundosDesde(inicio);
+        cout << "  " << modificados << " appends en el original: " << tiempo / modificados * 1e6 << " us cada uno, RSS +"
+             << (memoriaResidenteKB() - memoriaAntes) << " KB, " << copiasPendientes.load() << " copias pendientes" << endl;
     }
 
-    cout << "renombrar: '" << nombreAntiguo << "': No existe el archivo o directorio" << endl;
+    long memoriaAntes = memoriaResidenteKB();
+    inicio = chrono::steady_clock::now();
+    materializarSubarbol(copia);
+    tiempo = segundosDesde(inicio);
+    long archivosCopia = 0;
+    uint64_t bytesCopia = 0;
+    recorridoIniciar(recorrido, copia);
+    while (Directorio* directorio = recorridoSiguiente(recorrido)) {
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) {
+            archivosCopia++;
+            bytesCopia += longitudContenido(a);
+        }
+    }
+    cout << "  materializar la copia entera (copia profunda): " << tiempo * 1000 << " ms, RSS +"
+         << (memoriaResidenteKB() - memoriaAntes) << " KB; " << archivosCopia << " archivos, " << bytesCopia << " bytes"
+         << (bytesCopia == bytesOriginales && bytesCopia == copia->bytesSubarbol ? "" : ", ERROR: la copia cambió") << endl;
+    delete[] archivos;
+    liberarSistemaArchivos(raiz);
 }
 
-// --- Carga Inicial del Sistema de Archivos ---
+// rm de un subárbol grande: liberarlo en el hilo de la sesión (lo que hacía rm antes) contra
+// desenlazarlo y dejárselo al reclamador. Mientras el reclamador trabaja, una sesión hace
+// búsquedas con el árbol compartido y se mide cuánto espera cada una.
+void benchmarkReclamacion(long nodos) {
+    Directorio* raiz = crearDirectorio("/");
+    const char* nombres[] = {"sincrono", "diferido"};
+    for (const char* nombre : nombres) {
+        invalidarRutasPositivas(); // La caché de rutas apunta al árbol cargado antes
+        invalidarRutasNegativas();
+        Directorio* cargado = cargarArbolSintetico("mixto", nodos);
+        if (!cargado) break;
+        liberarNombre(cargado->nombre);
+        cargado->nombre = copiarNombre(nombre);
+        anadirDirectorioALista(raiz, cargado);
+    }
+    Directorio* sincrono = buscarDirectorio(raiz, "sincrono");
+    if (!sincrono || !buscarDirectorio(raiz, "diferido")) {
+        liberarSistemaArchivos(raiz);
+        return;
+    }
+    long nodosSubarbol = sincrono->archivosSubarbol + sincrono->directoriosSubarbol + 1;
+    cout << "reclamacion: rm de un subárbol de " << nodosSubarbol << " nodos" << endl;
 
-Directorio* cargarSistemaArchivos(const char* nombreArchivo, Directorio*& raiz) {
-    ifstream archivo(nombreArchivo);
-    if (!archivo.is_open()) {
-        cerr << "Error: No se pudo abrir el archivo de configuración del sistema de archivos: " << nombreArchivo << endl;
-        return nullptr;
+    auto inicio = chrono::steady_clock::now();
+    {
+        unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+        desenlazarDirectorio(raiz, sincrono);
+        propagarTotales(raiz, -sincrono->archivosSubarbol, -sincrono->directoriosSubarbol - 1,
+                        -(int64_t)sincrono->bytesSubarbol);
+        eliminarDirectorio(sincrono);
     }
+    double tiempoSincrono = segundosDesde(inicio);
+    cout << "  liberado en la sesión: " << tiempoSincrono * 1000 << " ms" << endl;
 
-    if (!raiz) {
-        raiz = crearDirectorio("/");
-        if (!raiz) {
-            cerr << "Error: No se pudo crear el directorio raíz." << endl;
-            return nullptr;
+    inicio = chrono::steady_clock::now();
+    {
+        unique_lock<shared_mutex> bloqueo(cerrojoArbol);
+        removerDirectorio(raiz, "diferido");
+    }
+    double tiempoRm = segundosDesde(inicio);
+
+    // Búsquedas de una sesión hasta que el reclamador termina
+    long consultas = 0;
+    double esperaTotal = 0, esperaMaxima = 0;
+    bool pendiente = true;
+    while (pendiente) {
+        auto inicioConsulta = chrono::steady_clock::now();
+        {
+            shared_lock<shared_mutex> bloqueo(cerrojoArbol);
+            buscarDirectorio(raiz, "diferido");
         }
+        double espera = segundosDesde(inicioConsulta);
+        esperaTotal += espera;
+        if (espera > esperaMaxima) esperaMaxima = espera;
+        consultas++;
+        lock_guard<mutex> bloqueo(reclamador.cerrojo);
+        pendiente = reclamador.cantidad > 0;
     }
+    double tiempoReclamacion = segundosDesde(inicio);
+    cout << "  rm con reclamador: " << tiempoRm * 1e6 << " us; liberado en segundo plano en " << tiempoReclamacion * 1000
+         << " ms (" << reclamador.lotes << " lotes)" << endl;
+    cout << "  sesión durante la reclamación: " << consultas << " búsquedas, espera media "
+         << (consultas > 0 ? esperaTotal / consultas * 1e6 : 0) << " us, máxima " << esperaMaxima * 1e6 << " us" << endl;
+    liberarSistemaArchivos(raiz);
+}
 
-    char bufferLinea[LONGITUD_MAX_RUTA + LONGITUD_MAX_CONTENIDO];
-    while (archivo.getline(bufferLinea, sizeof(bufferLinea))) {
-        char comando[5];
-        char bufferRutaStr[LONGITUD_MAX_RUTA];
-        
-        // Usar sscanf_s para mayor seguridad en Windows, si no, sscanf normal
-        #ifdef _MSC_VER
-            if (sscanf_s(bufferLinea, "%s %s", comando, (unsigned int)sizeof(comando), bufferRutaStr, (unsigned int)sizeof(bufferRutaStr)) < 2) {
-        #else
-            if (sscanf(bufferLinea, "%s %s", comando, bufferRutaStr) < 2) {
-        #endif
-            cerr << "Advertencia: Línea mal formada en el archivo de configuración: " << bufferLinea << endl;
-            continue;
+// Experimento: tabla compacta de nodos (estructura de arreglos). Solo la construye
+// --bench compacta, que la compara con el árbol enlazado; los comandos y save no la usan.
+// Con 200000 nodos mixtos construirla cuesta unos 230 ms y guardarla 100 ms, contra 300 ms de
+// guardar el árbol enlazado con un hilo, así que para save no compensa.
+// Representación del árbol sin punteros, para árboles muy grandes que sobre todo se recorren:
+// cada nodo es una posición en arreglos paralelos, los enlaces son índices de 32 bits y los
+// nombres y contenidos son desplazamientos en dos pools de bytes. El nodo 0 es la raíz y los
+// demás se numeran en el orden del snapshot de texto: los hijos de un directorio son
+// consecutivos (subdirectorios primero) y el subárbol de cada directorio ocupa un rango
+// contiguo a partir de su primer hijo. Así guardar es una sola pasada lineal por los arreglos
+// y liberar son unos pocos delete[], haya los nodos que haya. Los subdirectorios de los
+// directorios con más de UMBRAL_INDICE_HIJOS subdirectorios van además a un índice hash
+// común (padre, nombre) -> nodo, igual que los índices de hijos del árbol enlazado.
+// La tabla es una foto del árbol (construirTablaCompacta).
+
+const uint32_t NODO_NINGUNO = ~(uint32_t)0;
+
+struct TablaCompacta {
+    uint32_t* padre;                // La raíz se apunta a sí misma
+    uint32_t* primerHijo;           // NODO_NINGUNO en archivos y directorios vacíos
+    uint32_t* siguienteHermano;     // NODO_NINGUNO en el último hijo
+    uint32_t* nombre;               // Desplazamiento en 'nombres'
+    uint64_t* contenido;            // Desplazamiento en 'contenidos', o SIN_CONTENIDO
+    uint8_t* esArchivo;
+    uint32_t cantidad;
+    BufferBytes nombres;            // Nombres terminados en '\0'
+    BufferBytes contenidos;         // Contenidos terminados en '\0'; los compartidos, una vez
+    uint32_t* indice;               // Sondeo lineal; NODO_NINGUNO = hueco libre
+    uint32_t capacidadIndice;       // Potencia de 2, o 0 si no hay directorios grandes
+};
+
+// Bytes por nodo de los arreglos paralelos (sin los pools)
+const size_t BYTES_NODO_COMPACTO = 4 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint8_t);
+
+void liberarTablaCompacta(TablaCompacta& tabla) {
+    delete[] tabla.padre;
+    delete[] tabla.primerHijo;
+    delete[] tabla.siguienteHermano;
+    delete[] tabla.nombre;
+    delete[] tabla.contenido;
+    delete[] tabla.esArchivo;
+    delete[] tabla.indice;
+    bufferLiberar(tabla.nombres);
+    bufferLiberar(tabla.contenidos);
+    tabla = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0, {nullptr, 0, 0}, {nullptr, 0, 0}, nullptr, 0};
+}
+
+// hashNombre de nombre[0, longitud) combinado con el padre
+uint32_t hashNodoCompacto(uint32_t padre, const char* nombre, size_t longitud) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < longitud; i++) {
+        hash ^= (unsigned char)nombre[i];
+        hash *= 16777619u;
+    }
+    return hash ^ (padre * 0x9E3779B1u);
+}
+
+// Subdirectorio 'nombre[0, longitud)' de 'padre' en el índice, o NODO_NINGUNO
+uint32_t buscarEnIndiceCompacto(const TablaCompacta& tabla, uint32_t padre, const char* nombre, size_t longitud) {
+    if (tabla.capacidadIndice == 0) return NODO_NINGUNO;
+    uint32_t mascara = tabla.capacidadIndice - 1;
+    for (uint32_t i = hashNodoCompacto(padre, nombre, longitud) & mascara; tabla.indice[i] != NODO_NINGUNO; i = (i + 1) & mascara) {
+        uint32_t nodo = tabla.indice[i];
+        const char* candidato = tabla.nombres.datos + tabla.nombre[nodo];
+        if (tabla.padre[nodo] == padre && strncmp(candidato, nombre, longitud) == 0 && candidato[longitud] == '\0') return nodo;
+    }
+    return NODO_NINGUNO;
+}
+
+// Indexa los subdirectorios de los directorios que tienen más de UMBRAL_INDICE_HIJOS
+void indexarTablaCompacta(TablaCompacta& tabla, uint64_t indexados) {
+    if (indexados == 0) return;
+    uint64_t capacidad = 1024;
+    while (capacidad < indexados * 2) capacidad *= 2;
+    tabla.capacidadIndice = (uint32_t)capacidad;
+    tabla.indice = new uint32_t[capacidad];
+    memset(tabla.indice, 0xff, capacidad * sizeof(uint32_t));
+    uint32_t mascara = tabla.capacidadIndice - 1;
+    for (uint32_t p = 0; p < tabla.cantidad; p++) {
+        int subdirectorios = 0;
+        uint32_t h = tabla.primerHijo[p];
+        while (h != NODO_NINGUNO && !tabla.esArchivo[h] && subdirectorios <= UMBRAL_INDICE_HIJOS) {
+            subdirectorios++;
+            h = tabla.siguienteHermano[h];
         }
+        if (subdirectorios <= UMBRAL_INDICE_HIJOS) continue;
+        for (h = tabla.primerHijo[p]; h != NODO_NINGUNO && !tabla.esArchivo[h]; h = tabla.siguienteHermano[h]) {
+            const char* nombre = tabla.nombres.datos + tabla.nombre[h];
+            uint32_t i = hashNodoCompacto(p, nombre, strlen(nombre)) & mascara;
+            while (tabla.indice[i] != NODO_NINGUNO) i = (i + 1) & mascara;
+            tabla.indice[i] = h;
+        }
+    }
+}
 
-        if (strcmp(comando, "DIR") == 0) {
-            char* ultimaBarra = strrchr(bufferRutaStr, '/');
-            if (ultimaBarra == nullptr) {
-                    cerr << "Advertencia: Formato de ruta DIR inválido: " << bufferRutaStr << endl;
-                    continue;
-            }
-            
-            char nombreDir[100];
-            strcpy(nombreDir, ultimaBarra + 1);
-            *ultimaBarra = '\0'; // Corta la ruta para obtener solo el padre
+// Ocupa el nodo 'indice' como hijo de 'padre'; falla si el pool de nombres no cabe en 32 bits
+bool agregarNodoCompacto(TablaCompacta& tabla, uint32_t indice, uint32_t padre, const char* nombre) {
+    size_t longitud = strlen(nombre) + 1;
+    if (tabla.nombres.longitud + longitud > NODO_NINGUNO) return false;
+    tabla.padre[indice] = padre;
+    tabla.primerHijo[indice] = NODO_NINGUNO;
+    tabla.siguienteHermano[indice] = indice + 1; // El último hijo se corrige al terminar el bloque
+    tabla.nombre[indice] = (uint32_t)tabla.nombres.longitud;
+    tabla.contenido[indice] = SIN_CONTENIDO;
+    tabla.esArchivo[indice] = 0;
+    bufferAgregar(tabla.nombres, nombre, longitud);
+    return true;
+}
 
-            char rutaPadre[LONGITUD_MAX_RUTA];
-            if (strlen(bufferRutaStr) == 0) { // Si la ruta original era solo "/nombre", padre es "/"
-                strcpy(rutaPadre, "/");
-            } else {
-                strcpy(rutaPadre, bufferRutaStr);
-            }
+// Numera los nodos en el orden de emitirSubarbol: al sacar un directorio de la pila sus hijos
+// reciben los siguientes índices y sus subdirectorios se apilan del primero al último
+bool construirTablaCompacta(Directorio* raiz, TablaCompacta& tabla) {
+    Directorio* vistaRaiz = vistaDirectorio(raiz);
+    uint64_t total = (uint64_t)vistaRaiz->archivosSubarbol + vistaRaiz->directoriosSubarbol + 1;
+    if (total >= NODO_NINGUNO) {
+        cerr << "Error: La tabla compacta admite hasta " << (NODO_NINGUNO - 1) << " nodos" << endl;
+        return false;
+    }
+    tabla.cantidad = (uint32_t)total;
+    tabla.padre = new uint32_t[total];
+    tabla.primerHijo = new uint32_t[total];
+    tabla.siguienteHermano = new uint32_t[total];
+    tabla.nombre = new uint32_t[total];
+    tabla.contenido = new uint64_t[total];
+    tabla.esArchivo = new uint8_t[total];
+    tabla.nombres = {nullptr, 0, 0};
+    tabla.contenidos = {nullptr, 0, 0};
+    tabla.indice = nullptr;
+    tabla.capacidadIndice = 0;
+    agregarNodoCompacto(tabla, 0, 0, "/");
+    tabla.siguienteHermano[0] = NODO_NINGUNO;
 
-            Directorio* padreParaNuevoDir = navegarRuta(raiz, rutaPadre, raiz);
+    struct Pendiente {
+        Directorio* directorio;
+        uint32_t indice;
+    };
+    Pendiente* pila = new Pendiente[64];
+    size_t cantidad = 0, capacidad = 64;
+    pila[cantidad++] = {raiz, 0};
+    TablaContenidosEscritos escritos = {nullptr, 0, 0};
+    uint32_t siguiente = 1;
+    uint64_t indexados = 0;
+    bool correcto = true;
 
-            if (padreParaNuevoDir) {
-                if (buscarDirectorio(padreParaNuevoDir, nombreDir) || buscarArchivo(padreParaNuevoDir, nombreDir)) {
-                    // Advertencia: El directorio ya existe, se omite.
-                } else {
-                    Directorio* nuevoDir = crearDirectorio(nombreDir);
-                    if (nuevoDir) {
-                        anadirDirectorioALista(padreParaNuevoDir, nuevoDir);
-                    }
+    while (cantidad > 0 && correcto) {
+        Pendiente actual = pila[--cantidad];
+        Directorio* directorio = vistaDirectorio(actual.directorio); // Una copia pendiente se guarda como su origen
+        uint32_t primero = siguiente;
+        for (Directorio* d = directorio->subdirectorios; d; d = d->siguienteDirectorio) {
+            correcto = siguiente < total && agregarNodoCompacto(tabla, siguiente, actual.indice, d->nombre);
+            if (!correcto) break;
+            if (cantidad == capacidad) {
+                Pendiente* mayor = new Pendiente[capacidad * 2];
+                memcpy(mayor, pila, cantidad * sizeof(Pendiente));
+                delete[] pila;
+                pila = mayor;
+                capacidad *= 2;
+            }
+            pila[cantidad++] = {d, siguiente++};
+        }
+        if (siguiente - primero > (uint32_t)UMBRAL_INDICE_HIJOS) indexados += siguiente - primero;
+        for (Archivo* a = directorio->archivos; a && correcto; a = a->siguiente) {
+            correcto = siguiente < total && agregarNodoCompacto(tabla, siguiente, actual.indice, a->nombre);
+            if (!correcto) break;
+            tabla.esArchivo[siguiente] = 1;
+            if (!contenidoVacio(a) && !a->piezas) {
+                tabla.contenido[siguiente] = desplazamientoContenido(escritos, a->contenido, tabla.contenidos);
+            } else if (!contenidoVacio(a)) {
+                tabla.contenido[siguiente] = tabla.contenidos.longitud;
+                const char* datos;
+                size_t longitud;
+                for (int k = 0; fragmentoContenido(a, k, datos, longitud, false); k++) {
+                    bufferAgregar(tabla.contenidos, datos, longitud);
                 }
-            } else {
-                cerr << "Error: No se encontró el directorio padre para DIR: " << rutaPadre << endl;
+                bufferAgregar(tabla.contenidos, "", 1);
             }
+            siguiente++;
+        }
+        if (siguiente > primero) {
+            tabla.primerHijo[actual.indice] = primero;
+            tabla.siguienteHermano[siguiente - 1] = NODO_NINGUNO;
+        }
+    }
+    delete[] pila;
+    delete[] escritos.entradas;
 
-        } else if (strcmp(comando, "FILE") == 0) {
-            char* ultimaBarra = strrchr(bufferRutaStr, '/');
-            if (ultimaBarra == nullptr) {
-                cerr << "Advertencia: Formato de ruta FILE inválido: " << bufferRutaStr << endl;
-                continue;
-            }
-            char nombreArchivo[100];
-            strcpy(nombreArchivo, ultimaBarra + 1);
-            *ultimaBarra = '\0'; // Corta la ruta para obtener solo el padre
+    if (!correcto || siguiente != total) { // Los totales por subárbol no cuadran con las listas
+        cerr << "Error: No se pudo construir la tabla compacta (" << siguiente << " de " << total << " nodos)" << endl;
+        liberarTablaCompacta(tabla);
+        return false;
+    }
+    indexarTablaCompacta(tabla, indexados);
+    return true;
+}
+
+// Escribe en 'ruta' la ruta absoluta de un nodo subiendo por 'padre' (la raíz queda vacía)
+void construirRutaCompacta(const TablaCompacta& tabla, uint32_t nodo, BufferBytes& ruta) {
+    ruta.longitud = 0;
+    uint32_t componentes[64];
+    uint32_t* pila = componentes;
+    size_t cantidad = 0, capacidad = 64;
+    for (uint32_t n = nodo; n != 0; n = tabla.padre[n]) {
+        if (cantidad == capacidad) {
+            uint32_t* mayor = new uint32_t[capacidad * 2];
+            memcpy(mayor, pila, cantidad * sizeof(uint32_t));
+            if (pila != componentes) delete[] pila;
+            pila = mayor;
+            capacidad *= 2;
+        }
+        pila[cantidad++] = n;
+    }
+    while (cantidad > 0) {
+        bufferAgregar(ruta, "/", 1);
+        bufferAgregarTexto(ruta, tabla.nombres.datos + tabla.nombre[pila[--cantidad]]);
+    }
+    if (pila != componentes) delete[] pila;
+}
 
-            char rutaPadre[LONGITUD_MAX_RUTA];
-            if (strlen(bufferRutaStr) == 0) { // Si la ruta original era solo "/nombre", padre es "/"
-                strcpy(rutaPadre, "/");
+// El snapshot de texto de la tabla en una sola pasada por los nodos. Como los hermanos son
+// consecutivos, la ruta del padre solo cambia al cambiar de directorio, y en el orden de la
+// tabla el padre nuevo es hijo de alguno de los directorios de la ruta vigente: se recortan
+// los componentes sobrantes y se agrega uno, sin volver a subir hasta la raíz. Los contenidos
+// van siempre en línea (sin BLOB/FILEREF): la tabla no sabe qué comparte el almacén, y al
+// cargar el snapshot el almacén los vuelve a deduplicar.
+bool guardarTablaCompacta(const char* nombreArchivo, const TablaCompacta& tabla) {
+    EscritorAtomico escritor;
+    if (!escritorAbrir(escritor, nombreArchivo)) return false;
+    BufferBytes salida = {nullptr, 0, 0};
+    BufferBytes ruta = {nullptr, 0, 0};
+    bufferAgregarTexto(salida, CABECERA_FORMATO_TEXTO);
+    struct Componente {
+        uint32_t nodo;
+        size_t longitud;        // De la ruta hasta ese nodo inclusive
+    };
+    Componente* componentes = new Componente[64];
+    size_t cantidad = 0, capacidad = 64;
+    componentes[cantidad++] = {0, 0};
+    for (uint32_t i = 1; i < tabla.cantidad; i++) {
+        uint32_t padre = tabla.padre[i];
+        if (padre != componentes[cantidad - 1].nodo) {
+            while (cantidad > 0 && componentes[cantidad - 1].nodo != tabla.padre[padre]) cantidad--;
+            if (cantidad == 0) { // No pasa con tablas de construirTablaCompacta
+                construirRutaCompacta(tabla, padre, ruta);
             } else {
-                strcpy(rutaPadre, bufferRutaStr);
+                ruta.longitud = componentes[cantidad - 1].longitud;
+                bufferAgregar(ruta, "/", 1);
+                bufferAgregarTexto(ruta, tabla.nombres.datos + tabla.nombre[padre]);
             }
-
-            char* inicioContenido = strstr(bufferLinea, bufferRutaStr);
-            if (inicioContenido) {
-                inicioContenido += strlen(bufferRutaStr); // Mueve el puntero después de la ruta
-                while (*inicioContenido == ' ') inicioContenido++; // Ignora espacios en blanco
+            if (cantidad == capacidad) {
+                Componente* mayor = new Componente[capacidad * 2];
+                memcpy(mayor, componentes, cantidad * sizeof(Componente));
+                delete[] componentes;
+                componentes = mayor;
+                capacidad *= 2;
             }
-            
-            const char* contenido = (inicioContenido && *inicioContenido != '\0') ? inicioContenido : nullptr;
-
-            Directorio* padreParaNuevoArchivo = navegarRuta(raiz, rutaPadre, raiz);
+            componentes[cantidad++] = {padre, ruta.longitud};
+        }
+        bool archivo = tabla.esArchivo[i];
+        bufferAgregar(salida, archivo ? "FILE " : "DIR ", archivo ? 5 : 4);
+        bufferAgregar(salida, ruta.datos, ruta.longitud);
+        bufferAgregar(salida, "/", 1);
+        bufferAgregarTexto(salida, tabla.nombres.datos + tabla.nombre[i]);
+        if (tabla.contenido[i] != SIN_CONTENIDO) {
+            const char* texto = tabla.contenidos.datos + tabla.contenido[i];
+            bufferAgregar(salida, " ", 1);
+            bufferAgregarEscapado(salida, texto, strlen(texto));
+        }
+        bufferAgregar(salida, "\n", 1);
+        if (salida.longitud >= TAM_BUFFER_ESCRITURA) {
+            escritorEscribir(escritor, salida.datos, salida.longitud);
+            salida.longitud = 0;
+        }
+    }
+    escritorEscribir(escritor, salida.datos, salida.longitud);
+    delete[] componentes;
+    bufferLiberar(salida);
+    bufferLiberar(ruta);
+    return escritorConfirmar(escritor);
+}
 
-            if (padreParaNuevoArchivo) {
-                if (buscarDirectorio(padreParaNuevoArchivo, nombreArchivo) || buscarArchivo(padreParaNuevoArchivo, nombreArchivo)) {
-                    // Advertencia: El archivo ya existe, se omite.
-                } else {
-                    Archivo* nuevoArchivo = crearArchivo(nombreArchivo, contenido);
-                    if (nuevoArchivo) {
-                        anadirArchivo(padreParaNuevoArchivo, nuevoArchivo);
-                    }
-                }
-            } else {
-                cerr << "Error: No se encontró el directorio padre para FILE: " << rutaPadre << endl;
+// navegarRuta sobre la tabla: cada componente se busca recorriendo los hijos contiguos del
+// directorio, y como los subdirectorios van primero el recorrido se corta en el primer archivo.
+// Pasados UMBRAL_INDICE_HIJOS subdirectorios sin encontrarlo se consulta el índice.
+// Devuelve NODO_NINGUNO si algún componente no existe.
+uint32_t navegarRutaCompacta(const TablaCompacta& tabla, uint32_t inicio, const char* ruta) {
+    if (!ruta) return inicio;
+    uint32_t actual = ruta[0] == '/' ? 0 : inicio;
+    const char* cursor = ruta;
+    while (*cursor) {
+        while (*cursor == '/') cursor++;
+        if (*cursor == '\0') break;
+        const char* fin = cursor;
+        while (*fin && *fin != '/') fin++;
+        size_t longitud = (size_t)(fin - cursor);
+        if (longitud == 2 && cursor[0] == '.' && cursor[1] == '.') {
+            actual = tabla.padre[actual];
+        } else if (longitud != 1 || cursor[0] != '.') {
+            uint32_t hijo = tabla.primerHijo[actual];
+            int revisados = 0;
+            while (hijo != NODO_NINGUNO && !tabla.esArchivo[hijo] && revisados < UMBRAL_INDICE_HIJOS) {
+                const char* nombre = tabla.nombres.datos + tabla.nombre[hijo];
+                if (strncmp(nombre, cursor, longitud) == 0 && nombre[longitud] == '\0') break;
+                hijo = tabla.siguienteHermano[hijo];
+                revisados++;
             }
-        } else {
-            cerr << "Advertencia: Comando desconocido en el archivo de configuración: " << comando << endl;
+            if (revisados == UMBRAL_INDICE_HIJOS && hijo != NODO_NINGUNO && !tabla.esArchivo[hijo]) {
+                hijo = buscarEnIndiceCompacto(tabla, actual, cursor, longitud);
+            }
+            if (hijo == NODO_NINGUNO || tabla.esArchivo[hijo]) return NODO_NINGUNO;
+            actual = hijo;
         }
+        cursor = fin;
     }
-    archivo.close();
-    cout << "Sistema de archivos inicial cargado desde '" << nombreArchivo << "'." << endl;
-    return raiz;
+    return actual;
 }
 
-// --- ESTRUCTURA DE PILA MANUAL ---
-// Definimos una estructura para cada elemento de nuestra pila
-struct StackNode {
-    Directorio* dir;
-    char* path; // Ruta completa hasta este directorio
-};
+// Árbol enlazado contra tabla compacta del mismo árbol: bytes por nodo, recorrido completo,
+// guardado de texto, navegación de rutas (sin caché de rutas) y liberación. El snapshot de la
+// tabla se vuelve a cargar y a guardar con guardarSistemaArchivos para comprobar que describe
+// exactamente el mismo árbol.
+void benchmarkCompacta(long nodos, const char* forma) {
+    const char* rutaArbol = "balatro_bench_compacta_arbol.txt";
+    const char* rutaTabla = "balatro_bench_compacta_tabla.txt";
+    long memoriaInicial = memoriaResidenteKB();
+    Directorio* raiz = cargarArbolSintetico(forma, nodos);
+    long memoriaArbol = memoriaResidenteKB() - memoriaInicial;
+    if (!raiz) {
+        cout << "Uso: --bench compacta [nodos] [ancho|profundo|mixto|grupos]" << endl;
+        return;
+    }
+    BufferNulo bufferNulo;
+    streambuf* salidaOriginal = cout.rdbuf();
+    long directorios = raiz->directoriosSubarbol + 1;
+    long totalNodos = directorios + raiz->archivosSubarbol;
+    cout << "compacta: " << forma << ", " << totalNodos << " nodos (" << directorios << " directorios)" << endl;
 
-// Una pila simple implementada con un array dinámico
-const int MAX_STACK_SIZE = 1000; // Un tamaño máximo razonable para la pila
-StackNode customStack[MAX_STACK_SIZE];
-int stackTop = -1; // Índice del tope de la pila, -1 indica vacía
+    // Recorrido del árbol enlazado: se suman los bytes de los nombres
+    auto inicio = chrono::steady_clock::now();
+    uint64_t bytesNombres = 0;
+    RecorridoSubarbol recorrido;
+    recorridoIniciar(recorrido, raiz);
+    while (Directorio* directorio = recorridoSiguiente(recorrido)) {
+        bytesNombres += strlen(directorio->nombre) + 1;
+        for (Archivo* a = directorio->archivos; a; a = a->siguiente) bytesNombres += strlen(a->nombre) + 1;
+    }
+    double recorridoArbol = segundosDesde(inicio);
 
-void push(Directorio* d, char* p) {
-    if (stackTop < MAX_STACK_SIZE - 1) {
-        stackTop++;
-        customStack[stackTop].dir = d;
-        customStack[stackTop].path = p;
-    } else {
-        cout << "Error: Desbordamiento de pila en guardarSistemaArchivos." << endl;
-        // Considerar manejo de errores o redimensionamiento del array
+    long memoriaAntes = memoriaResidenteKB();
+    inicio = chrono::steady_clock::now();
+    TablaCompacta tabla;
+    if (!construirTablaCompacta(raiz, tabla)) {
+        liberarSistemaArchivos(raiz);
+        return;
+    }
+    double tiempoConstruccion = segundosDesde(inicio);
+    long memoriaTabla = memoriaResidenteKB() - memoriaAntes;
+
+    inicio = chrono::steady_clock::now();
+    uint64_t bytesNombresTabla = 0;
+    for (uint32_t i = 0; i < tabla.cantidad; i++) bytesNombresTabla += strlen(tabla.nombres.datos + tabla.nombre[i]) + 1;
+    double recorridoTabla = segundosDesde(inicio);
+
+    uint64_t estructuraArbol = (uint64_t)directorios * sizeof(Directorio) +
+                               (uint64_t)raiz->archivosSubarbol * sizeof(Archivo) + bytesNombres;
+    uint64_t estructuraTabla = (uint64_t)tabla.cantidad * BYTES_NODO_COMPACTO + tabla.nombres.longitud +
+                               (uint64_t)tabla.capacidadIndice * sizeof(uint32_t);
+    cout << "  bytes por nodo (nodos + nombres, sin contenidos): enlazado " << (double)estructuraArbol / totalNodos
+         << " sin índices de hijos, compacta " << (double)estructuraTabla / totalNodos << " con su índice" << endl;
+    cout << "  RSS al cargar el árbol (con contenidos e índices): " << memoriaArbol * 1024.0 / totalNodos
+         << " bytes/nodo; al construir la tabla (con su copia de los contenidos): " << memoriaTabla * 1024.0 / totalNodos
+         << " bytes/nodo en " << tiempoConstruccion * 1000 << " ms" << endl;
+    cout << "  recorrido completo: enlazado " << (long)(totalNodos / recorridoArbol) << " nodos/s, compacta "
+         << (long)(totalNodos / recorridoTabla) << " nodos/s"
+         << (bytesNombresTabla == bytesNombres ? "" : ", ERROR: los nombres no coinciden") << endl;
+
+    cout.rdbuf(&bufferNulo);
+    inicio = chrono::steady_clock::now();
+    guardarSistemaArchivos(rutaArbol, raiz, 1);
+    double guardadoArbol = segundosDesde(inicio);
+    cout.rdbuf(salidaOriginal);
+    inicio = chrono::steady_clock::now();
+    bool guardada = guardarTablaCompacta(rutaTabla, tabla);
+    double guardadoTabla = segundosDesde(inicio);
+    cout << "  guardado de texto (1 hilo): enlazado " << guardadoArbol * 1000 << " ms, compacta "
+         << guardadoTabla * 1000 << " ms" << (guardada ? "" : ", ERROR: no se pudo escribir") << endl;
+
+    // Rutas de una muestra de directorios, tomadas de la tabla
+    const long MUESTRA_RUTAS = 100000;
+    BufferBytes rutas = {nullptr, 0, 0};
+    BufferBytes ruta = {nullptr, 0, 0};
+    size_t* inicios = new size_t[MUESTRA_RUTAS];
+    uint32_t* esperados = new uint32_t[MUESTRA_RUTAS];
+    long muestra = 0;
+    for (long j = 0; j < MUESTRA_RUTAS * 4 && muestra < MUESTRA_RUTAS; j++) {
+        uint32_t nodo = (uint32_t)(((uint64_t)j * 2654435761u) % tabla.cantidad);
+        if (tabla.esArchivo[nodo]) continue;
+        construirRutaCompacta(tabla, nodo, ruta);
+        if (ruta.longitud == 0 || ruta.longitud >= LONGITUD_MAX_RUTA) continue; // navegarRuta las truncaría
+        inicios[muestra] = rutas.longitud;
+        esperados[muestra++] = nodo;
+        bufferAgregar(rutas, ruta.datos, ruta.longitud);
+        bufferAgregar(rutas, "", 1);
     }
+    bufferLiberar(ruta);
+    if (muestra > 0) {
+        long fallos = 0;
+        cacheRutasActiva = false;
+        inicio = chrono::steady_clock::now();
+        for (long j = 0; j < muestra; j++) {
+            if (!navegarRuta(raiz, rutas.datos + inicios[j], raiz)) fallos++;
+        }
+        double navegacionArbol = segundosDesde(inicio);
+        cacheRutasActiva = true;
+        inicio = chrono::steady_clock::now();
+        for (long j = 0; j < muestra; j++) {
+            if (navegarRutaCompacta(tabla, 0, rutas.datos + inicios[j]) != esperados[j]) fallos++;
+        }
+        double navegacionTabla = segundosDesde(inicio);
+        cout << "  navegar " << muestra << " rutas: enlazado " << navegacionArbol * 1e9 / muestra << " ns/ruta, compacta "
+             << navegacionTabla * 1e9 / muestra << " ns/ruta" << (fallos == 0 ? "" : ", ERROR: rutas no encontradas") << endl;
+    }
+    delete[] inicios;
+    delete[] esperados;
+    bufferLiberar(rutas);
+
+    // La tabla primero: liberar los nodos enlazados deja a malloc consolidando sus trozos en
+    // el siguiente free grande, que se le cobraría a la tabla
+    inicio = chrono::steady_clock::now();
+    liberarTablaCompacta(tabla);
+    double liberacionTabla = segundosDesde(inicio);
+    inicio = chrono::steady_clock::now();
+    eliminarDirectorio(raiz, false);
+    double liberacionArbol = segundosDesde(inicio);
+    cout << "  liberar: enlazado " << liberacionArbol * 1000 << " ms, compacta " << liberacionTabla * 1000 << " ms" << endl;
+
+    // El snapshot de la tabla, cargado y guardado de nuevo, tiene que ser idéntico al del árbol
+    cout.rdbuf(&bufferNulo);
+    invalidarRutasPositivas();
+    invalidarRutasNegativas();
+    raiz = nullptr;
+    cargarSistemaArchivos(rutaTabla, raiz);
+    if (raiz) guardarSistemaArchivos(rutaTabla, raiz, 1);
+    cout.rdbuf(salidaOriginal);
+    bool iguales = raiz && huellaArchivo(rutaTabla) == huellaArchivo(rutaArbol);
+    cout << "  snapshot de la tabla releído: " << (iguales ? "idéntico al del árbol" : "ERROR: distinto del árbol") << endl;
+    if (raiz) liberarSistemaArchivos(raiz);
+    remove(rutaArbol);
+    remove(rutaTabla);
 }
 
-StackNode pop() {
-    if (stackTop >= 0) {
-        return customStack[stackTop--];
+#ifdef __linux__
+// Generador de carga para --serve: 'conexiones' clientes en un solo hilo con epoll, cada uno
+// con hasta 'profundidad' peticiones en vuelo. Cada conexión trabaja en su propio directorio
+// /carga_<pid>_<n>, que crea al empezar y borra al terminar (esas peticiones no se miden).
+// Mezcla: 45% ls --limit 20, 25% cat, 10% cd, 10% mkdir y rm en una línea, 10% write con bloque.
+const int PETICIONES_PREPARACION = 3;
+
+struct ConexionCarga {
+    int descriptor;
+    int numero;
+    long enviadas;              // Peticiones generadas, preparación y limpieza incluidas
+    long respondidas;
+    long total;
+    uint64_t* marcasEnvio;      // Anillo de 'profundidad' entradas, por número de petición
+    BufferBytes porEnviar;
+    size_t inicioEnvio;
+    uint32_t semilla;
+    uint32_t eventos;
+};
+
+void generarPeticionCarga(ConexionCarga& conexion) {
+    char peticion[128];
+    int proceso = (int)getpid();
+    long i = conexion.enviadas;
+    if (i == 0) {
+        snprintf(peticion, sizeof(peticion), "mkdir carga_%d_%d\n", proceso, conexion.numero);
+    } else if (i == 1) {
+        snprintf(peticion, sizeof(peticion), "cd carga_%d_%d\n", proceso, conexion.numero);
+    } else if (i == 2) {
+        snprintf(peticion, sizeof(peticion), "touch f\n");
+    } else if (i == conexion.total - 1) {
+        snprintf(peticion, sizeof(peticion), "cd /;rm carga_%d_%d\n", proceso, conexion.numero);
+    } else {
+        conexion.semilla = conexion.semilla * 1103515245u + 12345u;
+        unsigned int tirada = (conexion.semilla >> 16) % 100;
+        if (tirada < 45) snprintf(peticion, sizeof(peticion), "ls --limit 20\n");
+        else if (tirada < 70) snprintf(peticion, sizeof(peticion), "cat f\n");
+        else if (tirada < 80) snprintf(peticion, sizeof(peticion), "cd /carga_%d_%d\n", proceso, conexion.numero);
+        else if (tirada < 90) snprintf(peticion, sizeof(peticion), "mkdir d;rm d\n");
+        else snprintf(peticion, sizeof(peticion), "write f 0\nabc\n.\n");
     }
-    // Deberías manejar este caso de error si la pila está vacía y se intenta pop
-    // Para este contexto, se asume que solo se llama pop si la pila no está vacía
-    return {nullptr, nullptr}; 
+    bufferAgregarTexto(conexion.porEnviar, peticion);
 }
 
-bool isEmpty() {
-    return stackTop == -1;
+// Envía lo pendiente y genera más peticiones mientras quepan en vuelo. Devuelve false si el
+// servidor cerró la conexión.
+bool alimentarConexionCarga(ConexionCarga& conexion, int profundidad) {
+    while (conexion.enviadas < conexion.total && conexion.enviadas - conexion.respondidas < profundidad) {
+        conexion.marcasEnvio[conexion.enviadas % profundidad] = marcaTiempo();
+        generarPeticionCarga(conexion);
+        conexion.enviadas++;
+    }
+    while (conexion.inicioEnvio < conexion.porEnviar.longitud) {
+        ssize_t enviados = send(conexion.descriptor, conexion.porEnviar.datos + conexion.inicioEnvio,
+                                conexion.porEnviar.longitud - conexion.inicioEnvio, MSG_NOSIGNAL);
+        if (enviados > 0) conexion.inicioEnvio += (size_t)enviados;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+        else if (errno != EINTR) return false;
+    }
+    conexion.porEnviar.longitud = 0;
+    conexion.inicioEnvio = 0;
+    return true;
 }
 
-// --- FIN ESTRUCTURA DE PILA MANUAL ---
+bool benchmarkCliente(const char* rutaSocket, int conexiones, long peticiones, int profundidad) {
+    if (conexiones < 1) conexiones = 1;
+    if (profundidad < 1) profundidad = 1;
+    if (peticiones < 1) peticiones = 1;
+    sockaddr_un direccion = {};
+    if (strlen(rutaSocket) >= sizeof(direccion.sun_path)) {
+        cout << "cliente: la ruta del socket '" << rutaSocket << "' es demasiado larga" << endl;
+        return false;
+    }
+    direccion.sun_family = AF_UNIX;
+    strcpy(direccion.sun_path, rutaSocket);
 
-// Función para guardar el sistema de archivos a un archivo de texto
-void guardarSistemaArchivos(const char* nombreArchivo, Directorio* raiz) {
-    ofstream archivoSalida(nombreArchivo);
-    if (!archivoSalida.is_open()) {
-        cerr << "Error: No se pudo abrir el archivo para guardar el sistema de archivos: " << nombreArchivo << endl;
-        return;
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    ConexionCarga* carga = new ConexionCarga[conexiones];
+    uint64_t* marcas = new uint64_t[(size_t)conexiones * profundidad];
+    int abiertas = 0;
+    bool correcto = true;
+    for (; abiertas < conexiones; abiertas++) {
+        int descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (descriptor < 0 || connect(descriptor, (sockaddr*)&direccion, sizeof(direccion)) < 0) {
+            cout << "cliente: no se pudo conectar a '" << rutaSocket << "': " << strerror(errno) << endl;
+            if (descriptor >= 0) close(descriptor);
+            correcto = false;
+            break;
+        }
+        fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK);
+        carga[abiertas] = {descriptor, abiertas, 0, 0, peticiones + PETICIONES_PREPARACION + 1,
+                           marcas + (size_t)abiertas * profundidad, {nullptr, 0, 0}, 0, 2463534242u + (uint32_t)abiertas, 0};
     }
 
-    // Reiniciar la pila para un nuevo guardado
-    stackTop = -1; 
-    char* rutaRaiz = new char[2]; // Asignar dinámicamente para la raíz también
-    strcpy(rutaRaiz, "/");
-    push(raiz, rutaRaiz); // Empieza el recorrido desde la raíz
+    ResumenComando* latencias = new ResumenComando(); // En marcas, como las estadísticas de comandos
+    long activas = abiertas;
+    auto inicio = chrono::steady_clock::now();
+    if (correcto) {
+        cout << "cliente: " << conexiones << " conexiones x " << peticiones << " peticiones, hasta " << profundidad
+             << " en vuelo por conexión" << endl;
+        for (int i = 0; i < abiertas && correcto; i++) correcto = alimentarConexionCarga(carga[i], profundidad);
+    }
 
-    while (!isEmpty()) { // Mientras haya elementos en la pila, sigue recorriendo
-        StackNode currentNode = pop(); // Obtiene el elemento del tope
-        Directorio* actualDir = currentNode.dir;
-        char* rutaActual = currentNode.path;
-        
-        // Guardar directorios
-        Directorio* subDir = actualDir->subdirectorios;
-        while (subDir) {
-            char nuevaRuta[LONGITUD_MAX_RUTA];
-            if (strcmp(rutaActual, "/") == 0) {
-                snprintf(nuevaRuta, LONGITUD_MAX_RUTA, "/%s", subDir->nombre);
-            } else {
-                snprintf(nuevaRuta, LONGITUD_MAX_RUTA, "%s/%s", rutaActual, subDir->nombre);
-            }
-            archivoSalida << "DIR " << nuevaRuta << endl;
-            
-            // Crea una copia dinámica de la ruta para el elemento de la pila
-            char* rutaParaPila = new char[strlen(nuevaRuta) + 1];
-            strcpy(rutaParaPila, nuevaRuta);
-            push(subDir, rutaParaPila); // Agrega el subdirectorio a la pila para visitarlo luego
-            subDir = subDir->siguienteDirectorio;
-        }
-
-        // Guardar archivos
-        Archivo* file = actualDir->archivos;
-        while (file) {
-            char rutaCompletaArchivo[LONGITUD_MAX_RUTA];
-            if (strcmp(rutaActual, "/") == 0) {
-                snprintf(rutaCompletaArchivo, LONGITUD_MAX_RUTA, "/%s", file->nombre);
-            } else {
-                snprintf(rutaCompletaArchivo, LONGITUD_MAX_RUTA, "%s/%s", rutaActual, file->nombre);
+    epoll_event eventos[EVENTOS_POR_ESPERA];
+    char bloque[TAM_BLOQUE_RECEPCION];
+    while (correcto && activas > 0) {
+        // Solo se pide EPOLLOUT a las conexiones con envíos a medias
+        for (int i = 0; i < abiertas; i++) {
+            ConexionCarga& conexion = carga[i];
+            if (conexion.descriptor < 0) continue;
+            uint32_t deseados = EPOLLIN;
+            if (conexion.inicioEnvio < conexion.porEnviar.longitud) deseados |= EPOLLOUT;
+            if (deseados == conexion.eventos) continue;
+            epoll_event evento = {};
+            evento.events = deseados;
+            evento.data.ptr = &conexion;
+            epoll_ctl(epoll, conexion.eventos ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conexion.descriptor, &evento);
+            conexion.eventos = deseados;
+        }
+        int listos = epoll_wait(epoll, eventos, EVENTOS_POR_ESPERA, -1);
+        if (listos < 0 && errno != EINTR) break;
+        for (int e = 0; e < listos && correcto; e++) {
+            ConexionCarga& conexion = *(ConexionCarga*)eventos[e].data.ptr;
+            if (eventos[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t leidos = recv(conexion.descriptor, bloque, sizeof(bloque), 0);
+                if (leidos == 0 || (leidos < 0 && errno != EAGAIN && errno != EINTR)) {
+                    cout << "cliente: el servidor cerró la conexión " << conexion.numero << endl;
+                    correcto = false;
+                    break;
+                }
+                uint64_t ahora = marcaTiempo();
+                for (ssize_t b = 0; b < leidos; b++) {
+                    if (bloque[b] != '\0') continue;
+                    long numero = conexion.respondidas++;
+                    if (numero < PETICIONES_PREPARACION || numero == conexion.total - 1) continue;
+                    uint64_t espera = ahora - conexion.marcasEnvio[numero % profundidad];
+                    latencias->muestras++;
+                    latencias->marcasTotales += espera;
+                    if (espera > latencias->maximo) latencias->maximo = espera;
+                    latencias->cubetas[cubetaLatencia(espera)]++;
+                }
             }
-
-            archivoSalida << "FILE " << rutaCompletaArchivo;
-            if (file->contenido) {
-                archivoSalida << " " << file->contenido;
+            correcto = alimentarConexionCarga(conexion, profundidad);
+            if (correcto && conexion.respondidas == conexion.total) {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, conexion.descriptor, nullptr);
+                close(conexion.descriptor);
+                conexion.descriptor = -1;
+                activas--;
             }
-            archivoSalida << endl;
-            file = file->siguiente;
         }
+    }
+    double segundos = segundosDesde(inicio);
 
-        // Libera la memoria de la ruta que sacamos de la pila
-        delete[] rutaActual;
+    if (correcto && latencias->muestras > 0) {
+        double microsegundos = nanosegundosPorMarca() / 1e3;
+        long totalPeticiones = (long)conexiones * (peticiones + PETICIONES_PREPARACION + 1);
+        cout << "  " << (long)(totalPeticiones / segundos) << " peticiones/s en " << segundos << " s" << endl;
+        char linea[200];
+        snprintf(linea, sizeof(linea), "  latencia (us): media %.2f, p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f",
+                 latencias->marcasTotales * microsegundos / latencias->muestras,
+                 percentilLatencia(*latencias, 0.5) * microsegundos, percentilLatencia(*latencias, 0.9) * microsegundos,
+                 percentilLatencia(*latencias, 0.99) * microsegundos, percentilLatencia(*latencias, 0.999) * microsegundos,
+                 latencias->maximo * microsegundos);
+        cout << linea << endl;
     }
+    for (int i = 0; i < abiertas; i++) {
+        if (carga[i].descriptor >= 0) close(carga[i].descriptor);
+        bufferLiberar(carga[i].porEnviar);
+    }
+    close(epoll);
+    delete latencias;
+    delete[] marcas;
+    delete[] carga;
+    return correcto;
+}
+#endif
 
-    archivoSalida.close();
-    cout << "Sistema de archivos guardado en '" << nombreArchivo << "'." << endl;
+int ejecutarBenchmark(int argc, char* argv[]) {
+    if (argc < 1) {
+        cout << "Uso: --bench <indice|asignador|rutas|carga|arranque|diario|guardado|contenidos|compresion|suite|generar|estres|buscar|grep|copias|reclamacion|compacta|cliente> [parametros]" << endl;
+        return 1;
+    }
+    if (strcmp(argv[0], "indice") == 0) {
+        benchmarkIndiceHijos(argc > 1 ? atoi(argv[1]) : 200000);
+        return 0;
+    }
+    if (strcmp(argv[0], "asignador") == 0) {
+        benchmarkAsignador(argc > 1 ? atoi(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "rutas") == 0) {
+        benchmarkCacheRutas(argc > 1 ? atoi(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "carga") == 0) {
+        benchmarkCarga(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "arranque") == 0) {
+        benchmarkArranque(argc > 1 ? atoi(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "diario") == 0) {
+        benchmarkDiario(argc > 1 ? atoi(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "guardado") == 0) {
+        benchmarkGuardado(argc > 1 ? atol(argv[1]) : 2000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "contenidos") == 0) {
+        benchmarkContenidos(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "compresion") == 0) {
+        benchmarkCompresion(argc > 1 ? atol(argv[1]) : 100000);
+        return 0;
+    }
+    if (strcmp(argv[0], "suite") == 0) { // suite [nodos] [ancho|profundo|mixto]
+        return benchmarkSuite(argc > 1 ? atol(argv[1]) : 1000000, argc > 2 ? argv[2] : nullptr) ? 0 : 1;
+    }
+    if (strcmp(argv[0], "estres") == 0) { // estres [hilos] [operaciones por hilo]
+        benchmarkEstres(argc > 1 ? atoi(argv[1]) : (int)thread::hardware_concurrency(), argc > 2 ? atol(argv[2]) : 200000);
+        return 0;
+    }
+    if (strcmp(argv[0], "buscar") == 0) { // buscar [nodos] [patrón] [hilos]
+        benchmarkBuscar(argc > 1 ? atol(argv[1]) : 2000000, argc > 2 ? argv[2] : "*_1*7",
+                        argc > 3 ? atoi(argv[3]) : (int)thread::hardware_concurrency());
+        return 0;
+    }
+    if (strcmp(argv[0], "grep") == 0) { // grep [nodos] [ediciones]
+        benchmarkGrep(argc > 1 ? atol(argv[1]) : 1000000, argc > 2 ? atol(argv[2]) : 100000);
+        return 0;
+    }
+    if (strcmp(argv[0], "copias") == 0) { // copias [nodos] [modificados]
+        benchmarkCopias(argc > 1 ? atol(argv[1]) : 1000000, argc > 2 ? atol(argv[2]) : 1000);
+        return 0;
+    }
+    if (strcmp(argv[0], "reclamacion") == 0) { // reclamacion [nodos]
+        benchmarkReclamacion(argc > 1 ? atol(argv[1]) : 1000000);
+        return 0;
+    }
+    if (strcmp(argv[0], "compacta") == 0) { // compacta [nodos] [ancho|profundo|mixto]
+        benchmarkCompacta(argc > 1 ? atol(argv[1]) : 1000000, argc > 2 ? argv[2] : "mixto");
+        return 0;
+    }
+    if (strcmp(argv[0], "cliente") == 0) { // cliente <socket> [conexiones] [peticiones por conexión] [en vuelo]
+#ifdef __linux__
+        if (argc < 2) {
+            cout << "Uso: --bench cliente <socket> [conexiones] [peticiones por conexión] [en vuelo por conexión]" << endl;
+            return 1;
+        }
+        return benchmarkCliente(argv[1], argc > 2 ? atoi(argv[2]) : 8, argc > 3 ? atol(argv[3]) : 100000,
+                                argc > 4 ? atoi(argv[4]) : 16) ? 0 : 1;
+#else
+        cout << "cliente: solo disponible en Linux" << endl;
+        return 1;
+#endif
+    }
+    if (strcmp(argv[0], "generar") == 0) { // generar <forma> <nodos> <ruta>
+        if (argc < 4 || !generarArbolSintetico(argv[3], argv[1], atol(argv[2]))) {
+            cout << "Uso: --bench generar <ancho|profundo|mixto|grupos> <nodos> <ruta>" << endl;
+            return 1;
+        }
+        return 0;
+    }
+    cout << "Benchmark desconocido: " << argv[0] << endl;
+    return 1;
 }
 
+// --- Servidor local (--serve) ---
+// Atiende a muchos clientes por un socket Unix con un único bucle de eventos (epoll). Cada
+// conexión es una sesión con su propio directorio actual sobre el árbol compartido.
+// Protocolo: el cliente envía líneas de comandos como en el modo por lotes (varios por línea
+// separados por ';') y cada edit/append/write va seguido de su bloque de texto, terminado como
+// en la terminal (una línea vacía para edit, una con solo '.' para append/write). El servidor
+// responde a cada línea con la salida de sus comandos seguida de un byte '\0'. El cliente
+// puede enviar muchas líneas sin esperar las respuestas, que llegan en el mismo orden.
+#ifdef __linux__
 
-// --- Bucle Principal de la Terminal ---
+enum TipoBloque {
+    BLOQUE_NINGUNO,
+    BLOQUE_EDICION,     // edit: líneas hasta una vacía
+    BLOQUE_PUNTO        // append, write: líneas hasta una con solo '.'
+};
 
-void procesarComando(char* lineaComando, Directorio*& directorioActual, Directorio* raiz, const char* nombreArchivoGuardado) {
-    char* token = strtok(lineaComando, " ");
+// Según el primer token del comando entre 'comando' y 'fin'
+TipoBloque bloqueDeComando(const char* comando, const char* fin) {
+    while (comando < fin && *comando == ' ') comando++;
+    const char* finToken = comando;
+    while (finToken < fin && *finToken != ' ') finToken++;
+    size_t longitud = finToken - comando;
+    if (longitud == 4 && memcmp(comando, "edit", 4) == 0) return BLOQUE_EDICION;
+    if (longitud == 6 && memcmp(comando, "append", 6) == 0) return BLOQUE_PUNTO;
+    if (longitud == 5 && memcmp(comando, "write", 5) == 0) return BLOQUE_PUNTO;
+    return BLOQUE_NINGUNO;
+}
 
-    if (token == nullptr) return;
+// Longitud del bloque de texto que empieza en 'datos', terminador incluido, o 0 si aún no
+// llegó entero. Sigue exactamente lo que leen comando_editar y comando_escribir.
+size_t longitudBloque(TipoBloque tipo, const char* datos, size_t longitud) {
+    size_t posicion = 0;
+    if (tipo == BLOQUE_EDICION && longitud > 0 && datos[0] == '\n') posicion = 1; // edit descarta una línea vacía inicial
+    while (posicion < longitud) {
+        const char* finLinea = (const char*)memchr(datos + posicion, '\n', longitud - posicion);
+        if (!finLinea) return 0;
+        size_t largo = finLinea - (datos + posicion);
+        bool terminador = tipo == BLOQUE_EDICION ? largo == 0 : (largo == 1 && datos[posicion] == '.');
+        posicion += largo + 1;
+        if (terminador) return posicion;
+    }
+    return 0;
+}
 
-    if (strcmp(token, "cd") == 0) {
-        char* ruta = strtok(nullptr, " ");
-        if (ruta) {
-            comando_cd(directorioActual, ruta, raiz);
-        } else {
-            cout << "cd: falta un operando" << endl;
-            cout << "Uso: cd <ruta_directorio>" << endl;
+// Longitud de la siguiente petición completa (su línea y los bloques de texto de sus
+// comandos) o 0 si todavía falta algo
+size_t longitudPeticion(const char* datos, size_t longitud) {
+    const char* finLinea = (const char*)memchr(datos, '\n', longitud);
+    if (!finLinea) return 0;
+    size_t posicion = finLinea - datos + 1;
+    for (const char* comando = datos; comando < finLinea;) {
+        const char* separador = (const char*)memchr(comando, ';', finLinea - comando);
+        const char* finComando = separador ? separador : finLinea;
+        TipoBloque tipo = bloqueDeComando(comando, finComando);
+        if (tipo != BLOQUE_NINGUNO) {
+            size_t bloque = longitudBloque(tipo, datos + posicion, longitud - posicion);
+            if (bloque == 0) return 0;
+            posicion += bloque;
         }
+        comando = finComando + 1;
     }
-    else if (strcmp(token, "ls") == 0) {
-        char* ruta = strtok(nullptr, " ");
-        if (ruta == nullptr) {
-            comando_ls(directorioActual);
-        } else {
-            Directorio* directorioDestino = navegarRuta(directorioActual, ruta, raiz);
-            if (directorioDestino) {
-                comando_ls(directorioDestino);
-            } else {
-                cout << "ls: no se puede acceder a '" << ruta << "': No existe el archivo o directorio" << endl;
-            }
+    return posicion;
+}
+
+struct Conexion {
+    int descriptor;
+    Sesion sesion;
+    BufferBytes recibido;       // Bytes recibidos; los anteriores a 'inicioRecibido' ya se ejecutaron
+    size_t inicioRecibido;
+    BufferBytes respuesta;      // Salida de los comandos; la anterior a 'inicioRespuesta' ya se envió
+    size_t inicioRespuesta;
+    bool finEntrada;            // El cliente cerró su lado de escritura
+    bool salio;                 // Ejecutó 'exit': se cierra en cuanto se envíe la respuesta
+    uint32_t eventos;           // Registrados en epoll
+    Conexion* anterior;
+    Conexion* siguiente;
+};
+
+struct Servidor {
+    int escucha;
+    int epoll;
+    Directorio* raiz;
+    const char* nombreArchivoGuardado;
+    Conexion* conexiones;
+    BufferSalidaBytes* salidaRespuestas;    // Tras salida() en el hilo del servidor
+    BufferEntradaMemoria* entradaBloques;   // Tras entrada() en el hilo del servidor
+    BufferBytes linea;                      // Copia modificable de la línea que se ejecuta
+    long comandos;
+    long conexionesAtendidas;
+};
+
+volatile sig_atomic_t servidorDetenido = 0;
+
+void detenerServidor(int) {
+    servidorDetenido = 1;
+}
+
+inline size_t respuestaPendiente(const Conexion* conexion) {
+    return conexion->respuesta.longitud - conexion->inicioRespuesta;
+}
+
+inline size_t entradaPendiente(const Conexion* conexion) {
+    return conexion->recibido.longitud - conexion->inicioRecibido;
+}
+
+// Ejecuta en orden las peticiones completas de la conexión mientras su respuesta pendiente no
+// supere LIMITE_RESPUESTA_PENDIENTE. Devuelve true si paró por ese límite con peticiones por
+// ejecutar: el resto espera a que el cliente lea.
+bool ejecutarPeticiones(Servidor& servidor, Conexion* conexion) {
+    servidor.salidaRespuestas->destino = &conexion->respuesta;
+    bool limitado = false;
+    while (!conexion->salio) {
+        const char* datos = conexion->recibido.datos + conexion->inicioRecibido;
+        size_t longitud = longitudPeticion(datos, entradaPendiente(conexion));
+        if (longitud == 0) break;
+        if (respuestaPendiente(conexion) >= LIMITE_RESPUESTA_PENDIENTE) {
+            limitado = true;
+            break;
         }
-    }
-    else if (strcmp(token, "mkdir") == 0) {
-        char* nombre = strtok(nullptr, " ");
-        if (nombre) {
-            comando_mkdir(directorioActual, nombre);
-        } else {
-            cout << "mkdir: falta un operando" << endl;
-            cout << "Uso: mkdir <nombre_carpeta>" << endl;
+        const char* finLinea = (const char*)memchr(datos, '\n', longitud);
+        servidor.linea.longitud = 0;
+        bufferAgregar(servidor.linea, datos, finLinea - datos);
+        bufferAgregar(servidor.linea, "", 1);
+
+        // Cada comando lee solo su bloque; uno que no lo lea (p. ej. el archivo no existe) no
+        // desincroniza a los siguientes
+        const char* bloque = finLinea + 1;
+        const char* finPeticion = datos + longitud;
+        char* comando = servidor.linea.datos;
+        bool seguir = true;
+        while (seguir && comando) {
+            char* separador = strchr(comando, ';');
+            if (separador) *separador = '\0';
+            TipoBloque tipo = bloqueDeComando(comando, comando + strlen(comando));
+            size_t largoBloque = tipo == BLOQUE_NINGUNO ? 0 : longitudBloque(tipo, bloque, finPeticion - bloque);
+            servidor.entradaBloques->asignar(bloque, largoBloque);
+            entrada().clear();
+            bloque += largoBloque;
+            seguir = procesarComando(comando, conexion->sesion.directorioActual, servidor.raiz, servidor.nombreArchivoGuardado);
+            servidor.comandos++;
+            comando = separador ? separador + 1 : nullptr;
         }
+        bufferAgregar(conexion->respuesta, "", 1);
+        conexion->inicioRecibido += longitud;
+        if (!seguir) conexion->salio = true; // Lo que venga detrás de 'exit' se descarta
     }
-    else if (strcmp(token, "rm") == 0) {
-        char* rutaAEliminar = strtok(nullptr, " ");
-        if (rutaAEliminar) {
-            comando_rm(directorioActual, rutaAEliminar, raiz);
-        } else {
-            cout << "rm: falta un operando" << endl;
-            cout << "Uso: rm <ruta_archivo_o_directorio>" << endl;
+
+    if (conexion->inicioRecibido == conexion->recibido.longitud) {
+        conexion->recibido.longitud = 0;
+        conexion->inicioRecibido = 0;
+    } else if (conexion->inicioRecibido > conexion->recibido.capacidad / 2) {
+        memmove(conexion->recibido.datos, conexion->recibido.datos + conexion->inicioRecibido, entradaPendiente(conexion));
+        conexion->recibido.longitud = entradaPendiente(conexion);
+        conexion->inicioRecibido = 0;
+    }
+    return limitado;
+}
+
+// Lee todo lo disponible sin bloquear, hasta TAM_MAX_PETICION bytes sin ejecutar.
+// Devuelve false si la conexión se rompió.
+bool recibirPeticiones(Conexion* conexion) {
+    char bloque[TAM_BLOQUE_RECEPCION];
+    while (entradaPendiente(conexion) < TAM_MAX_PETICION) {
+        ssize_t leidos = recv(conexion->descriptor, bloque, sizeof(bloque), 0);
+        if (leidos > 0) {
+            bufferAgregar(conexion->recibido, bloque, (size_t)leidos);
+        } else if (leidos == 0) {
+            conexion->finEntrada = true;
+            return true;
+        } else if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
     }
-    else if (strcmp(token, "touch") == 0) {
-        char* nombre = strtok(nullptr, " ");
-        if (nombre) {
-            comando_touch(directorioActual, nombre);
-        } else {
-            cout << "touch: falta un operando" << endl;
-            cout << "Uso: touch <nombre_archivo>" << endl;
+    return true;
+}
+
+// Envía lo que admita el socket sin bloquear. Devuelve false si la conexión se rompió.
+bool enviarRespuesta(Conexion* conexion) {
+    while (respuestaPendiente(conexion) > 0) {
+        ssize_t enviados = send(conexion->descriptor, conexion->respuesta.datos + conexion->inicioRespuesta,
+                                respuestaPendiente(conexion), MSG_NOSIGNAL);
+        if (enviados > 0) {
+            conexion->inicioRespuesta += (size_t)enviados;
+        } else if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
     }
-    else if (strcmp(token, "edit") == 0) {
-        char* nombreArchivo = strtok(nullptr, " ");
-        if (nombreArchivo) {
-            Archivo* archivoAEditar = buscarArchivo(directorioActual, nombreArchivo);
-            if (archivoAEditar) {
-                comando_editar(archivoAEditar);
-            } else {
-                cout << "editar: '" << nombreArchivo << "': No existe tal archivo" << endl;
+    conexion->respuesta.longitud = 0;
+    conexion->inicioRespuesta = 0;
+    return true;
+}
+
+// Con epoll por nivel basta con no pedir EPOLLIN para dejar de leer a un cliente que no lee
+// sus respuestas o que ya envió una petición del tamaño máximo
+void actualizarEventos(Servidor& servidor, Conexion* conexion) {
+    uint32_t eventos = 0;
+    if (!conexion->finEntrada && !conexion->salio && respuestaPendiente(conexion) < LIMITE_RESPUESTA_PENDIENTE &&
+        entradaPendiente(conexion) < TAM_MAX_PETICION) {
+        eventos |= EPOLLIN;
+    }
+    if (respuestaPendiente(conexion) > 0) eventos |= EPOLLOUT;
+    if (eventos == conexion->eventos) return;
+    epoll_event evento = {};
+    evento.events = eventos;
+    evento.data.ptr = conexion;
+    epoll_ctl(servidor.epoll, EPOLL_CTL_MOD, conexion->descriptor, &evento);
+    conexion->eventos = eventos;
+}
+
+void cerrarConexion(Servidor& servidor, Conexion* conexion) {
+    epoll_ctl(servidor.epoll, EPOLL_CTL_DEL, conexion->descriptor, nullptr);
+    close(conexion->descriptor);
+    quitarSesion(&conexion->sesion);
+    if (conexion->anterior) conexion->anterior->siguiente = conexion->siguiente;
+    else servidor.conexiones = conexion->siguiente;
+    if (conexion->siguiente) conexion->siguiente->anterior = conexion->anterior;
+    bufferLiberar(conexion->recibido);
+    bufferLiberar(conexion->respuesta);
+    delete conexion;
+}
+
+void aceptarConexiones(Servidor& servidor) {
+    while (true) {
+        int descriptor = accept4(servidor.escucha, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (descriptor < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                cerr << "Advertencia: accept: " << strerror(errno) << endl;
             }
-        } else {
-            cout << "editar: falta un operando" << endl;
-            cout << "Uso: editar <nombre_archivo>" << endl;
+            return;
+        }
+        Conexion* conexion = new Conexion{descriptor, {servidor.raiz, nullptr}, {nullptr, 0, 0}, 0, {nullptr, 0, 0}, 0,
+                                          false, false, EPOLLIN, nullptr, servidor.conexiones};
+        epoll_event evento = {};
+        evento.events = EPOLLIN;
+        evento.data.ptr = conexion;
+        if (epoll_ctl(servidor.epoll, EPOLL_CTL_ADD, descriptor, &evento) < 0) {
+            cerr << "Advertencia: epoll_ctl: " << strerror(errno) << endl;
+            close(descriptor);
+            delete conexion;
+            continue;
         }
+        registrarSesion(&conexion->sesion);
+        if (servidor.conexiones) servidor.conexiones->anterior = conexion;
+        servidor.conexiones = conexion;
+        servidor.conexionesAtendidas++;
     }
-    else if (strcmp(token, "rename") == 0) {
-        char* nombreAntiguo = strtok(nullptr, " ");
-        char* nombreNuevo = strtok(nullptr, " ");
-        if (nombreAntiguo && nombreNuevo) {
-            comando_renombrar(directorioActual, nombreAntiguo, nombreNuevo);
+}
+
+void atenderConexion(Servidor& servidor, Conexion* conexion, uint32_t eventos) {
+    bool sana = (eventos & EPOLLERR) == 0;
+    if (sana && (eventos & (EPOLLIN | EPOLLHUP))) sana = recibirPeticiones(conexion);
+    bool limitado = false;
+    while (sana) {
+        limitado = ejecutarPeticiones(servidor, conexion);
+        sana = enviarRespuesta(conexion);
+        if (!limitado || respuestaPendiente(conexion) > 0) break;
+    }
+    if (sana && respuestaPendiente(conexion) == 0 && entradaPendiente(conexion) >= TAM_MAX_PETICION) {
+        cerr << "Advertencia: petición de más de " << TAM_MAX_PETICION << " bytes; se cierra la conexión." << endl;
+        sana = false;
+    }
+    // Con la entrada cerrada, lo que quede sin ejecutar es una petición incompleta
+    if (!sana || (respuestaPendiente(conexion) == 0 && (conexion->salio || (conexion->finEntrada && !limitado)))) {
+        cerrarConexion(servidor, conexion);
+    } else {
+        actualizarEventos(servidor, conexion);
+    }
+}
+
+// Atiende clientes en 'rutaSocket' hasta recibir SIGINT o SIGTERM. Devuelve false si no pudo
+// ponerse a escuchar.
+bool servir(const char* rutaSocket, Directorio* raiz, const char* nombreArchivoGuardado) {
+    sockaddr_un direccion = {};
+    if (strlen(rutaSocket) >= sizeof(direccion.sun_path)) {
+        cerr << "Error: La ruta del socket '" << rutaSocket << "' es demasiado larga." << endl;
+        return false;
+    }
+    direccion.sun_family = AF_UNIX;
+    strcpy(direccion.sun_path, rutaSocket);
+    struct stat previo;
+    if (stat(rutaSocket, &previo) == 0 && S_ISSOCK(previo.st_mode)) unlink(rutaSocket); // De una ejecución anterior
+
+    int escucha = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (escucha < 0 || bind(escucha, (sockaddr*)&direccion, sizeof(direccion)) < 0 || listen(escucha, SOMAXCONN) < 0) {
+        cerr << "Error: No se pudo escuchar en '" << rutaSocket << "': " << strerror(errno) << endl;
+        if (escucha >= 0) close(escucha);
+        return false;
+    }
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event evento = {};
+    evento.events = EPOLLIN;
+    evento.data.ptr = nullptr; // El socket de escucha
+    epoll_ctl(epoll, EPOLL_CTL_ADD, escucha, &evento);
+
+    // SIGINT y SIGTERM quedan bloqueadas salvo dentro de epoll_pwait, para que no se pierdan
+    // entre la comprobación de servidorDetenido y la espera
+    struct sigaction accion = {};
+    accion.sa_handler = detenerServidor;
+    sigemptyset(&accion.sa_mask);
+    sigaction(SIGINT, &accion, nullptr);
+    sigaction(SIGTERM, &accion, nullptr);
+    sigset_t senales, mascaraOriginal;
+    sigemptyset(&senales);
+    sigaddset(&senales, SIGINT);
+    sigaddset(&senales, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &senales, &mascaraOriginal);
+    sigset_t mascaraEspera = mascaraOriginal;
+    sigdelset(&mascaraEspera, SIGINT);
+    sigdelset(&mascaraEspera, SIGTERM);
+
+    BufferSalidaBytes salidaRespuestas;
+    ostream flujoSalida(&salidaRespuestas);
+    BufferEntradaMemoria entradaBloques;
+    istream flujoEntrada(&entradaBloques);
+    salidaSesion = &flujoSalida;
+    entradaSesion = &flujoEntrada;
+    Servidor servidor = {escucha, epoll, raiz, nombreArchivoGuardado, nullptr, &salidaRespuestas, &entradaBloques,
+                         {nullptr, 0, 0}, 0, 0};
+
+    cout << "Servidor escuchando en '" << rutaSocket << "' (SIGINT o SIGTERM para terminar)." << endl;
+    auto inicio = chrono::steady_clock::now();
+    epoll_event eventos[EVENTOS_POR_ESPERA];
+    while (!servidorDetenido) {
+        int listos = epoll_pwait(epoll, eventos, EVENTOS_POR_ESPERA, -1, &mascaraEspera);
+        if (listos < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Error: epoll_wait: " << strerror(errno) << endl;
+            break;
+        }
+        for (int i = 0; i < listos; i++) {
+            if (eventos[i].data.ptr == nullptr) aceptarConexiones(servidor);
+            else atenderConexion(servidor, (Conexion*)eventos[i].data.ptr, eventos[i].events);
+        }
+    }
+    double segundos = segundosDesde(inicio);
+
+    while (servidor.conexiones) cerrarConexion(servidor, servidor.conexiones);
+    salidaSesion = &cout;
+    entradaSesion = &cin;
+    bufferLiberar(servidor.linea);
+    close(epoll);
+    close(escucha);
+    unlink(rutaSocket);
+    pthread_sigmask(SIG_SETMASK, &mascaraOriginal, nullptr);
+    cerr << "Servidor: " << servidor.conexionesAtendidas << " conexiones, " << servidor.comandos << " comandos en "
+         << segundos << " s (" << (segundos > 0 ? servidor.comandos / segundos : 0) << " comandos/s)." << endl;
+    return true;
+}
+
+#endif
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        int resultado = ejecutarBenchmark(argc - 2, argv + 2);
+        detenerReclamador();
+        return resultado;
+    }
+
+    hilosGuardado = (int)thread::hardware_concurrency();
+    const char* rutaGuion = nullptr;
+    const char* rutaSocket = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            hilosGuardado = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            cargaPerezosa = true;
+        } else if (strcmp(argv[i], "--compress-threshold") == 0 && i + 1 < argc) {
+            long umbral = atol(argv[++i]);
+            umbralCompresion = umbral > 0 ? (size_t)umbral : 0;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            rutaGuion = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            rutaSocket = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            volcarEstadisticasAlSalir = true;
+        } else if (strcmp(argv[i], "--stats-muestreo") == 0 && i + 1 < argc) {
+            periodoMuestreo = atol(argv[++i]);
+            if (periodoMuestreo < 1) periodoMuestreo = 1;
         } else {
-            cout << "renombrar: falta un operando" << endl;
-            cout << "Uso: renombrar <nombre_antiguo> <nombre_nuevo>" << endl;
+            cerr << "Opción desconocida: " << argv[i] << endl;
+            cerr << "Uso: " << argv[0] << " [--threads N] [--lazy] [--compress-threshold BYTES] [-f guion | --serve socket] [--stats] [--stats-muestreo N] | --bench <nombre> [parametros]" << endl;
+            return 1;
         }
     }
-    else if (strcmp(token, "save") == 0) {
-        guardarSistemaArchivos(nombreArchivoGuardado, raiz);
+    if (hilosGuardado < 1) hilosGuardado = 1;
+    if (hilosGuardado > MAX_HILOS) hilosGuardado = MAX_HILOS;
+    if (rutaSocket && rutaGuion) {
+        cerr << "Error: --serve y -f no se pueden usar juntos." << endl;
+        return 1;
+    }
+#ifndef __linux__
+    if (rutaSocket) {
+        cerr << "Error: --serve solo está disponible en Linux." << endl;
+        return 1;
     }
-    else if (strcmp(token, "exit") == 0) {
-        cout << "Saliendo de la terminal." << endl;
-        guardarSistemaArchivos(nombreArchivoGuardado, raiz); // Guardar antes de salir
-        eliminarDirectorio(raiz); // Liberar memoria al salir
-        exit(0);    
+#endif
+
+    // Modo por lotes: con -f o cuando la entrada no es una terminal (tubería o redirección).
+    // Sin prompt, con la salida acumulada y con varios comandos por línea separados por ';'.
+    bool modoLote = rutaGuion != nullptr;
+#ifndef _WIN32
+    if (!isatty(STDIN_FILENO) && !rutaSocket) modoLote = true;
+#endif
+    ifstream guion;
+    BufferSalidaLote salidaLote(stdout);
+    streambuf* entradaOriginal = cin.rdbuf();
+    streambuf* salidaOriginal = cout.rdbuf();
+    if (modoLote) {
+        ios::sync_with_stdio(false); // Antes de cambiar los buffers: restablece los de cin y cout
+        entradaOriginal = cin.rdbuf();
+        salidaOriginal = cout.rdbuf();
+        cout.rdbuf(&salidaLote);
     }
-    else {
-        cout << lineaComando << ": comando no encontrado" << endl;
+    if (rutaGuion) {
+        guion.open(rutaGuion, ios::binary);
+        if (!guion) {
+            cout.rdbuf(salidaOriginal);
+            cerr << "Error: No se pudo abrir el guion '" << rutaGuion << "'." << endl;
+            return 1;
+        }
+        cin.rdbuf(guion.rdbuf());
     }
-}
 
-int main() {
     Directorio* raiz = nullptr;
-    Directorio* directorioActual = nullptr;
     const char* nombreArchivoConfig = "Balatro.Balatrez.txt";
 
-    raiz = cargarSistemaArchivos(nombreArchivoConfig, raiz);
+    {
+#if ESTADISTICAS_COMANDOS
+        MedicionComando medicion(COMANDO_CARGA);
+#endif
+        raiz = cargarSnapshot(nombreArchivoConfig, raiz);
+    }
 
     if (!raiz) {
         cout << "Error al inicializar el sistema de archivos. Saliendo." << endl;
+        salidaLote.volcar();
+        cout.rdbuf(salidaOriginal);
+        cin.rdbuf(entradaOriginal);
         return 1;
     }
 
-    directorioActual = raiz;
+    abrirDiario(nombreArchivoConfig, raiz);
+    Sesion sesion = {raiz, nullptr};
+    registrarSesion(&sesion);
 
-    char lineaComando[LONGITUD_MAX_RUTA + LONGITUD_MAX_CONTENIDO];
+    BufferBytes lineaComando = {nullptr, 0, 0};
+    long comandosEjecutados = 0;
+    auto inicioComandos = chrono::steady_clock::now();
+    bool continuar = true;
+    int codigoSalida = 0;
+#ifdef __linux__
+    if (rutaSocket) { // Las sesiones son las de los clientes; la entrada estándar no se lee
+        if (!servir(rutaSocket, raiz, nombreArchivoConfig)) codigoSalida = 1;
+        continuar = false;
+    }
+#endif
 
-    while (true) {
-        imprimirPrompt(directorioActual);
-        cin.getline(lineaComando, sizeof(lineaComando));
-        
-        char copiaLineaComando[sizeof(lineaComando)];
-        strcpy(copiaLineaComando, lineaComando);
+    while (continuar) {
+        if (!modoLote) imprimirPrompt(sesion.directorioActual);
+        if (!leerLineaEntrada(lineaComando)) { // Fin de la entrada: se sale como con 'exit'
+            if (!modoLote) cout << endl;
+            break;
+        }
+        bufferAgregar(lineaComando, "", 1);
+
+        char* comando = lineaComando.datos;
+        while (continuar && comando) {
+            char* separador = modoLote ? strchr(comando, ';') : nullptr;
+            if (separador) *separador = '\0';
+            continuar = procesarComando(comando, sesion.directorioActual, raiz, nombreArchivoConfig);
+            comandosEjecutados++;
+            comando = separador ? separador + 1 : nullptr;
+        }
+    }
+    double segundos = segundosDesde(inicioComandos);
+    if (volcarEstadisticasAlSalir) imprimirEstadisticasComandos();
 
-        procesarComando(copiaLineaComando, directorioActual, raiz, nombreArchivoConfig);
+    if (diarioNecesitaCheckpoint() || !diario.archivo) {
+        checkpoint(nombreArchivoConfig, raiz); // Guardar antes de salir
     }
+    quitarSesion(&sesion);
+    cerrarDiario();
+    liberarSistemaArchivos(raiz); // Liberar memoria al salir
+    bufferLiberar(lineaComando);
+    liberarEstadisticasHilos();
 
-    return 0;
+    if (modoLote) {
+        salidaLote.volcar();
+        cout.rdbuf(salidaOriginal);
+        cin.rdbuf(entradaOriginal);
+        cerr << "Lote: " << comandosEjecutados << " comandos en " << segundos << " s ("
+             << (segundos > 0 ? comandosEjecutados / segundos : 0) << " comandos/s)." << endl;
+    }
+    return codigoSalida;
 }
 //balatro 2